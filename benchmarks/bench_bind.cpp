@@ -0,0 +1,121 @@
+#include <iomanip>
+#include <iostream>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <time.h>
+
+#include "lib/client.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+// Looks up many assets over loopback TCP, from a server answering from memory in its own
+// thread, one BindRead and AssetStatus per asset, and in BindBatches answered by
+// AssetStatusBatches.
+const size_t ASSETS = 20000;
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+class LookupServer : public Client {
+	bool _batches;
+public:
+	LookupServer(asio::io_service& ioSvc, bool batches) :
+		Client(ioSvc, "server"), _batches(batches)
+	{}
+
+protected:
+	virtual bool servesBindBatches() const { return _batches; }
+
+	static void found(bithorde::AssetStatus& resp, const bithorde::BindRead& msg) {
+		resp.set_handle(msg.handle());
+		resp.set_status(msg.ids_size() ? bithorde::SUCCESS : bithorde::NOTFOUND);
+		resp.set_size(1024*1024);
+		resp.set_availability(1000);
+	}
+
+	virtual void onMessage(bithorde::BindRead& msg) {
+		bithorde::AssetStatus resp;
+		found(resp, msg);
+		sendMessage(Connection::AssetStatus, resp);
+	}
+
+	virtual void onMessage(bithorde::BindBatch& msg) {
+		bithorde::AssetStatusBatch resp;
+		for (int i=0; i < msg.binds_size(); i++)
+			found(*resp.add_statuses(), msg.binds(i));
+		sendMessage(Connection::AssetStatusBatch, resp);
+	}
+};
+
+struct StatusCounter {
+	size_t found;
+
+	StatusCounter() : found(0) {}
+
+	void onStatus(const bithorde::AssetStatus& status) {
+		if (status.status() == bithorde::SUCCESS)
+			found++;
+	}
+};
+
+static void run(bool batches) {
+	asio::io_service serverSvc, clientSvc;
+	asio::ip::tcp::acceptor acceptor(serverSvc, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+	auto clientSocket = boost::make_shared<asio::ip::tcp::socket>(clientSvc);
+	clientSocket->connect(acceptor.local_endpoint());
+	auto serverSocket = boost::make_shared<asio::ip::tcp::socket>(serverSvc);
+	acceptor.accept(*serverSocket);
+
+	boost::shared_ptr<LookupServer> server(new LookupServer(serverSvc, batches));
+	server->connect(Connection::create(serverSvc, serverSocket));
+	asio::io_service::work work(serverSvc);
+	boost::thread serverThread(boost::bind(&asio::io_service::run, &serverSvc));
+
+	Client::Pointer client = Client::create(clientSvc, "client");
+	client->connect(Connection::create(clientSvc, clientSocket));
+	while (client->peerName().empty() && clientSvc.run_one());
+	BOOST_REQUIRE_EQUAL( client->peerServesBindBatches(), batches );
+
+	StatusCounter counter;
+	vector< boost::shared_ptr<ReadAsset> > assets;
+	vector<ReadAsset*> toBind;
+	for (size_t i = 0; i < ASSETS; i++) {
+		BitHordeIds ids;
+		auto id = ids.Add();
+		id->set_type(bithorde::TREE_TIGER);
+		id->set_id("asset-" + boost::lexical_cast<string>(i) + "-padded-to-tiger-size");
+		assets.push_back(boost::make_shared<ReadAsset>(client, ids));
+		assets.back()->statusUpdate.connect(boost::bind(&StatusCounter::onStatus, &counter, _1));
+		toBind.push_back(assets.back().get());
+	}
+
+	double start = wallClock();
+	BOOST_CHECK_EQUAL( client->bind(toBind), ASSETS );
+	while ((counter.found < ASSETS) && clientSvc.run_one());
+	double wall = wallClock() - start;
+
+	serverSvc.stop();
+	serverThread.join();
+
+	BOOST_CHECK_EQUAL( counter.found, ASSETS );
+	cout << (batches ? "BindBatch:       " : "Single BindRead: ")
+		<< fixed << setprecision(0) << setw(9) << ASSETS / wall << " lookups/s" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( bind_lookups )
+{
+	run(false);
+	run(true);
+}
@@ -0,0 +1,77 @@
+#include <iomanip>
+#include <iostream>
+
+#include <boost/bind.hpp>
+#include <boost/signals2.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <time.h>
+
+#include "bithorde.pb.h"
+#include "lib/callback.h"
+#include "lib/types.h"
+
+using namespace std;
+
+using namespace bithorde;
+
+// The cost of delivering each chunk to the single handler of a ReadAsset, through the
+// signals2::signal it used to be, and through a Callback, bound straight to the member or
+// through boost::bind with extra arguments, like ForwardedAsset does.
+const size_t CHUNKS = 10000000;
+
+struct Receiver {
+	uint64_t received;
+	Receiver() : received(0) {}
+	void onData(uint64_t offset, const ByteSlice& data, int tag, bithorde::Status status) {
+		received += (status == bithorde::SUCCESS);
+	}
+	void onTagged(int upstream, uint64_t offset, const ByteSlice& data, int tag, bithorde::Status status) {
+		received += (status == bithorde::SUCCESS) && upstream;
+	}
+};
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void report(const char* what, double wall, uint64_t check) {
+	cout << what << fixed << setprecision(1) << wall * 1000000000.0 / CHUNKS << " ns/chunk"
+		<< (check == CHUNKS ? "" : " (miscounted)") << endl;
+}
+
+template <typename Dispatch>
+static double deliver(Dispatch& dispatch) {
+	ByteSlice data;
+	double start = wallClock();
+	for (size_t i=0; i < CHUNKS; i++)
+		dispatch(i * 4096, data, i & 0xffff, bithorde::SUCCESS);
+	return wallClock() - start;
+}
+
+BOOST_AUTO_TEST_CASE( chunk_dispatch )
+{
+	{
+		Receiver receiver;
+		boost::signals2::signal<void (uint64_t, const ByteSlice&, int, bithorde::Status)> dataArrived;
+		dataArrived.connect(boost::bind(&Receiver::onData, &receiver, _1, _2, _3, _4));
+		double wall = deliver(dataArrived);
+		report("signals2::signal:      ", wall, receiver.received);
+	}
+	{
+		Receiver receiver;
+		Callback<void (uint64_t, const ByteSlice&, int, bithorde::Status)> dataArrived;
+		dataArrived.connect<Receiver, &Receiver::onData>(&receiver);
+		double wall = deliver(dataArrived);
+		report("Callback, member:      ", wall, receiver.received);
+	}
+	{
+		Receiver receiver;
+		Callback<void (uint64_t, const ByteSlice&, int, bithorde::Status)> dataArrived;
+		dataArrived.connect(boost::bind(&Receiver::onTagged, &receiver, 1, _1, _2, _3, _4));
+		double wall = deliver(dataArrived);
+		report("Callback, boost::bind: ", wall, receiver.received);
+	}
+}
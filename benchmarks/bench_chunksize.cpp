@@ -0,0 +1,158 @@
+#include <iomanip>
+#include <iostream>
+#include <sys/resource.h>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <time.h>
+
+#include "lib/client.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+// Streams an asset over loopback TCP with reads of the chunk-size agreed in the HandShake,
+// keeping about the same amount of data in flight. The server answers from memory, so
+// the cost measured is that of the messages themselves.
+const size_t IN_FLIGHT = 1024*1024;
+const size_t TOTAL = 2048ull*1024*1024;
+
+static double cpuTime(const struct rusage& usage) {
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+class MemoryServer : public Client {
+	boost::shared_ptr<Buffer> _content;
+public:
+	MemoryServer(asio::io_service& ioSvc, const boost::shared_ptr<Buffer>& content) :
+		Client(ioSvc, "server"), _content(content)
+	{}
+
+protected:
+	virtual void onMessage(bithorde::BindRead& msg) {
+		if (!msg.ids_size())
+			return;
+		bithorde::AssetStatus resp;
+		resp.set_handle(msg.handle());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_size(TOTAL);
+		sendMessage(Connection::AssetStatus, resp);
+	}
+
+	virtual void onMessage(const bithorde::Read::Request& msg) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(msg.reqid());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(msg.offset());
+		size_t size = min((size_t)msg.size(), chunkSize());
+		sendMessage(Connection::ReadResponse, resp, ByteSlice(_content, 0, size));
+	}
+};
+
+class Download {
+	ReadAsset& _asset;
+	Client& _client;
+	uint64_t _requested, _received;
+	size_t _messages;
+public:
+	Download(ReadAsset& asset, Client& client) :
+		_asset(asset), _client(client), _requested(0), _received(0), _messages(0)
+	{
+		_asset.statusUpdate.connect(boost::bind(&Download::onStatus, this, _1));
+		_asset.dataArrived.connect(boost::bind(&Download::onData, this, _2));
+	}
+
+	uint64_t received() const { return _received; }
+	size_t messages() const { return _messages; }
+private:
+	void onStatus(const bithorde::AssetStatus& status) {
+		BOOST_REQUIRE_EQUAL( status.status(), bithorde::SUCCESS );
+		requestMore();
+	}
+
+	void onData(const ByteSlice& data) {
+		BOOST_REQUIRE_EQUAL( data.size(), _client.chunkSize() );
+		_received += data.size();
+		_messages++;
+		if (_received == TOTAL)
+			_asset.close();
+		else
+			requestMore();
+	}
+
+	void requestMore() {
+		size_t chunk = _client.chunkSize();
+		while ((_requested < TOTAL) && (_requested < _received + IN_FLIGHT)) {
+			_asset.aSyncRead(_requested, chunk);
+			_requested += chunk;
+		}
+	}
+};
+
+static void run(const boost::shared_ptr<Buffer>& content, size_t serverChunk, size_t clientChunk) {
+	asio::io_service serverSvc, clientSvc;
+	asio::ip::tcp::acceptor acceptor(serverSvc, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+	auto clientSocket = boost::make_shared<asio::ip::tcp::socket>(clientSvc);
+	clientSocket->connect(acceptor.local_endpoint());
+	auto serverSocket = boost::make_shared<asio::ip::tcp::socket>(serverSvc);
+	acceptor.accept(*serverSocket);
+
+	boost::shared_ptr<MemoryServer> server(new MemoryServer(serverSvc, content));
+	server->setMaxChunk(serverChunk);
+	server->connect(Connection::create(serverSvc, serverSocket));
+	asio::io_service::work work(serverSvc);
+	boost::thread serverThread(boost::bind(&asio::io_service::run, &serverSvc));
+
+	Client::Pointer client = Client::create(clientSvc, "client");
+	client->setMaxChunk(clientChunk);
+	client->connect(Connection::create(clientSvc, clientSocket));
+	BitHordeIds ids;
+	auto id = ids.Add();
+	id->set_type(bithorde::TREE_TIGER);
+	id->set_id("asset");
+	ReadAsset asset(client, ids);
+	Download download(asset, *client);
+
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	double start = wallClock();
+	client->bind(asset);
+	while (download.received() < TOTAL && clientSvc.run_one());
+	double wall = wallClock() - start;
+	getrusage(RUSAGE_SELF, &after);
+
+	serverSvc.stop();
+	serverThread.join();
+
+	double gb = download.received() / (1024.0*1024*1024);
+	double cpu = cpuTime(after) - cpuTime(before);
+	cout << "Server " << setw(3) << serverChunk/1024 << "KB, client " << setw(3) << clientChunk/1024 << "KB: "
+		<< setw(3) << client->chunkSize()/1024 << "KB chunks, "
+		<< fixed << setprecision(2) << gb / wall << " GB/s, "
+		<< setprecision(0) << download.messages() / wall << " msgs/s, "
+		<< setprecision(2) << cpu / gb << " CPU-s/GB" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( chunksize_throughput )
+{
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	buf->grow(Connection::MAX_CHUNK);
+	buf->charge(Connection::MAX_CHUNK);
+	memset(buf->ptr, 0, buf->size);
+
+	run(buf, Connection::DEFAULT_CHUNK, Connection::MAX_CHUNK); // Like a peer not announcing any
+	run(buf, Connection::MAX_CHUNK, 128*1024);
+	run(buf, Connection::MAX_CHUNK, Connection::MAX_CHUNK);
+}
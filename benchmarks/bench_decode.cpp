@@ -0,0 +1,133 @@
+#include <iomanip>
+#include <iostream>
+#include <new>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include "lib/connection.h"
+
+using namespace std;
+namespace asio = boost::asio;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+// Counts every heap-allocation made in the process
+static uint64_t allocations = 0;
+
+void* operator new(size_t size) {
+	allocations++;
+	void* res = malloc(size);
+	if (!res)
+		throw std::bad_alloc();
+	return res;
+}
+
+void operator delete(void* ptr) throw() {
+	free(ptr);
+}
+
+const size_t FRAMES = 1000000;
+
+static bithorde::BindRead sampleBindRead() {
+	bithorde::BindRead msg;
+	msg.set_handle(17);
+	msg.set_uuid(0x1234567890abcdefULL);
+	msg.set_timeout(500);
+	auto tiger = msg.add_ids();
+	tiger->set_type(bithorde::TREE_TIGER);
+	tiger->set_id(string(24, 't'));
+	auto sha1 = msg.add_ids();
+	sha1->set_type(bithorde::SHA1);
+	sha1->set_id(string(20, 's'));
+	return msg;
+}
+
+static void report(const char* name, uint64_t count, uint64_t allocs, const pt::ptime& start) {
+	double secs = (pt::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+	cout << setw(28) << left << name
+		<< fixed << setprecision(0) << setw(10) << right << (count / secs) << " msgs/s, "
+		<< setprecision(2) << (double)allocs / count << " allocations/msg" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( decode_bindread )
+{
+	string encoded = sampleBindRead().SerializeAsString();
+	const void* data = encoded.data();
+	int size = encoded.size();
+
+	uint64_t allocsBefore = allocations;
+	pt::ptime start = pt::microsec_clock::universal_time();
+	for (size_t i = 0; i < FRAMES; i++) {
+		bithorde::BindRead msg;
+		msg.ParsePartialFromArray(data, size);
+	}
+	report("fresh message per frame", FRAMES, allocations - allocsBefore, start);
+
+	allocsBefore = allocations;
+	start = pt::microsec_clock::universal_time();
+	bithorde::BindRead cached;
+	for (size_t i = 0; i < FRAMES; i++) {
+		cached.Clear();
+		cached.ParsePartialFromArray(data, size);
+	}
+	report("re-used message", FRAMES, allocations - allocsBefore, start);
+}
+
+static uint64_t received = 0;
+static void countMessage(asio::io_service* ioSvc, Connection::MessageType, ::google::protobuf::Message&, const ByteSlice&) {
+	if (++received == FRAMES)
+		ioSvc->stop();
+}
+
+static void writeFrames(int fd, const string& frames, size_t repeat) {
+	for (size_t i = 0; i < repeat; i++) {
+		size_t written = 0;
+		while (written < frames.size()) {
+			ssize_t res = ::write(fd, frames.data()+written, frames.size()-written);
+			if (res <= 0)
+				return;
+			written += res;
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE( decode_connection )
+{
+	const size_t BATCH = 1000;
+	string frame;
+	{
+		string msg = sampleBindRead().SerializeAsString();
+		::google::protobuf::io::StringOutputStream out(&frame);
+		::google::protobuf::io::CodedOutputStream stream(&out);
+		stream.WriteTag((Connection::BindRead << 3) | 2);
+		stream.WriteVarint32(msg.size());
+		stream.WriteString(msg);
+	}
+	string frames;
+	for (size_t i = 0; i < BATCH; i++)
+		frames += frame;
+
+	asio::io_service ioSvc;
+	auto ours = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+	asio::local::stream_protocol::socket theirs(ioSvc);
+	asio::local::connect_pair(*ours, theirs);
+
+	Connection::Pointer c = Connection::create(ioSvc, ours);
+	c->message.connect(boost::bind(&countMessage, &ioSvc, _1, _2, _3));
+
+	uint64_t allocsBefore = allocations;
+	pt::ptime start = pt::microsec_clock::universal_time();
+	boost::thread writer(boost::bind(&writeFrames, theirs.native_handle(), frames, FRAMES/BATCH));
+	ioSvc.run();
+	report("Connection, BindRead", received, allocations - allocsBefore, start);
+	cout << "  " << c->stats() << endl;
+	writer.join();
+}
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "bithorded/lib/randomaccessfile.hpp"
+#include "bithorded/lib/readengine.hpp"
+#include "bithorded/source/store.hpp"
+
+using namespace std;
+using namespace bithorded;
+namespace asio = boost::asio;
+namespace fs = boost::filesystem;
+namespace pt = boost::posix_time;
+
+const size_t CHUNK = 64*1024;
+const size_t HOT_SIZE = 1024*1024;
+const size_t COLD_SIZE = 64*1024*1024;
+const int READ_THREADS = 8;
+
+// Where reads that miss page-cache are done
+enum Engine {
+	ON_LOOP,
+	THREADS,
+	RING,
+	STORE, // SourceAsset::async_read, on assets from a source::Store
+};
+
+static const char* engineName(Engine engine) {
+	switch (engine) {
+	case ON_LOOP: return "on the loop";
+	case THREADS: return "on threads";
+	case RING: return "on io_uring";
+	case STORE: return "in a Store";
+	}
+	return "";
+}
+
+static void createFile(const fs::path& path, size_t size) {
+	vector<byte> content(size);
+	for (size_t i = 0; i < size; i++)
+		content[i] = rand();
+	int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	BOOST_REQUIRE( write(fd, content.data(), size) == (ssize_t)size );
+	fdatasync(fd);
+	close(fd);
+}
+
+struct TestFiles {
+	fs::path dir;
+	TestFiles() : dir(fs::temp_directory_path() / fs::unique_path()) {
+		fs::create_directories(dir);
+		createFile(dir/"hot", HOT_SIZE);
+		createFile(dir/"cold", COLD_SIZE);
+	}
+	~TestFiles() {
+		fs::remove_all(dir);
+	}
+};
+
+// An event-loop serving a steady stream of 64KB reads, one in every COLD_RATIO for content
+// evicted from page-cache. Cold reads are spread out, so readahead doesn't help. Measures
+// the latency of each read, from arriving on the loop until completed there.
+const size_t READS = 4000;
+const size_t COLD_RATIO = 20;
+const size_t COLD_STRIDE = COLD_SIZE / (READS / COLD_RATIO);
+const pt::microseconds INTERVAL(50);
+
+class ReadLatency {
+	asio::io_service _ioSvc;
+	RandomAccessFile& _hot;
+	RandomAccessFile& _cold;
+	Engine _engine;
+	ReadEngine _readEngine;
+	boost::scoped_ptr<source::Store> _store;
+	IAsset::Ptr _hotAsset, _coldAsset;
+	vector<long> _hotLatency, _coldLatency;
+	size_t _completed;
+public:
+	ReadLatency(const TestFiles& files, RandomAccessFile& hot, RandomAccessFile& cold, Engine engine) :
+		_hot(hot), _cold(cold), _engine(engine), _readEngine(_ioSvc, READ_THREADS, engine == RING), _completed(0)
+	{
+		if (engine == STORE) {
+			// The Store picks its own engine; io_uring where the kernel offers it
+			_store.reset(new source::Store(_ioSvc, files.dir));
+			_hotAsset = _store->addAsset(files.dir/"hot");
+			_coldAsset = _store->addAsset(files.dir/"cold");
+			while (!hashed(_hotAsset) || !hashed(_coldAsset))
+				_ioSvc.run_one();
+		}
+	}
+
+	void run() {
+		posix_fadvise(_cold.fd(), 0, 0, POSIX_FADV_DONTNEED);
+		asio::io_service::work work(_ioSvc);
+		boost::thread requests(boost::bind(&ReadLatency::request, this));
+		_ioSvc.run();
+		requests.join();
+
+		report("cached", _hotLatency);
+		report("uncached", _coldLatency);
+	}
+private:
+	void request() {
+		pt::ptime start = pt::microsec_clock::universal_time();
+		for (size_t i = 0; i < READS; i++) {
+			boost::this_thread::sleep(start + INTERVAL*i);
+			bool cold = (i % COLD_RATIO) == 0;
+			uint64_t offset = cold ? (i/COLD_RATIO)*COLD_STRIDE : (i*CHUNK) % HOT_SIZE;
+			_ioSvc.post(boost::bind(&ReadLatency::serve, this, cold, offset, pt::microsec_clock::universal_time()));
+		}
+	}
+
+	void serve(bool cold, uint64_t offset, pt::ptime queued) {
+		if (_engine == STORE) {
+			size_t size = CHUNK;
+			IAsset::Ptr& asset = cold ? _coldAsset : _hotAsset;
+			asset->async_read(offset, size, boost::bind(&ReadLatency::assetRead, this, cold, queued, _2), this, pt::pos_infin);
+			return;
+		}
+		RandomAccessFile& file = cold ? _cold : _hot;
+		boost::shared_array<byte> buf(new byte[CHUNK]);
+		if (_engine == ON_LOOP) {
+			size_t size = CHUNK;
+			file.read(offset, size, buf.get());
+		} else if (!file.readCached(offset, CHUNK, buf.get())) {
+			// Completions from threads are posted back to the loop
+			_readEngine.read(file, offset, CHUNK, buf.get(), boost::bind(&ReadLatency::readDone, this, cold, queued, buf));
+			return;
+		}
+		completed(cold, queued);
+	}
+
+	void readDone(bool cold, pt::ptime queued, boost::shared_array<byte> buf) {
+		_ioSvc.dispatch(boost::bind(&ReadLatency::completed, this, cold, queued));
+	}
+
+	// Like the daemon, hand completions from the disk back to the loop, and finish cached reads right away
+	void assetRead(bool cold, pt::ptime queued, const ByteSlice& data) {
+		BOOST_CHECK_EQUAL( data.size(), CHUNK );
+		_ioSvc.dispatch(boost::bind(&ReadLatency::completed, this, cold, queued));
+	}
+
+	void completed(bool cold, pt::ptime queued) {
+		long latency = (pt::microsec_clock::universal_time() - queued).total_microseconds();
+		(cold ? _coldLatency : _hotLatency).push_back(latency);
+		if (++_completed == READS)
+			_ioSvc.stop();
+	}
+
+	static bool hashed(const IAsset::Ptr& asset) {
+		return boost::static_pointer_cast<source::SourceAsset>(asset)->hasRootHash();
+	}
+
+	void report(const char* kind, vector<long>& latencies) {
+		sort(latencies.begin(), latencies.end());
+		cout << "Uncached " << setw(14) << left << engineName(_engine) << setw(10) << kind
+			<< "median " << setw(7) << right << latencies[latencies.size()/2] << " us, "
+			<< "p99 " << setw(7) << right << latencies[(latencies.size()*99)/100] << " us" << endl;
+	}
+};
+
+BOOST_AUTO_TEST_CASE( diskread_latency )
+{
+	TestFiles files;
+	RandomAccessFile hot(files.dir/"hot"), cold(files.dir/"cold");
+	byte buf[CHUNK];
+	for (uint64_t offset = 0; offset < HOT_SIZE; offset += CHUNK) {
+		size_t size = CHUNK;
+		hot.read(offset, size, buf);
+	}
+
+	ReadLatency(files, hot, cold, ON_LOOP).run();
+	ReadLatency(files, hot, cold, THREADS).run();
+	ReadLatency(files, hot, cold, RING).run();
+	ReadLatency(files, hot, cold, STORE).run();
+}
+
+// Random, uncached 4KB reads, keeping QUEUE_DEPTH in flight from the event-loop.
+const size_t RANDOM_READS = 20000;
+const size_t RANDOM_SIZE = 4096;
+const size_t QUEUE_DEPTH = 32;
+
+class RandomReads {
+	asio::io_service _ioSvc;
+	RandomAccessFile& _file;
+	Engine _engine;
+	ReadEngine _readEngine;
+	size_t _issued, _completed;
+public:
+	RandomReads(RandomAccessFile& file, Engine engine) :
+		_file(file), _engine(engine), _readEngine(_ioSvc, READ_THREADS, engine == RING), _issued(0), _completed(0)
+	{}
+
+	void run() {
+		posix_fadvise(_file.fd(), 0, 0, POSIX_FADV_DONTNEED);
+		posix_fadvise(_file.fd(), 0, 0, POSIX_FADV_RANDOM);
+		struct rusage before, after;
+		getrusage(RUSAGE_SELF, &before);
+		pt::ptime start = pt::microsec_clock::universal_time();
+
+		asio::io_service::work work(_ioSvc);
+		for (size_t i = 0; i < QUEUE_DEPTH; i++)
+			issue();
+		_ioSvc.run();
+
+		double secs = (pt::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+		getrusage(RUSAGE_SELF, &after);
+		long switches = (after.ru_nvcsw + after.ru_nivcsw) - (before.ru_nvcsw + before.ru_nivcsw);
+		double mb = (double)(RANDOM_READS * RANDOM_SIZE) / (1024*1024);
+		cout << "Random reads " << setw(14) << left << engineName(_engine)
+			<< fixed << setprecision(0) << setw(8) << right << (RANDOM_READS / secs) << " IOPS, "
+			<< setw(6) << right << (switches / mb) << " context-switches/MB" << endl;
+	}
+private:
+	void issue() {
+		if (_issued == RANDOM_READS)
+			return;
+		_issued++;
+		uint64_t offset = ((uint64_t)rand() % (COLD_SIZE / RANDOM_SIZE)) * RANDOM_SIZE;
+		boost::shared_array<byte> buf(new byte[RANDOM_SIZE]);
+		_readEngine.read(_file, offset, RANDOM_SIZE, buf.get(), boost::bind(&RandomReads::readDone, this, buf));
+	}
+
+	void readDone(boost::shared_array<byte> buf) {
+		_ioSvc.dispatch(boost::bind(&RandomReads::completed, this));
+	}
+
+	void completed() {
+		if (++_completed == RANDOM_READS)
+			_ioSvc.stop();
+		else
+			issue();
+	}
+};
+
+BOOST_AUTO_TEST_CASE( diskread_random )
+{
+	TestFiles files;
+	RandomAccessFile file(files.dir/"cold");
+	RandomReads(file, THREADS).run();
+	RandomReads(file, RING).run();
+}
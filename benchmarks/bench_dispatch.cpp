@@ -0,0 +1,139 @@
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include <time.h>
+
+#include "lib/allocator.h"
+#include "lib/slotmap.h"
+
+using namespace std;
+
+// The bookkeeping of bithorde::Client for each read response: taking a reqId for the
+// request, and then finding the request and the binding of its asset as the response
+// comes in, and freeing the reqId. Either on std::maps with a CachedAllocator for ids,
+// or on SlotMaps. Many assets are bound, and a window of reads is in flight.
+const size_t BINDINGS = 10000;
+const size_t IN_FLIGHT = 64;
+const size_t RESPONSES = 10000000;
+
+struct Binding {
+	int handle;
+	uint64_t received;
+};
+
+struct Request {
+	int asset;
+	size_t responses;
+	bool cancelled;
+};
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void report(const char* what, double wall, uint64_t check) {
+	cout << what << fixed << setprecision(1) << wall * 1000000000.0 / RESPONSES << " ns/response"
+		<< (check == RESPONSES ? "" : " (miscounted)") << endl;
+}
+
+static void runMaps() {
+	std::map<int, unique_ptr<Binding> > assets;
+	std::map<int, Request> requests;
+	CachedAllocator<int> handles(1), reqIds(1);
+	vector<int> bound;
+	for (size_t i=0; i < BINDINGS; i++) {
+		int h = handles.allocate();
+		assets[h].reset(new Binding());
+		bound.push_back(h);
+	}
+
+	double start = wallClock();
+	vector<int> window;
+	for (size_t i=0; i < IN_FLIGHT; i++) {
+		int reqId = reqIds.allocate();
+		Request& req = requests[reqId];
+		req.asset = bound[(i*7919) % BINDINGS];
+		req.responses = 1;
+		req.cancelled = false;
+		window.push_back(reqId);
+	}
+	for (size_t i=0; i < RESPONSES; i++) {
+		int& slot = window[i % IN_FLIGHT];
+		auto req = requests.find(slot);
+		int asset = req->second.asset;
+		if (!--req->second.responses) {
+			requests.erase(req);
+			reqIds.free(slot);
+		}
+		auto binding = assets.find(asset);
+		if (binding != assets.end())
+			binding->second->received++;
+
+		slot = reqIds.allocate();
+		Request& next = requests[slot];
+		next.asset = bound[((i+IN_FLIGHT)*7919) % BINDINGS];
+		next.responses = 1;
+		next.cancelled = false;
+	}
+	double wall = wallClock() - start;
+	uint64_t received = 0;
+	for (auto iter = assets.begin(); iter != assets.end(); iter++)
+		received += iter->second->received;
+	report("std::map + CachedAllocator: ", wall, received);
+}
+
+static void runSlotMaps() {
+	SlotMap<unique_ptr<Binding>, 0> assets;
+	SlotMap<Request, 12> requests;
+	vector<int> bound;
+	for (size_t i=0; i < BINDINGS; i++) {
+		int h = assets.allocate();
+		assets.find(h)->reset(new Binding());
+		bound.push_back(h);
+	}
+
+	double start = wallClock();
+	vector<int> window;
+	for (size_t i=0; i < IN_FLIGHT; i++) {
+		int reqId = requests.allocate();
+		Request& req = *requests.find(reqId);
+		req.asset = bound[(i*7919) % BINDINGS];
+		req.responses = 1;
+		req.cancelled = false;
+		window.push_back(reqId);
+	}
+	for (size_t i=0; i < RESPONSES; i++) {
+		int& slot = window[i % IN_FLIGHT];
+		Request* req = requests.find(slot);
+		int asset = req->asset;
+		if (!--req->responses)
+			requests.free(slot);
+		if (unique_ptr<Binding>* binding = assets.find(asset))
+			(*binding)->received++;
+
+		slot = requests.allocate();
+		Request& next = *requests.find(slot);
+		next.asset = bound[((i+IN_FLIGHT)*7919) % BINDINGS];
+		next.responses = 1;
+		next.cancelled = false;
+	}
+	double wall = wallClock() - start;
+	uint64_t received = 0;
+	auto keys = assets.keys();
+	for (auto iter = keys.begin(); iter != keys.end(); iter++)
+		received += (*assets.find(*iter))->received;
+	report("SlotMap:                    ", wall, received);
+}
+
+BOOST_AUTO_TEST_CASE( response_dispatch )
+{
+	runMaps();
+	runSlotMaps();
+}
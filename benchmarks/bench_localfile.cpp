@@ -0,0 +1,148 @@
+#include <iomanip>
+#include <iostream>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "lib/client.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+// Streams a (page-cached) asset to a client on the same host over a unix-socket, the way
+// bhget does, with a window of 64KB reads in flight. The server side answers reads like
+// bithorded, through sendfile(), and passes the client a LocalFile unless disabled.
+const size_t CHUNK = 64*1024;
+const size_t WINDOW = 10;
+const size_t FILE_SIZE = 256*1024*1024;
+const size_t PASSES = 4;
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+class LocalServer : public Client {
+	boost::shared_ptr<FILE> _file;
+	bool _passFiles;
+public:
+	LocalServer(asio::io_service& ioSvc, const boost::shared_ptr<FILE>& file, bool passFiles) :
+		Client(ioSvc, "server"), _file(file), _passFiles(passFiles)
+	{}
+
+protected:
+	virtual void onMessage(bithorde::BindRead& msg) {
+		if (!msg.ids_size())
+			return;
+		if (_passFiles && peerTakesLocalFiles()) {
+			bithorde::LocalFile desc;
+			desc.set_handle(msg.handle());
+			auto range = desc.add_verified();
+			range->set_offset(0);
+			range->set_size(FILE_SIZE);
+			sendMessage(Connection::LocalFile, desc, Descriptor(_file, fileno(_file.get())));
+		}
+		bithorde::AssetStatus resp;
+		resp.set_handle(msg.handle());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_size(FILE_SIZE);
+		sendMessage(Connection::AssetStatus, resp);
+	}
+
+	virtual void onMessage(const bithorde::Read::Request& msg) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(msg.reqid());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(msg.offset());
+		sendMessage(Connection::ReadResponse, resp, FileSlice(_file, fileno(_file.get()), msg.offset(), msg.size()));
+	}
+};
+
+class Download {
+	ReadAsset& _asset;
+	uint64_t _requested, _received, _total;
+public:
+	Download(ReadAsset& asset) :
+		_asset(asset), _requested(0), _received(0), _total(FILE_SIZE*PASSES)
+	{
+		_asset.statusUpdate.connect(boost::bind(&Download::onStatus, this, _1));
+		_asset.dataArrived.connect(boost::bind(&Download::onData, this, _2));
+	}
+
+	uint64_t received() const { return _received; }
+private:
+	void onStatus(const bithorde::AssetStatus& status) {
+		BOOST_REQUIRE_EQUAL( status.status(), bithorde::SUCCESS );
+		requestMore();
+	}
+
+	void onData(const ByteSlice& data) {
+		BOOST_REQUIRE_EQUAL( data.size(), CHUNK );
+		_received += data.size();
+		if (_received == _total)
+			_asset.close();
+		else
+			requestMore();
+	}
+
+	void requestMore() {
+		while ((_requested < _total) && (_requested < _received + WINDOW*CHUNK)) {
+			_asset.aSyncRead(_requested % FILE_SIZE, CHUNK);
+			_requested += CHUNK;
+		}
+	}
+};
+
+static void run(const char* name, const boost::shared_ptr<FILE>& file, bool passFiles) {
+	asio::io_service serverSvc, clientSvc;
+	auto serverSocket = boost::make_shared<asio::local::stream_protocol::socket>(serverSvc);
+	auto clientSocket = boost::make_shared<asio::local::stream_protocol::socket>(clientSvc);
+	asio::local::connect_pair(*serverSocket, *clientSocket);
+
+	boost::shared_ptr<LocalServer> server(new LocalServer(serverSvc, file, passFiles));
+	server->connect(Connection::create(serverSvc, serverSocket));
+	asio::io_service::work work(serverSvc);
+	boost::thread serverThread(boost::bind(&asio::io_service::run, &serverSvc));
+
+	Client::Pointer client = Client::create(clientSvc, "client");
+	client->connect(Connection::create(clientSvc, clientSocket));
+	BitHordeIds ids;
+	auto id = ids.Add();
+	id->set_type(bithorde::TREE_TIGER);
+	id->set_id("asset");
+	ReadAsset asset(client, ids);
+	Download download(asset);
+
+	double start = wallClock();
+	client->bind(asset);
+	while (download.received() < FILE_SIZE*PASSES && clientSvc.run_one());
+	double wall = wallClock() - start;
+
+	serverSvc.stop();
+	serverThread.join();
+
+	double gb = download.received() / (1024.0*1024*1024);
+	cout << setw(24) << left << name << fixed << setprecision(2) << gb / wall << " GB/s" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( localfile_throughput )
+{
+	boost::shared_ptr<FILE> file(tmpfile(), fclose);
+	BOOST_REQUIRE( file );
+	static byte chunk[CHUNK];
+	for (size_t written = 0; written < FILE_SIZE; written += CHUNK)
+		BOOST_REQUIRE( fwrite(chunk, 1, CHUNK, file.get()) == CHUNK );
+	fflush(file.get());
+
+	run("Read.Response stream", file, false);
+	run("LocalFile", file, true);
+}
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "lib/connection.h"
+
+using namespace std;
+namespace asio = boost::asio;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+// Round-trip a bind-like request/response while the responding side saturates the link
+// with 64KB ReadResponses.
+const size_t PINGS = 500;
+const size_t CHUNK = 64*1024;
+
+class LatencyTest {
+	asio::io_service _ioSvc;
+	Connection::Pointer _server, _client;
+	boost::shared_ptr<Buffer> _chunk;
+	bool _loaded;
+	Connection::Priority _replyPriority;
+	pt::ptime _pingSent;
+	vector<long> _rtts;
+public:
+	LatencyTest(bool loaded, Connection::Priority replyPriority) :
+		_chunk(new Buffer()), _loaded(loaded), _replyPriority(replyPriority)
+	{
+		auto a = boost::make_shared<asio::local::stream_protocol::socket>(_ioSvc);
+		auto b = boost::make_shared<asio::local::stream_protocol::socket>(_ioSvc);
+		asio::local::connect_pair(*a, *b);
+		_server = Connection::create(_ioSvc, a);
+		_client = Connection::create(_ioSvc, b);
+		_server->message.connect(boost::bind(&LatencyTest::onServerMessage, this, _1, _2));
+		_server->writable.connect(boost::bind(&LatencyTest::pump, this));
+		_client->message.connect(boost::bind(&LatencyTest::onClientMessage, this, _1));
+
+		_chunk->grow(CHUNK);
+		memset(_chunk->ptr, 0, CHUNK);
+		_chunk->charge(CHUNK);
+	}
+
+	void run(const char* name) {
+		pump();
+		ping();
+		_ioSvc.run();
+
+		sort(_rtts.begin(), _rtts.end());
+		cout << setw(36) << left << name
+			<< "median " << setw(6) << right << _rtts[_rtts.size()/2] << " us, "
+			<< "p99 " << setw(6) << right << _rtts[(_rtts.size()*99)/100] << " us" << endl;
+	}
+private:
+	void pump() {
+		if (!_loaded)
+			return;
+		bithorde::Read::Response resp;
+		resp.set_reqid(1);
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(0);
+		while (_server->sendMessage(Connection::ReadResponse, resp, ByteSlice(_chunk, 0, CHUNK)));
+	}
+
+	void ping() {
+		bithorde::Ping msg;
+		_pingSent = pt::microsec_clock::universal_time();
+		_client->sendMessage(Connection::Ping, msg);
+	}
+
+	void onServerMessage(Connection::MessageType type, ::google::protobuf::Message& msg) {
+		if (type != Connection::Ping)
+			return;
+		bithorde::AssetStatus resp;
+		resp.set_handle(1);
+		resp.set_status(bithorde::SUCCESS);
+		_server->sendMessage(Connection::AssetStatus, resp, _replyPriority);
+	}
+
+	void onClientMessage(Connection::MessageType type) {
+		if (type != Connection::AssetStatus)
+			return;
+		_rtts.push_back((pt::microsec_clock::universal_time() - _pingSent).total_microseconds());
+		if (_rtts.size() < PINGS)
+			ping();
+		else
+			_ioSvc.stop();
+	}
+};
+
+BOOST_AUTO_TEST_CASE( priority_latency )
+{
+	LatencyTest(false, Connection::Control).run("Idle link");
+	LatencyTest(true, Connection::Interactive).run("Loaded, reply queued behind data");
+	LatencyTest(true, Connection::Control).run("Loaded, reply as Control");
+}
@@ -0,0 +1,173 @@
+#include <iomanip>
+#include <iostream>
+#include <sys/resource.h>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <time.h>
+
+#include "lib/client.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+// Streams an asset over loopback TCP in small reads, like FUSE readahead does, either as
+// one Read.Request per read or batched into ReadV:s. The server answers from memory, so
+// the cost measured is that of the requests and responses themselves.
+const size_t READ_SIZE = 4*1024;
+const size_t BATCH = 16;
+const size_t IN_FLIGHT = 4*BATCH*READ_SIZE;
+const uint64_t TOTAL = 512ull*1024*1024;
+
+static double cpuTime(const struct rusage& usage) {
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+class MemoryServer : public Client {
+	boost::shared_ptr<Buffer> _content;
+public:
+	MemoryServer(asio::io_service& ioSvc, const boost::shared_ptr<Buffer>& content) :
+		Client(ioSvc, "server"), _content(content)
+	{}
+
+protected:
+	virtual bool servesVectoredReads() const { return true; }
+
+	virtual void onMessage(bithorde::BindRead& msg) {
+		if (!msg.ids_size())
+			return;
+		bithorde::AssetStatus resp;
+		resp.set_handle(msg.handle());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_size(TOTAL);
+		sendMessage(Connection::AssetStatus, resp);
+	}
+
+	void respond(uint32_t reqId, uint64_t offset, size_t size) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(reqId);
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(offset);
+		sendMessage(Connection::ReadResponse, resp, ByteSlice(_content, 0, size));
+	}
+
+	virtual void onMessage(const bithorde::Read::Request& msg) {
+		respond(msg.reqid(), msg.offset(), msg.size());
+	}
+
+	virtual void onMessage(const bithorde::ReadV& msg) {
+		for (int i=0; i < msg.ranges_size(); i++)
+			respond(msg.reqid(), msg.ranges(i).offset(), msg.ranges(i).size());
+	}
+};
+
+class Download {
+	ReadAsset& _asset;
+	bool _vectored;
+	uint64_t _requested, _received;
+	size_t _requests;
+public:
+	Download(ReadAsset& asset, bool vectored) :
+		_asset(asset), _vectored(vectored), _requested(0), _received(0), _requests(0)
+	{
+		_asset.statusUpdate.connect(boost::bind(&Download::onStatus, this, _1));
+		_asset.dataArrived.connect(boost::bind(&Download::onData, this, _2));
+	}
+
+	uint64_t received() const { return _received; }
+	size_t requests() const { return _requests; }
+private:
+	void onStatus(const bithorde::AssetStatus& status) {
+		BOOST_REQUIRE_EQUAL( status.status(), bithorde::SUCCESS );
+		requestMore();
+	}
+
+	void onData(const ByteSlice& data) {
+		BOOST_REQUIRE_EQUAL( data.size(), READ_SIZE );
+		_received += data.size();
+		if (_received == TOTAL)
+			_asset.close();
+		else
+			requestMore();
+	}
+
+	void requestMore() {
+		// Both refill a batch at a time, so only the requests differ
+		while ((_requested < TOTAL) && (_requested + BATCH*READ_SIZE <= _received + IN_FLIGHT)) {
+			vector<ReadAsset::Range> ranges;
+			for (size_t i=0; i < BATCH; i++, _requested += READ_SIZE)
+				ranges.push_back(make_pair(_requested, READ_SIZE));
+			if (_vectored) {
+				BOOST_REQUIRE( _asset.aSyncReadV(ranges) >= 0 );
+				_requests++;
+			} else {
+				for (auto iter = ranges.begin(); iter != ranges.end(); iter++, _requests++)
+					_asset.aSyncRead(iter->first, iter->second);
+			}
+		}
+	}
+};
+
+static void run(const boost::shared_ptr<Buffer>& content, bool vectored) {
+	asio::io_service serverSvc, clientSvc;
+	asio::ip::tcp::acceptor acceptor(serverSvc, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+	auto clientSocket = boost::make_shared<asio::ip::tcp::socket>(clientSvc);
+	clientSocket->connect(acceptor.local_endpoint());
+	auto serverSocket = boost::make_shared<asio::ip::tcp::socket>(serverSvc);
+	acceptor.accept(*serverSocket);
+
+	boost::shared_ptr<MemoryServer> server(new MemoryServer(serverSvc, content));
+	server->connect(Connection::create(serverSvc, serverSocket));
+	asio::io_service::work work(serverSvc);
+	boost::thread serverThread(boost::bind(&asio::io_service::run, &serverSvc));
+
+	Client::Pointer client = Client::create(clientSvc, "client");
+	client->connect(Connection::create(clientSvc, clientSocket));
+	BitHordeIds ids;
+	auto id = ids.Add();
+	id->set_type(bithorde::TREE_TIGER);
+	id->set_id("asset");
+	ReadAsset asset(client, ids);
+	Download download(asset, vectored);
+
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	double start = wallClock();
+	client->bind(asset);
+	while (download.received() < TOTAL && clientSvc.run_one());
+	double wall = wallClock() - start;
+	getrusage(RUSAGE_SELF, &after);
+
+	serverSvc.stop();
+	serverThread.join();
+
+	double gb = download.received() / (1024.0*1024*1024);
+	double cpu = cpuTime(after) - cpuTime(before);
+	cout << (vectored ? "ReadV, " : "Read,  ") << setw(2) << BATCH << "x" << READ_SIZE/1024 << "KB: "
+		<< fixed << setprecision(2) << gb / wall << " GB/s, "
+		<< setprecision(0) << download.requests() / wall << " requests/s, "
+		<< setprecision(2) << cpu / gb << " CPU-s/GB" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( readv_throughput )
+{
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	buf->grow(READ_SIZE);
+	buf->charge(READ_SIZE);
+	memset(buf->ptr, 0, buf->size);
+
+	run(buf, false);
+	run(buf, true);
+}
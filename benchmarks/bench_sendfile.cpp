@@ -0,0 +1,119 @@
+#include <iomanip>
+#include <iostream>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <fcntl.h>
+#include <time.h>
+
+#include "lib/connection.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+// Serve 64KB ReadResponses from a (page-cached) file over TCP loopback, comparing
+// pread() into a buffer against sendfile(). Only the sending thread's CPU is counted.
+const size_t CHUNK = 64*1024;
+const size_t FILE_SIZE = 64*1024*1024;
+const uint64_t TOTAL = 4ULL*1024*1024*1024;
+
+static double threadCPU() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Consume until all payload has arrived, then stop the sender
+static void drain(int fd, asio::io_service* ioSvc) {
+	static byte buf[1024*1024];
+	uint64_t received = 0;
+	ssize_t res;
+	while ((received < TOTAL) && ((res = ::read(fd, buf, sizeof(buf))) > 0))
+		received += res;
+	ioSvc->stop();
+}
+
+class Server {
+	Connection::Pointer _c;
+	int _fd;
+	bool _sendFile;
+	uint64_t _queued;
+public:
+	Server(const Connection::Pointer& c, int fd, bool sendFile) :
+		_c(c), _fd(fd), _sendFile(sendFile), _queued(0)
+	{
+		_c->writable.connect(boost::bind(&Server::pump, this));
+	}
+
+	void pump() {
+		while (_queued < TOTAL) {
+			uint64_t offset = _queued % FILE_SIZE;
+			bithorde::Read::Response resp;
+			resp.set_reqid(1);
+			resp.set_status(bithorde::SUCCESS);
+			resp.set_offset(offset);
+			bool sent;
+			if (_sendFile) {
+				sent = _c->sendMessage(Connection::ReadResponse, resp, FileSlice(boost::shared_ptr<void>(), _fd, offset, CHUNK));
+			} else {
+				boost::shared_ptr<Buffer> buf(new Buffer());
+				buf->grow(CHUNK);
+				buf->charge(pread64(_fd, buf->ptr, CHUNK, offset));
+				sent = _c->sendMessage(Connection::ReadResponse, resp, ByteSlice(buf, 0, CHUNK));
+			}
+			if (!sent)
+				return;
+			_queued += CHUNK;
+		}
+	}
+};
+
+static void run(const char* name, int fd, bool sendFile) {
+	asio::io_service ioSvc;
+	asio::ip::tcp::acceptor acceptor(ioSvc, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+	asio::ip::tcp::socket client(ioSvc);
+	client.connect(acceptor.local_endpoint());
+	auto socket = boost::make_shared<asio::ip::tcp::socket>(ioSvc);
+	acceptor.accept(*socket);
+
+	boost::thread reader(boost::bind(&drain, client.native_handle(), &ioSvc));
+	Connection::Pointer c = Connection::create(ioSvc, socket);
+	Server server(c, fd, sendFile);
+
+	double wallStart = wallClock(), cpuStart = threadCPU();
+	server.pump();
+	ioSvc.run();
+	double cpu = threadCPU() - cpuStart, wall = wallClock() - wallStart;
+	reader.join();
+
+	double gb = c->stats().bytesOut / (1024.0*1024*1024);
+	cout << setw(12) << left << name << fixed << setprecision(2)
+		<< gb / wall << " GB/s, " << gb / cpu << " GB/s per core" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( sendfile_throughput )
+{
+	char path[] = "/tmp/bithorde-bench-XXXXXX";
+	int fd = mkstemp(path);
+	BOOST_REQUIRE( fd >= 0 );
+	unlink(path);
+	static byte chunk[CHUNK];
+	for (size_t written = 0; written < FILE_SIZE; written += CHUNK)
+		BOOST_REQUIRE( ::write(fd, chunk, CHUNK) == (ssize_t)CHUNK );
+
+	run("pread", fd, false);
+	run("sendfile", fd, true);
+	close(fd);
+}
@@ -0,0 +1,111 @@
+#include <iomanip>
+#include <iostream>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "lib/sendqueue.h"
+#include "lib/types.h"
+
+using namespace std;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+// Mimic the daemon serving ReadResponses to a peer that keeps ~1MB queued, with the
+// socket accepting somewhat less than one frame per write.
+const size_t MAX_MSG = 256*1024;
+const size_t SEND_BUF = 1024*1024;
+const size_t FRAME_SIZE = 64*1024 + 16;
+const size_t WRITE_SIZE = 48*1024;
+const uint64_t TOTAL = 2ULL*1024*1024*1024;
+
+static byte payload[FRAME_SIZE];
+
+void report(const char* name, uint64_t bytes, const pt::ptime& start) {
+	double secs = (pt::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+	cout << setw(24) << left << name << fixed << setprecision(1) << (bytes / secs) / (1024*1024) << " MB/s" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( sendqueue_throughput )
+{
+	uint64_t sent = 0;
+	pt::ptime start = pt::microsec_clock::universal_time();
+	{
+		// The previous Connection-path; one flat buffer, compacted on every write
+		Buffer buf;
+		buf.allocate(2*SEND_BUF);
+		while (sent < TOTAL) {
+			while (buf.size < SEND_BUF) {
+				byte* dst = buf.allocate(MAX_MSG);
+				memcpy(dst, payload, FRAME_SIZE);
+				buf.charge(FRAME_SIZE);
+			}
+			size_t written = min(WRITE_SIZE, buf.size);
+			buf.pop(written);
+			sent += written;
+		}
+	}
+	report("Buffer", sent, start);
+
+	sent = 0;
+	start = pt::microsec_clock::universal_time();
+	{
+		SendQueue q(MAX_MSG);
+		while (sent < TOTAL) {
+			while (q.size() < SEND_BUF) {
+				byte* dst = q.allocate(FRAME_SIZE);
+				memcpy(dst, payload, FRAME_SIZE);
+				q.charge(FRAME_SIZE);
+			}
+			size_t written = min(WRITE_SIZE, q.size());
+			q.buffers(); // Gathered for writev
+			q.pop(written);
+			sent += written;
+		}
+	}
+	report("SendQueue", sent, start);
+}
+
+BOOST_AUTO_TEST_CASE( sendqueue_payload )
+{
+	// Queue 64KB read-responses, either copying the content in or referring to it
+	const size_t CHUNK = 64*1024;
+	boost::shared_ptr<Buffer> chunk(new Buffer());
+	memcpy(chunk->allocate(CHUNK), payload, CHUNK);
+	chunk->charge(CHUNK);
+
+	uint64_t sent = 0;
+	pt::ptime start = pt::microsec_clock::universal_time();
+	{
+		SendQueue q(MAX_MSG);
+		while (sent < TOTAL) {
+			while (q.size() < SEND_BUF) {
+				byte* dst = q.allocate(16 + CHUNK);
+				memcpy(dst + 16, chunk->ptr, CHUNK);
+				q.charge(16 + CHUNK);
+			}
+			size_t written = min(WRITE_SIZE, q.size());
+			q.pop(written);
+			sent += written;
+		}
+	}
+	report("Copied content", sent, start);
+
+	sent = 0;
+	start = pt::microsec_clock::universal_time();
+	{
+		SendQueue q(MAX_MSG);
+		while (sent < TOTAL) {
+			while (q.size() < SEND_BUF) {
+				q.allocate(16);
+				q.charge(16);
+				q.append(ByteSlice(chunk, 0, CHUNK));
+			}
+			size_t written = min(WRITE_SIZE, q.size());
+			q.pop(written);
+			sent += written;
+		}
+	}
+	report("Referenced content", sent, start);
+}
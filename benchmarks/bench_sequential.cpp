@@ -0,0 +1,151 @@
+#include <iomanip>
+#include <iostream>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <time.h>
+
+#include "lib/client.h"
+#include "lib/sequentialreader.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+// Reads an asset start to end through a SequentialReader over loopback TCP, with the
+// server answering from memory in its own thread, for a range of read windows.
+const uint64_t TOTAL = 1024ull*1024*1024;
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+class MemoryServer : public Client {
+	boost::shared_ptr<Buffer> _content;
+public:
+	MemoryServer(asio::io_service& ioSvc, const boost::shared_ptr<Buffer>& content) :
+		Client(ioSvc, "server"), _content(content)
+	{}
+
+protected:
+	virtual bool servesVectoredReads() const { return true; }
+
+	virtual void onMessage(bithorde::BindRead& msg) {
+		if (!msg.ids_size())
+			return;
+		bithorde::AssetStatus resp;
+		resp.set_handle(msg.handle());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_size(TOTAL);
+		sendMessage(Connection::AssetStatus, resp);
+	}
+
+	void respond(uint32_t reqId, uint64_t offset, size_t size) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(reqId);
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(offset);
+		sendMessage(Connection::ReadResponse, resp, ByteSlice(_content, 0, size));
+	}
+
+	virtual void onMessage(const bithorde::Read::Request& msg) {
+		respond(msg.reqid(), msg.offset(), msg.size());
+	}
+
+	virtual void onMessage(const bithorde::ReadV& msg) {
+		for (int i=0; i < msg.ranges_size(); i++)
+			respond(msg.reqid(), msg.ranges(i).offset(), msg.ranges(i).size());
+	}
+};
+
+class Download {
+	ReadAsset& _asset;
+	size_t _window;
+	SequentialReader* _reader;
+	uint64_t _received;
+	bool _done;
+public:
+	Download(ReadAsset& asset, size_t window) :
+		_asset(asset), _window(window), _reader(NULL), _received(0), _done(false)
+	{
+		_asset.statusUpdate.connect(boost::bind(&Download::onStatus, this, _1));
+	}
+	~Download() {
+		delete _reader;
+	}
+
+	uint64_t received() const { return _received; }
+	bool done() const { return _done; }
+private:
+	void onStatus(const bithorde::AssetStatus& status) {
+		BOOST_REQUIRE_EQUAL( status.status(), bithorde::SUCCESS );
+		_reader = new SequentialReader(_asset, 0, TOTAL);
+		_reader->setWindow(_window);
+		_reader->dataArrived.connect<Download, &Download::onData>(this);
+		_reader->finished.connect(boost::bind(&Download::onFinished, this, _1));
+		BOOST_REQUIRE( _reader->start() );
+	}
+
+	void onData(uint64_t offset, const ByteSlice& data) {
+		_received += data.size();
+	}
+
+	void onFinished(bithorde::Status status) {
+		BOOST_REQUIRE_EQUAL( status, bithorde::SUCCESS );
+		_done = true;
+	}
+};
+
+static void run(const boost::shared_ptr<Buffer>& content, size_t chunks) {
+	asio::io_service serverSvc, clientSvc;
+	asio::ip::tcp::acceptor acceptor(serverSvc, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+	auto clientSocket = boost::make_shared<asio::ip::tcp::socket>(clientSvc);
+	clientSocket->connect(acceptor.local_endpoint());
+	auto serverSocket = boost::make_shared<asio::ip::tcp::socket>(serverSvc);
+	acceptor.accept(*serverSocket);
+
+	boost::shared_ptr<MemoryServer> server(new MemoryServer(serverSvc, content));
+	server->connect(Connection::create(serverSvc, serverSocket));
+	asio::io_service::work work(serverSvc);
+	boost::thread serverThread(boost::bind(&asio::io_service::run, &serverSvc));
+
+	Client::Pointer client = Client::create(clientSvc, "client");
+	client->connect(Connection::create(clientSvc, clientSocket));
+	BitHordeIds ids;
+	auto id = ids.Add();
+	id->set_type(bithorde::TREE_TIGER);
+	id->set_id("asset");
+	ReadAsset asset(client, ids);
+	Download download(asset, chunks * Connection::MAX_CHUNK);
+
+	double start = wallClock();
+	client->bind(asset);
+	while (!download.done() && clientSvc.run_one());
+	double wall = wallClock() - start;
+
+	serverSvc.stop();
+	serverThread.join();
+
+	BOOST_CHECK_EQUAL( download.received(), TOTAL );
+	cout << "Window " << setw(2) << chunks << " chunks: "
+		<< fixed << setprecision(2) << (download.received() / (1024.0*1024*1024)) / wall << " GB/s" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( sequential_throughput )
+{
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	buf->grow(Connection::MAX_CHUNK);
+	buf->charge(Connection::MAX_CHUNK);
+	memset(buf->ptr, 0, buf->size);
+
+	const size_t windows[] = { 1, 2, 4, 10, 32 };
+	for (size_t i=0; i < sizeof(windows)/sizeof(windows[0]); i++)
+		run(buf, windows[i]);
+}
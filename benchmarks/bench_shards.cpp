@@ -0,0 +1,115 @@
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "lib/connection.h"
+
+using namespace std;
+namespace asio = boost::asio;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+// Every shard is an event-loop on its own thread, pumping 64KB ReadResponses over its own
+// loopback TCP-connection, the way bithorded serves reads from its worker-loops.
+const size_t CHUNK = 64*1024;
+const pt::seconds DURATION(2);
+
+class Shard {
+	asio::io_service _ioSvc;
+	Connection::Pointer _sender, _receiver;
+	boost::shared_ptr<Buffer> _chunk;
+	uint64_t _received;
+public:
+	Shard(asio::ip::tcp::acceptor& listener) :
+		_chunk(new Buffer()), _received(0)
+	{
+		auto a = boost::make_shared<asio::ip::tcp::socket>(_ioSvc);
+		auto b = boost::make_shared<asio::ip::tcp::socket>(_ioSvc);
+		a->connect(listener.local_endpoint());
+		listener.accept(*b);
+		_sender = Connection::create(_ioSvc, a);
+		_receiver = Connection::create(_ioSvc, b);
+		_sender->writable.connect(boost::bind(&Shard::pump, this));
+		_receiver->message.connect(boost::bind(&Shard::onMessage, this, _3));
+
+		_chunk->grow(CHUNK);
+		memset(_chunk->ptr, 0, CHUNK);
+		_chunk->charge(CHUNK);
+	}
+
+	void run() {
+		pump();
+		_ioSvc.run();
+	}
+
+	void stop() {
+		_ioSvc.stop();
+	}
+
+	uint64_t received() const { return _received; }
+private:
+	void pump() {
+		bithorde::Read::Response resp;
+		resp.set_reqid(1);
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(0);
+		while (_sender->sendMessage(Connection::ReadResponse, resp, ByteSlice(_chunk, 0, CHUNK)));
+	}
+
+	void onMessage(const ByteSlice& payload) {
+		_received += payload.size();
+	}
+};
+
+static double measure(size_t shardCount) {
+	asio::io_service ioSvc;
+	asio::ip::tcp::acceptor listener(ioSvc, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+
+	vector< boost::shared_ptr<Shard> > shards;
+	for (size_t i = 0; i < shardCount; i++)
+		shards.push_back(boost::make_shared<Shard>(boost::ref(listener)));
+
+	pt::ptime start = pt::microsec_clock::universal_time();
+	boost::thread_group threads;
+	for (auto iter = shards.begin(); iter != shards.end(); iter++)
+		threads.create_thread(boost::bind(&Shard::run, iter->get()));
+	boost::this_thread::sleep(DURATION);
+	for (auto iter = shards.begin(); iter != shards.end(); iter++)
+		(*iter)->stop();
+	threads.join_all();
+	double secs = (pt::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+
+	uint64_t received = 0;
+	for (auto iter = shards.begin(); iter != shards.end(); iter++)
+		received += (*iter)->received();
+	return (received / secs) / (1024*1024);
+}
+
+BOOST_AUTO_TEST_CASE( shards_throughput )
+{
+	size_t cores = boost::thread::hardware_concurrency();
+	if (cores < 1)
+		cores = 1;
+
+	double single = 0;
+	for (size_t shards = 1; ; shards *= 2) {
+		if (shards > cores)
+			shards = cores;
+		double rate = measure(shards);
+		if (shards == 1)
+			single = rate;
+		cout << setw(3) << right << shards << " event-loops: "
+			<< fixed << setprecision(1) << setw(8) << rate << " MB/s, "
+			<< setprecision(2) << (rate / single) << "x" << endl;
+		if (shards == cores)
+			break;
+	}
+}
@@ -0,0 +1,154 @@
+#include <iomanip>
+#include <iostream>
+#include <sys/resource.h>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "lib/client.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+// Streams a (page-cached) asset to a client on the same host over a unix-socket, with a
+// window of reads in flight, either through the socket or through shared memory. The
+// server side answers reads like bithorded, from the file.
+const size_t WINDOW = 16;
+const size_t FILE_SIZE = 64*1024*1024;
+const size_t SHARED_MEMORY = 2*1024*1024;
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+class FileServer : public Client {
+	boost::shared_ptr<FILE> _file;
+public:
+	FileServer(asio::io_service& ioSvc, const boost::shared_ptr<FILE>& file) :
+		Client(ioSvc, "server"), _file(file)
+	{}
+
+protected:
+	virtual void onMessage(bithorde::BindRead& msg) {
+		if (!msg.ids_size())
+			return;
+		bithorde::AssetStatus resp;
+		resp.set_handle(msg.handle());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_size(FILE_SIZE);
+		sendMessage(Connection::AssetStatus, resp);
+	}
+
+	virtual void onMessage(const bithorde::Read::Request& msg) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(msg.reqid());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(msg.offset());
+		sendMessage(Connection::ReadResponse, resp, FileSlice(_file, fileno(_file.get()), msg.offset(), msg.size()));
+	}
+};
+
+class Download {
+	ReadAsset& _asset;
+	size_t _chunk;
+	uint64_t _requested, _received;
+public:
+	Download(ReadAsset& asset, size_t chunk) :
+		_asset(asset), _chunk(chunk), _requested(0), _received(0)
+	{
+		_asset.statusUpdate.connect(boost::bind(&Download::onStatus, this, _1));
+		_asset.dataArrived.connect(boost::bind(&Download::onData, this, _2));
+	}
+
+	uint64_t received() const { return _received; }
+private:
+	void onStatus(const bithorde::AssetStatus& status) {
+		BOOST_REQUIRE_EQUAL( status.status(), bithorde::SUCCESS );
+		requestMore();
+	}
+
+	void onData(const ByteSlice& data) {
+		BOOST_REQUIRE_EQUAL( data.size(), _chunk );
+		_received += data.size();
+		if (_received == FILE_SIZE)
+			_asset.close();
+		else
+			requestMore();
+	}
+
+	void requestMore() {
+		while ((_requested < FILE_SIZE) && (_requested < _received + WINDOW*_chunk)) {
+			_asset.aSyncRead(_requested, _chunk);
+			_requested += _chunk;
+		}
+	}
+};
+
+static void run(const boost::shared_ptr<FILE>& file, size_t chunk, bool sharedMemory) {
+	asio::io_service serverSvc, clientSvc;
+	auto serverSocket = boost::make_shared<asio::local::stream_protocol::socket>(serverSvc);
+	auto clientSocket = boost::make_shared<asio::local::stream_protocol::socket>(clientSvc);
+	asio::local::connect_pair(*serverSocket, *clientSocket);
+
+	boost::shared_ptr<FileServer> server(new FileServer(serverSvc, file));
+	server->connect(Connection::create(serverSvc, serverSocket));
+	asio::io_service::work work(serverSvc);
+	boost::thread serverThread(boost::bind(&asio::io_service::run, &serverSvc));
+
+	Client::Pointer client = Client::create(clientSvc, "client");
+	if (sharedMemory)
+		client->useSharedMemory(SHARED_MEMORY);
+	client->connect(Connection::create(clientSvc, clientSocket));
+	BitHordeIds ids;
+	auto id = ids.Add();
+	id->set_type(bithorde::TREE_TIGER);
+	id->set_id("asset");
+	ReadAsset asset(client, ids);
+	Download download(asset, chunk);
+
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	double start = wallClock();
+	client->bind(asset);
+	while (download.received() < FILE_SIZE && clientSvc.run_one());
+	double wall = wallClock() - start;
+	getrusage(RUSAGE_SELF, &after);
+
+	serverSvc.stop();
+	serverThread.join();
+
+	size_t messages = FILE_SIZE / chunk;
+	long switches = (after.ru_nvcsw + after.ru_nivcsw) - (before.ru_nvcsw + before.ru_nivcsw);
+	double mb = download.received() / (1024.0*1024);
+	cout << setw(14) << left << (sharedMemory ? "Shared memory" : "Socket")
+		<< setw(4) << right << chunk/1024 << "KB reads: "
+		<< fixed << setprecision(2) << setw(6) << (mb / 1024) / wall << " GB/s, "
+		<< setprecision(0) << setw(7) << messages / wall << " msgs/s, "
+		<< setprecision(1) << setw(6) << switches / mb << " context-switches/MB" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( shmring_throughput )
+{
+	boost::shared_ptr<FILE> file(tmpfile(), fclose);
+	BOOST_REQUIRE( file );
+	static byte block[64*1024];
+	for (size_t written = 0; written < FILE_SIZE; written += sizeof(block))
+		BOOST_REQUIRE( fwrite(block, 1, sizeof(block), file.get()) == sizeof(block) );
+	fflush(file.get());
+
+	const size_t chunks[] = { 4*1024, 64*1024 };
+	for (size_t i = 0; i < sizeof(chunks)/sizeof(chunks[0]); i++) {
+		run(file, chunks[i], false);
+		run(file, chunks[i], true);
+	}
+}
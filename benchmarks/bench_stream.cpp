@@ -0,0 +1,211 @@
+#include <iomanip>
+#include <iostream>
+#include <sys/resource.h>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <time.h>
+
+#include "lib/client.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+// Downloads an asset over loopback TCP like bhget, either through a window of reads or
+// pushed by the server as a ReadStream. The server answers from memory, so the cost
+// measured is that of the messages and the round-trips. Requests may be held back by the
+// server, as if they took that long to get there.
+const size_t READ_WINDOW = 10;
+const uint64_t TOTAL = 1024ull*1024*1024;
+
+static double cpuTime(const struct rusage& usage) {
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+class StreamServer : public Client {
+	boost::shared_ptr<Buffer> _content;
+	boost::posix_time::time_duration _delay;
+	bithorde::ReadStream _stream;
+	uint64_t _next, _end;
+public:
+	StreamServer(asio::io_service& ioSvc, const boost::shared_ptr<Buffer>& content, const boost::posix_time::time_duration& delay) :
+		Client(ioSvc, "server"), _content(content), _delay(delay), _next(0), _end(0)
+	{}
+
+protected:
+	virtual bool servesStreams() const { return true; }
+
+	virtual void onMessage(bithorde::BindRead& msg) {
+		if (!msg.ids_size())
+			return;
+		bithorde::AssetStatus resp;
+		resp.set_handle(msg.handle());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_size(TOTAL);
+		sendMessage(Connection::AssetStatus, resp);
+	}
+
+	void respond(uint32_t reqId, uint64_t offset, size_t size) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(reqId);
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(offset);
+		sendMessage(Connection::ReadResponse, resp, ByteSlice(_content, 0, size));
+	}
+
+	virtual void onMessage(const bithorde::Read::Request& msg) {
+		delay(boost::bind(&StreamServer::respond, this, msg.reqid(), msg.offset(), min((size_t)msg.size(), chunkSize())));
+	}
+
+	virtual void onMessage(const bithorde::ReadStream& msg) {
+		delay(boost::bind(&StreamServer::startStream, this, msg));
+	}
+
+	void delay(const boost::function<void()>& handler) {
+		if (_delay.is_special())
+			return handler();
+		boost::shared_ptr<asio::deadline_timer> timer(new asio::deadline_timer(ioService(), _delay));
+		timer->async_wait(boost::bind(&StreamServer::delayed, this, timer, handler));
+	}
+
+	void delayed(boost::shared_ptr<asio::deadline_timer>, const boost::function<void()>& handler) {
+		handler();
+	}
+
+	void startStream(const bithorde::ReadStream& msg) {
+		_stream = msg;
+		_next = msg.offset();
+		_end = TOTAL;
+		push();
+	}
+
+	virtual void onWritable() {
+		Client::onWritable();
+		push();
+	}
+
+	// Paced by the send-window, like bithorded
+	void push() {
+		while ((_next < _end) && sendCredit(Connection::ReadResponse)) {
+			size_t size = min<uint64_t>(chunkSize(), _end - _next);
+			respond(_stream.reqid(), _next, size);
+			if ((_next += size) == _end) {
+				bithorde::Read::Response end;
+				end.set_reqid(_stream.reqid());
+				end.set_status(bithorde::NONE);
+				sendMessage(Connection::ReadResponse, end);
+			}
+		}
+	}
+};
+
+class Download {
+	ReadAsset& _asset;
+	Client& _client;
+	bool _stream;
+	uint64_t _requested, _received;
+public:
+	Download(ReadAsset& asset, Client& client, bool stream) :
+		_asset(asset), _client(client), _stream(stream), _requested(0), _received(0)
+	{
+		_asset.statusUpdate.connect(boost::bind(&Download::onStatus, this, _1));
+		_asset.dataArrived.connect(boost::bind(&Download::onData, this, _2));
+	}
+
+	uint64_t received() const { return _received; }
+private:
+	void onStatus(const bithorde::AssetStatus& status) {
+		BOOST_REQUIRE_EQUAL( status.status(), bithorde::SUCCESS );
+		if (_stream)
+			BOOST_REQUIRE( _asset.aSyncStream(0) >= 0 );
+		else
+			requestMore();
+	}
+
+	void onData(const ByteSlice& data) {
+		_received += data.size();
+		if (_received == TOTAL)
+			_asset.close();
+		else if (!_stream)
+			requestMore();
+	}
+
+	void requestMore() {
+		size_t chunk = _client.chunkSize();
+		while ((_requested < TOTAL) && (_requested < _received + chunk*READ_WINDOW)) {
+			_asset.aSyncRead(_requested, chunk);
+			_requested += chunk;
+		}
+	}
+};
+
+static void run(const boost::shared_ptr<Buffer>& content, size_t chunk, const boost::posix_time::time_duration& delay, bool stream) {
+	asio::io_service serverSvc, clientSvc;
+	asio::ip::tcp::acceptor acceptor(serverSvc, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+	auto clientSocket = boost::make_shared<asio::ip::tcp::socket>(clientSvc);
+	clientSocket->connect(acceptor.local_endpoint());
+	auto serverSocket = boost::make_shared<asio::ip::tcp::socket>(serverSvc);
+	acceptor.accept(*serverSocket);
+
+	boost::shared_ptr<StreamServer> server(new StreamServer(serverSvc, content, delay));
+	server->setMaxChunk(chunk);
+	server->connect(Connection::create(serverSvc, serverSocket));
+	asio::io_service::work work(serverSvc);
+	boost::thread serverThread(boost::bind(&asio::io_service::run, &serverSvc));
+
+	Client::Pointer client = Client::create(clientSvc, "client");
+	client->connect(Connection::create(clientSvc, clientSocket));
+	BitHordeIds ids;
+	auto id = ids.Add();
+	id->set_type(bithorde::TREE_TIGER);
+	id->set_id("asset");
+	ReadAsset asset(client, ids);
+	Download download(asset, *client, stream);
+
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	double start = wallClock();
+	client->bind(asset);
+	while (download.received() < TOTAL && clientSvc.run_one());
+	double wall = wallClock() - start;
+	getrusage(RUSAGE_SELF, &after);
+
+	serverSvc.stop();
+	serverThread.join();
+
+	double gb = download.received() / (1024.0*1024*1024);
+	double cpu = cpuTime(after) - cpuTime(before);
+	cout << setw(3) << chunk/1024 << "KB chunks, " << setw(4) << (delay.is_special() ? 0 : delay.total_microseconds()) << "us delay, "
+		<< (stream ? "ReadStream:     " : "Window of Reads:") << " "
+		<< fixed << setprecision(2) << gb / wall << " GB/s, "
+		<< setprecision(2) << cpu / gb << " CPU-s/GB" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( stream_throughput )
+{
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	buf->grow(Connection::MAX_CHUNK);
+	buf->charge(Connection::MAX_CHUNK);
+	memset(buf->ptr, 0, buf->size);
+
+	size_t chunks[] = { Connection::DEFAULT_CHUNK, Connection::MAX_CHUNK };
+	boost::posix_time::time_duration delays[] = { boost::posix_time::not_a_date_time, boost::posix_time::microseconds(500) };
+	for (size_t i=0; i < 2; i++) {
+		for (size_t j=0; j < 2; j++) {
+			run(buf, chunks[i], delays[j], false);
+			run(buf, chunks[i], delays[j], true);
+		}
+	}
+}
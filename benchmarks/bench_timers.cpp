@@ -0,0 +1,103 @@
+#include <iomanip>
+#include <iostream>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <time.h>
+
+#include "lib/client.h"
+#include "lib/timerwheel.h"
+
+using namespace std;
+namespace asio = boost::asio;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+// Arms, re-arms and cancels a timer for each of 100k bindings, the way bindings re-arm
+// theirs on every bind and release, first as deadline_timers and then on the TimerWheel.
+// None of them expire, so the cost measured is that of keeping them.
+const size_t BINDINGS = 100000;
+const size_t REARMS = 4;
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void noop() {}
+static void noopWait(const boost::system::error_code&) {}
+
+static void report(const char* what, double wall, size_t ops) {
+	cout << what << fixed << setprecision(0) << wall * 1000000000.0 / ops << " ns/op" << endl;
+}
+
+static void runAsio() {
+	asio::io_service ioSvc;
+	boost::ptr_vector<asio::deadline_timer> timers;
+	for (size_t i=0; i < BINDINGS; i++)
+		timers.push_back(new asio::deadline_timer(ioSvc));
+
+	double start = wallClock();
+	for (size_t round=0; round < REARMS; round++) {
+		for (size_t i=0; i < BINDINGS; i++) {
+			timers[i].expires_from_now(pt::seconds(10 + i % 20));
+			timers[i].async_wait(&noopWait);
+		}
+		ioSvc.poll(); // The aborted waits of the round before
+	}
+	for (size_t i=0; i < BINDINGS; i++)
+		timers[i].cancel();
+	ioSvc.poll();
+	report("deadline_timer, arm+cancel: ", wallClock() - start, BINDINGS*(REARMS+1));
+}
+
+static void runWheel() {
+	asio::io_service ioSvc;
+	boost::ptr_vector<TimerWheel::Timer> timers;
+	for (size_t i=0; i < BINDINGS; i++)
+		timers.push_back(new TimerWheel::Timer(ioSvc, &noop));
+
+	double start = wallClock();
+	for (size_t round=0; round < REARMS; round++) {
+		for (size_t i=0; i < BINDINGS; i++)
+			timers[i].arm(pt::seconds(10 + i % 20));
+		ioSvc.poll();
+	}
+	for (size_t i=0; i < BINDINGS; i++)
+		timers[i].cancel();
+	ioSvc.poll();
+	report("TimerWheel,     arm+cancel: ", wallClock() - start, BINDINGS*(REARMS+1));
+}
+
+// Through the bindings of a Client, binding and closing each asset while disconnected
+static void runBindings() {
+	asio::io_service ioSvc;
+	Client::Pointer client = Client::create(ioSvc, "client");
+	BitHordeIds ids;
+	auto id = ids.Add();
+	id->set_type(bithorde::TREE_TIGER);
+	id->set_id("asset");
+	boost::ptr_vector<ReadAsset> assets;
+	for (size_t i=0; i < BINDINGS; i++)
+		assets.push_back(new ReadAsset(client, ids));
+
+	double start = wallClock();
+	for (size_t i=0; i < BINDINGS; i++)
+		client->bind(assets[i]);
+	for (size_t i=0; i < BINDINGS; i++)
+		assets[i].close();
+	ioSvc.poll();
+	report("Client,         bind+close: ", wallClock() - start, BINDINGS*2);
+}
+
+BOOST_AUTO_TEST_CASE( timer_wheel )
+{
+	runAsio();
+	runWheel();
+	runBindings();
+}
@@ -0,0 +1,180 @@
+#include <iomanip>
+#include <iostream>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <time.h>
+
+#include "lib/client.h"
+#include "lib/sequentialreader.h"
+
+using namespace std;
+namespace asio = boost::asio;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+// Reads an asset through a SequentialReader over loopback TCP, from a server emulating a
+// link of limited rate and long round-trip, with the window of bhget before it was tuned,
+// and tuned to the link. Then again without emulating a link, as over a local socket.
+const uint64_t TOTAL = 128ull*1024*1024;
+const size_t FIXED_WINDOW = 640*1024;
+
+static double wallClock() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+class LinkServer : public Client {
+	boost::shared_ptr<Buffer> _content;
+	double _rate; // Bytes per second, or 0 for no link
+	pt::time_duration _delay;
+	pt::ptime _linkFree; // When the last response has been sent over the link
+public:
+	LinkServer(asio::io_service& ioSvc, const boost::shared_ptr<Buffer>& content, double rate, const pt::time_duration& delay) :
+		Client(ioSvc, "server"), _content(content), _rate(rate), _delay(delay)
+	{}
+
+protected:
+	virtual bool servesVectoredReads() const { return true; }
+
+	virtual void onMessage(bithorde::BindRead& msg) {
+		if (!msg.ids_size())
+			return;
+		bithorde::AssetStatus resp;
+		resp.set_handle(msg.handle());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_size(TOTAL);
+		sendMessage(Connection::AssetStatus, resp);
+	}
+
+	void respond(uint32_t reqId, uint64_t offset, size_t size) {
+		bithorde::Read::Response resp;
+		resp.set_reqid(reqId);
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(offset);
+		sendMessage(Connection::ReadResponse, resp, ByteSlice(_content, 0, size));
+	}
+
+	void onDue(const boost::shared_ptr<asio::deadline_timer>&, uint32_t reqId, uint64_t offset, size_t size) {
+		respond(reqId, offset, size);
+	}
+
+	// Responses leave once the link has sent those before them, and arrive after the delay
+	void schedule(uint32_t reqId, uint64_t offset, size_t size) {
+		if (!_rate)
+			return respond(reqId, offset, size);
+		pt::ptime now = pt::microsec_clock::universal_time();
+		if (_linkFree.is_not_a_date_time() || (_linkFree < now))
+			_linkFree = now;
+		_linkFree += pt::microseconds((int64_t)(size * 1000000.0 / _rate));
+		auto timer = boost::make_shared<asio::deadline_timer>(ioService(), _linkFree + _delay);
+		timer->async_wait(boost::bind(&LinkServer::onDue, this, timer, reqId, offset, size));
+	}
+
+	virtual void onMessage(const bithorde::Read::Request& msg) {
+		schedule(msg.reqid(), msg.offset(), msg.size());
+	}
+
+	virtual void onMessage(const bithorde::ReadV& msg) {
+		for (int i=0; i < msg.ranges_size(); i++)
+			schedule(msg.reqid(), msg.ranges(i).offset(), msg.ranges(i).size());
+	}
+};
+
+class Download {
+	ReadAsset& _asset;
+	size_t _window; // Or 0 to tune
+	SequentialReader* _reader;
+	uint64_t _received;
+	bool _done;
+public:
+	Download(ReadAsset& asset, size_t window) :
+		_asset(asset), _window(window), _reader(NULL), _received(0), _done(false)
+	{
+		_asset.statusUpdate.connect(boost::bind(&Download::onStatus, this, _1));
+	}
+	~Download() {
+		delete _reader;
+	}
+
+	uint64_t received() const { return _received; }
+	bool done() const { return _done; }
+	size_t window() const { return _reader ? _reader->window() : 0; }
+private:
+	void onStatus(const bithorde::AssetStatus& status) {
+		BOOST_REQUIRE_EQUAL( status.status(), bithorde::SUCCESS );
+		_reader = new SequentialReader(_asset, 0, TOTAL);
+		if (_window)
+			_reader->setWindow(_window);
+		_reader->dataArrived.connect<Download, &Download::onData>(this);
+		_reader->finished.connect(boost::bind(&Download::onFinished, this, _1));
+		BOOST_REQUIRE( _reader->start() );
+	}
+
+	void onData(uint64_t offset, const ByteSlice& data) {
+		_received += data.size();
+	}
+
+	void onFinished(bithorde::Status status) {
+		BOOST_REQUIRE_EQUAL( status, bithorde::SUCCESS );
+		_done = true;
+	}
+};
+
+static void run(const char* what, const boost::shared_ptr<Buffer>& content, double rate, const pt::time_duration& delay, size_t window) {
+	asio::io_service serverSvc, clientSvc;
+	asio::ip::tcp::acceptor acceptor(serverSvc, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+	auto clientSocket = boost::make_shared<asio::ip::tcp::socket>(clientSvc);
+	clientSocket->connect(acceptor.local_endpoint());
+	auto serverSocket = boost::make_shared<asio::ip::tcp::socket>(serverSvc);
+	acceptor.accept(*serverSocket);
+
+	boost::shared_ptr<LinkServer> server(new LinkServer(serverSvc, content, rate, delay));
+	server->connect(Connection::create(serverSvc, serverSocket));
+	asio::io_service::work work(serverSvc);
+	boost::thread serverThread(boost::bind(&asio::io_service::run, &serverSvc));
+
+	Client::Pointer client = Client::create(clientSvc, "client");
+	client->connect(Connection::create(clientSvc, clientSocket));
+	BitHordeIds ids;
+	auto id = ids.Add();
+	id->set_type(bithorde::TREE_TIGER);
+	id->set_id("asset");
+	ReadAsset asset(client, ids);
+	Download download(asset, window);
+
+	double start = wallClock();
+	client->bind(asset);
+	while (!download.done() && clientSvc.run_one());
+	double wall = wallClock() - start;
+
+	serverSvc.stop();
+	serverThread.join();
+
+	BOOST_CHECK_EQUAL( download.received(), TOTAL );
+	double mbps = download.received() / wall / 1000000.0;
+	cout << what << (window ? "fixed 640KB window: " : "tuned window:       ")
+		<< fixed << setprecision(1) << setw(7) << mbps << " MB/s";
+	if (rate)
+		cout << " (" << setprecision(0) << mbps * 100000000.0 / rate << "% of link)";
+	cout << ", window " << download.window() / 1024 << "KB" << endl;
+}
+
+BOOST_AUTO_TEST_CASE( window_tuning )
+{
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	buf->grow(Connection::MAX_CHUNK);
+	buf->charge(Connection::MAX_CHUNK);
+	memset(buf->ptr, 0, buf->size);
+
+	run("200 MB/s, 20 ms, ", buf, 200e6, pt::milliseconds(20), FIXED_WINDOW);
+	run("200 MB/s, 20 ms, ", buf, 200e6, pt::milliseconds(20), 0);
+	run("Local,            ", buf, 0, pt::time_duration(), FIXED_WINDOW);
+	run("Local,            ", buf, 0, pt::time_duration(), 0);
+}
@@ -0,0 +1,199 @@
+/*
+    Copyright 2012 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+
+#include "iouring.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+typedef boost::lock_guard<boost::mutex> mutex_guard;
+
+struct IOUring::Operation {
+	Callback cb;
+	struct iovec iov;
+};
+
+#ifdef HAVE_IO_URING
+
+template <typename T>
+static T* ringPtr(void* ring, unsigned offset) {
+	return (T*)((char*)ring + offset);
+}
+
+IOUring::IOUring(unsigned entries) :
+	_fd(-1), _eventFd(-1), _entries(0), _inFlight(0),
+	_sqRing(MAP_FAILED), _sqRingSize(0), _cqRing(MAP_FAILED), _cqRingSize(0), _sqes(MAP_FAILED), _sqesSize(0)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return;
+
+	_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		_sqRingSize = _cqRingSize = max(_sqRingSize, _cqRingSize);
+	_sqRing = mmap(NULL, _sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		_cqRing = _sqRing;
+	else
+		_cqRing = mmap(NULL, _cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	_sqes = mmap(NULL, _sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	_eventFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	_fd = fd;
+	if (_sqRing == MAP_FAILED || _cqRing == MAP_FAILED || _sqes == MAP_FAILED || _eventFd < 0 ||
+			syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &_eventFd, 1) < 0) {
+		release();
+		return;
+	}
+
+	_sqHead = ringPtr<unsigned>(_sqRing, p.sq_off.head);
+	_sqTail = ringPtr<unsigned>(_sqRing, p.sq_off.tail);
+	_sqMask = ringPtr<unsigned>(_sqRing, p.sq_off.ring_mask);
+	_sqArray = ringPtr<unsigned>(_sqRing, p.sq_off.array);
+	_cqHead = ringPtr<unsigned>(_cqRing, p.cq_off.head);
+	_cqTail = ringPtr<unsigned>(_cqRing, p.cq_off.tail);
+	_cqMask = ringPtr<unsigned>(_cqRing, p.cq_off.ring_mask);
+	_cqes = ringPtr<void>(_cqRing, p.cq_off.cqes);
+	_entries = p.sq_entries;
+}
+
+IOUring::~IOUring()
+{
+	release();
+}
+
+void IOUring::release()
+{
+	if (_sqes != MAP_FAILED)
+		munmap(_sqes, _sqesSize);
+	if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+		munmap(_cqRing, _cqRingSize);
+	if (_sqRing != MAP_FAILED)
+		munmap(_sqRing, _sqRingSize);
+	if (_eventFd >= 0)
+		close(_eventFd);
+	if (_fd >= 0)
+		close(_fd);
+	_sqRing = _cqRing = _sqes = MAP_FAILED;
+	_fd = _eventFd = -1;
+}
+
+bool IOUring::read(int fd, void* buf, size_t size, uint64_t offset, const Callback& cb)
+{
+	if (!valid())
+		return false;
+	mutex_guard lock(_m);
+	// Never more in flight than the completion-queue is guaranteed to hold
+	if (_inFlight >= _entries)
+		return false;
+
+	Operation* op = new Operation;
+	op->cb = cb;
+	op->iov.iov_base = buf;
+	op->iov.iov_len = size;
+
+	unsigned tail = *_sqTail;
+	unsigned index = tail & *_sqMask;
+	struct io_uring_sqe* sqe = (struct io_uring_sqe*)_sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)&op->iov;
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = (uint64_t)op;
+	_sqArray[index] = index;
+	__atomic_store_n(_sqTail, tail+1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, _fd, 1, 0, 0, NULL, 0) != 1) {
+		// Take it back, the kernel didn't consume it
+		__atomic_store_n(_sqTail, tail, __ATOMIC_RELEASE);
+		delete op;
+		return false;
+	}
+	_inFlight++;
+	return true;
+}
+
+size_t IOUring::reap()
+{
+	uint64_t events;
+	while (::read(_eventFd, &events, sizeof(events)) > 0);
+
+	vector< pair<Operation*, ssize_t> > done;
+	{
+		unsigned head = *_cqHead;
+		unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe* cqe = (struct io_uring_cqe*)_cqes + (head & *_cqMask);
+			done.push_back(make_pair((Operation*)cqe->user_data, (ssize_t)cqe->res));
+		}
+		__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+	}
+	{
+		mutex_guard lock(_m);
+		_inFlight -= done.size();
+	}
+
+	for (auto iter = done.begin(); iter != done.end(); iter++) {
+		iter->first->cb(iter->second);
+		delete iter->first;
+	}
+	return done.size();
+}
+
+#else // HAVE_IO_URING
+
+IOUring::IOUring(unsigned entries) :
+	_fd(-1), _eventFd(-1), _entries(0), _inFlight(0)
+{
+}
+
+IOUring::~IOUring()
+{
+}
+
+void IOUring::release()
+{
+}
+
+bool IOUring::read(int fd, void* buf, size_t size, uint64_t offset, const Callback& cb)
+{
+	return false;
+}
+
+size_t IOUring::reap()
+{
+	return 0;
+}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,90 @@
+/*
+    Copyright 2012 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+
+#ifndef BITHORDED_IOURING_HPP
+#define BITHORDED_IOURING_HPP
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Minimal io_uring, driven straight through the system calls. Completions are signalled
+ * on eventFd(), and handed out by reap().
+ *
+ * Operations may be queued from any thread, but only one thread at a time may reap().
+ * Where io_uring is not built in, or not permitted by the kernel, valid() is false.
+ */
+class IOUring : boost::noncopyable
+{
+public:
+	/**
+	 * Called from reap() with the result of the operation; bytes read, or -errno.
+	 */
+	typedef boost::function<void(ssize_t res)> Callback;
+
+	explicit IOUring(unsigned entries);
+	~IOUring();
+
+	bool valid() const { return _fd >= 0; }
+
+	/**
+	 * Readable whenever there are completions to reap()
+	 */
+	int eventFd() const { return _eventFd; }
+
+	/**
+	 * Submit a read of up to /size/ bytes from /fd/ at /offset/ into /buf/. Both /fd/
+	 * and /buf/ must stay valid until /cb/ has been called.
+	 *
+	 * @returns false if the ring is full, or the read could not be submitted
+	 */
+	bool read(int fd, void* buf, size_t size, uint64_t offset, const Callback& cb);
+
+	/**
+	 * Call back all completed operations
+	 *
+	 * @returns the number of completions
+	 */
+	size_t reap();
+private:
+	struct Operation;
+
+	void release();
+
+	int _fd;
+	int _eventFd;
+	unsigned _entries;
+	unsigned _inFlight;
+	boost::mutex _m;
+
+	void* _sqRing;
+	size_t _sqRingSize;
+	void* _cqRing;
+	size_t _cqRingSize;
+	void* _sqes;
+	size_t _sqesSize;
+
+	unsigned *_sqHead, *_sqTail, *_sqMask, *_sqArray;
+	unsigned *_cqHead, *_cqTail, *_cqMask;
+	void* _cqes;
+};
+
+#endif // BITHORDED_IOURING_HPP
@@ -22,6 +22,9 @@
 #include <fcntl.h>
 #include <ios>
 #include <sys/stat.h>
+#include <sys/uio.h>
+
+const size_t RandomAccessFile::WINDOW_SIZE;
 
 RandomAccessFile::RandomAccessFile(const boost::filesystem::path& path, RandomAccessFile::Mode mode)
 	: _path(path)
@@ -69,6 +72,28 @@ byte* RandomAccessFile::read(uint64_t offset, size_t& size, byte* buf)
 	}
 }
 
+byte* RandomAccessFile::readCached(uint64_t offset, size_t size, byte* buf)
+{
+	BOOST_ASSERT( size <= WINDOW_SIZE );
+#ifdef RWF_NOWAIT
+	struct iovec iov = { buf, size };
+	ssize_t read = preadv2(_fd, &iov, 1, offset, RWF_NOWAIT);
+	return ((read > 0) && ((size_t)read == size)) ? buf : NULL;
+#else
+	return NULL;
+#endif
+}
+
+bool RandomAccessFile::isCached(uint64_t offset, size_t size)
+{
+#ifdef RWF_NOWAIT
+	byte probe;
+	return size && readCached(offset, 1, &probe) && readCached(offset+size-1, 1, &probe);
+#else
+	return true;
+#endif
+}
+
 ssize_t RandomAccessFile::write(uint64_t offset, void* src, size_t size)
 {
 	BOOST_ASSERT( size <= WINDOW_SIZE );
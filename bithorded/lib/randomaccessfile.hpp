@@ -26,7 +26,7 @@ class RandomAccessFile {
 	int _fd;
 	const boost::filesystem::path _path;
 public:
-	const static size_t WINDOW_SIZE = 65536;
+	const static size_t WINDOW_SIZE = 256*1024; // Largest read or write at once, a full Read chunk
         enum Mode {
           READ = 1,
           WRITE = 2,
@@ -55,11 +55,28 @@ public:
 	 */
 	byte* read(uint64_t offset, size_t& size, byte *buf);
 
+	/**
+	 * Like read(), but only succeeds if all of /size/ can be read without waiting for the
+	 * disk. Where the platform can't tell, never succeeds.
+	 */
+	byte* readCached(uint64_t offset, size_t size, byte *buf);
+
+	/**
+	 * Guesses whether reading the range would have to wait for the disk, by probing its
+	 * first and last byte. Where the platform can't tell, assumes it would not.
+	 */
+	bool isCached(uint64_t offset, size_t size);
+
 	/**
 	 * Writes up to /size/ bytes to file beginning at /offset/.
 	 */
 	ssize_t write(uint64_t offset, void* src, size_t size);
 
+	/**
+	 * The underlying file descriptor
+	 */
+	int fd() const { return _fd; }
+
 	/**
 	 * Return the path used to open the file
 	 */
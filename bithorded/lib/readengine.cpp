@@ -0,0 +1,84 @@
+/*
+    Copyright 2012 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "readengine.hpp"
+
+#include <boost/asio/placeholders.hpp>
+#include <boost/bind.hpp>
+
+namespace asio = boost::asio;
+
+const unsigned RING_ENTRIES = 256;
+
+struct ReadTask : public Task {
+	boost::function<void()> read;
+
+	ReadTask(const boost::function<void()>& read) : read(read) {}
+
+	void operator()() {
+		read();
+		delete this;
+	}
+};
+
+static void readBlocking(RandomAccessFile& file, uint64_t offset, size_t size, byte* buf, const ReadEngine::Callback& cb)
+{
+	const byte* data = file.read(offset, size, buf);
+	cb(data, size);
+}
+
+static void ringRead(byte* buf, const ReadEngine::Callback& cb, ssize_t res)
+{
+	if (res > 0)
+		cb(buf, res);
+	else
+		cb(NULL, 0);
+}
+
+ReadEngine::ReadEngine(asio::io_service& ioSvc, int threads, bool useRing) :
+	_pool(threads),
+	_ringEvents(ioSvc)
+{
+	if (!useRing)
+		return;
+	_ring.reset(new IOUring(RING_ENTRIES));
+	if (_ring->valid()) {
+		_ringEvents.assign(::dup(_ring->eventFd()));
+		waitForRing();
+	} else {
+		_ring.reset();
+	}
+}
+
+void ReadEngine::read(RandomAccessFile& file, uint64_t offset, size_t size, byte* buf, const Callback& cb)
+{
+	if (_ring && _ring->read(file.fd(), buf, size, offset, boost::bind(&ringRead, buf, cb, _1)))
+		return;
+	_pool.post(*new ReadTask(boost::bind(&readBlocking, boost::ref(file), offset, size, buf, cb)));
+}
+
+void ReadEngine::waitForRing()
+{
+	_ringEvents.async_read_some(asio::null_buffers(), boost::bind(&ReadEngine::onRingEvent, this, asio::placeholders::error));
+}
+
+void ReadEngine::onRingEvent(const boost::system::error_code& ec)
+{
+	if (ec)
+		return;
+	_ring->reap();
+	waitForRing();
+}
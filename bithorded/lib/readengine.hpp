@@ -0,0 +1,66 @@
+/*
+    Copyright 2012 Ulrik Mikaelsson <ulrik.mikaelsson@gmail.com>
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+
+#ifndef BITHORDED_READENGINE_HPP
+#define BITHORDED_READENGINE_HPP
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <memory>
+
+#include "iouring.hpp"
+#include "randomaccessfile.hpp"
+#include "threadpool.hpp"
+
+/**
+ * Performs file-reads that may have to wait for the disk, without blocking the caller.
+ * Reads go through io_uring where built in and permitted, and otherwise, or when the
+ * ring is full, to a pool of threads doing plain pread().
+ */
+class ReadEngine : boost::noncopyable
+{
+public:
+	/**
+	 * Called with the data read, or NULL on failure. io_uring-reads are completed from
+	 * /ioSvc/, thread-reads from the reading thread.
+	 */
+	typedef boost::function<void(const byte* data, size_t size)> Callback;
+
+	ReadEngine(boost::asio::io_service& ioSvc, int threads, bool useRing=true);
+
+	/**
+	 * Read up to /size/ bytes at /offset/ of /file/ into /buf/. Both must stay valid
+	 * until /cb/ has been called.
+	 */
+	void read(RandomAccessFile& file, uint64_t offset, size_t size, byte* buf, const Callback& cb);
+
+	/**
+	 * Whether reads are done using io_uring
+	 */
+	bool usingRing() const { return _ring.get(); }
+private:
+	void waitForRing();
+	void onRingEvent(const boost::system::error_code& ec);
+
+	ThreadPool _pool;
+	std::unique_ptr<IOUring> _ring;
+	boost::asio::posix::stream_descriptor _ringEvents;
+};
+
+#endif // BITHORDED_READENGINE_HPP
@@ -26,11 +26,17 @@ ThreadPool::ThreadPool(int maxThreads) :
 	_running(true),
 	_m(),
 	_maxThreads(maxThreads),
+	_idle(0),
 	_threads(),
 	_tasks()
 {
 }
 
+ThreadPool::~ThreadPool()
+{
+	join();
+}
+
 void ThreadPool::post(Task& task)
 {
 	mutex_guard m(_m);
@@ -39,15 +45,21 @@ void ThreadPool::post(Task& task)
 	if (!_running)
 		return;
 	size_t threads = _threads.size();
-	if ((threads < _maxThreads) && (threads < _tasks.size())) {
+	if ((threads < _maxThreads) && (_idle < _tasks.size())) {
 		auto thread = new boost::thread(boost::bind(&ThreadPool::thread_main, this));
 		_threads[thread->get_id()] = thread;
+	} else {
+		_wakeup.notify_one();
 	}
 }
 
 void ThreadPool::join()
 {
-	_running = false;
+	{
+		mutex_guard m(_m);
+		_running = false;
+		_wakeup.notify_all();
+	}
 	while (size_t workers = workerCount())
 		boost::this_thread::sleep(boost::posix_time::milliseconds(10*workers));
 }
@@ -73,7 +85,13 @@ void ThreadPool::thread_main()
 
 Task* ThreadPool::getTask()
 {
-	mutex_guard m(_m);
+	// Idle workers stay around until join(), ready to pick up new tasks.
+	boost::unique_lock<boost::mutex> m(_m);
+	while (_tasks.empty() && _running) {
+		_idle++;
+		_wakeup.wait(m);
+		_idle--;
+	}
 	Task* res = NULL;
 	if (!_tasks.empty()) {
 		res = _tasks.front();
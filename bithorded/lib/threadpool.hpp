@@ -18,6 +18,7 @@
 #ifndef BITHORDED_THREADPOOL_HPP
 #define BITHORDED_THREADPOOL_HPP
 
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
 #include <map>
@@ -25,6 +26,7 @@
 
 class Task {
 public:
+	virtual ~Task() {}
 	virtual void operator()() = 0;
 };
 
@@ -32,6 +34,7 @@ class ThreadPool
 {
 public:
 	ThreadPool(int maxThreads);
+	~ThreadPool();
 
 	void post(Task& task);
 
@@ -43,7 +46,9 @@ private:
 
 	bool _running;
 	boost::mutex _m;
+	boost::condition_variable _wakeup;
 	uint _maxThreads;
+	uint _idle; // Workers waiting for tasks
 	std::map<boost::thread::id, boost::thread*> _threads;
 	std::queue<Task*> _tasks;
 };
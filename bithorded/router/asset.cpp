@@ -24,6 +24,9 @@
 #include <log4cplus/logger.h>
 #include <log4cplus/loggingmacros.h>
 
+#include "router.hpp"
+#include "../server/server.hpp"
+
 using namespace bithorded::router;
 using namespace std;
 
@@ -45,8 +48,12 @@ void bithorded::router::ForwardedAsset::bindUpstreams(const std::map< string, bi
 		auto upstream = new bithorde::ReadAsset(f, _ids);
 		auto peername = f->peerName();
 		upstream->statusUpdate.connect(boost::bind(&ForwardedAsset::onUpstreamStatus, this, peername, bithorde::ASSET_ARG_STATUS));
-		upstream->dataArrived.connect(boost::bind(&ForwardedAsset::onData, this,
-			bithorde::ASSET_ARG_OFFSET, bithorde::ASSET_ARG_DATA, bithorde::ASSET_ARG_TAG));
+		upstream->dataArrived.connect(boost::bind(&ForwardedAsset::onData, this, peername,
+			bithorde::ASSET_ARG_OFFSET, bithorde::ASSET_ARG_DATA, bithorde::ASSET_ARG_TAG, bithorde::ASSET_ARG_READ_STATUS));
+		// Failed reads are rather tried on the next upstream, within the deadline
+		upstream->setRetryPolicy(UpstreamAsset::RetryPolicy(UpstreamAsset::DEFAULT_TIMEOUT, 0));
+		if (f->chunkSize() < _chunkSize)
+			_chunkSize = f->chunkSize();
 		auto& upstream_ = _upstream[peername];
 		upstream_.reset(upstream);
 		f->bind(*upstream_, uuid, timeout);
@@ -63,18 +70,39 @@ void bithorded::router::ForwardedAsset::onUpstreamStatus(const string& peername,
 				_size = status.size();
 			} else if (_size != (int64_t)status.size()) {
 				LOG4CPLUS_WARN(assetLogger, peername << " responded with mismatching size, ignoring...");
-				_upstream.erase(peername);
+				dropUpstream(peername);
 			}
 		} else {
 			LOG4CPLUS_WARN(assetLogger, peername << " SUCCESS response not accompanied with asset-size.");
 		}
 	} else {
 		LOG4CPLUS_DEBUG(assetLogger, "Failed upstream " << peername);
-		_upstream.erase(peername);
+		dropUpstream(peername);
 	}
 	updateStatus();
 }
 
+void bithorded::router::ForwardedAsset::dropUpstream(const string& peername)
+{
+	auto upstream = _upstream.find(peername);
+	if (upstream == _upstream.end())
+		return;
+	list<PendingRead> orphans;
+	for (auto iter=_pendingReads.begin(); iter != _pendingReads.end(); ) {
+		if (iter->upstream == peername) {
+			upstream->second->cancel(iter->tag);
+			orphans.splice(orphans.end(), _pendingReads, iter++);
+		} else {
+			iter++;
+		}
+	}
+	_upstream.erase(upstream);
+
+	// Not counted as failed by it, since it never answered
+	for (auto iter=orphans.begin(); iter != orphans.end(); iter++)
+		failOver(*iter);
+}
+
 void bithorded::router::ForwardedAsset::updateStatus() {
 	bithorde::Status status = _upstream.empty() ? bithorde::Status::NOTFOUND : bithorde::Status::NONE;
 	for (auto iter=_upstream.begin(); iter!=_upstream.end(); iter++) {
@@ -96,30 +124,115 @@ bool bithorded::router::ForwardedAsset::getIds(BitHordeIds& ids)
 	return true;
 }
 
-void bithorded::router::ForwardedAsset::async_read(uint64_t offset, size_t& size, ReadCallback cb)
+void bithorded::router::ForwardedAsset::async_read(uint64_t offset, size_t& size, ReadCallback cb, const void* reader, const boost::posix_time::ptime& deadline)
+{
+	if (size > _chunkSize)
+		size = _chunkSize;
+	_router.server().ioService().dispatch(boost::bind(&ForwardedAsset::startRead, shared_from_this(), offset, size, cb, reader, deadline));
+}
+
+void bithorded::router::ForwardedAsset::cancel_read(const void* reader)
+{
+	// Queued behind the startRead() of the reader
+	_router.server().ioService().dispatch(boost::bind(&ForwardedAsset::cancelRead, shared_from_this(), reader));
+}
+
+void bithorded::router::ForwardedAsset::startRead(uint64_t offset, size_t size, ReadCallback cb, const void* reader, const boost::posix_time::ptime& deadline)
 {
-	auto selector = _upstream.begin(); // TODO: Actually select the least loaded connection
-	if (selector == _upstream.end())
-		return cb(-1, string());
 	PendingRead read;
 	read.offset = offset;
 	read.size = size;
 	read.cb = cb;
-	_pendingReads.push_back(read); // TODO: timeout
-	selector->second->aSyncRead(offset, size);
+	read.reader = reader;
+	read.deadline = deadline;
+	read.failovers = 0;
+	if (!forwardRead(read, _upstream.begin())) // TODO: Actually select the least loaded connection
+		cb(-1, ByteSlice());
 }
 
-void bithorded::router::ForwardedAsset::onData(uint64_t offset, const std::string& data, int tag) {
-	for (auto iter=_pendingReads.begin(); iter != _pendingReads.end(); ) {
-		if (iter->offset == offset) {
-			iter->cb(offset, data);	
-			iter = _pendingReads.erase(iter); // Will increase the iterator
-		} else {
-			iter++;	// Move to next
+bool bithorded::router::ForwardedAsset::forwardRead(PendingRead& read, std::map<std::string, std::unique_ptr<UpstreamAsset> >::iterator upstream)
+{
+	if (upstream == _upstream.end())
+		return false;
+
+	// The upstream counts its time from when the request gets there, and the response
+	// must be back here in time, so it gets what is left less the round-trip to it.
+	int timeout = UpstreamAsset::DEFAULT_TIMEOUT;
+	if (!read.deadline.is_special()) {
+		auto left = read.deadline - boost::posix_time::microsec_clock::universal_time();
+		timeout = (left - upstream->second->client()->roundTrip()).total_milliseconds();
+		if (timeout <= 0)
+			return false;
+	}
+
+	read.upstream = upstream->first;
+	read.tag = upstream->second->aSyncRead(read.offset, read.size, timeout);
+	if (read.tag < 0)
+		return false;
+	_pendingReads.push_back(read);
+	return true;
+}
+
+void bithorded::router::ForwardedAsset::cancelRead(const void* reader)
+{
+	for (auto iter=_pendingReads.begin(); iter != _pendingReads.end(); iter++) {
+		if (iter->reader == reader) {
+			PendingRead read = *iter;
+			_pendingReads.erase(iter);
+			// Reads of the same offset are served by their own requests
+			auto upstream = _upstream.find(read.upstream);
+			if (upstream != _upstream.end())
+				upstream->second->cancel(read.tag);
+			read.cb(-1, ByteSlice());
+			return;
+		}
+	}
+}
+
+void bithorded::router::ForwardedAsset::onData(const string& peername, uint64_t offset, const ByteSlice& data, int tag, bithorde::Status status) {
+	if (status == bithorde::SUCCESS) {
+		for (auto iter=_pendingReads.begin(); iter != _pendingReads.end(); ) {
+			if (iter->offset == offset) {
+				iter->cb(offset, data); // Passed on without copying
+				iter = _pendingReads.erase(iter); // Will increase the iterator
+			} else {
+				iter++;	// Move to next
+			}
+		}
+		return;
+	}
+
+	// Failed, or timed out, so fail over to the next upstream, if any is left to try
+	for (auto iter=_pendingReads.begin(); iter != _pendingReads.end(); iter++) {
+		if ((iter->upstream == peername) && (iter->tag == tag)) {
+			PendingRead read = *iter;
+			_pendingReads.erase(iter);
+			read.failovers++;
+			failOver(read);
+			return;
 		}
 	}
 }
 
+/**
+ * Forwards /read/ to the upstreams after the one it was last forwarded to, until one takes
+ * it, or every upstream has failed it.
+ */
+void bithorded::router::ForwardedAsset::failOver(PendingRead read)
+{
+	while (read.failovers < _upstream.size()) {
+		auto next = _upstream.upper_bound(read.upstream);
+		if (next == _upstream.end())
+			next = _upstream.begin();
+		LOG4CPLUS_DEBUG(assetLogger, "Read failed on " << read.upstream << ", trying " << next->first);
+		if (forwardRead(read, next))
+			return;
+		read.upstream = next->first;
+		read.failovers++;
+	}
+	read.cb(-1, ByteSlice());
+}
+
 uint64_t bithorded::router::ForwardedAsset::size()
 {
 	return _size;
@@ -17,9 +17,12 @@
 #ifndef BITHORDED_ROUTER_ASSET_H
 #define BITHORDED_ROUTER_ASSET_H
 
+#include <atomic>
 #include <map>
 #include <memory>
 
+#include <boost/smart_ptr/enable_shared_from_this.hpp>
+
 #include "../server/asset.hpp"
 #include "../server/client.hpp"
 #include "../../lib/asset.h"
@@ -33,15 +36,25 @@ struct PendingRead {
 	uint64_t offset;
 	size_t size;
 	IAsset::ReadCallback cb;
+	const void* reader;
+	std::string upstream; // Peer the read was forwarded to
+	int tag;
+	boost::posix_time::ptime deadline;
+	size_t failovers; // Upstreams that failed it so far
 };
 
-class ForwardedAsset : public bithorded::IAsset
+/**
+ * Lives on the control loop, with the friend-connections it forwards through. Reads may
+ * come from any shard, and are completed from the control loop.
+ */
+class ForwardedAsset : public bithorded::IAsset, public boost::enable_shared_from_this<ForwardedAsset>
 {
 	typedef bithorde::ReadAsset UpstreamAsset;
 
 	Router& _router;
 	BitHordeIds _ids;
 	int64_t _size;
+	std::atomic<size_t> _chunkSize; // Smallest of the upstreams, so reads are answered in full
 	std::map<std::string, std::unique_ptr<UpstreamAsset> > _upstream;
 	std::list<PendingRead> _pendingReads;
 public:
@@ -52,6 +65,7 @@ public:
 		_router(router),
 		_ids(ids),
 		_size(-1),
+		_chunkSize(bithorde::Connection::MAX_CHUNK),
 		_upstream(),
 		_pendingReads()
 	{}
@@ -61,12 +75,18 @@ public:
 
 	virtual size_t can_read(uint64_t offset, size_t size);
 	virtual bool getIds(BitHordeIds& ids);
-	virtual void async_read(uint64_t offset, size_t& size, ReadCallback cb);
+	virtual void async_read(uint64_t offset, size_t& size, ReadCallback cb, const void* reader, const boost::posix_time::ptime& deadline);
+	virtual void cancel_read(const void* reader);
 	virtual uint64_t size();
 private:
+	void startRead(uint64_t offset, size_t size, ReadCallback cb, const void* reader, const boost::posix_time::ptime& deadline);
+	bool forwardRead(PendingRead& read, std::map<std::string, std::unique_ptr<UpstreamAsset> >::iterator upstream);
+	void cancelRead(const void* reader);
 	void onUpstreamStatus(const std::string& peername, const bithorde::AssetStatus& status);
+	void dropUpstream(const std::string& peername);
+	void failOver(PendingRead read);
 	void updateStatus();
-	void onData(uint64_t offset, const std::string& data, int tag);
+	void onData(const std::string& peername, uint64_t offset, const ByteSlice& data, int tag, bithorde::Status status);
 };
 
 }
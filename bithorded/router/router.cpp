@@ -18,6 +18,7 @@
 
 #include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/placeholders.hpp>
+#include <boost/checked_delete.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/make_shared.hpp>
@@ -39,6 +40,7 @@ namespace bithorded { namespace router {
 } }
 
 class bithorded::router::FriendConnector : public boost::enable_shared_from_this<bithorded::router::FriendConnector> {
+	Router& _router;
 	Server& _server;
 	boost::shared_ptr<boost::asio::ip::tcp::socket> _socket;
 	boost::asio::ip::tcp::resolver _resolver;
@@ -46,18 +48,19 @@ class bithorded::router::FriendConnector : public boost::enable_shared_from_this
 	boost::asio::ip::tcp::resolver::query _q;
 	bool _cancelled;
 public:
-	FriendConnector(Server& server, const bithorded::Friend& cfg) :
-		_server(server),
-		_socket(boost::make_shared<boost::asio::ip::tcp::socket>(server.ioService())),
-		_resolver(server.ioService()),
-		_timer(server.ioService()),
+	FriendConnector(Router& router, const bithorded::Friend& cfg) :
+		_router(router),
+		_server(router.server()),
+		_socket(boost::make_shared<boost::asio::ip::tcp::socket>(_server.ioService())),
+		_resolver(_server.ioService()),
+		_timer(_server.ioService()),
 		_q(cfg.addr, boost::lexical_cast<string>(cfg.port)),
 		_cancelled(false)
 	{
 	}
 
-	static boost::shared_ptr<FriendConnector> create(Server& server, const bithorded::Friend& cfg) {
-		auto res = boost::make_shared<FriendConnector>(server, cfg);
+	static boost::shared_ptr<FriendConnector> create(Router& router, const bithorded::Friend& cfg) {
+		auto res = boost::make_shared<FriendConnector>(boost::ref(router), cfg);
 		res->start();
 		return res;
 	}
@@ -82,6 +85,7 @@ private:
 		if (error) {
 			scheduleRestart();
 		} else if (!_cancelled) {
+			_router.addFriendAddress(iterator->endpoint().address());
 			_socket->async_connect(iterator->endpoint(), boost::bind(&FriendConnector::connectionDone, shared_from_this(), asio::placeholders::error));
 		}
 	}
@@ -103,14 +107,29 @@ bithorded::router::Router::Router(Server& server)
 
 void bithorded::router::Router::addFriend(const bithorded::Friend& f)
 {
-	_connectors[f.name] = FriendConnector::create(_server, f);
+	_connectors[f.name] = FriendConnector::create(*this, f);
 	_friends[f.name] = f;
 }
 
+bool Router::isFriendAddress(const asio::ip::address& addr)
+{
+	return _friendAddresses.count(addr);
+}
+
+void Router::addFriendAddress(const asio::ip::address& addr)
+{
+	_friendAddresses.insert(addr);
+}
+
 void Router::onConnected(const bithorded::Client::Ptr& client )
 {
 	string peerName = client->peerName();
 	if (_friends.count(peerName)) {
+		if (&client->ioService() != &_server.ioService()) {
+			// Came in from an address we did not know, and was placed on a worker-loop.
+			LOG4CPLUS_WARN(routerLog, "Friend " << peerName << " connected from unknown address, not routing through it");
+			return;
+		}
 		LOG4CPLUS_INFO(routerLog, "Friend " << peerName << " connected");
 		if (_connectors[peerName].get())
 			_connectors[peerName]->cancel();
@@ -122,8 +141,20 @@ void Router::onConnected(const bithorded::Client::Ptr& client )
 void Router::onDisconnected(const bithorded::Client::Ptr& client)
 {
 	string peerName = client->peerName();
-	if (_connectedFriends.erase(peerName))
-		_connectors[peerName] = FriendConnector::create(_server, _friends[peerName]);
+	auto iter = _connectedFriends.find(peerName);
+	if ((iter != _connectedFriends.end()) && (iter->second == client)) {
+		_connectedFriends.erase(iter);
+		_connectors[peerName] = FriendConnector::create(*this, _friends[peerName]);
+	}
+}
+
+/**
+ * The last reference to a ForwardedAsset may be dropped by a client on any shard, but
+ * its upstream bindings belong to friends on the control loop.
+ */
+static void deleteOnControlLoop(asio::io_service* ioSvc, ForwardedAsset* asset)
+{
+	ioSvc->dispatch(boost::bind(&boost::checked_delete<ForwardedAsset>, asset));
 }
 
 bithorded::IAsset::Ptr bithorded::router::Router::findAsset(const bithorde::BindRead& req)
@@ -134,7 +165,7 @@ bithorded::IAsset::Ptr bithorded::router::Router::findAsset(const bithorde::Bind
 
 	if (_sessionMap.count(req.uuid()))
 		throw BindError(bithorde::WOULD_LOOP);
-	auto asset = boost::make_shared<ForwardedAsset, Router&, const BitHordeIds&>(*this, req.ids());
+	ForwardedAsset::Ptr asset(new ForwardedAsset(*this, req.ids()), boost::bind(&deleteOnControlLoop, &_server.ioService(), _1));
 	_sessionMap[req.uuid()] = asset;
 
 	asset->bindUpstreams(_connectedFriends, req.uuid(), timeout);
@@ -22,6 +22,7 @@
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <map>
+#include <set>
 #include <vector>
 
 #include "../server/config.hpp"
@@ -35,12 +36,16 @@ namespace router {
 
 class FriendConnector;
 
+/**
+ * Lives on the control loop of the Server, as do the connections to friends.
+ */
 class Router
 {
 	Server& _server;
 	std::map<std::string, Friend> _friends;
 	std::map<std::string, boost::shared_ptr<FriendConnector> > _connectors;
 	std::map<std::string, Client::Ptr > _connectedFriends;
+	std::set<boost::asio::ip::address> _friendAddresses;
 
 	std::map< uint64_t, ForwardedAsset::WeakPtr > _sessionMap;
 public:
@@ -50,6 +55,13 @@ public:
 
 	Server& server() { return _server; }
 
+	/**
+	 * Whether /addr/ is known to belong to a friend, so connections from it can be kept
+	 * on the control loop.
+	 */
+	bool isFriendAddress(const boost::asio::ip::address& addr);
+	void addFriendAddress(const boost::asio::ip::address& addr);
+
 	void onConnected(const bithorded::Client::Ptr& client);
 	void onDisconnected(const bithorded::Client::Ptr& client);
 
@@ -18,6 +18,7 @@
 #ifndef BITHORDED_ASSET_HPP
 #define BITHORDED_ASSET_HPP
 
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
 #include <boost/signals2/signal.hpp>
@@ -31,21 +32,50 @@ namespace bithorded
 class IAsset
 {
 public:
-	typedef boost::function<void(int64_t offset, const std::string& data)> ReadCallback;
+	typedef boost::function<void(int64_t offset, const ByteSlice& data)> ReadCallback;
+	typedef boost::signals2::signal<void(const bithorde::Status&)> StatusSignal;
 
 	bithorde::Status status;
-	boost::signals2::signal<void(const bithorde::Status&)> statusChange;
+	StatusSignal statusChange;
 	IAsset() : status(bithorde::Status::NONE)
 	{}
 
 	typedef boost::shared_ptr<IAsset> Ptr;
 	typedef boost::weak_ptr<IAsset> WeakPtr;
 
-	virtual void async_read(uint64_t offset, size_t& size, ReadCallback cb) = 0;
+	/**
+	 * Reads /size/ bytes from /offset/, or less if the asset reads less at once, trimming
+	 * /size/ to what is read. /reader/ identifies the read to cancel_read(), and must be
+	 * unique among the reads in flight, like the address of the caller's state for it.
+	 * Past /deadline/ nobody waits for the read anymore.
+	 */
+	virtual void async_read(uint64_t offset, size_t& size, ReadCallback cb, const void* reader, const boost::posix_time::ptime& deadline) = 0;
+
+	/**
+	 * Abandons the read of /reader/, if still waiting for its data. Its callback is then
+	 * called without data, possibly right away. Reads from local disk are short, and just
+	 * run to completion.
+	 */
+	virtual void cancel_read(const void* reader) {}
 	virtual uint64_t size() = 0;
 	virtual size_t can_read(uint64_t offset, size_t size) = 0;
 	virtual bool getIds(BitHordeIds& ids) = 0;
 
+	/**
+	 * For assets backed by a plain file, returns the file descriptor to read /offset/
+	 * from, with /size/ trimmed to what the file holds. Otherwise, or if nothing can be
+	 * read, returns -1. Called from the event-loop of any client, so it may only look at
+	 * the file itself, not at state changed on the control loop.
+	 */
+	virtual int file_range(uint64_t offset, size_t& size) { return -1; }
+
+	/**
+	 * For assets backed by a plain file, returns its read-only file descriptor, and adds
+	 * the ranges of it verified against the asset to /desc/. Otherwise returns -1.
+	 * Called from the control loop.
+	 */
+	virtual int local_file(bithorde::LocalFile& desc) { return -1; }
+
 protected:
 	void setStatus(bithorde::Status newStatus);
 };
@@ -23,11 +23,14 @@
 #include <log4cplus/loggingmacros.h>
 
 #include "server.hpp"
+#include "../lib/randomaccessfile.hpp"
 #include "../../lib/magneturi.h"
 #include "../../lib/random.h"
 
 const size_t MAX_ASSETS = 1024;
-const size_t MAX_CHUNK = 64*1024;
+const size_t MAX_READS_IN_FLIGHT = 16; // Bounds the disk-queue of each client
+const size_t MAX_PARKED_RUNS = 256; // Beyond, requests are left on the socket
+const size_t MAX_RUN = RandomAccessFile::WINDOW_SIZE; // Largest read of adjacent ranges, as one read of the file
 
 using namespace std;
 namespace fs = boost::filesystem;
@@ -38,10 +41,27 @@ namespace bithorded {
 	log4cplus::Logger clientLogger = log4cplus::Logger::getInstance("client");
 }
 
-Client::Client( Server& server) :
-	bithorde::Client(server.ioService(), server.name()),
-	_server(server)
+static bool isRequest(uint32_t reqId, uint32_t candidate, bithorde::Asset::Handle) {
+	return candidate == reqId;
+}
+
+static bool onHandle(bithorde::Asset::Handle h, uint32_t, bithorde::Asset::Handle candidate) {
+	return candidate == h;
+}
+
+static bool anyRequest(uint32_t, bithorde::Asset::Handle) {
+	return true;
+}
+
+Client::Client( Server& server, boost::asio::io_service& ioSvc) :
+	bithorde::Client(ioSvc, server.name()),
+	_server(server),
+	_readsInFlight(0),
+	_readTimer(ioSvc, boost::bind(&Client::onReadTimer, this)),
+	_bindCounter(0)
 {
+	// Nobody is waiting for the reads of a lost peer, least of all our friends
+	disconnected.connect(boost::bind(&Client::cancelRequests, this, RequestFilter(&anyRequest)));
 }
 
 bool Client::requestsAsset(const BitHordeIds& ids) {
@@ -67,14 +87,8 @@ void Client::onMessage(const bithorde::BindWrite& msg)
 	if (msg.has_linkpath()) {
 		fs::path path(msg.linkpath());
 		if (path.is_absolute()) {
-			auto asset = _server.async_linkAsset(path);
-			if (asset) {
-				LOG4CPLUS_INFO(clientLogger, "Linking " << path);
-				assignAsset(msg.handle(), asset);
-			} else {
-				LOG4CPLUS_ERROR(clientLogger, "Upload did not match any allowed assetStore: " << path);
-				informAssetStatus(msg.handle(), bithorde::ERROR);
-			}
+			uint64_t bindId = beginBind(msg.handle());
+			_server.ioService().post(boost::bind(&Client::linkAsset, shared_from_this(), msg.handle(), bindId, path));
 		} else {
 			LOG4CPLUS_ERROR(clientLogger, "Relative links not supported" << path);
 			informAssetStatus(msg.handle(), bithorde::ERROR);
@@ -86,92 +100,629 @@ void Client::onMessage(const bithorde::BindWrite& msg)
 }
 
 void Client::onMessage(bithorde::BindRead& msg)
+{
+	if (uint64_t bindId = beginBindRead(msg))
+		_server.ioService().post(boost::bind(&Client::findAsset, shared_from_this(), bindId, msg));
+}
+
+void Client::onMessage(bithorde::BindBatch& msg)
+{
+	// Looked up in one go, so the statuses known right away go back in one batch
+	LookupsPtr lookups(new std::vector<Lookup>());
+	lookups->reserve(msg.binds_size());
+	for (int i=0; i < msg.binds_size(); i++) {
+		bithorde::BindRead& req = *msg.mutable_binds(i);
+		if (uint64_t bindId = beginBindRead(req)) {
+			lookups->push_back(Lookup());
+			lookups->back().bindId = bindId;
+			lookups->back().req.Swap(&req);
+		}
+	}
+	if (!lookups->empty())
+		_server.ioService().post(boost::bind(&Client::findAssets, shared_from_this(), lookups));
+}
+
+/**
+ * Starts binding the handle of /msg/, returning the bindId to look it up under, or closes
+ * it and returns 0, if /msg/ has no ids.
+ */
+uint64_t Client::beginBindRead(bithorde::BindRead& msg)
 {
 	bithorde::Asset::Handle h = msg.handle();
+	// Whatever was read from the handle before is no longer wanted
+	cancelRequests(boost::bind(&onHandle, h, _1, _2));
 	if (msg.ids_size() > 0) {
 		// Trying to open
 		LOG4CPLUS_INFO(clientLogger, peerName() << ':' << h << " requested: " << MagnetURI(msg));
 		if (!msg.has_uuid())
 			msg.set_uuid(rand64());
-
-		try {
-			auto asset = _server.async_findAsset(msg);
-			if (asset)
-				assignAsset(h, asset);
-			else
-				informAssetStatus(h, bithorde::NOTFOUND);
-		} catch (bithorded::BindError e) {
-			informAssetStatus(h, e.status);
-		}
+		return beginBind(h);
 	} else {
 		// Trying to close
 		LOG4CPLUS_INFO(clientLogger, peerName() << ':' << h << " closed");
+		_pendingBinds.erase(h);
 		clearAsset(h);
 		informAssetStatus(h, bithorde::NOTFOUND);
+		return 0;
+	}
+}
+
+void Client::linkAsset(bithorde::Asset::Handle h, uint64_t bindId, const fs::path& path)
+{
+	auto asset = _server.async_linkAsset(path);
+	if (asset) {
+		LOG4CPLUS_INFO(clientLogger, "Linking " << path);
+	} else {
+		LOG4CPLUS_ERROR(clientLogger, "Upload did not match any allowed assetStore: " << path);
 	}
+	SnapshotPtr snapshot = asset ? snapshotAsset(asset) : SnapshotPtr();
+	ioService().post(boost::bind(&Client::onBound, shared_from_this(), h, bindId, asset, snapshot, bithorde::ERROR));
+}
+
+void Client::findAsset(uint64_t bindId, const bithorde::BindRead& req)
+{
+	bithorde::Status status;
+	IAsset::Ptr asset = lookupAsset(req, status);
+	SnapshotPtr snapshot = asset ? snapshotAsset(asset) : SnapshotPtr();
+	ioService().post(boost::bind(&Client::onBound, shared_from_this(), req.handle(), bindId, asset, snapshot, status));
 }
 
+void Client::findAssets(const LookupsPtr& lookups)
+{
+	for (auto iter = lookups->begin(); iter != lookups->end(); iter++) {
+		iter->asset = lookupAsset(iter->req, iter->status);
+		if (iter->asset)
+			iter->snapshot = snapshotAsset(iter->asset);
+	}
+	ioService().post(boost::bind(&Client::onAllBound, shared_from_this(), lookups));
+}
+
+IAsset::Ptr Client::lookupAsset(const bithorde::BindRead& req, bithorde::Status& status)
+{
+	status = bithorde::NOTFOUND;
+	try {
+		return _server.async_findAsset(req);
+	} catch (bithorded::BindError e) {
+		status = e.status;
+		return IAsset::Ptr();
+	}
+}
+
+uint64_t Client::beginBind(bithorde::Asset::Handle h)
+{
+	return _pendingBinds[h] = ++_bindCounter;
+}
+
+void Client::onBound(bithorde::Asset::Handle h, uint64_t bindId, const IAsset::Ptr& asset, const SnapshotPtr& snapshot, bithorde::Status status)
+{
+	auto pending = _pendingBinds.find(h);
+	if ((pending == _pendingBinds.end()) || (pending->second != bindId))
+		return; // Closed or re-bound while looking up
+	_pendingBinds.erase(pending);
+	if (asset)
+		assignAsset(h, asset, snapshot);
+	else
+		informAssetStatus(h, status);
+}
+
+void Client::onAllBound(const LookupsPtr& lookups)
+{
+	for (auto iter = lookups->begin(); iter != lookups->end(); iter++)
+		onBound(iter->req.handle(), iter->bindId, iter->asset, iter->snapshot, iter->status);
+}
+
+// A range pushed to the peer, until done, cancelled or failed
+struct Client::PushStream {
+	uint32_t reqId;
+	bithorde::Asset::Handle handle;
+	uint64_t next, end;
+	size_t inFlight; // Reads not yet responded to
+	bool stopped; // No more reads, end once those in flight are responded to
+	bithorde::Status status; // Sent in the end
+};
+
+// One read from an asset, answering ranges [first, last) of its run
+struct Client::RunRead {
+	ReadRun run;
+	IAsset::Ptr asset;
+	PushStreamPtr stream; // Set for reads pushing a stream
+	Deadline deadline;
+	int first;
+	int last; // Known once the asset has said how much it reads at once
+	bool cancelled; // Ranges are answered without content
+	bool arrived;
+	int64_t offset;
+	ByteSlice data;
+};
+
 void Client::onMessage(const bithorde::Read::Request& msg)
 {
+	boost::shared_ptr<bithorde::ReadV> run(new bithorde::ReadV());
+	run->set_reqid(msg.reqid());
+	run->set_handle(msg.handle());
+	run->set_timeout(msg.timeout());
+	auto range = run->add_ranges();
+	range->set_offset(msg.offset());
+	range->set_size(min<size_t>(msg.size(), chunkSize()));
+	queueRun(run, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(msg.timeout()));
+}
+
+void Client::onMessage(const bithorde::ReadV& msg)
+{
+	size_t chunk = chunkSize();
+	Deadline deadline = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(msg.timeout());
+	boost::shared_ptr<bithorde::ReadV> run;
+	uint64_t runEnd = 0;
+	size_t runSize = 0;
+	for (int i=0; i < msg.ranges_size(); i++) {
+		if ((size_t)i >= bithorde::Connection::MAX_RANGES) {
+			respondRanges(msg, i, bithorde::NORESOURCES);
+			break;
+		}
+		const auto& range = msg.ranges(i);
+		size_t size = min<size_t>(range.size(), chunk);
+		if (!run || (range.offset() != runEnd) || (runSize + size > MAX_RUN)) {
+			if (run)
+				queueRun(run, deadline);
+			run.reset(new bithorde::ReadV());
+			run->set_reqid(msg.reqid());
+			run->set_handle(msg.handle());
+			run->set_timeout(msg.timeout());
+			runSize = 0;
+		}
+		auto added = run->add_ranges();
+		added->set_offset(range.offset());
+		added->set_size(size);
+		runEnd = range.offset() + size;
+		runSize += size;
+	}
+	if (run)
+		queueRun(run, deadline);
+}
+
+void Client::onMessage(const bithorde::ReadStream& msg)
+{
+	PushStreamPtr stream(new PushStream());
+	stream->reqId = msg.reqid();
+	stream->handle = msg.handle();
+	stream->next = stream->end = msg.offset();
+	stream->inFlight = 0;
+	stream->stopped = false;
 	IAsset::Ptr& asset = getAsset(msg.handle());
-	if (asset) {
-		uint64_t offset = msg.offset();
-		size_t size = msg.size();
-		if (size > MAX_CHUNK)
-			size = MAX_CHUNK;
+	if (!asset || (_snapshots[msg.handle()]->status.status() != bithorde::SUCCESS))
+		return stopStream(stream, bithorde::INVALID_HANDLE);
+	// As the peer was told, the asset itself changes on the control loop
+	uint64_t assetSize = _snapshots[msg.handle()]->status.size();
+	uint64_t size = assetSize;
+	if (msg.has_size() && (msg.size() < size))
+		size = msg.size();
+	if (stream->next < assetSize)
+		stream->end = min(assetSize, stream->next + size);
+	if (stream->next == stream->end)
+		return stopStream(stream, bithorde::NONE);
+	_streams.push_back(stream);
+	pumpStreams();
+}
 
-		// Raw pointer to this should be fine here, since asset has ownership of this. (Through member Ptr client)
-		asset->async_read(offset, size, boost::bind(&Client::onReadResponse, this, msg, _1, _2));
-	} else {
-		bithorde::Read::Response resp;
-		resp.set_reqid(msg.reqid());
-		resp.set_status(bithorde::INVALID_HANDLE);
-		sendMessage(bithorde::Connection::ReadResponse, resp);
+void Client::onMessage(const bithorde::Read::Cancel& msg)
+{
+	cancelRequests(boost::bind(&isRequest, msg.reqid(), _1, _2));
+}
+
+/**
+ * Answers the parked runs, ends the streams, and abandons the reads in flight of every
+ * request picked by /filter/.
+ */
+void Client::cancelRequests(const RequestFilter& filter)
+{
+	for (auto iter = _parkedReads.begin(); iter != _parkedReads.end(); ) {
+		const ReadRun& run = iter->first;
+		if (filter(run->reqid(), run->handle())) {
+			respondRanges(*run, 0, bithorde::NONE);
+			iter = _parkedReads.erase(iter);
+		} else {
+			iter++;
+		}
+	}
+	for (auto iter = _streams.begin(); iter != _streams.end(); ) {
+		if (filter((*iter)->reqId, (*iter)->handle)) {
+			stopStream(*iter, bithorde::NONE);
+			iter = _streams.erase(iter);
+		} else {
+			iter++;
+		}
+	}
+	// Assets need not call back for cancelled reads, so unless they do so right away, the
+	// reads are answered without them
+	std::list< boost::shared_ptr<RunRead> > reads;
+	for (auto iter = _reads.begin(); iter != _reads.end(); iter++) {
+		const auto& read = *iter;
+		if (!read->cancelled && filter(read->run->reqid(), read->run->handle())) {
+			read->cancelled = true;
+			reads.push_back(read);
+		}
 	}
+	for (auto iter = reads.begin(); iter != reads.end(); iter++) {
+		(*iter)->asset->cancel_read(iter->get());
+		abandonRead(*iter);
+	}
+	serveParkedReads();
 }
 
-void Client::onReadResponse(const bithorde::Read::Request& req, int64_t offset, const std::string& data) {
-	bithorde::Read::Response resp;
-	resp.set_reqid(req.reqid());
-	if ((offset >= 0) && (data.size() > 0)) {
-		resp.set_status(bithorde::SUCCESS);
-		resp.set_offset(offset);
-		resp.set_content(data);
+void Client::queueRun(const ReadRun& run, const Deadline& deadline)
+{
+	if (!_parkedReads.empty() || !canServeRead()) {
+		// No room for the response, or too many reads queued for the disk. Held back while
+		// Read.Cancels and Pings keep coming, unless the peer queues up too many.
+		_parkedReads.push_back(make_pair(run, deadline));
+		if (_parkedReads.size() >= MAX_PARKED_RUNS)
+			pauseRead();
 	} else {
-		resp.set_status(bithorde::NOTFOUND);
+		serveRun(run, deadline);
 	}
+}
+
+void Client::onWritable()
+{
+	bithorde::Client::onWritable();
+	serveParkedReads();
+}
+
+bool Client::canServeRead()
+{
+	return sendCredit(bithorde::Connection::ReadResponse) && (_readsInFlight < MAX_READS_IN_FLIGHT);
+}
+
+void Client::serveParkedReads()
+{
+	auto now = boost::posix_time::microsec_clock::universal_time();
+	while (!_parkedReads.empty() && canServeRead()) {
+		auto parked = _parkedReads.front();
+		_parkedReads.pop_front();
+		// Under overload, reads the peer has given up on would only delay the others
+		if (now < parked.second)
+			serveRun(parked.first, parked.second);
+		else
+			respondRanges(*parked.first, 0, bithorde::TIMEOUT);
+	}
+	if (_parkedReads.size() < MAX_PARKED_RUNS)
+		resumeRead();
+	if (_parkedReads.empty())
+		pumpStreams();
+}
+
+void Client::serveRun(const ReadRun& run, const Deadline& deadline)
+{
+	IAsset::Ptr& asset = getAsset(run->handle());
+	int count = run->ranges_size();
+	if (!asset)
+		return respondRanges(*run, 0, bithorde::INVALID_HANDLE);
+
+	int first = 0;
+	if (_server.sendFile()) {
+		// Only the headers are encoded, the content is sent by the kernel straight from the file.
+		for (; first < count; first++) {
+			uint64_t offset = run->ranges(first).offset();
+			size_t size = run->ranges(first).size();
+			int fd = asset->file_range(offset, size);
+			if (fd < 0)
+				break;
+			bithorde::Read::Response resp;
+			resp.set_reqid(run->reqid());
+			resp.set_status(bithorde::SUCCESS);
+			resp.set_offset(offset);
+			sendMessage(bithorde::Connection::ReadResponse, resp, FileSlice(asset, fd, offset, size));
+		}
+	}
+
+	while (first < count)
+		startRead(asset, run, first, PushStreamPtr(), deadline);
+}
+
+/**
+ * Starts a single read from /asset/ of the ranges of /run/ from /first/, and moves /first/
+ * past those it covers. Returns the amount read at once.
+ */
+size_t Client::startRead(const IAsset::Ptr& asset, const ReadRun& run, int& first, const PushStreamPtr& stream, const Deadline& deadline)
+{
+	boost::shared_ptr<RunRead> read(new RunRead());
+	read->run = run;
+	read->asset = asset;
+	read->stream = stream;
+	read->deadline = deadline;
+	read->first = first;
+	read->last = -1;
+	read->cancelled = false;
+	read->arrived = false;
+	const auto& lastRange = run->ranges(run->ranges_size()-1);
+	uint64_t offset = run->ranges(first).offset();
+	size_t size = lastRange.offset() + lastRange.size() - offset;
+	_reads.push_back(read);
+	_readsInFlight++;
+	armReadTimer(deadline);
+	if (stream)
+		stream->inFlight++;
+	asset->async_read(offset, size, boost::bind(&Client::onReadDone, shared_from_this(), read, _1, _2), read.get(), deadline);
+
+	// The asset may read less at once, leaving ranges not read in full to the next read
+	do {
+		first++;
+	} while ((first < run->ranges_size()) && (run->ranges(first).offset() + run->ranges(first).size() <= offset + size));
+	read->last = first;
+	if (read->arrived)
+		respondRead(*read);
+	return size;
+}
+
+void Client::pumpStreams()
+{
+	size_t chunk = chunkSize();
+	while (!_streams.empty() && _parkedReads.empty() && canServeRead()) {
+		PushStreamPtr stream = _streams.front();
+		_streams.pop_front();
+		if (stream->stopped)
+			continue; // Failed, and ended once its reads are responded to
+		IAsset::Ptr& asset = getAsset(stream->handle);
+		if (!asset) {
+			stopStream(stream, bithorde::INVALID_HANDLE);
+			continue;
+		}
+
+		uint64_t offset = stream->next;
+		size_t size = min<uint64_t>(chunk, stream->end - offset);
+		int fd;
+		if (_server.sendFile() && ((fd = asset->file_range(offset, size)) >= 0)) {
+			bithorde::Read::Response resp;
+			resp.set_reqid(stream->reqId);
+			resp.set_status(bithorde::SUCCESS);
+			resp.set_offset(offset);
+			sendMessage(bithorde::Connection::ReadResponse, resp, FileSlice(asset, fd, offset, size));
+		} else {
+			boost::shared_ptr<bithorde::ReadV> run(new bithorde::ReadV());
+			run->set_reqid(stream->reqId);
+			run->set_handle(stream->handle);
+			auto range = run->add_ranges();
+			range->set_offset(offset);
+			range->set_size(size);
+			int first = 0;
+			size = startRead(asset, run, first, stream, Deadline(boost::posix_time::pos_infin));
+		}
+
+		stream->next += size;
+		if (stream->next < stream->end)
+			_streams.push_back(stream);
+		else
+			stopStream(stream, bithorde::NONE);
+	}
+}
+
+void Client::stopStream(const PushStreamPtr& stream, bithorde::Status s)
+{
+	if (stream->stopped)
+		return;
+	stream->stopped = true;
+	stream->status = s;
+	if (!stream->inFlight)
+		endStream(*stream);
+}
+
+void Client::endStream(const PushStream& stream)
+{
+	bithorde::Read::Response resp;
+	resp.set_reqid(stream.reqId);
+	resp.set_status(stream.status);
+	resp.set_offset(stream.next);
 	sendMessage(bithorde::Connection::ReadResponse, resp);
 }
 
+/**
+ * Fails the ranges of /run/ from /first/ with /s/, each with its offset
+ */
+void Client::respondRanges(const bithorde::ReadV& run, int first, bithorde::Status s)
+{
+	bithorde::Read::Response resp;
+	resp.set_reqid(run.reqid());
+	resp.set_status(s);
+	for (int i=first; i < run.ranges_size(); i++) {
+		resp.set_offset(run.ranges(i).offset());
+		sendMessage(bithorde::Connection::ReadResponse, resp);
+	}
+}
+
+void Client::onReadDone(const boost::shared_ptr<RunRead>& read, int64_t offset, const ByteSlice& data) {
+	// Assets may complete reads on another shard than ours
+	ioService().dispatch(boost::bind(&Client::onReadResponse, shared_from_this(), read, offset, data));
+}
+
+void Client::onReadResponse(const boost::shared_ptr<RunRead>& read, int64_t offset, const ByteSlice& data) {
+	if (read->arrived)
+		return; // Abandoned
+	read->arrived = true;
+	read->offset = offset;
+	read->data = data;
+	// Reads completed right from within serveRun() are responded to once it knows their ranges
+	if (read->last >= 0)
+		respondRead(*read);
+}
+
+void Client::respondRead(const RunRead& read) {
+	for (auto iter = _reads.begin(); iter != _reads.end(); iter++) {
+		if (iter->get() == &read) {
+			_reads.erase(iter);
+			break;
+		}
+	}
+
+	uint64_t dataEnd = read.offset + read.data.size();
+	for (int i=read.first; i < read.last; i++) {
+		const auto& range = read.run->ranges(i);
+		bithorde::Read::Response resp;
+		resp.set_reqid(read.run->reqid());
+		if (!read.cancelled && (read.offset >= 0) && (range.offset() >= (uint64_t)read.offset) && (range.offset() < dataEnd)) {
+			resp.set_status(bithorde::SUCCESS);
+			resp.set_offset(range.offset());
+			// Content is sent straight from the read-buffer
+			size_t size = min<uint64_t>(range.size(), dataEnd - range.offset());
+			sendMessage(bithorde::Connection::ReadResponse, resp, read.data.slice(range.offset() - read.offset, size));
+		} else if (!read.stream) { // Streams are told by their end only
+			resp.set_offset(range.offset());
+			if (read.cancelled)
+				resp.set_status(bithorde::NONE);
+			else if (boost::posix_time::microsec_clock::universal_time() < read.deadline)
+				resp.set_status(bithorde::NOTFOUND);
+			else
+				resp.set_status(bithorde::TIMEOUT); // Like forwarded reads running out of time
+			sendMessage(bithorde::Connection::ReadResponse, resp);
+		}
+	}
+	if (read.stream) {
+		if (!read.cancelled && ((read.offset < 0) || read.data.empty()))
+			stopStream(read.stream, bithorde::NOTFOUND);
+		if (!--read.stream->inFlight && read.stream->stopped)
+			endStream(*read.stream);
+	}
+	// Reads are often completed right from within serveRun(), so pick up parked reads later
+	if ((_readsInFlight-- == MAX_READS_IN_FLIGHT) && !(_parkedReads.empty() && _streams.empty()))
+		ioService().post(boost::bind(&Client::serveParkedReads, shared_from_this()));
+}
+
+/**
+ * Answers the ranges of /read/ without content, freeing its slot without waiting for the
+ * asset. Whatever the asset delivers later is dropped.
+ */
+void Client::abandonRead(const boost::shared_ptr<RunRead>& read)
+{
+	if (read->arrived)
+		return; // Answered already, or as soon as its ranges are known
+	read->arrived = true;
+	read->offset = -1;
+	read->data = ByteSlice();
+	respondRead(*read);
+}
+
+void Client::armReadTimer(const Deadline& deadline)
+{
+	if (deadline.is_special() || (_readTimer.armed() && (_readTimerAt <= deadline)))
+		return;
+	_readTimerAt = deadline;
+	auto left = deadline - boost::posix_time::microsec_clock::universal_time();
+	_readTimer.arm(left.is_negative() ? boost::posix_time::time_duration() : left);
+}
+
+void Client::onReadTimer()
+{
+	auto now = boost::posix_time::microsec_clock::universal_time();
+	std::vector< boost::shared_ptr<RunRead> > expired;
+	Deadline next(boost::posix_time::pos_infin);
+	for (auto iter = _reads.begin(); iter != _reads.end(); iter++) {
+		const Deadline& deadline = (*iter)->deadline;
+		if (deadline <= now)
+			expired.push_back(*iter);
+		else if (deadline < next)
+			next = deadline;
+	}
+	// The peer has given up on them, so the assets may as well
+	for (auto iter = expired.begin(); iter != expired.end(); iter++) {
+		(*iter)->asset->cancel_read(iter->get());
+		abandonRead(*iter);
+	}
+	armReadTimer(next);
+}
+
 void Client::informAssetStatus(bithorde::Asset::Handle h, bithorde::Status s)
 {
 	bithorde::AssetStatus resp;
 	resp.set_handle(h);
 	resp.set_status(s);
-	sendMessage(bithorde::Connection::AssetStatus, resp);
+	sendStatus(resp);
 }
 
-void Client::informAssetStatusUpdate(bithorde::Asset::Handle h, const bithorded::IAsset::WeakPtr& asset_)
+/**
+ * Statuses to peers taking AssetStatusBatches are held until the end of this turn of the
+ * event-loop, so that those of a BindBatch, or of many assets changing at once, go
+ * together.
+ */
+void Client::sendStatus(const bithorde::AssetStatus& status)
+{
+	if (!peerTakesStatusBatches()) {
+		sendMessage(bithorde::Connection::AssetStatus, status);
+		return;
+	}
+	if (!_statusBatch.statuses_size())
+		ioService().post(boost::bind(&Client::flushStatuses, shared_from_this()));
+	_statusBatch.add_statuses()->CopyFrom(status);
+	if ((size_t)_statusBatch.statuses_size() >= bithorde::Connection::MAX_BINDS)
+		flushStatuses();
+}
+
+void Client::flushStatuses()
+{
+	if (_statusBatch.statuses_size() == 1)
+		sendMessage(bithorde::Connection::AssetStatus, _statusBatch.statuses(0));
+	else if (_statusBatch.statuses_size() > 1)
+		sendMessage(bithorde::Connection::AssetStatusBatch, _statusBatch);
+	_statusBatch.Clear();
+}
+
+void Client::onAssetStatusChange(bithorde::Asset::Handle h, const bithorded::IAsset::WeakPtr& asset_)
+{
+	// Asset-status is changed from the control loop, so it's read here and passed on
+	auto asset = asset_.lock();
+	SnapshotPtr snapshot = asset ? snapshotAsset(asset) : SnapshotPtr();
+	ioService().dispatch(boost::bind(&Client::informAssetStatusUpdate, shared_from_this(), h, asset_, snapshot));
+}
+
+/**
+ * Reads what the peer is to be told of /asset/. Must run on the control loop.
+ */
+Client::SnapshotPtr Client::snapshotAsset(const IAsset::Ptr& asset)
+{
+	boost::shared_ptr<AssetSnapshot> snapshot(new AssetSnapshot());
+	snapshot->status.set_handle(0); // Set when sent
+	snapshot->status.set_status(asset->status);
+	snapshot->localFd = -1;
+	if (asset->status == bithorde::SUCCESS) {
+		snapshot->status.set_availability(1000);
+		snapshot->status.set_size(asset->size());
+		asset->getIds(*snapshot->status.mutable_ids());
+		snapshot->localFile.set_handle(0);
+		snapshot->localFd = asset->local_file(snapshot->localFile);
+	}
+	return snapshot;
+}
+
+void Client::informAssetStatusUpdate(bithorde::Asset::Handle h, const bithorded::IAsset::WeakPtr& asset_, const SnapshotPtr& snapshot)
 {
 	bithorde::AssetStatus resp;
-	resp.set_handle(h);
 
-	if (auto asset = asset_.lock()) {
-		resp.set_status(asset->status);
-		if (asset->status == bithorde::SUCCESS) {
-			resp.set_availability(1000);
-			resp.set_size(asset->size());
-			asset->getIds(*resp.mutable_ids());
-		}
+	auto asset = asset_.lock();
+	if (asset && (getAsset(h) != asset))
+		return; // Handle has been re-bound or closed since the change
+	if (asset) {
+		resp.CopyFrom(snapshot->status);
+		_snapshots[h] = snapshot;
 	} else {
 		resp.set_status(bithorde::NOTFOUND);
 	}
+	resp.set_handle(h);
 	LOG4CPLUS_INFO(clientLogger, peerName() << ':' << h << " new state " << bithorde::Status_Name(resp.status()));
 
-	sendMessage(bithorde::Connection::AssetStatus, resp);
+	// The file goes first, so the peer has it at hand as soon as it starts reading
+	if (asset && (resp.status() == bithorde::SUCCESS) && peerTakesLocalFiles())
+		informLocalFile(h, asset, *snapshot);
+	sendStatus(resp);
+}
+
+void Client::informLocalFile(bithorde::Asset::Handle h, const IAsset::Ptr& asset, const AssetSnapshot& snapshot)
+{
+	if ((snapshot.localFd < 0) || !snapshot.localFile.verified_size())
+		return;
+	bithorde::LocalFile msg(snapshot.localFile);
+	msg.set_handle(h);
+	sendMessage(bithorde::Connection::LocalFile, msg, Descriptor(asset, snapshot.localFd));
 }
 
-bithorde::Status Client::assignAsset(bithorde::Asset::Handle handle_, const IAsset::Ptr& a)
+bithorde::Status Client::assignAsset(bithorde::Asset::Handle handle_, const IAsset::Ptr& a, const SnapshotPtr& snapshot)
 {
 	size_t handle = handle_;
 	if (handle >= _assets.size()) {
@@ -183,18 +734,20 @@ bithorde::Status Client::assignAsset(bithorde::Asset::Handle handle_, const IAss
 		if (new_size > MAX_ASSETS)
 			new_size = MAX_ASSETS;
 		_assets.resize(new_size);
+		_snapshots.resize(new_size);
 	}
 	_assets[handle] = a;
+	_snapshots[handle] = snapshot;
 
 	// Remember to inform peer about changes in asset-status.
-	a->statusChange.connect(boost::bind(&Client::informAssetStatusUpdate, this, handle_, IAsset::WeakPtr(a)));
+	a->statusChange.connect(IAsset::StatusSignal::slot_type(&Client::onAssetStatusChange, this, handle_, IAsset::WeakPtr(a)).track(shared_from_this()));
 
-	if (a->status != bithorde::Status::NONE) {
+	if (snapshot->status.status() != bithorde::Status::NONE) {
 		// We already have a valid status for the asset, so inform about it
-		informAssetStatusUpdate(handle_, a);
+		informAssetStatusUpdate(handle_, a, snapshot);
 	}
 
-	return a->status;
+	return snapshot->status.status();
 }
 
 void Client::clearAsset(bithorde::Asset::Handle handle_)
@@ -202,8 +755,9 @@ void Client::clearAsset(bithorde::Asset::Handle handle_)
 	size_t handle = handle_;
 	if (handle < _assets.size()) {
 		if (auto& a=_assets[handle])
-			a->statusChange.disconnect(boost::bind(&Client::informAssetStatusUpdate, this, handle_, IAsset::WeakPtr(a)));
+			a->statusChange.disconnect(boost::bind(&Client::onAssetStatusChange, this, handle_, IAsset::WeakPtr(a)));
 		_assets[handle].reset();
+		_snapshots[handle].reset();
 	}
 }
 
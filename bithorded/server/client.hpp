@@ -18,6 +18,13 @@
 #ifndef BITHORDED_CLIENT_H
 #define BITHORDED_CLIENT_H
 
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
 #include <boost/smart_ptr/enable_shared_from_this.hpp>
 
 #include "lib/allocator.h"
@@ -31,27 +38,103 @@ class Client : public bithorde::Client, public boost::enable_shared_from_this<Cl
 {
 	Server& _server;
 	std::vector< IAsset::Ptr > _assets;
+	// What the peer is told of an asset, taken on the control loop where assets change
+	struct AssetSnapshot {
+		bithorde::AssetStatus status;
+		bithorde::LocalFile localFile;
+		int localFd; // Of localFile, or -1
+	};
+	typedef boost::shared_ptr<const AssetSnapshot> SnapshotPtr;
+	std::vector< SnapshotPtr > _snapshots; // Of _assets, as last told the peer
+	// Adjacent ranges of a Read- or ReadV-request, read from the asset together
+	typedef boost::shared_ptr<const bithorde::ReadV> ReadRun;
+	typedef boost::posix_time::ptime Deadline; // When the peer stops waiting for a read
+	struct RunRead;
+	std::deque< std::pair<ReadRun, Deadline> > _parkedReads; // Held back while congested
+	struct PushStream;
+	typedef boost::shared_ptr<PushStream> PushStreamPtr;
+	std::list< PushStreamPtr > _streams; // Pushed a chunk at a time, round-robin
+	std::list< boost::shared_ptr<RunRead> > _reads; // Asset-reads not yet responded to
+	size_t _readsInFlight; // Size of _reads
+	bithorde::TimerWheel::Timer _readTimer; // Abandons reads past their deadline
+	Deadline _readTimerAt;
+	// Picks requests to cancel, by reqId and handle
+	typedef boost::function<bool(uint32_t reqId, bithorde::Asset::Handle h)> RequestFilter;
+
+	// Binds being looked up on the control loop. Results for binds no longer pending are dropped.
+	std::map< bithorde::Asset::Handle, uint64_t > _pendingBinds;
+	uint64_t _bindCounter;
+	// A bind of a BindBatch, looked up together with the others on the control loop
+	struct Lookup {
+		uint64_t bindId;
+		bithorde::BindRead req;
+		IAsset::Ptr asset;
+		SnapshotPtr snapshot;
+		bithorde::Status status;
+	};
+	typedef boost::shared_ptr< std::vector<Lookup> > LookupsPtr;
+
+	// Statuses sent this turn of the event-loop, to peers taking AssetStatusBatches
+	bithorde::AssetStatusBatch _statusBatch;
 public:
 	typedef boost::shared_ptr<Client> Ptr;
 	typedef boost::weak_ptr<Client> WeakPtr;
-	static Ptr create(Server& server) {
-		return Ptr(new Client(server));
+	static Ptr create(Server& server, boost::asio::io_service& ioSvc) {
+		return Ptr(new Client(server, ioSvc));
 	}
 	bool requestsAsset(const BitHordeIds& ids);
 
 protected:
-	Client(Server& server);
+	Client(Server& server, boost::asio::io_service& ioSvc);
 
 	virtual void onMessage(const bithorde::HandShake& msg);
 	virtual void onMessage(const bithorde::BindWrite& msg);
 	virtual void onMessage(bithorde::BindRead& msg);
+	virtual void onMessage(bithorde::BindBatch& msg);
 	virtual void onMessage(const bithorde::Read::Request& msg);
+	virtual void onMessage(const bithorde::ReadV& msg);
+	virtual void onWritable();
+	virtual void onMessage(const bithorde::ReadStream& msg);
+	virtual void onMessage(const bithorde::Read::Cancel& msg);
+	virtual bool servesVectoredReads() const { return true; }
+	virtual bool servesStreams() const { return true; }
+	virtual bool servesBindBatches() const { return true; }
 
 private:
+	// Run on the control loop
+	void findAsset(uint64_t bindId, const bithorde::BindRead& req);
+	void findAssets(const LookupsPtr& lookups);
+	IAsset::Ptr lookupAsset(const bithorde::BindRead& req, bithorde::Status& status);
+	void linkAsset(bithorde::Asset::Handle h, uint64_t bindId, const boost::filesystem::path& path);
+	void onAssetStatusChange(bithorde::Asset::Handle h, const bithorded::IAsset::WeakPtr& asset);
+	static SnapshotPtr snapshotAsset(const IAsset::Ptr& asset);
+
+	uint64_t beginBind(bithorde::Asset::Handle h);
+	uint64_t beginBindRead(bithorde::BindRead& msg);
+	void onBound(bithorde::Asset::Handle h, uint64_t bindId, const IAsset::Ptr& asset, const SnapshotPtr& snapshot, bithorde::Status status);
+	void onAllBound(const LookupsPtr& lookups);
+	bool canServeRead();
+	void serveParkedReads();
+	void queueRun(const ReadRun& run, const Deadline& deadline);
+	void serveRun(const ReadRun& run, const Deadline& deadline);
+	size_t startRead(const IAsset::Ptr& asset, const ReadRun& run, int& first, const PushStreamPtr& stream, const Deadline& deadline);
+	void pumpStreams();
+	void stopStream(const PushStreamPtr& stream, bithorde::Status s);
+	void endStream(const PushStream& stream);
+	void respondRanges(const bithorde::ReadV& run, int first, bithorde::Status s);
+	void cancelRequests(const RequestFilter& filter);
 	void informAssetStatus(bithorde::Asset::Handle h, bithorde::Status s);
-	void informAssetStatusUpdate(bithorde::Asset::Handle h, const bithorded::IAsset::WeakPtr& asset);
-	void onReadResponse( const bithorde::Read::Request& req, int64_t offset, const std::string& data);
-	bithorde::Status assignAsset(bithorde::Asset::Handle handle, const bithorded::IAsset::Ptr& a);
+	void sendStatus(const bithorde::AssetStatus& status);
+	void flushStatuses();
+	void informAssetStatusUpdate(bithorde::Asset::Handle h, const bithorded::IAsset::WeakPtr& asset, const SnapshotPtr& snapshot);
+	void informLocalFile(bithorde::Asset::Handle h, const bithorded::IAsset::Ptr& asset, const AssetSnapshot& snapshot);
+	void onReadDone( const boost::shared_ptr<RunRead>& read, int64_t offset, const ByteSlice& data);
+	void onReadResponse( const boost::shared_ptr<RunRead>& read, int64_t offset, const ByteSlice& data);
+	void respondRead( const RunRead& read);
+	void abandonRead(const boost::shared_ptr<RunRead>& read);
+	void armReadTimer(const Deadline& deadline);
+	void onReadTimer();
+	bithorde::Status assignAsset(bithorde::Asset::Handle handle, const bithorded::IAsset::Ptr& a, const SnapshotPtr& snapshot);
 	void clearAsset(bithorde::Asset::Handle handle);
 	IAsset::Ptr& getAsset(bithorde::Asset::Handle handle);
 };
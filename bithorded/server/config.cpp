@@ -23,6 +23,7 @@
 #include <boost/foreach.hpp>
 #include <boost/tokenizer.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread/thread.hpp>
 #include <iostream>
 #include <fstream>
 
@@ -112,6 +113,10 @@ bithorded::Config::Config(int argc, char* argv[])
 			"TCP port to listen on for incoming connections")
 		("server.unixSocket", po::value<string>(&unixSocket)->default_value("/tmp/bithorde"),
 			"Path to UNIX-socket to listen on")
+		("server.sendFile", po::value<bool>(&sendFile)->default_value(true),
+			"Send asset-content to cleartext connections straight from disk, using sendfile()")
+		("server.threads", po::value<uint>(&threads)->default_value(boost::thread::hardware_concurrency()),
+			"Number of event-loops to serve connections on, each in its own thread")
 	;
 
 	cmdline_options.add(cli_options).add(config_options);
@@ -62,6 +62,8 @@ struct Config
 
 	uint16_t tcpPort;
 	std::string unixSocket;
+	bool sendFile;
+	uint threads;
 
 	std::vector<Source> sources;
 	std::vector<Friend> friends;
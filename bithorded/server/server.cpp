@@ -21,6 +21,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/make_shared.hpp>
 #include <iostream>
+#include <unistd.h>
 
 #include "client.hpp"
 #include "config.hpp"
@@ -45,13 +46,50 @@ BindError::BindError(bithorde::Status status):
 {
 }
 
+static void runShard(asio::io_service* shard)
+{
+	shard->run();
+}
+
+/**
+ * Sockets are tied to the io_service they were created on, so accepted sockets are handed
+ * over to a new socket on the target shard. Returns a null Ptr on failure.
+ */
+template <typename Socket>
+static boost::shared_ptr<Socket> moveToShard(boost::shared_ptr<Socket>& socket, asio::io_service& shard)
+{
+	boost::system::error_code ec;
+	auto protocol = socket->local_endpoint(ec).protocol();
+	int fd = ec ? -1 : ::dup(socket->native_handle());
+	if (fd < 0)
+		return boost::shared_ptr<Socket>();
+	auto res = boost::make_shared<Socket>(shard);
+	res->assign(protocol, fd, ec);
+	if (ec) {
+		::close(fd);
+		return boost::shared_ptr<Socket>();
+	}
+	socket->close(ec);
+	return res;
+}
+
 Server::Server(asio::io_service& ioSvc, Config& cfg) :
 	_cfg(cfg),
 	_ioSvc(ioSvc),
+	_nextShard(0),
 	_tcpListener(ioSvc),
 	_localListener(ioSvc),
 	_router(*this)
 {
+	// The control loop is run by our owner, the rest get a thread each
+	for (uint i = 1; i < _cfg.threads; i++) {
+		auto shard = boost::make_shared<asio::io_service>();
+		_shardWork.push_back(boost::make_shared<asio::io_service::work>(boost::ref(*shard)));
+		_shardThreads.create_thread(boost::bind(&runShard, shard.get()));
+		_shards.push_back(shard);
+	}
+	LOG4CPLUS_INFO(serverLog, "Serving connections on " << (_shards.size()+1) << " event-loops");
+
 	for (auto iter=_cfg.sources.begin(); iter != _cfg.sources.end(); iter++)
 		_assetStores.push_back( unique_ptr<source::Store>(new source::Store(ioSvc, iter->root)) );
 
@@ -81,11 +119,45 @@ Server::Server(asio::io_service& ioSvc, Config& cfg) :
 	}
 }
 
+Server::~Server()
+{
+	_shardWork.clear();
+	for (auto iter=_shards.begin(); iter != _shards.end(); iter++)
+		(*iter)->stop();
+	_shardThreads.join_all();
+}
+
 asio::io_service& Server::ioService()
 {
 	return _ioSvc;
 }
 
+asio::io_service& Server::nextShard()
+{
+	size_t shard = _nextShard++ % (_shards.size()+1);
+	return shard ? *_shards[shard-1] : _ioSvc;
+}
+
+template <typename Socket>
+void Server::assignShard(boost::shared_ptr<Socket>& socket, asio::io_service& shard)
+{
+	auto sock = socket;
+	if (&shard != &_ioSvc && !(sock = moveToShard(socket, shard))) {
+		LOG4CPLUS_WARN(serverLog, "Failed to move connection to worker, keeping it on the control loop");
+		return assignShard(socket, _ioSvc);
+	}
+	// The client must be set up by the shard itself, since it may start receiving right away.
+	shard.post(boost::bind(&Server::startClient<Socket>, this, boost::ref(shard), sock));
+}
+
+template <typename Socket>
+void Server::startClient(asio::io_service& shard, boost::shared_ptr<Socket>& socket)
+{
+	bithorded::Client::Ptr c = bithorded::Client::create(*this, shard);
+	c->connect(bithorde::Connection::create(shard, socket));
+	clientConnected(c);
+}
+
 void Server::waitForTCPConnection()
 {
 	boost::shared_ptr<asio::ip::tcp::socket> sock = boost::make_shared<asio::ip::tcp::socket>(_ioSvc);
@@ -102,9 +174,13 @@ void Server::onTCPConnected(boost::shared_ptr< asio::ip::tcp::socket >& socket,
 
 void Server::onTCPConnected ( boost::shared_ptr< asio::ip::tcp::socket >& socket )
 {
-	bithorded::Client::Ptr c = bithorded::Client::create(*this);
-	c->connect(bithorde::Connection::create(_ioSvc, socket));
-	clientConnected(c);
+	// Friends stay on the control loop, where the router forwards requests through them.
+	boost::system::error_code ec;
+	auto peer = socket->remote_endpoint(ec);
+	if (!ec && _router.isFriendAddress(peer.address()))
+		assignShard(socket, _ioSvc);
+	else
+		assignShard(socket, nextShard());
 }
 
 void Server::waitForLocalConnection()
@@ -116,9 +192,7 @@ void Server::waitForLocalConnection()
 void Server::onLocalConnected(boost::shared_ptr< boost::asio::local::stream_protocol::socket >& socket, const boost::system::error_code& ec)
 {
 	if (!ec) {
-		bithorded::Client::Ptr c = bithorded::Client::create(*this);
-		c->connect(bithorde::Connection::create(_ioSvc, socket));
-		clientConnected(c);
+		assignShard(socket, nextShard());
 		waitForLocalConnection();
 	}
 }
@@ -134,13 +208,13 @@ void Server::clientConnected(const bithorded::Client::Ptr& client)
 
 void Server::clientAuthenticated(const bithorded::Client::WeakPtr& client_) {
 	if (Client::Ptr client = client_.lock())
-		_router.onConnected(client);
+		_ioSvc.post(boost::bind(&router::Router::onConnected, &_router, client));
 }
 
 void Server::clientDisconnected(bithorded::Client::Ptr& client)
 {
-	LOG4CPLUS_INFO(serverLog, "Disconnected: " << client->peerName());
-	_router.onDisconnected(client);
+	LOG4CPLUS_INFO(serverLog, "Disconnected: " << client->peerName() << " (" << client->stats() << ")");
+	_ioSvc.post(boost::bind(&router::Router::onDisconnected, &_router, client));
 	// Will destroy the client, unless others are holding references.
 	client.reset();
 }
@@ -26,6 +26,7 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/local/stream_protocol.hpp>
 #include <boost/filesystem/path.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "../router/router.hpp"
 #include "../source/store.hpp"
@@ -42,11 +43,22 @@ public:
 	explicit BindError(bithorde::Status status);
 };
 
+/**
+ * Connections are spread over a number of event-loops (shards), each run by its own
+ * thread. The loop passed to the constructor is the control loop; it owns the listeners,
+ * the asset-stores and the router, including all connections to friends. Clients on other
+ * shards reach those by posting to the control loop, and have results posted back.
+ */
 class Server
 {
 	Config &_cfg;
 	boost::asio::io_service& _ioSvc;
 
+	std::vector< boost::shared_ptr<boost::asio::io_service> > _shards;
+	std::vector< boost::shared_ptr<boost::asio::io_service::work> > _shardWork;
+	boost::thread_group _shardThreads;
+	size_t _nextShard;
+
 	boost::asio::ip::tcp::acceptor _tcpListener;
 	boost::asio::local::stream_protocol::acceptor _localListener;
 
@@ -54,15 +66,28 @@ class Server
 	router::Router _router;
 public:
 	Server(boost::asio::io_service& ioSvc, Config& cfg);
+	~Server();
 
+	/**
+	 * The control loop
+	 */
 	boost::asio::io_service& ioService();
 	std::string name() { return _cfg.nodeName; }
+	bool sendFile() { return _cfg.sendFile; }
 
+	/**
+	 * Asset-lookups may only be made from the control loop.
+	 */
 	IAsset::Ptr async_linkAsset(const boost::filesystem::path& filePath);
 	IAsset::Ptr async_findAsset(const bithorde::BindRead& req);
 
 	void onTCPConnected(boost::shared_ptr<boost::asio::ip::tcp::socket>& socket);
 private:
+	boost::asio::io_service& nextShard();
+	template <typename Socket>
+	void assignShard(boost::shared_ptr<Socket>& socket, boost::asio::io_service& shard);
+	template <typename Socket>
+	void startClient(boost::asio::io_service& shard, boost::shared_ptr<Socket>& socket);
 	void clientConnected(const bithorded::Client::Ptr& client);
 	void clientAuthenticated(const bithorded::Client::WeakPtr& client);
 	void clientDisconnected(bithorded::Client::Ptr& client);
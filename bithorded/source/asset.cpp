@@ -17,14 +17,20 @@
 
 #include "asset.hpp"
 
-const size_t MAX_CHUNK = 64*1024;
+#include <boost/bind.hpp>
+#include <boost/static_assert.hpp>
+
+#include <lib/connection.h>
+
+BOOST_STATIC_ASSERT(bithorde::Connection::MAX_CHUNK <= RandomAccessFile::WINDOW_SIZE);
 
 using namespace std;
 
 using namespace bithorded;
 using namespace bithorded::source;
 
-SourceAsset::SourceAsset(const boost::filesystem3::path& metaFolder) :
+SourceAsset::SourceAsset(ReadEngine& readEngine, const boost::filesystem3::path& metaFolder) :
+	_readEngine(readEngine),
 	_metaFolder(metaFolder),
 	_file(metaFolder/"data"),
 	_metaStore(metaFolder/"meta", _file.blocks(BLOCKSIZE)),
@@ -36,8 +42,8 @@ SourceAsset::SourceAsset(const boost::filesystem3::path& metaFolder) :
 size_t SourceAsset::can_read(uint64_t offset, size_t size)
 {
 	size_t res = 0;
-	if (size > MAX_CHUNK)
-		size = MAX_CHUNK;
+	if (size > bithorde::Connection::MAX_CHUNK)
+		size = bithorde::Connection::MAX_CHUNK;
 	uint currentBlock = offset / BLOCKSIZE;
 	uint endBlockNum = (offset + size) / BLOCKSIZE;
 	size_t currentBlockSize = BLOCKSIZE - (offset % BLOCKSIZE);
@@ -100,14 +106,73 @@ void SourceAsset::notifyValidRange(uint64_t offset, uint64_t size)
 	updateHash(offset, end);
 }
 
-void SourceAsset::async_read(uint64_t offset, size_t& size, ReadCallback cb)
+void SourceAsset::async_read(uint64_t offset, size_t& size, ReadCallback cb, const void* reader, const boost::posix_time::ptime& deadline)
 {
-	byte buf[MAX_CHUNK];
-	const byte* data = _file.read(offset, size, buf);
-	if (data)
-		cb(offset, std::string((char*)data, size));
-	else
-		cb(offset, std::string());
+	if (!size)
+		return cb(offset, ByteSlice());
+	if (size > RandomAccessFile::WINDOW_SIZE)
+		size = RandomAccessFile::WINDOW_SIZE;
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	buf->grow(size);
+	if (_file.readCached(offset, size, buf->ptr)) {
+		buf->charge(size);
+		return cb(offset, ByteSlice(buf, 0, size));
+	}
+	// Waiting for the disk would stall every connection on the event-loop
+	_readEngine.read(_file, offset, size, buf->ptr, boost::bind(&SourceAsset::onRead, shared_from_this(), offset, buf, cb, _1, _2));
+}
+
+void SourceAsset::onRead(uint64_t offset, boost::shared_ptr<Buffer> buf, ReadCallback cb, const byte* data, size_t size)
+{
+	if (data) {
+		BOOST_ASSERT(data == buf->ptr);
+		buf->charge(size);
+		cb(offset, ByteSlice(buf, 0, size));
+	} else {
+		cb(offset, ByteSlice());
+	}
+}
+
+int SourceAsset::file_range(uint64_t offset, size_t& size)
+{
+	uint64_t fileSize = _file.size();
+	if (offset >= fileSize)
+		return -1;
+	if (size > fileSize - offset)
+		size = fileSize - offset;
+	// sendfile() would block the event-loop on cold content, leave that to async_read()
+	if (!size || !_file.isCached(offset, size))
+		return -1;
+	return _file.fd();
+}
+
+int SourceAsset::local_file(bithorde::LocalFile& desc)
+{
+	uint64_t fileSize = _file.size();
+	if (hasRootHash()) {
+		auto range = desc.add_verified();
+		range->set_offset(0);
+		range->set_size(fileSize);
+	} else {
+		bithorde::LocalFile::Range* range = NULL;
+		uint blocks = _file.blocks(BLOCKSIZE);
+		for (uint block = 0; block < blocks; block++) {
+			if (!_hasher.isBlockSet(block)) {
+				range = NULL;
+				continue;
+			}
+			uint64_t offset = (uint64_t)block * BLOCKSIZE;
+			uint64_t size = min<uint64_t>(BLOCKSIZE, fileSize - offset);
+			if (range) {
+				range->set_size(range->size() + size);
+			} else {
+				range = desc.add_verified();
+				range->set_offset(offset);
+				range->set_size(size);
+			}
+		}
+	}
+	return _file.fd();
 }
 
 uint64_t SourceAsset::size() {
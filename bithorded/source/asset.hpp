@@ -20,19 +20,21 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/smart_ptr/enable_shared_from_this.hpp>
 
 #include "../store/assetmeta.hpp"
 
 #include "../server/asset.hpp"
 #include "../lib/hashtree.hpp"
 #include "../lib/randomaccessfile.hpp"
+#include "../lib/readengine.hpp"
 
 #include "bithorde.pb.h"
 
 namespace bithorded {
 	namespace source {
 
-class SourceAsset : public IAsset
+class SourceAsset : public IAsset, public boost::enable_shared_from_this<SourceAsset>
 {
 public:
 	typedef HashTree<TigerNode, AssetMeta> Hasher;
@@ -44,12 +46,26 @@ public:
 	 */
 	const static int BLOCKSIZE = Hasher::BLOCKSIZE;
 
-	SourceAsset(const boost::filesystem::path& metaFolder);
+	/**
+	 * Reads that have to wait for the disk are done through /readEngine/.
+	 */
+	SourceAsset(ReadEngine& readEngine, const boost::filesystem::path& metaFolder);
+
+	/**
+	 * Will read up to /size/ bytes, at most RandomAccessFile::WINDOW_SIZE, from underlying
+	 * file, and send to callback. Content already in page-cache is read right away, otherwise /cb/ is called once the ReadEngine is done.
+	 */
+	virtual void async_read(uint64_t offset, size_t& size, ReadCallback cb, const void* reader, const boost::posix_time::ptime& deadline);
+
+	/**
+	 * Describes the range of the underlying file to send, for reading straight from disk.
+	 */
+	virtual int file_range(uint64_t offset, size_t& size);
 
 	/**
-	 * Will read up to /size/ bytes from underlying file, and send to callback.
+	 * The data-file, with the ranges hashed so far
 	 */
-	virtual void async_read(uint64_t offset, size_t& size, ReadCallback cb);
+	virtual int local_file(bithorde::LocalFile& desc);
 
 	/**
 	 * The size of the asset, in bytes
@@ -94,7 +110,9 @@ public:
 	void updateStatus();
 private:
 	void updateHash(uint64_t offset, uint64_t end);
+	void onRead(uint64_t offset, boost::shared_ptr<Buffer> buf, ReadCallback cb, const byte* data, size_t size);
 
+	ReadEngine& _readEngine;
 	boost::filesystem::path _metaFolder;
 	RandomAccessFile _file;
 	AssetMeta _metaStore;
@@ -38,6 +38,7 @@ const fs::path META_DIR = ".bh_meta/assets";
 const fs::path TIGER_DIR = ".bh_meta/tiger";
 
 const int THREADPOOL_CONCURRENCY = 4;
+const int READ_CONCURRENCY = 8;
 
 namespace bithorded {
 	log4cplus::Logger storeLog = log4cplus::Logger::getInstance("store");
@@ -45,6 +46,7 @@ namespace bithorded {
 
 Store::Store(boost::asio::io_service& ioSvc, const boost::filesystem3::path& baseDir) :
 	_threadPool(THREADPOOL_CONCURRENCY),
+	_readEngine(ioSvc, READ_CONCURRENCY),
 	_ioSvc(ioSvc),
 	_baseDir(baseDir),
 	_assetsFolder(baseDir/META_DIR),
@@ -57,6 +59,7 @@ Store::Store(boost::asio::io_service& ioSvc, const boost::filesystem3::path& bas
 	if (!fs::exists(_tigerFolder))
 		fs::create_directories(_tigerFolder);
 	srand(time(NULL));
+	LOG4CPLUS_INFO(storeLog, _baseDir << ": reading through " << (_readEngine.usingRing() ? "io_uring" : "threads"));
 }
 
 struct HashTask : public Task {
@@ -109,7 +112,7 @@ IAsset::Ptr Store::addAsset(const boost::filesystem3::path& file)
 		fs::create_directory(assetFolder);
 		fs::create_symlink(file, assetFolder/"data");
 
-		SourceAsset::Ptr asset = boost::make_shared<SourceAsset>(assetFolder);
+		SourceAsset::Ptr asset = boost::make_shared<SourceAsset>(boost::ref(_readEngine), assetFolder);
 		asset->statusChange.connect(boost::bind(&Store::_addAsset, this, asset.get()));
 		HashTask* task = new HashTask(asset, _ioSvc);
 		_threadPool.post(*task);
@@ -172,7 +175,7 @@ LinkStatus validateDataSymlink(const fs::path& path) {
 
 void noop(IAsset::Ptr) {}
 
-SourceAsset::Ptr openAssetFolder(const fs::path& referrer, const fs::path& assetFolder) {
+SourceAsset::Ptr openAssetFolder(ReadEngine& readEngine, const fs::path& referrer, const fs::path& assetFolder) {
 	auto assetDataPath = assetFolder/"data";
 	switch (validateDataSymlink(assetDataPath)) {
 	case OUTDATED:
@@ -180,7 +183,7 @@ SourceAsset::Ptr openAssetFolder(const fs::path& referrer, const fs::path& asset
 		purgeLink(referrer);
 		fs::remove(referrer/"meta");
 	case OK:
-		return boost::make_shared<SourceAsset>(assetFolder);
+		return boost::make_shared<SourceAsset>(boost::ref(readEngine), assetFolder);
 		break;
 
 	case BROKEN:
@@ -203,7 +206,7 @@ SourceAsset::Ptr Store::_openTiger(const std::string& tigerId)
 		auto assetFolder = fs::read_symlink(hashLink, e);
 		if (e || !fs::is_directory(assetFolder)) {
 			purgeLink(hashLink);
-		} else if (asset = openAssetFolder(hashLink, assetFolder)) {
+		} else if (asset = openAssetFolder(_readEngine, hashLink, assetFolder)) {
 			if (asset->hasRootHash()) {
 				_tigerMap[tigerId] = asset;
 			} else {
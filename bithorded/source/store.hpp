@@ -33,6 +33,7 @@ namespace bithorded {
 class Store
 {
 	ThreadPool _threadPool;
+	ReadEngine _readEngine; // For asset-reads that must wait for the disk
 	boost::asio::io_service& _ioSvc;
 	boost::filesystem::path _baseDir;
 	boost::filesystem::path _assetsFolder;
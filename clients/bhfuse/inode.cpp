@@ -1,16 +1,16 @@
 #include "main.h"
 #include "inode.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <iostream>
+#include <string.h>
 
 #include <lib/client.h>
 
 static const uint ATTR_TIMEOUT = 2;
 static const uint INODE_TIMEOUT = 4;
-static const size_t BLOCK_SIZE = 64*1024;
 static const uint REBIND_INTERVAL_MS = 1000;
-static const uint READ_RETRIES = 5;
 
 using namespace std;
 namespace asio = boost::asio;
@@ -64,15 +64,22 @@ bool INode::fuse_reply_stat(fuse_req_t req) {
 BHReadOperation::BHReadOperation() :
 	req(NULL),
 	off(-1),
-	size(0),
-	retries(0)
+	size(0)
 {}
 
 BHReadOperation::BHReadOperation(fuse_req_t req, off_t off, size_t size) :
 	req(req),
 	off(off),
-	size(size),
-	retries(0)
+	size(size)
+{}
+
+BHReadAssembly::BHReadAssembly(fuse_req_t req, off_t off, size_t size) :
+	req(req),
+	off(off),
+	buf(size),
+	end(size),
+	pending(0),
+	failed(false)
 {}
 
 FUSEAsset::FUSEAsset(BHFuse* fs, ino_t ino, boost::shared_ptr< ReadAsset > asset, LookupParams& lookup_params) :
@@ -95,11 +102,12 @@ void FUSEAsset::init()
 	}
 
 	_statusConnection = asset->statusUpdate.connect(Asset::StatusSignal::slot_type(&FUSEAsset::onStatusChanged, this, ASSET_ARG_STATUS));
-	_dataConnection = asset->dataArrived.connect(ReadAsset::DataSignal::slot_type(&FUSEAsset::onDataArrived, this, ASSET_ARG_OFFSET, ASSET_ARG_DATA, ASSET_ARG_TAG));
+	asset->dataArrived.connect(boost::bind(&FUSEAsset::onDataArrived, this, ASSET_ARG_OFFSET, ASSET_ARG_DATA, ASSET_ARG_TAG));
 }
 
 FUSEAsset::~FUSEAsset()
 {
+	asset->dataArrived.disconnect();
 	_holdOpenTimer.cancel();
 	_rebindTimer.cancel();
 	BOOST_ASSERT(_openCount == 0);
@@ -141,16 +149,57 @@ void FUSEAsset::fuse_reply_open(fuse_req_t req) {
 
 void FUSEAsset::read(fuse_req_t req, off_t off, size_t size)
 {
+	size_t chunk = fs->client->chunkSize();
 	if (off >= (off_t)this->size) {
 		fuse_reply_buf(req, 0, 0);
-	} else {
+	} else if (size <= chunk) {
 		queueRead(BHReadOperation(req,off,size));
+	} else {
+		size = min(size, (size_t)(this->size - off));
+		boost::shared_ptr<BHReadAssembly> assembly(new BHReadAssembly(req, off, size));
+		for (size_t pos = 0; pos < size; pos += chunk) {
+			BHReadOperation part(req, off+pos, min(chunk, size-pos));
+			part.assembly = assembly;
+			assembly->pending++;
+			queueRead(part);
+		}
+	}
+}
+
+void FUSEAsset::reply(const BHReadOperation& read, const ByteSlice& data)
+{
+	if (!read.assembly) {
+		fuse_reply_buf(read.req, (const char*)data.data(), data.size());
+		return;
+	}
+	BHReadAssembly& assembly = *read.assembly;
+	size_t pos = read.off - assembly.off;
+	size_t size = min(data.size(), read.size);
+	memcpy(assembly.buf.data() + pos, data.data(), size);
+	// Parts after a short one would leave a hole, so the reply ends with it
+	if (size < read.size)
+		assembly.end = min(assembly.end, pos + size);
+	if ((--assembly.pending == 0) && !assembly.failed)
+		fuse_reply_buf(assembly.req, (const char*)assembly.buf.data(), assembly.end);
+}
+
+void FUSEAsset::fail(const BHReadOperation& read, int err)
+{
+	if (!read.assembly) {
+		fuse_reply_err(read.req, err);
+		return;
+	}
+	BHReadAssembly& assembly = *read.assembly;
+	assembly.pending--;
+	if (!assembly.failed) {
+		assembly.failed = true;
+		fuse_reply_err(assembly.req, err);
 	}
 }
 
 void FUSEAsset::fill_stat_t(struct stat &s) {
 	s.st_mode = S_IFREG | 0555;
-	s.st_blksize = BLOCK_SIZE;
+	s.st_blksize = Connection::MAX_CHUNK;
 	s.st_ino = nr;
 	s.st_size = size;
 	s.st_nlink = 1;
@@ -194,8 +243,7 @@ void FUSEAsset::queueRead(const BHReadOperation& read)
 			tag++;
 		} while (_readOperations.count(tag)); // Just find a tag to hook it on
 	}
-	auto& op = _readOperations[tag] = read;
-	op.retries++;
+	_readOperations[tag] = read;
 }
 
 void FUSEAsset::tryRebind()
@@ -208,24 +256,16 @@ void FUSEAsset::tryRebind()
 	}
 }
 
-void FUSEAsset::onDataArrived(uint64_t offset, const std::string& data, int tag) {
+void FUSEAsset::onDataArrived(uint64_t offset, const ByteSlice& data, int tag) {
 	if (_readOperations.count(tag)) {
 		BHReadOperation &op = _readOperations[tag];
 		if (_connected) {
-			if (data.empty()) {
-				BHReadOperation opCopy = op;
-				_readOperations.erase(tag);
-				if (op.retries < READ_RETRIES)
-					queueRead(opCopy);
-				else
-					fuse_reply_err(op.req, EIO);
-			} else {
-				if ((off_t)offset == op.off)
-					fuse_reply_buf(op.req, (const char*)data.data(), data.size());
-				else
-					fuse_reply_err(op.req, EIO);
-				_readOperations.erase(tag);
-			}
+			// Already retried by the asset
+			if (!data.empty() && ((off_t)offset == op.off))
+				reply(op, data);
+			else
+				fail(op, EIO);
+			_readOperations.erase(tag);
 		} // else wait for reconnection
 	} else {
 		(cerr << "ERROR: got response for unknown request " << tag << endl).flush();
@@ -236,10 +276,12 @@ void FUSEAsset::closeOne()
 {
 	if ((--_openCount) <= 0) {
 		_rebindTimer.cancel();
-		asset->close();
+		// Abandoned reads would otherwise still be served, through every friend on the way
 		for (auto iter = _readOperations.begin(); iter != _readOperations.end(); iter++) {
-			fuse_reply_err(iter->second.req, EIO);
+			asset->cancel(iter->first);
+			fail(iter->second, EIO);
 		}
 		_readOperations.clear();
+		asset->close();
 	}
 }
@@ -3,6 +3,7 @@
 
 #include <atomic>
 #include <map>
+#include <vector>
 #include <sys/stat.h>
 
 #include <boost/asio/deadline_timer.hpp>
@@ -45,11 +46,25 @@ protected:
 	virtual void fill_stat_t(struct stat & s) = 0;
 };
 
+/**
+ * A read from the kernel larger than the server answers at once, assembled from several
+ */
+struct BHReadAssembly {
+	fuse_req_t req;
+	off_t off;
+	std::vector<byte> buf;
+	size_t end; // Of the data filled in, up to the first part read short
+	uint pending;
+	bool failed;
+
+	BHReadAssembly(fuse_req_t req, off_t off, size_t size);
+};
+
 struct BHReadOperation {
 	fuse_req_t req;
 	off_t off;
 	size_t size;
-	uint retries;
+	boost::shared_ptr<BHReadAssembly> assembly; // If part of a larger read
 
 	BHReadOperation();
 	BHReadOperation(fuse_req_t req, off_t off, size_t size);
@@ -74,9 +89,11 @@ public:
 protected:
 	virtual void fill_stat_t(struct stat & s);
 private:
-	void onDataArrived(uint64_t offset, const std::string& data, int tag);
+	void onDataArrived(uint64_t offset, const ByteSlice& data, int tag);
 	void onStatusChanged(const bithorde::AssetStatus& s);
 	void queueRead(const BHReadOperation& read);
+	void reply(const BHReadOperation& read, const ByteSlice& data);
+	void fail(const BHReadOperation& read, int err);
 	void tryRebind();
 	void closeOne();
 private:
@@ -88,7 +105,6 @@ private:
 	bool _connected;
 
 	boost::signals2::scoped_connection _statusConnection;
-	boost::signals2::scoped_connection _dataConnection;
 };
 
 #endif // INODE_H
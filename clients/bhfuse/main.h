@@ -11,7 +11,7 @@
 
 class BHFuse : public BoostAsioFilesystem {
 public:
-	BHFuse(boost::asio::io_service & ioSvc, std::string bithorded, BoostAsioFilesystem_Options & opts);
+	BHFuse(boost::asio::io_service & ioSvc, std::string bithorded, BoostAsioFilesystem_Options & opts, bool sharedMemory);
 
 	virtual int fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
 	virtual void fuse_forget(fuse_ino_t ino, u_long nlookup);
@@ -5,6 +5,7 @@
 #include <list>
 #include <sstream>
 #include <utility>
+#include <vector>
 
 #include "buildconf.hpp"
 
@@ -14,10 +15,11 @@ using namespace std;
 
 using namespace bithorde;
 
-const static size_t BLOCK_SIZE = (64*1024);
+const static size_t SHARED_MEMORY = (2*1024*1024);
+const static size_t MAX_PIN_RATIO = 4; // Most receive-buffer kept alive per byte held
 
 struct OutQueue {
-	typedef pair<uint64_t, string> Chunk;
+	typedef pair<uint64_t, ByteSlice> Chunk; // Keeping its buffer alive, unless copied out
 	uint64_t position;
 	list<Chunk> _stored;
 
@@ -25,10 +27,10 @@ struct OutQueue {
 		position(0)
 	{}
 
-	void send(uint64_t offset, const string& data) {
+	void send(uint64_t offset, const ByteSlice& data) {
 		if (offset <= position) {
 			BOOST_ASSERT(offset == position);
-			_flush(data);
+			_flush(data.data(), data.size());
 			_dequeue();
 		} else {
 			_queue(offset, data);
@@ -36,11 +38,15 @@ struct OutQueue {
 	}
 
 private:
-	void _queue(uint64_t offset, const string& data) {
+	void _queue(uint64_t offset, const ByteSlice& data) {
 		list<Chunk>::iterator pos = _stored.begin();
 		while ((pos != _stored.end()) && (pos->first < offset))
 			pos++;
-		_stored.insert(pos, Chunk(offset, data));
+		// Small chunks would each keep a whole receive-buffer alive while waiting
+		if (data.buffer() && (data.size() * MAX_PIN_RATIO < data.buffer()->capacity))
+			_stored.insert(pos, Chunk(offset, data.copy()));
+		else
+			_stored.insert(pos, Chunk(offset, data));
 	}
 
 	void _dequeue() {
@@ -50,15 +56,14 @@ private:
 				break;
 			} else {
 				BOOST_ASSERT(first.first == position);
-				_flush(first.second);
+				_flush(first.second.data(), first.second.size());
 				_stored.pop_front();
 			}
 		}
 	}
 
-	void _flush(const string& data) {
-		ssize_t datasize = data.size();
-		if (write(1, data.data(), datasize) == datasize)
+	void _flush(const byte* data, ssize_t datasize) {
+		if (write(1, data, datasize) == datasize)
 			position += datasize;
 		else
 			(cerr << "Error: failed to write block" << endl).flush();
@@ -68,9 +73,12 @@ private:
 BHGet::BHGet(po::variables_map& args) :
 	optMyName(args["name"].as<string>()),
 	optQuiet(args.count("quiet")),
+	optSharedMemory(args.count("shared-memory")),
 	optConnectUrl(args["url"].as<string>()),
 	_ioSvc(),
-	_asset(NULL)
+	_asset(NULL),
+	_reader(NULL),
+	_stream(-1)
 {
 }
 
@@ -82,6 +90,8 @@ int BHGet::main(const std::vector<std::string>& args) {
 	}
 
 	_client = Client::create(_ioSvc, optMyName);
+	if (optSharedMemory)
+		_client->useSharedMemory(SHARED_MEMORY);
 	_client->authenticated.connect(boost::bind(&BHGet::onAuthenticated, this, _1));
 	_client->connect(optConnectUrl);
 
@@ -118,6 +128,10 @@ bool BHGet::queueAsset(const std::string& _uri) {
 }
 
 void BHGet::nextAsset() {
+	if (_reader) {
+		delete _reader;
+		_reader = NULL;
+	}
 	if (_asset) {
 		_asset->close();
 		delete _asset;
@@ -137,11 +151,10 @@ void BHGet::nextAsset() {
 
 	_asset = new ReadAsset(_client, ids);
 	_asset->statusUpdate.connect(boost::bind(&BHGet::onStatusUpdate, this, _1));
-	_asset->dataArrived.connect(boost::bind(&BHGet::onDataChunk, this, _1, _2, _3));
 	_client->bind(*_asset);
 
 	_outQueue = new OutQueue();
-	_currentOffset = 0;
+	_stream = -1;
 }
 
 void BHGet::onStatusUpdate(const bithorde::AssetStatus& status)
@@ -150,7 +163,7 @@ void BHGet::onStatusUpdate(const bithorde::AssetStatus& status)
 	case bithorde::SUCCESS:
 		if (status.size() > 0 ) {
 			cerr << "Downloading ..." << endl;
-			requestMore();
+			startReading();
 		} else {
 			cerr << "Zero-sized asset, skipping ..." << endl;
 			nextAsset();
@@ -163,28 +176,50 @@ void BHGet::onStatusUpdate(const bithorde::AssetStatus& status)
 	}
 }
 
-void BHGet::requestMore()
+void BHGet::startReading()
 {
-	while (_currentOffset < (_outQueue->position + (BLOCK_SIZE*10)) &&
-		_currentOffset < _asset->size()) {
-		_asset->aSyncRead(_currentOffset, BLOCK_SIZE);
-		_currentOffset += BLOCK_SIZE;
+	// Servers taking ReadStream push it all, as fast as the connection takes it
+	if (_client->peerServesStreams()) {
+		_asset->dataArrived.connect<BHGet, &BHGet::onStreamChunk>(this);
+		_stream = _asset->aSyncStream(0);
+		if (_stream >= 0)
+			return;
+	}
+
+	_reader = new SequentialReader(*_asset, 0, _asset->size());
+	_reader->dataArrived.connect<BHGet, &BHGet::onDataChunk>(this);
+	_reader->finished.connect(boost::bind(&BHGet::onReadFinished, this, _1));
+	if (!_reader->start()) {
+		cerr << "Error: failed to start reading" << endl;
+		nextAsset();
 	}
 }
 
-void BHGet::onDataChunk(uint64_t offset, const string& data, int tag)
+void BHGet::onStreamChunk(uint64_t offset, const ByteSlice& data, int tag, bithorde::Status status)
 {
-	_outQueue->send(offset, data);
-	if ((data.size() < BLOCK_SIZE) && ((offset+data.size()) < _asset->size())) {
-		 cerr << "Error: got unexpectedly small data-block" << endl;
-	}
-	if (_outQueue->position < _asset->size()) {
-		requestMore();
+	if (tag != _stream)
+		return;
+	if (!data.empty()) {
+		_outQueue->send(offset, data);
 	} else {
+		if (_outQueue->position < _asset->size())
+			cerr << "Error: stream ended early" << endl;
 		nextAsset();
 	}
 }
 
+void BHGet::onDataChunk(uint64_t offset, const ByteSlice& data)
+{
+	_outQueue->send(offset, data);
+}
+
+void BHGet::onReadFinished(bithorde::Status status)
+{
+	if (status != bithorde::SUCCESS)
+		cerr << "Error: failed read (" << bithorde::Status_Name(status) << ")" << endl;
+	_ioSvc.post(boost::bind(&BHGet::nextAsset, this)); // Not from within the reader
+}
+
 void BHGet::onAuthenticated(string& peerName) {
 	cerr << "Connected to "+peerName << endl;
 	cerr.flush();
@@ -202,6 +237,8 @@ int main(int argc, char *argv[]) {
 			"Bithorde-name of this client")
 		("quiet,q",
 			"Don't show progressbar")
+		("shared-memory",
+			"Move a local connection into shared memory. Saves system calls on small reads, but rules out sendfile()")
 		("url,u", po::value< string >()->default_value("/tmp/bithorde"),
 			"Where to connect to bithorde. Either host:port, or /path/socket")
 		("magnet-url", po::value< vector<string> >(), "magnet url(s) to fetch")
@@ -16,6 +16,7 @@ class BHGet {
 	// Options
 	std::string optMyName;
 	bool optQuiet;
+	bool optSharedMemory;
 	std::string optConnectUrl;
 
 	// Internal items
@@ -23,7 +24,8 @@ class BHGet {
 	bithorde::Client::Pointer _client;
 	boost::asio::io_service _ioSvc;
 	bithorde::ReadAsset * _asset;
-	uint64_t _currentOffset;
+	bithorde::SequentialReader * _reader;
+	int _stream; // Tag of the stream pushing the asset, or -1
 	OutQueue * _outQueue;
 public:
 	BHGet(boost::program_options::variables_map &map);
@@ -33,10 +35,12 @@ public:
 private:
 	void onAuthenticated(std::string& peerName);
 	void onStatusUpdate(const bithorde::AssetStatus&);
-	void onDataChunk(uint64_t offset, const std::string& data, int tag);
+	void onStreamChunk(uint64_t offset, const ByteSlice& data, int tag, bithorde::Status status);
+	void onDataChunk(uint64_t offset, const ByteSlice& data);
+	void onReadFinished(bithorde::Status status);
 
 	void nextAsset();
-	void requestMore();
+	void startReading();
 };
 
 #endif
@@ -1,8 +1,10 @@
 
 #include "asset.h"
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <iostream>
+#include <unistd.h>
 
 #include "client.h"
 
@@ -58,9 +60,16 @@ void Asset::handleMessage(const bithorde::AssetStatus & msg)
 
 ReadAsset::ReadAsset(const bithorde::ReadAsset::ClientPointer& client, const BitHordeIds& requestIds) :
 	Asset(client),
-	_requestIds(requestIds)
+	_requestIds(requestIds),
+	_retryPolicy(),
+	_localFile(-1)
 {}
 
+ReadAsset::~ReadAsset()
+{
+	clearLocalFile();
+}
+
 const BitHordeIds& ReadAsset::requestIds() const
 {
 	return _requestIds;
@@ -75,38 +84,156 @@ void ReadAsset::handleMessage(const bithorde::AssetStatus &msg)
 			// TODO: Application::instance().logger().warning("Peer tried to change asset-size.");
 		}
 	}
+	if (msg.status() != bithorde::SUCCESS)
+		clearLocalFile();
 	Asset::handleMessage(msg);
 }
 
-void ReadAsset::handleMessage(const bithorde::Read::Response &msg) {
+void ReadAsset::handleMessage(const bithorde::Read::Response &msg, const ByteSlice& content) {
 	if (msg.status() == bithorde::SUCCESS) {
-		dataArrived(msg.offset(), msg.content(), msg.reqid());
+		dataArrived(msg.offset(), content, msg.reqid(), msg.status());
 	} else {
-		cerr << "Error: failed read, " << msg.status() << endl;
-		string nil;
-		dataArrived(msg.offset(), nil, msg.reqid());
+		if (msg.status() != bithorde::NONE) // Streams end with NONE
+			cerr << "Error: failed read, " << msg.status() << endl;
+		dataArrived(msg.offset(), ByteSlice(), msg.reqid(), msg.status());
 	}
-	_client->releaseRPCRequest(msg.reqid());
 }
 
-int ReadAsset::aSyncRead(uint64_t offset, ssize_t size)
+int ReadAsset::aSyncRead(uint64_t offset, ssize_t size, int timeout)
 {
 	if (!_client || !_client->isConnected())
 		return -1;
 	int reqId = _client->allocRPCRequest(_handle);
+	if (reqId < 0)
+		return -1;
+	_client->expectRange(reqId, offset);
 	int64_t maxSize = _size - offset;
 	if (size > maxSize)
 		size = maxSize;
+	if ((size > 0) && readLocal(reqId, offset, size))
+		return reqId;
 	bithorde::Read_Request req;
 	req.set_handle(_handle);
 	req.set_reqid(reqId);
 	req.set_offset(offset);
 	req.set_size(size);
-	req.set_timeout(4000);
-	_client->sendMessage(Connection::ReadRequest, req);
+	req.set_timeout((timeout < 0) ? _retryPolicy.timeout : timeout);
+	if (!_client->sendMessage(Connection::ReadRequest, req)) {
+		_client->releaseRPCRequest(reqId);
+		return -1;
+	}
+	_client->retryRPCRequest(req, _retryPolicy);
+	return reqId;
+}
+
+int ReadAsset::aSyncReadV(const vector<Range>& ranges, int timeout)
+{
+	if (!_client || !_client->isConnected() || !_client->peerServesVectoredReads())
+		return -1;
+	if (ranges.empty() || (ranges.size() > Connection::MAX_RANGES))
+		return -1;
+	int reqId = _client->allocRPCRequest(_handle, ranges.size());
+	if (reqId < 0)
+		return -1;
+	bithorde::ReadV req;
+	req.set_handle(_handle);
+	req.set_reqid(reqId);
+	req.set_timeout((timeout < 0) ? _retryPolicy.timeout : timeout);
+	for (auto iter = ranges.begin(); iter != ranges.end(); iter++) {
+		uint64_t offset = iter->first;
+		int64_t size = iter->second;
+		_client->expectRange(reqId, offset);
+		int64_t maxSize = _size - offset;
+		if (size > maxSize)
+			size = max(maxSize, (int64_t)0);
+		if ((size > 0) && readLocal(reqId, offset, size))
+			continue;
+		auto range = req.add_ranges();
+		range->set_offset(offset);
+		range->set_size(size);
+	}
+	if (!req.ranges_size())
+		return reqId;
+	if (!_client->sendMessage(Connection::ReadV, req)) {
+		_client->releaseRPCRequest(reqId);
+		return -1;
+	}
+	_client->timeRPCRequest(reqId, req.timeout());
 	return reqId;
 }
 
+int ReadAsset::aSyncStream(uint64_t offset, uint64_t size)
+{
+	if (!_client || !_client->isConnected() || !_client->peerServesStreams())
+		return -1;
+	int reqId = _client->allocRPCRequest(_handle, 0, true);
+	if (reqId < 0)
+		return -1;
+	bithorde::ReadStream req;
+	req.set_handle(_handle);
+	req.set_reqid(reqId);
+	req.set_offset(offset);
+	if (size)
+		req.set_size(size);
+	if (!_client->sendMessage(Connection::ReadStream, req)) {
+		_client->releaseRPCRequest(reqId);
+		return -1;
+	}
+	return reqId;
+}
+
+bool ReadAsset::cancel(int tag)
+{
+	if (!_client || !_client->cancelRPCRequest(_handle, tag))
+		return false;
+	bithorde::Read::Cancel req;
+	req.set_reqid(tag);
+	_client->sendMessage(Connection::ReadCancel, req);
+	return true;
+}
+
+void ReadAsset::setLocalFile(int fd, const bithorde::LocalFile& msg)
+{
+	clearLocalFile();
+	_localFile = fd;
+	for (auto iter = msg.verified().begin(); iter != msg.verified().end(); iter++)
+		_localRanges.push_back(make_pair(iter->offset(), iter->offset() + iter->size()));
+}
+
+void ReadAsset::clearLocalFile()
+{
+	if (_localFile >= 0)
+		::close(_localFile);
+	_localFile = -1;
+	_localRanges.clear();
+}
+
+bool ReadAsset::readLocal(int reqId, uint64_t offset, size_t size)
+{
+	if (_localFile < 0)
+		return false;
+	auto range = _localRanges.begin();
+	while ((range != _localRanges.end()) && !((range->first <= offset) && (offset + size <= range->second)))
+		range++;
+	if (range == _localRanges.end())
+		return false;
+
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	buf->grow(size);
+	ssize_t read = pread(_localFile, buf->ptr, size, offset);
+	if (read != (ssize_t)size)
+		return false; // Let the server sort it out
+	buf->charge(size);
+
+	// Delivered like a response from the server, never from within aSyncRead()
+	bithorde::Read::Response resp;
+	resp.set_reqid(reqId);
+	resp.set_status(bithorde::SUCCESS);
+	resp.set_offset(offset);
+	_client->ioService().post(boost::bind(&Client::onLocalRead, _client, resp, ByteSlice(buf, 0, size)));
+	return true;
+}
+
 UploadAsset::UploadAsset(const bithorde::Asset::ClientPointer& client, uint64_t size)
 	: Asset(client)
 {
@@ -122,6 +249,8 @@ UploadAsset::UploadAsset(const bithorde::Asset::ClientPointer& client, const boo
 bool UploadAsset::tryWrite(uint64_t offset, byte* data, size_t amount)
 {
 	BOOST_ASSERT(isBound());
+	if (!_client->sendCredit(Connection::DataSegment))
+		return false; // Wait for the client to become writable again
 	bithorde::DataSegment msg;
 	msg.set_handle(_handle);
 	msg.set_offset(offset);
@@ -134,6 +263,6 @@ const fs::path& UploadAsset::link()
 	return _linkPath;
 }
 
-void UploadAsset::handleMessage(const bithorde::Read::Response&) {
+void UploadAsset::handleMessage(const bithorde::Read::Response&, const ByteSlice&) {
 	BOOST_ASSERT(false);
 }
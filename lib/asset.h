@@ -11,6 +11,7 @@
 #include <boost/signals2.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include "callback.h"
 #include "hashes.h"
 #include "bithorde.pb.h"
 #include "types.h"
@@ -40,6 +41,7 @@ public:
 
 	bool isBound();
 	uint64_t size();
+	const ClientPointer& client() const { return _client; }
 
 	typedef boost::signals2::signal<void (const bithorde::AssetStatus&)> StatusSignal;
 	typedef boost::signals2::signal<void ()> VoidSignal;
@@ -54,12 +56,13 @@ protected:
 	int64_t _size;
 
 	virtual void handleMessage(const bithorde::AssetStatus &msg);
-	virtual void handleMessage(const bithorde::Read::Response &msg) = 0;
+	virtual void handleMessage(const bithorde::Read::Response &msg, const ByteSlice& content) = 0;
 };
 
 static boost::arg<1> ASSET_ARG_OFFSET;
 static boost::arg<2> ASSET_ARG_DATA;
 static boost::arg<3> ASSET_ARG_TAG;
+static boost::arg<4> ASSET_ARG_READ_STATUS;
 
 class ReadAsset : public Asset, boost::noncopyable
 {
@@ -68,21 +71,89 @@ public:
 	typedef boost::shared_ptr<ReadAsset> Ptr;
 
 	typedef std::pair<bithorde::HashType, std::string> Identifier;
+	typedef std::pair<uint64_t, size_t> Range; // offset, size
+
+	static const int DEFAULT_TIMEOUT = 4000; // Milliseconds the peer keeps trying to read
+
+	/**
+	 * How long single reads are waited for, and how often they are retried when they fail
+	 * or time out. Before each retry, a random wait of half to all of the backoff, which
+	 * doubles for every retry up to maxBackoff.
+	 */
+	struct RetryPolicy {
+		int timeout; // Milliseconds for each try, on top of the round-trip
+		int retries;
+		int backoff; // Milliseconds
+		int maxBackoff;
+		RetryPolicy(int timeout=DEFAULT_TIMEOUT, int retries=2, int backoff=100, int maxBackoff=2000) :
+			timeout(timeout), retries(retries), backoff(backoff), maxBackoff(maxBackoff)
+		{}
+	};
 
 	explicit ReadAsset(const bithorde::ReadAsset::ClientPointer& client, const BitHordeIds& requestIds);
+	virtual ~ReadAsset();
+
+	/**
+	 * Requests /size/ bytes at /offset/, delivered through dataArrived, retried by the
+	 * retry policy until it succeeds or runs out of retries. Each try may take /timeout/
+	 * milliseconds, or the timeout of the policy if negative. Ranges the server passed a
+	 * LocalFile for are read straight from the file, but still delivered later.
+	 *
+	 * @return the tag of the request, or -1 on failure
+	 */
+	int aSyncRead(uint64_t offset, ssize_t size, int timeout=-1);
+
+	/**
+	 * Requests several ranges in a single ReadV, if the peer serves them. Each range is
+	 * delivered through dataArrived on its own, all with the same tag. Ranges not in by
+	 * /timeout/, like for aSyncRead(), are delivered as TIMEOUT, but are not retried.
+	 *
+	 * @return the tag of the request, or -1 if the peer does not serve ReadV, there are
+	 *         more than Connection::MAX_RANGES ranges, or on failure
+	 */
+	int aSyncReadV(const std::vector<Range>& ranges, int timeout=-1);
+
+	/**
+	 * Asks the peer to push /size/ bytes from /offset/, or up to the end if /size/ is 0,
+	 * as fast as the connection takes them. The content is delivered through dataArrived
+	 * in any order, and the end of the stream as an empty slice, all with the same tag.
+	 *
+	 * @return the tag of the stream, or -1 if the peer does not serve streams, or on failure
+	 */
+	int aSyncStream(uint64_t offset, uint64_t size=0);
+
+	/**
+	 * Abandons the read, ReadV or stream of /tag/, so the peer stops serving it. Nothing
+	 * more is delivered for it, though the tag stays in use until the peer has confirmed.
+	 *
+	 * @return false if /tag/ is no pending request of this asset
+	 */
+	bool cancel(int tag);
 
-	int aSyncRead(uint64_t offset, ssize_t size);
 	const BitHordeIds & requestIds() const;
 
-	typedef boost::signals2::signal<void (uint64_t offset, const std::string& data, int tag)> DataSignal;
-	DataSignal dataArrived;
+	const RetryPolicy& retryPolicy() const { return _retryPolicy; }
+	void setRetryPolicy(const RetryPolicy& policy) { _retryPolicy = policy; }
+
+	// Failed reads are delivered with empty data, and the status they failed with
+	typedef Callback<void (uint64_t offset, const ByteSlice& data, int tag, bithorde::Status status)> DataCallback;
+	DataCallback dataArrived;
 
 protected:
 	virtual void handleMessage(const bithorde::AssetStatus &msg);
-	virtual void handleMessage(const bithorde::Read::Response &msg);
+	virtual void handleMessage(const bithorde::Read::Response &msg, const ByteSlice& content);
 
 private:
+	friend class Client;
+
+	void setLocalFile(int fd, const bithorde::LocalFile& msg);
+	void clearLocalFile();
+	bool readLocal(int reqId, uint64_t offset, size_t size);
+
 	BitHordeIds _requestIds;
+	RetryPolicy _retryPolicy;
+	int _localFile;
+	std::vector< std::pair<uint64_t, uint64_t> > _localRanges; // Verified [start, end) of _localFile
 };
 
 class UploadAsset : public Asset
@@ -96,7 +167,7 @@ public:
 	const boost::filesystem::path& link();
 
 protected:
-	virtual void handleMessage(const bithorde::Read::Response &msg);
+	virtual void handleMessage(const bithorde::Read::Response &msg, const ByteSlice& content);
 };
 
 }
@@ -1,9 +1,11 @@
 #ifndef LIBBITHORDE_H
 #define LIBBITHORDE_H
 
+#include "allocator.h"
 #include "asset.h"
 #include "client.h"
 #include "hashes.h"
 #include "magneturi.h"
+#include "sequentialreader.h"
 
 #endif // LIBBITHORDE_H
@@ -0,0 +1,69 @@
+#ifndef BITHORDE_CALLBACK_H
+#define BITHORDE_CALLBACK_H
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace bithorde {
+
+template <typename Signature> class Callback;
+
+/**
+ * Single-slot stand-in for a signals2::signal, for events fired on every message or chunk,
+ * where the locking and slot-list bookkeeping of a signal costs more than the handler.
+ * Connecting a handler replaces the one before. A member-function given as template
+ * argument is called straight through a function pointer, any other handler through a
+ * boost::function. Neither allocates when called. Unlike signals2, nothing is thread-safe.
+ *
+ * A handler may disconnect itself while being called, but not connect another.
+ */
+template <typename... Args>
+class Callback<void (Args...)> : boost::noncopyable {
+public:
+	typedef boost::function<void (Args...)> Function;
+
+	Callback() : _obj(NULL), _call(NULL) {}
+
+	/**
+	 * Calls /Method/ on /obj/, which must stay alive until disconnected
+	 */
+	template <typename T, void (T::*Method)(Args...)>
+	void connect(T* obj) {
+		_obj = obj;
+		_call = &callMethod<T, Method>;
+	}
+
+	void connect(const Function& function) {
+		_function = function;
+		_obj = &_function;
+		_call = function ? &callFunction : NULL;
+	}
+
+	void disconnect() { _call = NULL; }
+	bool connected() const { return _call != NULL; }
+
+	void operator()(Args... args) const {
+		if (_call)
+			_call(_obj, args...);
+	}
+
+private:
+	typedef void (*Trampoline)(void* obj, Args... args);
+
+	template <typename T, void (T::*Method)(Args...)>
+	static void callMethod(void* obj, Args... args) {
+		(static_cast<T*>(obj)->*Method)(args...);
+	}
+
+	static void callFunction(void* obj, Args... args) {
+		(*static_cast<Function*>(obj))(args...);
+	}
+
+	void* _obj;
+	Trampoline _call;
+	Function _function; // Kept when disconnected, in case it is the one being called
+};
+
+}
+
+#endif // BITHORDE_CALLBACK_H
@@ -1,5 +1,6 @@
 #include "client.h"
 
+#include <algorithm>
 #include <boost/asio/placeholders.hpp>
 #include <boost/assert.hpp>
 #include <boost/bind.hpp>
@@ -8,6 +9,7 @@
 #include <boost/regex.hpp>
 #include <iostream>
 #include <string.h>
+#include <unistd.h>
 
 #include "random.h"
 
@@ -18,11 +20,13 @@ namespace asio = boost::asio;
 
 using namespace bithorde;
 
+const size_t Client::MAX_DEFERRED;
+
 AssetBinding::AssetBinding(Client* client, Asset* asset, Asset::Handle handle) :
 	_client(client),
 	_asset(asset),
 	_handle(handle),
-	_statusTimer(client->_ioSvc)
+	_statusTimer(client->_timers, boost::bind(&AssetBinding::onTimeout, this))
 {
 	setTimer(DEFAULT_ASSET_TIMEOUT*2); // TODO: Get from actual timeout value
 }
@@ -45,8 +49,7 @@ void AssetBinding::close()
 
 void AssetBinding::setTimer(const boost::posix_time::time_duration& timeout)
 {
-	_statusTimer.expires_from_now(timeout);
-	_statusTimer.async_wait(boost::bind(&AssetBinding::onTimeout, this, boost::asio::placeholders::error));
+	_statusTimer.arm(timeout);
 }
 
 void AssetBinding::clearTimer()
@@ -54,10 +57,8 @@ void AssetBinding::clearTimer()
 	_statusTimer.cancel();
 }
 
-void AssetBinding::onTimeout(const boost::system::error_code& error)
+void AssetBinding::onTimeout()
 {
-	if (error)
-		return;
 	if (_asset) {
 		bithorde::AssetStatus msg;
 		msg.set_status(bithorde::Status::TIMEOUT);
@@ -69,22 +70,38 @@ void AssetBinding::onTimeout(const boost::system::error_code& error)
 
 Client::Client(asio::io_service& ioSvc, string myName) :
 	_ioSvc(ioSvc),
+	_timers(asio::use_service<TimerWheel>(ioSvc)),
 	_connection(),
 	_myName(myName),
-	_handleAllocator(1),
-	_rpcIdAllocator(1),
-	_protoVersion(0)
+	_protoVersion(0),
+	_peerLocalFiles(false),
+	_peerReadV(false),
+	_peerReadStream(false),
+	_peerBindBatch(false),
+	_peerStatusBatch(false),
+	_sharedMemory(0),
+	_maxChunk(Connection::MAX_CHUNK),
+	_peerMaxChunk(Connection::DEFAULT_CHUNK),
+	_deferredCount(0),
+	_readPaused(false),
+	_sendBacklogged(false)
+{
+}
+
+Client::~Client()
 {
+	if (_connection)
+		_connection->message.disconnect();
+	clearRPCRequests();
 }
 
 void Client::connect(Connection::Pointer newConn) {
 	BOOST_ASSERT(!_connection);
 
-	_rpcIdAllocator.reset();
 	_connection = newConn;
 
-	_messageConnection = _connection->message.connect(Connection::MessageSignal::slot_type(&Client::onIncomingMessage, this, _1, _2));
-	_writableConnection = _connection->writable.connect(writable);
+	_connection->message.connect<Client, &Client::onIncomingMessage>(this);
+	_writableConnection = _connection->writable.connect(Connection::VoidSignal::slot_type(&Client::onWritable, this));
 	_disconnectedConnection = _connection->disconnected.connect(Connection::VoidSignal::slot_type(&Client::onDisconnected, this));
 
 	sayHello();
@@ -118,16 +135,35 @@ void Client::connect(string spec) {
 }
 
 void Client::onDisconnected() {
+	if (_connection) {
+		_pastStats += _connection->stats();
+		_connection->message.disconnect();
+	}
 	_connection.reset();
-	for (auto iter=_assetMap.begin(); iter != _assetMap.end(); iter++) {
-		ReadAsset* asset = iter->second->readAsset();
+	for (size_t i = 0; i < Connection::Auto; i++)
+		_deferred[i].clear();
+	_deferredCount = 0;
+	_readPaused = false;
+	_sendBacklogged = false;
+	_peerLocalFiles = false;
+	_peerReadV = false;
+	_peerReadStream = false;
+	_peerBindBatch = false;
+	_peerStatusBatch = false;
+	_peerMaxChunk = Connection::DEFAULT_CHUNK;
+	_roundTrip.reset();
+	failRPCRequests(bithorde::DISCONNECTED); // Never to be answered
+	auto handles = _assetMap.keys();
+	for (auto iter=handles.begin(); iter != handles.end(); iter++) {
+		AssetPtr& binding = *_assetMap.find(*iter);
+		ReadAsset* asset = binding->readAsset();
 		if (asset) {
 			bithorde::AssetStatus s;
 			s.set_status(bithorde::DISCONNECTED);
 			asset->statusUpdate(s);
 		} else {
-			_handleAllocator.free(iter->first);
-			_assetMap.erase(iter);
+			binding.reset();
+			_assetMap.free(*iter);
 		}
 	}
 	disconnected();
@@ -143,33 +179,166 @@ const std::string& Client::peerName()
 	return _peerName;
 }
 
+Connection::Stats Client::stats() const
+{
+	Connection::Stats res(_pastStats);
+	if (_connection)
+		res += _connection->stats();
+	return res;
+}
+
 bool Client::sendMessage(Connection::MessageType type, const::google::protobuf::Message &msg)
 {
-	BOOST_ASSERT(_connection);
+	return sendMessage(type, msg, ByteSlice());
+}
+
+bool Client::sendMessage(Connection::MessageType type, const::google::protobuf::Message &msg, const ByteSlice& payload)
+{
+	if (!_connection)
+		return false;
+	if (sendCredit(type))
+		return _connection->sendMessage(type, msg, payload);
+	defer(type, msg, payload, FileSlice());
+	return true;
+}
+
+bool Client::sendMessage(Connection::MessageType type, const::google::protobuf::Message &msg, const FileSlice& payload)
+{
+	if (!_connection)
+		return false;
+	if (sendCredit(type))
+		return _connection->sendMessage(type, msg, payload);
+	defer(type, msg, ByteSlice(), payload);
+	return true;
+}
+
+bool Client::sendMessage(Connection::MessageType type, const::google::protobuf::Message &msg, const Descriptor& fd)
+{
+	if (!(_connection && _connection->passesDescriptors()))
+		return false;
+	if (sendCredit(type))
+		return _connection->sendMessage(type, msg, fd);
+	defer(type, msg, ByteSlice(), FileSlice(), fd);
+	return true;
+}
+
+size_t Client::chunkSize() const
+{
+	return min(_maxChunk, _peerMaxChunk);
+}
 
-	return _connection->sendMessage(type, msg);
+size_t Client::sendCredit(Connection::MessageType type) const
+{
+	if (_connection && _deferred[Connection::defaultPriority(type)].empty())
+		return _connection->sendCredit(type);
+	else
+		return 0;
+}
+
+void Client::defer(Connection::MessageType type, const::google::protobuf::Message& msg, const ByteSlice& payload, const FileSlice& file, const Descriptor& attached)
+{
+	DeferredMessage deferred;
+	deferred.type = type;
+	deferred.msg.reset(msg.New());
+	deferred.msg->CopyFrom(msg);
+	deferred.payload = payload;
+	deferred.file = file;
+	deferred.attached = attached;
+	_deferred[Connection::defaultPriority(type)].push_back(deferred);
+	// The peer keeps asking for more than it takes, stop listening until it catches up
+	if ((++_deferredCount >= MAX_DEFERRED) && !_sendBacklogged) {
+		_sendBacklogged = true;
+		_connection->pauseRead();
+	}
+}
+
+bool Client::trySend(const DeferredMessage& msg)
+{
+	if (!_connection->sendCredit(msg.type))
+		return false;
+	if (msg.file.size)
+		_connection->sendMessage(msg.type, *msg.msg, msg.file);
+	else if (msg.attached.fd >= 0)
+		_connection->sendMessage(msg.type, *msg.msg, msg.attached);
+	else
+		_connection->sendMessage(msg.type, *msg.msg, msg.payload);
+	return true;
+}
+
+void Client::drainDeferred(std::deque<DeferredMessage>& deferred)
+{
+	while (!deferred.empty() && trySend(deferred.front())) {
+		deferred.pop_front();
+		_deferredCount--;
+	}
+}
+
+void Client::onWritable()
+{
+	// In class order, each held back only by its own credit
+	for (size_t i = 0; (i < Connection::Auto) && _connection; i++)
+		drainDeferred(_deferred[i]);
+	if (_sendBacklogged && (_deferredCount < MAX_DEFERRED / 2)) {
+		_sendBacklogged = false;
+		if (_connection && !_readPaused)
+			_connection->resumeRead();
+	}
+	writable();
+}
+
+void Client::pauseRead()
+{
+	_readPaused = true;
+	if (_connection)
+		_connection->pauseRead();
+}
+
+void Client::resumeRead()
+{
+	_readPaused = false;
+	if (_connection && !_sendBacklogged)
+		_connection->resumeRead();
 }
 
 void Client::sayHello() {
 	bithorde::HandShake h;
 	h.set_protoversion(2);
 	h.set_name(_myName);
+	if (_connection->passesDescriptors())
+		h.set_localfiles(true);
+	if (_connection->supportsSharedMemory() && !_sharedMemory)
+		h.set_sharedmemory(true);
+	h.set_maxchunk(_maxChunk);
+	if (servesVectoredReads())
+		h.set_readv(true);
+	if (servesStreams())
+		h.set_readstream(true);
+	if (servesBindBatches())
+		h.set_bindbatch(true);
+	h.set_statusbatch(true);
 
 	sendMessage(Connection::HandShake, h);
 }
 
-void Client::onIncomingMessage(Connection::MessageType type, ::google::protobuf::Message& msg)
+void Client::onIncomingMessage(Connection::MessageType type, ::google::protobuf::Message& msg, const ByteSlice& payload)
 {
 	switch (type) {
 	case Connection::HandShake: return onMessage((bithorde::HandShake&) msg);
 	case Connection::BindRead: return onMessage((bithorde::BindRead&) msg);
 	case Connection::AssetStatus: return onMessage((bithorde::AssetStatus&) msg);
 	case Connection::ReadRequest: return onMessage((bithorde::Read::Request&) msg);
-	case Connection::ReadResponse: return onMessage((bithorde::Read::Response&) msg);
+	case Connection::ReadResponse: return onMessage((bithorde::Read::Response&) msg, payload);
 	case Connection::BindWrite: return onMessage((bithorde::BindWrite&) msg);
-	case Connection::DataSegment: return onMessage((bithorde::DataSegment&) msg);
+	case Connection::DataSegment: return onMessage((bithorde::DataSegment&) msg, payload);
 	case Connection::HandShakeConfirmed: return onMessage((bithorde::HandShakeConfirmed&) msg);
 	case Connection::Ping: return onMessage((bithorde::Ping&) msg);
+	case Connection::LocalFile: return onMessage((bithorde::LocalFile&) msg);
+	case Connection::SharedMemory: return; // Handled by the connection itself
+	case Connection::ReadV: return onMessage((bithorde::ReadV&) msg);
+	case Connection::ReadStream: return onMessage((bithorde::ReadStream&) msg);
+	case Connection::ReadCancel: return onMessage((bithorde::Read::Cancel&) msg);
+	case Connection::BindBatch: return onMessage((bithorde::BindBatch&) msg);
+	case Connection::AssetStatusBatch: return onMessage((bithorde::AssetStatusBatch&) msg);
 	}
 }
 
@@ -179,22 +348,37 @@ void Client::onMessage(const bithorde::HandShake &msg)
 		_protoVersion = 2;
 	} else {
 		cerr << "Only Protocol-version 2 or higer supported" << endl;
-		_connection->close();
+		_connection->close(); // Detaches from the connection, through onDisconnected()
 		_connection.reset();
 		return;
 	}
 
 	_peerName = msg.name();
+	_peerLocalFiles = msg.localfiles() && _connection->passesDescriptors();
+	_peerReadV = msg.readv();
+	_peerReadStream = msg.readstream();
+	_peerBindBatch = msg.bindbatch();
+	_peerStatusBatch = msg.statusbatch();
+	if (msg.maxchunk())
+		_peerMaxChunk = min((size_t)msg.maxchunk(), (size_t)Connection::MAX_CHUNK);
+	else
+		_peerMaxChunk = Connection::DEFAULT_CHUNK;
+	if (_sharedMemory && msg.sharedmemory())
+		_connection->offerSharedMemory(_sharedMemory);
 
 	if (msg.has_challenge()) {
 		cerr << "Challenge required" << endl;
 		// Setup encryption
 	} else {
-		for (auto iter = _assetMap.begin(); iter != _assetMap.end(); iter++) {
-			ReadAsset* asset = iter->second->readAsset();
-			BOOST_ASSERT(asset);
-			informBound(*iter->second, rand64(), DEFAULT_ASSET_TIMEOUT.total_milliseconds());
+		auto handles = _assetMap.keys();
+		vector<const AssetBinding*> bindings;
+		bindings.reserve(handles.size());
+		for (auto iter = handles.begin(); iter != handles.end(); iter++) {
+			AssetBinding& binding = **_assetMap.find(*iter);
+			BOOST_ASSERT(binding.readAsset());
+			bindings.push_back(&binding);
 		}
+		informBound(bindings, DEFAULT_ASSET_TIMEOUT.total_milliseconds());
 			
 		authenticated(_peerName);
 	}
@@ -208,18 +392,29 @@ void Client::onMessage(bithorde::BindRead & msg) {
 	sendMessage(bithorde::Connection::AssetStatus, resp);
 }
 
+void Client::onMessage(bithorde::BindBatch& msg) {
+	for (int i=0; i < msg.binds_size(); i++)
+		onMessage(*msg.mutable_binds(i));
+}
+
+void Client::onMessage(const bithorde::AssetStatusBatch& msg) {
+	for (int i=0; i < msg.statuses_size(); i++)
+		onMessage(msg.statuses(i));
+}
+
 void Client::onMessage(const bithorde::AssetStatus & msg) {
 	if (!msg.has_handle())
 		return;
 	Asset::Handle handle = msg.handle();
-	if (_assetMap.count(handle)) {
-		AssetBinding& a = *_assetMap[handle];
+	AssetPtr* binding = _assetMap.find(handle);
+	if (binding) {
+		AssetBinding& a = **binding;
 		a.clearTimer();
 		if (a) {
 			a->handleMessage(msg);
 		} else if (msg.status() != bithorde::Status::SUCCESS) {
-			_assetMap.erase(handle);
-			_handleAllocator.free(handle);
+			binding->reset();
+			_assetMap.free(handle);
 		} else {
 			cerr << "WARNING: Status OK recieved for Asset supposedly closed or re-written." << endl;
 		}
@@ -236,18 +431,88 @@ void Client::onMessage(const bithorde::Read::Request & msg) {
 	sendMessage(bithorde::Connection::ReadResponse, resp);
 }
 
-void Client::onMessage(const bithorde::Read::Response & msg) {
-	if (_requestIdMap.count(msg.reqid())) {
-		Asset::Handle assetHandle = _requestIdMap[msg.reqid()];
-		releaseRPCRequest(msg.reqid());
-		if (_assetMap.count(assetHandle)) {
-			Asset* a = _assetMap[assetHandle]->asset();
-			a->handleMessage(msg);
+void Client::onMessage(const bithorde::ReadV & msg) {
+	cerr << "unsupported: handling ReadV-Requests" << endl;
+	bithorde::Read::Response resp;
+	resp.set_reqid(msg.reqid());
+	resp.set_status(ERROR);
+	for (int i=0; i < msg.ranges_size(); i++)
+		sendMessage(bithorde::Connection::ReadResponse, resp);
+}
+
+void Client::onMessage(const bithorde::ReadStream & msg) {
+	cerr << "unsupported: handling ReadStream-Requests" << endl;
+	bithorde::Read::Response resp;
+	resp.set_reqid(msg.reqid());
+	resp.set_status(ERROR);
+	sendMessage(bithorde::Connection::ReadResponse, resp);
+}
+
+void Client::onMessage(const bithorde::Read::Cancel & msg) {
+	// Every request was answered right away
+}
+
+void Client::onMessage(const bithorde::Read::Response & msg, const ByteSlice& content) {
+	RPCRequest* found = _requestIdMap.find(msg.reqid());
+	if (!found) {
+		cerr << "WARNING: ReadResponse with unknown requestId" << endl;
+		return;
+	}
+	RPCRequest& req = *found;
+	int reqId = req.reqId;
+	Asset::Handle assetHandle = req.asset;
+	if (!req.sent.is_not_a_date_time())
+		timeRoundTrip(req);
+	bool last = req.stream ? (msg.status() != bithorde::SUCCESS) : !--req.responses;
+	bool deliver = !req.cancelled && !req.delivered;
+	if (deliver && req.read.has_reqid()) {
+		if (msg.status() == bithorde::SUCCESS) {
+			req.delivered = true;
+			req.backingOff = false; // An earlier try made it after all
+		} else if (!last || req.backingOff) {
+			deliver = false; // A try already given up on
+		} else if ((msg.status() != bithorde::NONE) && (req.retry.retries > 0)) {
+			deliver = false;
+			backOff(req);
 		} else {
-			cerr << "WARNING: ReadResponse " << msg.reqid() << msg.has_reqid() << " for unmapped handle" << endl;
+			req.delivered = true;
 		}
+	}
+	if (req.backingOff)
+		last = false; // Another try is coming
+	else if (req.delivered && req.timer)
+		req.timer->cancel();
+	bool timedOut = req.timedOut && (msg.status() == bithorde::NONE);
+	if (deliver && !req.stream) {
+		// Failures need not carry the offset, so any range left stands for it
+		auto offset = find(req.offsets.begin(), req.offsets.end(), msg.offset());
+		if (offset != req.offsets.end())
+			req.offsets.erase(offset);
+		else if (!req.offsets.empty())
+			req.offsets.pop_back();
+	}
+	if (last)
+		releaseRPCRequest(reqId);
+	if (!deliver) {
+		return;
+	} else if (timedOut) {
+		bithorde::Read::Response resp(msg);
+		resp.set_status(bithorde::TIMEOUT);
+		deliverRead(assetHandle, resp, content);
 	} else {
-		cerr << "WARNING: ReadResponse with unknown requestId" << endl;
+		deliverRead(assetHandle, msg, content);
+	}
+}
+
+void Client::deliverRead(Asset::Handle assetHandle, const bithorde::Read::Response& msg, const ByteSlice& content)
+{
+	AssetPtr* binding = _assetMap.find(assetHandle);
+	if (binding) {
+		Asset* a = (*binding)->asset();
+		if (a) // Not closed while waiting
+			a->handleMessage(msg, content);
+	} else {
+		cerr << "WARNING: ReadResponse " << msg.reqid() << msg.has_reqid() << " for unmapped handle" << endl;
 	}
 }
 
@@ -258,7 +523,7 @@ void Client::onMessage(const bithorde::BindWrite & msg) {
 	resp.set_status(ERROR);
 	sendMessage(bithorde::Connection::AssetStatus, resp);
 }
-void Client::onMessage(const bithorde::DataSegment & msg) {
+void Client::onMessage(const bithorde::DataSegment & msg, const ByteSlice& content) {
 	cerr << "unsupported: handling DataSegment-pushes" << endl;
 	_connection->close();
 }
@@ -268,7 +533,25 @@ void Client::onMessage(const bithorde::HandShakeConfirmed & msg) {
 }
 void Client::onMessage(const bithorde::Ping & msg) {
 	bithorde::Ping reply;
-	_connection->sendMessage(Connection::Ping, reply);
+	sendMessage(Connection::Ping, reply);
+}
+
+void Client::onMessage(const bithorde::LocalFile & msg) {
+	int fd = _connection->takeDescriptor();
+	if (fd < 0)
+		return;
+	ReadAsset* asset = NULL;
+	if (AssetPtr* binding = _assetMap.find(msg.handle()))
+		asset = (*binding)->readAsset();
+	if (asset)
+		asset->setLocalFile(fd, msg);
+	else
+		::close(fd);
+}
+
+void Client::onLocalRead(const bithorde::Read::Response& msg, const ByteSlice& content)
+{
+	onMessage(msg, content);
 }
 
 bool Client::bind(ReadAsset &asset) {
@@ -276,16 +559,30 @@ bool Client::bind(ReadAsset &asset) {
 }
 
 bool Client::bind(ReadAsset& asset, uint64_t uuid, int timeout) {
+	return informBound(allocBinding(asset), uuid, timeout);
+}
+
+size_t Client::bind(const vector<ReadAsset*>& assets) {
+	return bind(assets, DEFAULT_ASSET_TIMEOUT.total_milliseconds());
+}
+
+size_t Client::bind(const vector<ReadAsset*>& assets, int timeout) {
+	vector<const AssetBinding*> bindings;
+	bindings.reserve(assets.size());
+	for (auto iter = assets.begin(); iter != assets.end(); iter++)
+		bindings.push_back(&allocBinding(**iter));
+	return informBound(bindings, timeout);
+}
+
+AssetBinding& Client::allocBinding(ReadAsset& asset) {
 	if (!asset.isBound()) {
 		BOOST_ASSERT(asset._handle < 0);
 		BOOST_ASSERT(asset.requestIds().size() > 0);
-		asset._handle = _handleAllocator.allocate();
+		asset._handle = _assetMap.allocate();
 		BOOST_ASSERT(asset._handle > 0);
-		BOOST_ASSERT(_assetMap.count(asset._handle) == 0);
-		_assetMap[asset._handle].reset(new AssetBinding(this, &asset, asset._handle));
+		_assetMap.find(asset._handle)->reset(new AssetBinding(this, &asset, asset._handle));
 	}
-
-	return informBound(*_assetMap[asset._handle], uuid, timeout);
+	return **_assetMap.find(asset._handle);
 }
 
 bool Client::bind(UploadAsset & asset)
@@ -293,23 +590,23 @@ bool Client::bind(UploadAsset & asset)
 	BOOST_ASSERT(asset._client.get() == this);
 	BOOST_ASSERT(asset._handle < 0);
 	BOOST_ASSERT(asset.size() > 0);
-	asset._handle = _handleAllocator.allocate();
-	_assetMap[asset._handle].reset(new AssetBinding(this, &asset, asset._handle));
+	asset._handle = _assetMap.allocate();
+	_assetMap.find(asset._handle)->reset(new AssetBinding(this, &asset, asset._handle));
 	bithorde::BindWrite msg;
 	msg.set_handle(asset._handle);
 	msg.set_size(asset.size());
 	const auto& link = asset.link();
 	if (!link.empty())
 		msg.set_linkpath(link.string());
-	return _connection->sendMessage(Connection::BindWrite, msg);
+	return sendMessage(Connection::BindWrite, msg);
 }
 
 bool Client::release(Asset & asset)
 {
 	BOOST_ASSERT(asset.isBound());
-	BOOST_ASSERT(_assetMap[asset._handle]);
+	BOOST_ASSERT(_assetMap.find(asset._handle));
 
-	auto& binding = *_assetMap[asset._handle];
+	auto& binding = **_assetMap.find(asset._handle);
 
 	// Leave binding dangling, so it won't be reused until confirmation has been received from the other side.
 	binding.close();
@@ -329,26 +626,198 @@ bool Client::informBound(const AssetBinding& asset, uint64_t uuid, int timeout)
 		return false;
 
 	bithorde::BindRead msg;
-	msg.set_handle(asset._handle);
+	describeBind(msg, asset, uuid, timeout);
+	return sendMessage(Connection::BindRead, msg);
+}
+
+size_t Client::informBound(const vector<const AssetBinding*>& assets, int timeout)
+{
+	if (!_connection)
+		return 0;
 
+	size_t sent = 0;
+	if (!_peerBindBatch) {
+		for (auto iter = assets.begin(); iter != assets.end(); iter++)
+			sent += informBound(**iter, rand64(), timeout);
+		return sent;
+	}
+
+	bithorde::BindBatch batch;
+	for (size_t i = 0; i < assets.size(); i++) {
+		describeBind(*batch.add_binds(), *assets[i], rand64(), timeout);
+		if (((size_t)batch.binds_size() == Connection::MAX_BINDS) || (i+1 == assets.size())) {
+			if (sendMessage(Connection::BindBatch, batch))
+				sent += batch.binds_size();
+			batch.Clear();
+		}
+	}
+	return sent;
+}
+
+void Client::describeBind(bithorde::BindRead& msg, const AssetBinding& asset, uint64_t uuid, int timeout)
+{
+	BOOST_ASSERT(asset._handle >= 0);
+
+	msg.set_handle(asset._handle);
 	ReadAsset * readAsset = asset.readAsset();
 	if (readAsset)
 		msg.mutable_ids()->CopyFrom(readAsset->requestIds());
 	msg.set_timeout(timeout);
 	msg.set_uuid(uuid);
-
-	return _connection->sendMessage(Connection::BindRead, msg);
 }
 
-int Client::allocRPCRequest(Asset::Handle asset)
+int Client::allocRPCRequest(Asset::Handle asset, size_t responses, bool stream)
 {
-	int res = _rpcIdAllocator.allocate();
-	_requestIdMap[res] = asset;
+	int res = _requestIdMap.allocate();
+	if (res < 0)
+		return -1; // Out of reqIds
+	RPCRequest& req = *_requestIdMap.find(res);
+	req.reqId = res;
+	req.asset = asset;
+	req.responses = responses;
+	req.stream = stream;
+	req.cancelled = false;
+	req.delivered = false;
+	req.timedOut = false;
+	req.backingOff = false;
+	req.sent = boost::posix_time::microsec_clock::universal_time();
+	req.read.Clear();
+	req.offsets.clear();
+	if (!req.timer)
+		req.timer.reset(new TimerWheel::Timer(_timers, boost::bind(&Client::onRPCTimer, this, &req)));
 	return res;
 }
 
 void Client::releaseRPCRequest(int reqId)
 {
-	if (_requestIdMap.erase(reqId))
-		_rpcIdAllocator.free(reqId);
+	RPCRequest* req = _requestIdMap.find(reqId);
+	if (!req)
+		return;
+	req->timer->cancel();
+	_requestIdMap.free(reqId);
+}
+
+void Client::expectRange(int reqId, uint64_t offset)
+{
+	if (RPCRequest* req = _requestIdMap.find(reqId))
+		req->offsets.push_back(offset);
+}
+
+void Client::clearRPCRequests()
+{
+	auto reqIds = _requestIdMap.keys();
+	for (auto iter = reqIds.begin(); iter != reqIds.end(); iter++)
+		releaseRPCRequest(*iter);
+}
+
+/**
+ * Releases every request, delivering /status/ for whatever was not yet delivered of them,
+ * or TIMEOUT for requests already timed out. Streams get a single failure, ending them.
+ */
+void Client::failRPCRequests(bithorde::Status status)
+{
+	// Released before delivering, so the assets may go on with reads of their own
+	vector< pair<Asset::Handle, bithorde::Read::Response> > failed;
+	auto reqIds = _requestIdMap.keys();
+	for (auto iter = reqIds.begin(); iter != reqIds.end(); iter++) {
+		RPCRequest& req = *_requestIdMap.find(*iter);
+		bithorde::Read::Response resp;
+		resp.set_reqid(req.reqId);
+		resp.set_status(req.timedOut ? bithorde::TIMEOUT : status);
+		if (req.cancelled) {
+			// Nobody is waiting for it
+		} else if (req.stream) {
+			failed.push_back(make_pair(req.asset, resp));
+		} else {
+			for (auto offset = req.offsets.begin(); offset != req.offsets.end(); offset++) {
+				resp.set_offset(*offset);
+				failed.push_back(make_pair(req.asset, resp));
+			}
+		}
+		releaseRPCRequest(*iter);
+	}
+	for (auto iter = failed.begin(); iter != failed.end(); iter++)
+		deliverRead(iter->first, iter->second, ByteSlice());
+}
+
+void Client::timeRPCRequest(int reqId, int timeout)
+{
+	if (RPCRequest* req = _requestIdMap.find(reqId))
+		req->timer->arm(boost::posix_time::milliseconds(timeout) + roundTrip());
+}
+
+void Client::retryRPCRequest(const bithorde::Read::Request& read, const ReadAsset::RetryPolicy& policy)
+{
+	RPCRequest* req = _requestIdMap.find(read.reqid());
+	if (!req)
+		return;
+	req->read = read;
+	req->retry = policy;
+	req->timer->arm(boost::posix_time::milliseconds(read.timeout()) + roundTrip());
+}
+
+void Client::onRPCTimer(RPCRequest* request)
+{
+	RPCRequest& req = *request; // Released requests have their timer cancelled
+	int reqId = req.reqId;
+	if (req.cancelled || req.delivered) {
+		return;
+	} else if (req.backingOff) {
+		req.backingOff = false;
+		req.responses++;
+		if (sendMessage(Connection::ReadRequest, req.read))
+			req.timer->arm(boost::posix_time::milliseconds(req.read.timeout()) + roundTrip());
+	} else if (req.read.has_reqid() && (req.retry.retries > 0)) {
+		sendCancel(reqId);
+		backOff(req);
+	} else {
+		// Out of tries. Whatever the peer still answers is dropped, or for ReadV delivered
+		// as TIMEOUT, until it has answered the cancel.
+		req.timedOut = true;
+		sendCancel(reqId);
+		if (req.read.has_reqid()) {
+			req.delivered = true;
+			bithorde::Read::Response resp;
+			resp.set_reqid(reqId);
+			resp.set_status(bithorde::TIMEOUT);
+			resp.set_offset(req.read.offset());
+			req.offsets.clear();
+			deliverRead(req.asset, resp, ByteSlice());
+		}
+	}
+}
+
+void Client::backOff(RPCRequest& req)
+{
+	int backoff = req.retry.backoff;
+	req.retry.retries--;
+	req.retry.backoff = min(backoff*2, req.retry.maxBackoff);
+	req.backingOff = true;
+	req.sent = boost::posix_time::not_a_date_time; // Which try a response is to is unknown
+	req.timer->arm(boost::posix_time::milliseconds(backoff/2 + rand64() % (backoff/2 + 1)));
+}
+
+void Client::sendCancel(int reqId)
+{
+	bithorde::Read::Cancel msg;
+	msg.set_reqid(reqId);
+	sendMessage(Connection::ReadCancel, msg);
+}
+
+void Client::timeRoundTrip(RPCRequest& req)
+{
+	auto now = boost::posix_time::microsec_clock::universal_time();
+	auto roundTrip = now - req.sent;
+	req.sent = boost::posix_time::not_a_date_time;
+	_roundTrip.sample(roundTrip, now);
+}
+
+bool Client::cancelRPCRequest(Asset::Handle asset, int reqId)
+{
+	RPCRequest* req = _requestIdMap.find(reqId);
+	if (!req || (req->asset != asset) || req->cancelled)
+		return false;
+	req->cancelled = true;
+	req->timer->cancel();
+	return true;
 }
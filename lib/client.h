@@ -1,10 +1,10 @@
 #ifndef BITHORDE_CLIENT_H
 #define BITHORDE_CLIENT_H
 
-#include <map>
+#include <deque>
 #include <string>
+#include <vector>
 
-#include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/local/stream_protocol.hpp>
 #include <boost/bind.hpp>
@@ -13,7 +13,9 @@
 
 #include "asset.h"
 #include "connection.h"
-#include "allocator.h"
+#include "roundtrip.h"
+#include "slotmap.h"
+#include "timerwheel.h"
 
 namespace bithorde {
 
@@ -25,7 +27,7 @@ class AssetBinding {
 	Client* _client;
 	Asset* _asset;
 	Asset::Handle _handle;
-	boost::asio::deadline_timer _statusTimer;
+	TimerWheel::Timer _statusTimer;
 public:
 	AssetBinding(Client* client, Asset* asset, Asset::Handle handle);
 
@@ -41,7 +43,7 @@ public:
 private:
 	void setTimer(const boost::posix_time::time_duration& timeout);
 	void clearTimer();
-	void onTimeout(const boost::system::error_code& error);
+	void onTimeout();
 };
 
 class Client
@@ -53,25 +55,71 @@ class Client
 	typedef std::unique_ptr<AssetBinding> AssetPtr;
 
 	boost::asio::io_service& _ioSvc;
+	TimerWheel& _timers;
 	Connection::Pointer _connection;
 
 	std::string _myName;
 	std::string _peerName;
 
-	std::map<Asset::Handle, AssetPtr> _assetMap;
-	std::map<int, Asset::Handle> _requestIdMap;
-	CachedAllocator<Asset::Handle> _handleAllocator;
-	CachedAllocator<int> _rpcIdAllocator;
+	// Servers index their tables by handle, so handles are kept small, without generations
+	SlotMap<AssetPtr, 0> _assetMap;
+	// Outstanding requests, by reqId. ReadV-requests are answered by one response per range,
+	// and streams until a response not SUCCESS. Responses to cancelled requests are dropped.
+	// Single reads that fail or time out are cancelled, and sent again under the same reqId
+	// after a backoff, so a response is due for every try. Only the first success, or the
+	// failure of the last try, is delivered.
+	struct RPCRequest {
+		int reqId;
+		Asset::Handle asset;
+		size_t responses;
+		bool stream;
+		bool cancelled;
+		bool delivered; // A single read has been answered to the asset
+		bool timedOut; // Given up on, ranges not yet in are delivered as TIMEOUT
+		bool backingOff; // Waiting to retry
+		boost::posix_time::ptime sent; // Until the first response, to time the round-trip
+		std::unique_ptr<TimerWheel::Timer> timer; // Kept with the slot, for the next request
+		bithorde::Read::Request read; // The single read, kept for retries
+		std::vector<uint64_t> offsets; // Of reads not yet delivered, failed if the link is lost
+		ReadAsset::RetryPolicy retry; // Retries left, and the next backoff
+	};
+	// Stale reqIds, like responses to requests already given up on, find nothing
+	SlotMap<RPCRequest, 12> _requestIdMap;
 
 	uint8_t _protoVersion;
+	bool _peerLocalFiles; // Peer can take LocalFile-messages
+	bool _peerReadV; // Peer serves ReadV-requests
+	bool _peerReadStream; // Peer serves ReadStream-requests
+	bool _peerBindBatch; // Peer serves BindBatches
+	bool _peerStatusBatch; // Peer takes AssetStatusBatches
+	size_t _sharedMemory; // Capacity of shared memory to offer local peers, or 0
+	size_t _maxChunk;
+	size_t _peerMaxChunk;
+	RoundTripFilter _roundTrip;
+	Connection::Stats _pastStats;
+
+	// Messages waiting for the connection to become writable
+	struct DeferredMessage {
+		Connection::MessageType type;
+		boost::shared_ptr< ::google::protobuf::Message > msg;
+		ByteSlice payload;
+		FileSlice file;
+		Descriptor attached;
+	};
+	std::deque<DeferredMessage> _deferred[Connection::Auto]; // By traffic class
+	size_t _deferredCount;
+	bool _readPaused; // By pauseRead()
+	bool _sendBacklogged; // Reading paused for too many deferred messages
 public:
 	typedef boost::shared_ptr<Client> Pointer;
 	typedef boost::weak_ptr<Client> WeakPtr;
 
+	const static size_t MAX_DEFERRED = 1024; // Messages deferred before reading is paused
+
 	static Pointer create(boost::asio::io_service& ioSvc, std::string myName) {
 		return Pointer(new Client(ioSvc, myName));
 	}
-	virtual ~Client() {}
+	virtual ~Client();
 
 	/**
 	 * Tries to parse spec either as HOST:PORT, or as /absolute/socket/path and connect to it. 
@@ -82,14 +130,97 @@ public:
 	void connect(boost::asio::local::stream_protocol::endpoint& ep);
 	void connect(Connection::Pointer newConn);
 
+	/**
+	 * Offer peers on unix-sockets to move the connection into shared memory, with rings
+	 * of /capacity/ bytes in each direction. Must be set before connecting.
+	 */
+	void useSharedMemory(size_t capacity) { _sharedMemory = capacity; }
+
+	/**
+	 * Limit the chunk-size announced to peers, Connection::MAX_CHUNK by default. Must be
+	 * set before connecting.
+	 */
+	void setMaxChunk(size_t size) { _maxChunk = size; }
+
+	/**
+	 * The largest read the peer answers in full, as agreed in the HandShakes
+	 */
+	size_t chunkSize() const;
+
+	/**
+	 * Whether the peer serves ReadV-requests, see ReadAsset::aSyncReadV()
+	 */
+	bool peerServesVectoredReads() const { return _peerReadV; }
+
+	/**
+	 * Whether the peer serves ReadStream-requests, see ReadAsset::aSyncStream()
+	 */
+	bool peerServesStreams() const { return _peerReadStream; }
+
+	/**
+	 * Whether the peer serves BindBatches, see bind() of many assets
+	 */
+	bool peerServesBindBatches() const { return _peerBindBatch; }
+
+	/**
+	 * The shortest round-trip of requests lately, an estimate of the latency of the link
+	 * without the time the peer spent serving them. Zero until measured.
+	 */
+	boost::posix_time::time_duration roundTrip() const {
+		return _roundTrip.measured() ? _roundTrip.shortest() : boost::posix_time::time_duration(0, 0, 0);
+	}
+
+	/**
+	 * The number of requests still waiting for responses from the peer
+	 */
+	size_t pendingRequests() const { return _requestIdMap.size(); }
+
 	bool isConnected();
 	const std::string& peerName();
 
+	/**
+	 * The event-loop driving this client and its connections
+	 */
+	boost::asio::io_service& ioService() { return _ioSvc; }
+
+	/**
+	 * Traffic counters, summed over all connections made by this client
+	 */
+	Connection::Stats stats() const;
+
 	bool bind(ReadAsset & asset);
 	bool bind(ReadAsset & asset, uint64_t uuid, int timeout);
 	bool bind(UploadAsset & asset);
 
+	/**
+	 * Binds many assets at once, in BindBatches of up to Connection::MAX_BINDS if the peer
+	 * serves them, or else one BindRead each. Each asset is told its status on its own, as
+	 * soon as the peer has looked it up.
+	 *
+	 * @return the number of binds sent, all of /assets/ unless not connected
+	 */
+	size_t bind(const std::vector<ReadAsset*>& assets);
+	size_t bind(const std::vector<ReadAsset*>& assets, int timeout);
+
+	/**
+	 * Sends a message to the peer. Messages the connection can not take right now are
+	 * deferred, and sent in order within their traffic class as it becomes writable.
+	 * Beyond MAX_DEFERRED deferred messages, reading from the peer is paused until they
+	 * drain.
+	 *
+	 * @return false only if not connected, or the message could not be encoded
+	 */
 	bool sendMessage(Connection::MessageType type, const ::google::protobuf::Message & msg);
+	bool sendMessage(Connection::MessageType type, const ::google::protobuf::Message & msg, const ByteSlice& payload);
+	bool sendMessage(Connection::MessageType type, const ::google::protobuf::Message & msg, const FileSlice& payload);
+	bool sendMessage(Connection::MessageType type, const ::google::protobuf::Message & msg, const Descriptor& fd);
+
+	/**
+	 * The number of bytes of /type/ that can be sent without being deferred, 0 while
+	 * its traffic class has messages deferred. Producers of bulk data should hold off at
+	 * 0, and continue when /writable/ is signalled.
+	 */
+	size_t sendCredit(Connection::MessageType type) const;
 
 	boost::signals2::signal<void (std::string&)> authenticated;
 	boost::signals2::signal<void ()> writable;
@@ -100,29 +231,84 @@ protected:
 
 	void sayHello();
 
+	/**
+	 * Whether the peer asked for LocalFile-messages, and they can be sent to it
+	 */
+	bool peerTakesLocalFiles() const { return _peerLocalFiles; }
+
+	/**
+	 * Whether to announce serving ReadV-requests in the HandShake
+	 */
+	virtual bool servesVectoredReads() const { return false; }
+
+	/**
+	 * Whether to announce serving ReadStream-requests in the HandShake
+	 */
+	virtual bool servesStreams() const { return false; }
+
+	/**
+	 * Whether to announce serving BindBatches in the HandShake
+	 */
+	virtual bool servesBindBatches() const { return false; }
+
+	/**
+	 * Whether the peer takes AssetStatusBatches, so statuses may be sent together
+	 */
+	bool peerTakesStatusBatches() const { return _peerStatusBatch; }
+
 	void onDisconnected();
-	void onIncomingMessage(Connection::MessageType type, ::google::protobuf::Message& msg);
+	virtual void onWritable();
+
+	/**
+	 * Stop/resume handling incoming messages from the peer, see Connection::pauseRead()
+	 */
+	void pauseRead();
+	void resumeRead();
+	void onIncomingMessage(Connection::MessageType type, ::google::protobuf::Message& msg, const ByteSlice& payload);
 
 	virtual void onMessage(const bithorde::HandShake & msg);
 	virtual void onMessage(bithorde::BindRead& msg);
 	virtual void onMessage(const bithorde::AssetStatus & msg);
+	virtual void onMessage(bithorde::BindBatch& msg);
+	virtual void onMessage(const bithorde::AssetStatusBatch & msg);
 	virtual void onMessage(const bithorde::Read::Request & msg);
-	virtual void onMessage(const bithorde::Read::Response & msg);
+	virtual void onMessage(const bithorde::ReadV & msg);
+	virtual void onMessage(const bithorde::ReadStream & msg);
+	virtual void onMessage(const bithorde::Read::Cancel & msg);
+	virtual void onMessage(const bithorde::Read::Response & msg, const ByteSlice& content);
 	virtual void onMessage(const bithorde::BindWrite & msg);
-	virtual void onMessage(const bithorde::DataSegment & msg);
+	virtual void onMessage(const bithorde::DataSegment & msg, const ByteSlice& content);
 	virtual void onMessage(const bithorde::HandShakeConfirmed & msg);
 	virtual void onMessage(const bithorde::Ping & msg);
+	virtual void onMessage(const bithorde::LocalFile & msg);
 
 private:
 	bool release(Asset & a);
+	bool trySend(const DeferredMessage& msg);
+	void drainDeferred(std::deque<DeferredMessage>& deferred);
+	void defer(Connection::MessageType type, const ::google::protobuf::Message& msg, const ByteSlice& payload, const FileSlice& file, const Descriptor& attached=Descriptor());
+	void onLocalRead(const bithorde::Read::Response& msg, const ByteSlice& content);
 
-	boost::signals2::scoped_connection _messageConnection;
 	boost::signals2::scoped_connection _writableConnection;
 	boost::signals2::scoped_connection _disconnectedConnection;
 
 	bool informBound(const bithorde::AssetBinding& asset, uint64_t uuid, int timeout);
-	int allocRPCRequest(Asset::Handle asset);
+	size_t informBound(const std::vector<const bithorde::AssetBinding*>& assets, int timeout);
+	void describeBind(bithorde::BindRead& msg, const bithorde::AssetBinding& asset, uint64_t uuid, int timeout);
+	AssetBinding& allocBinding(ReadAsset& asset);
+	int allocRPCRequest(Asset::Handle asset, size_t responses=1, bool stream=false);
 	void releaseRPCRequest(int reqId);
+	bool cancelRPCRequest(Asset::Handle asset, int reqId);
+	void timeRoundTrip(RPCRequest& req);
+	void timeRPCRequest(int reqId, int timeout);
+	void retryRPCRequest(const bithorde::Read::Request& read, const ReadAsset::RetryPolicy& policy);
+	void expectRange(int reqId, uint64_t offset);
+	void clearRPCRequests();
+	void failRPCRequests(bithorde::Status status);
+	void onRPCTimer(RPCRequest* req);
+	void backOff(RPCRequest& req);
+	void sendCancel(int reqId);
+	void deliverRead(Asset::Handle assetHandle, const bithorde::Read::Response& msg, const ByteSlice& content);
 };
 
 }
@@ -1,20 +1,35 @@
 #include "connection.h"
+#include "shmring.h"
 
 #include <iostream>
 
 #include <boost/asio.hpp>
+#include <boost/assert.hpp>
 #include <boost/bind.hpp>
+#include <boost/type_traits/is_same.hpp>
 
 #include <google/protobuf/wire_format_lite.h>
 #include <google/protobuf/wire_format_lite_inl.h>
 #include <google/protobuf/io/coded_stream.h>
-#include <google/protobuf/io/zero_copy_stream_impl.h>
 
-const size_t MAX_MSG = 256*1024;
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+const size_t MAX_MSG = bithorde::Connection::MAX_CHUNK + 4*1024; // Content, and the message around it
+const size_t MAX_FRAME_HEADER = 10; // Two varint32:s, message-type tag and length
 const size_t READ_BLOCK = MAX_MSG*2;
+const size_t READ_MIN = MAX_MSG/4;
 const size_t SEND_BUF = 1024*1024;
 const size_t SEND_BUF_EMERGENCY = 2*SEND_BUF;
 const size_t SEND_BUF_LOW_WATER_MARK = MAX_MSG;
+const size_t SEND_BLOCK = MAX_MSG;
+const size_t DRR_QUANTUM = 64*1024;
+const size_t INTERACTIVE_WEIGHT = 4; // Relative to Bulk
+const size_t MAX_DESCRIPTORS = 16; // Received, but not yet picked up by a message
+const size_t DOORBELL_DRAIN = 256;
 
 namespace asio = boost::asio;
 using namespace std;
@@ -26,6 +41,7 @@ class ConnectionImpl : public Connection {
 	typedef typename Protocol::socket Socket;
 	typedef typename Protocol::endpoint EndPoint;
 
+protected:
 	boost::shared_ptr<Socket> _socket;
 public:
 	ConnectionImpl(boost::asio::io_service& ioSvc, const EndPoint& addr) 
@@ -44,21 +60,153 @@ public:
 		close();
 	}
 
+	bool passesDescriptors() const {
+		return boost::is_same<Protocol, asio::local::stream_protocol>::value;
+	}
+
 	void trySend() {
-		if (_sendBuf.size) {
-			_socket->async_write_some(asio::buffer(_sendBuf.ptr, _sendBuf.size),
+		size_t limit;
+		SendQueue* queue = nextSendQueue(limit);
+		if (!queue)
+			return;
+		int fd;
+		uint64_t offset;
+		size_t size;
+		if (queue->fileHead(fd, offset, size)) {
+			// Wait for the socket to become writable, then let the kernel move the data.
+			_socket->async_write_some(asio::null_buffers(),
+				boost::bind(&ConnectionImpl::sendFile, boost::static_pointer_cast<ConnectionImpl>(shared_from_this()),
+							queue, asio::placeholders::error)
+			);
+		} else if (queue->attachedHead() >= 0) {
+			// Descriptors can only be passed through sendmsg()
+			_socket->async_write_some(asio::null_buffers(),
+				boost::bind(&ConnectionImpl::sendAttached, boost::static_pointer_cast<ConnectionImpl>(shared_from_this()),
+							queue, limit, asio::placeholders::error)
+			);
+		} else {
+			auto buffers = queue->buffers(limit);
+			_socket->async_send(buffers, buffers.more ? MSG_MORE : 0,
 				boost::bind(&Connection::onWritten, shared_from_this(),
 							asio::placeholders::error, asio::placeholders::bytes_transferred)
 			);
 		}
 	}
 
+	void sendFile(SendQueue* queue, const boost::system::error_code& err) {
+		int fd;
+		uint64_t offset;
+		size_t size;
+		if (err || !queue->fileHead(fd, offset, size))
+			return onWritten(err, 0);
+
+		off_t pos = offset;
+		ssize_t res = ::sendfile(_socket->native_handle(), fd, &pos, size);
+		if (res > 0) {
+			onWritten(err, res);
+		} else if ((res < 0) && (errno == EAGAIN || errno == EINTR)) {
+			trySend();
+		} else {
+			// Read-error, or the file shrunk. The frame cannot be completed either way.
+			onWritten(boost::system::error_code((res < 0) ? errno : EIO, boost::system::system_category()), 0);
+		}
+	}
+
+	void sendAttached(SendQueue* queue, size_t limit, const boost::system::error_code& err) {
+		int fd = queue->attachedHead();
+		if (err || (fd < 0))
+			return onWritten(err, 0);
+
+		auto buffers = queue->buffers(limit);
+		struct iovec iov[SendQueue::MAX_BUFFERS];
+		for (size_t i = 0; i < buffers.count; i++) {
+			iov[i].iov_base = (void*)asio::buffer_cast<const void*>(buffers.items[i]);
+			iov[i].iov_len = asio::buffer_size(buffers.items[i]);
+		}
+		union {
+			struct cmsghdr align;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} control;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		memset(&control, 0, sizeof(control));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = buffers.count;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+		ssize_t res = ::sendmsg(_socket->native_handle(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL | (buffers.more ? MSG_MORE : 0));
+		if (res > 0) {
+			onWritten(err, res);
+		} else if ((res < 0) && (errno == EAGAIN || errno == EINTR)) {
+			trySend();
+		} else {
+			onWritten(boost::system::error_code((res < 0) ? errno : EIO, boost::system::system_category()), 0);
+		}
+	}
+
 	void tryRead() {
-		_socket->async_read_some(asio::buffer(_rcvBuf.allocate(MAX_MSG), MAX_MSG),
-			boost::bind(&Connection::onRead, shared_from_this(),
-				asio::placeholders::error, asio::placeholders::bytes_transferred
-			)
-		);
+		if (passesDescriptors()) {
+			// Descriptors can only be received through recvmsg()
+			_socket->async_read_some(asio::null_buffers(),
+				boost::bind(&ConnectionImpl::receive, boost::static_pointer_cast<ConnectionImpl>(shared_from_this()),
+					asio::placeholders::error
+				)
+			);
+		} else {
+			_socket->async_read_some(readBuffer(),
+				boost::bind(&Connection::onRead, shared_from_this(),
+					asio::placeholders::error, asio::placeholders::bytes_transferred
+				)
+			);
+		}
+	}
+
+	void receive(const boost::system::error_code& err) {
+		if (err)
+			return onRead(err, 0);
+
+		auto buf = readBuffer();
+		ssize_t res = receiveAttached(asio::buffer_cast<void*>(buf), asio::buffer_size(buf));
+		int error = (res < 0) ? errno : 0;
+		if (error == EAGAIN || error == EINTR)
+			return tryRead();
+		onRead(boost::system::error_code(error, boost::system::system_category()), (res > 0) ? res : 0);
+	}
+
+	/**
+	 * recvmsg() into /buf/, handing any descriptors received to onDescriptor()
+	 */
+	ssize_t receiveAttached(void* buf, size_t size) {
+		struct iovec iov = { buf, size };
+		union {
+			struct cmsghdr align;
+			char buf[CMSG_SPACE(MAX_DESCRIPTORS * sizeof(int))];
+		} control;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		ssize_t res = ::recvmsg(_socket->native_handle(), &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (res < 0)
+			return res;
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+				const int* fds = (const int*)CMSG_DATA(cmsg);
+				size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				for (size_t i = 0; i < count; i++)
+					onDescriptor(fds[i]);
+			}
+		}
+		return res;
 	}
 
 	void close() {
@@ -69,93 +217,577 @@ public:
 	}
 };
 
+/**
+ * Shortens the regions of /space/ to at most /size/ bytes in total.
+ */
+static void clamp(struct iovec space[2], size_t size)
+{
+	if (space[0].iov_len >= size) {
+		space[0].iov_len = size;
+		space[1].iov_len = 0;
+	} else {
+		space[1].iov_len = min(space[1].iov_len, size - space[0].iov_len);
+	}
+}
+
+/**
+ * Copies /buffers/ into the regions of /space/, as far as they go. Counted by CopyCounter.
+ */
+template <class Buffers>
+static size_t copyInto(const Buffers& buffers, struct iovec space[2])
+{
+	size_t res = 0, region = 0, regionUsed = 0;
+	for (auto iter = buffers.begin(); (iter != buffers.end()) && (region < 2); iter++) {
+		const byte* src = asio::buffer_cast<const byte*>(*iter);
+		size_t left = asio::buffer_size(*iter);
+		while (left && (region < 2)) {
+			size_t chunk = min(left, space[region].iov_len - regionUsed);
+			memcpy((byte*)space[region].iov_base + regionUsed, src, chunk);
+			src += chunk;
+			left -= chunk;
+			res += chunk;
+			regionUsed += chunk;
+			if (regionUsed == space[region].iov_len) {
+				region++;
+				regionUsed = 0;
+			}
+		}
+	}
+	if (res)
+		CopyCounter::count(res);
+	return res;
+}
+
+/**
+ * Unix-socket connection, which may move the conversation into a pair of ShmRings, see
+ * SharedMemory in bithorde.proto. Messages are then copied through the rings without any
+ * system-calls, as long as both sides keep busy. The socket is left for waking a sleeping
+ * peer, and for passing descriptors.
+ */
+class SharedMemoryConnection : public ConnectionImpl<asio::local::stream_protocol> {
+	typedef ConnectionImpl<asio::local::stream_protocol> Base;
+
+	enum TxState {
+		TxSocket,
+		TxDraining, // Waiting for the queues to empty, before sending SharedMemory
+		TxLast, // SharedMemory is the last message queued for the socket
+		TxRing,
+	};
+
+	ShmRings::Pointer _rings;
+	bool _offering;
+	TxState _tx;
+	bool _rxRing;
+	bool _rxSleeping, _txSleeping; // Waiting for the peer to wake us
+	bool _wakePending; // The peer must be woken, once the socket carries no more messages
+public:
+	SharedMemoryConnection(boost::asio::io_service& ioSvc, const asio::local::stream_protocol::endpoint& addr)
+		: Base(ioSvc, addr)
+	{
+		init();
+	}
+
+	SharedMemoryConnection(boost::asio::io_service& ioSvc, boost::shared_ptr<asio::local::stream_protocol::socket>& socket)
+		: Base(ioSvc, socket)
+	{
+		init();
+	}
+
+	bool supportsSharedMemory() const {
+		return true;
+	}
+
+	bool offerSharedMemory(size_t capacity) {
+		if (_rings || !_socket->is_open())
+			return false;
+		_rings = ShmRings::create(capacity);
+		if (!_rings)
+			return false;
+		_offering = true;
+		drain();
+		return true;
+	}
+
+	bool usesSharedMemory() const {
+		return _rxRing && (_tx == TxRing);
+	}
+
+	void trySend() {
+		switch (_tx) {
+		case TxSocket:
+			return Base::trySend();
+		case TxDraining:
+			if (queued())
+				return Base::trySend();
+			sendLast();
+			return Base::trySend();
+		case TxLast:
+			if (queued())
+				return Base::trySend();
+			// Everything is out on the socket, the rest goes through the ring
+			_tx = TxRing;
+			_sendHeld = false;
+			if (_wakePending)
+				wakePeer();
+			return;
+		case TxRing:
+			_ioSvc.post(boost::bind(&SharedMemoryConnection::writeRing, self()));
+			return;
+		}
+	}
+
+	void tryRead() {
+		if (_rxRing)
+			_ioSvc.post(boost::bind(&SharedMemoryConnection::readRing, self()));
+		else
+			Base::tryRead();
+	}
+
+protected:
+	bool onSharedMemory(const bithorde::SharedMemory& msg) {
+		if (_offering) {
+			// The answer, so the peer is now writing to its ring
+			if (_rxRing)
+				return false;
+		} else {
+			if (_rings || _rcvDescriptors.empty())
+				return false;
+			int fd = _rcvDescriptors.front();
+			_rcvDescriptors.pop_front();
+			_rings = ShmRings::map(fd, msg.capacity());
+			if (!_rings)
+				return false;
+			drain();
+		}
+
+		// Anything received after this frame can only be wakeups, and is not to be parsed.
+		BOOST_ASSERT(!_reading);
+		_rcvBuf->size = _rcvParsed + _rcvFrameSize;
+		_rxRing = true;
+		watchSocket();
+		// Wakeups may have been among the discarded
+		_ioSvc.post(boost::bind(&SharedMemoryConnection::wake, self()));
+		return true;
+	}
+
+	void pollDescriptors() {
+		if (_rxRing) {
+			// Passed ahead of the message, but maybe not picked up from the socket yet
+			drainSocket();
+			_ioSvc.post(boost::bind(&SharedMemoryConnection::wake, self()));
+		}
+	}
+
+private:
+	void init() {
+		_offering = false;
+		_tx = TxSocket;
+		_rxRing = false;
+		_rxSleeping = _txSleeping = false;
+		_wakePending = false;
+	}
+
+	boost::shared_ptr<SharedMemoryConnection> self() {
+		return boost::static_pointer_cast<SharedMemoryConnection>(shared_from_this());
+	}
+
+	/**
+	 * Hold back new messages, and send SharedMemory once all queued are out.
+	 */
+	void drain() {
+		_tx = TxDraining;
+		_sendHeld = true;
+		if (!queued())
+			trySend();
+	}
+
+	void sendLast() {
+		bithorde::SharedMemory msg;
+		msg.set_capacity(_rings->capacity());
+		Descriptor fd(_rings, _rings->fd());
+		encode(SharedMemory, msg, 0, _sendClasses[Control], _offering ? &fd : NULL);
+		_tx = TxLast;
+	}
+
+	void writeRing() {
+		if (!_socket->is_open())
+			return;
+		ShmRing& ring = _rings->outgoing();
+		struct iovec space[2];
+		ssize_t free = ring.reserve(space);
+		if (free < 0)
+			return corrupted();
+		if (free == 0) {
+			if (ring.producerSleep())
+				_txSleeping = true;
+			else
+				trySend();
+			return;
+		}
+
+		size_t limit;
+		SendQueue* queue = nextSendQueue(limit);
+		if (!queue)
+			return;
+		clamp(space, min(limit, (size_t)free));
+
+		int attached = queue->attachedHead();
+		if (attached >= 0) {
+			// Must reach the peer before the message does
+			if (!sendWakeup(attached)) {
+				if (errno != EAGAIN)
+					return onWritten(boost::system::error_code(errno, boost::system::system_category()), 0);
+				_socket->async_write_some(asio::null_buffers(),
+					boost::bind(&SharedMemoryConnection::writeRing, self()));
+				return;
+			}
+		}
+
+		size_t written;
+		int fd;
+		uint64_t offset;
+		size_t size;
+		if (queue->fileHead(fd, offset, size)) {
+			clamp(space, size);
+			ssize_t res = ::preadv(fd, space, 2, offset);
+			if (res <= 0)
+				return onWritten(boost::system::error_code((res < 0) ? errno : EIO, boost::system::system_category()), 0);
+			written = res;
+		} else {
+			written = copyInto(queue->buffers(limit), space);
+		}
+
+		if (ring.commit(written))
+			wakePeer();
+		onWritten(boost::system::error_code(), written);
+	}
+
+	void readRing() {
+		if (!_socket->is_open())
+			return;
+		ShmRing& ring = _rings->incoming();
+		struct iovec data[2];
+		ssize_t available = ring.peek(data);
+		if (available < 0)
+			return corrupted();
+		if (available == 0) {
+			if (ring.consumerSleep())
+				_rxSleeping = true;
+			else
+				tryRead();
+			return;
+		}
+
+		auto buf = readBuffer();
+		byte* dst = asio::buffer_cast<byte*>(buf);
+		size_t room = asio::buffer_size(buf), count = 0;
+		for (int i = 0; (i < 2) && (count < room); i++) {
+			size_t chunk = min(data[i].iov_len, room - count);
+			memcpy(dst + count, data[i].iov_base, chunk);
+			count += chunk;
+		}
+		CopyCounter::count(count);
+		if (ring.consume(count))
+			wakePeer();
+		onRead(boost::system::error_code(), count);
+	}
+
+	/**
+	 * Retry whatever sleeps, waiting for the peer
+	 */
+	void wake() {
+		if (_rxSleeping) {
+			_rxSleeping = false;
+			readRing();
+		}
+		if (_txSleeping) {
+			_txSleeping = false;
+			writeRing();
+		}
+	}
+
+	void wakePeer() {
+		if (_tx == TxRing) {
+			// If the socket is full, the peer has wakeups waiting already
+			_wakePending = false;
+			sendWakeup(-1);
+		} else {
+			// Can't mix wakeups into the messages still going out on the socket
+			_wakePending = true;
+		}
+	}
+
+	/**
+	 * Sends a single wakeup-byte, with /fd/ attached unless -1
+	 */
+	bool sendWakeup(int fd) {
+		byte wakeup = 0;
+		struct iovec iov = { &wakeup, 1 };
+		union {
+			struct cmsghdr align;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} control;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (fd >= 0) {
+			memset(&control, 0, sizeof(control));
+			msg.msg_control = control.buf;
+			msg.msg_controllen = sizeof(control.buf);
+			struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		}
+		ssize_t res;
+		do {
+			res = ::sendmsg(_socket->native_handle(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		} while ((res < 0) && (errno == EINTR));
+		return res == 1;
+	}
+
+	void watchSocket() {
+		_socket->async_read_some(asio::null_buffers(),
+			boost::bind(&SharedMemoryConnection::onWakeup, self(), asio::placeholders::error));
+	}
+
+	void onWakeup(const boost::system::error_code& err) {
+		if (err || !drainSocket())
+			return close();
+		wake();
+		if (_socket->is_open())
+			watchSocket();
+	}
+
+	/**
+	 * Picks up the wakeups and descriptors waiting on the socket
+	 *
+	 * @return false if the peer hung up
+	 */
+	bool drainSocket() {
+		byte buf[DOORBELL_DRAIN];
+		while (true) {
+			ssize_t res = receiveAttached(buf, sizeof(buf));
+			if (res == 0)
+				return false;
+			if ((res < 0) && (errno != EINTR))
+				return errno == EAGAIN;
+		}
+	}
+
+	void corrupted() {
+		cerr << "ERROR: Peer corrupted shared memory, disconnecting" << endl;
+		close();
+	}
+};
+
+const size_t Connection::MAX_CHUNK;
+const size_t Connection::DEFAULT_CHUNK;
+const size_t Connection::MAX_RANGES;
+const size_t Connection::MAX_BINDS;
+
+boost::shared_ptr<Buffer> allocateSlab() {
+	boost::shared_ptr<Buffer> res(new Buffer());
+	res->grow(READ_BLOCK);
+	return res;
+}
+
 Connection::Connection(asio::io_service & ioSvc) :
 	_state(Connected),
-	_ioSvc(ioSvc)
+	_ioSvc(ioSvc),
+	_rcvBuf(allocateSlab()),
+	_rcvParsed(0),
+	_rcvFrameSize(0),
+	_reading(false),
+	_readPaused(false),
+	_descriptor(-1),
+	_sending(NULL),
+	_roundRobin(Interactive),
+	_sendHeld(false)
+{
+	_sendClasses[Interactive].quantum = INTERACTIVE_WEIGHT * DRR_QUANTUM;
+	_sendClasses[Bulk].quantum = DRR_QUANTUM;
+}
+
+Connection::~Connection()
 {
-	_sendBuf.allocate(SEND_BUF_EMERGENCY); // Prepare so we don't have to move it later during async send.
+	for (auto iter = _rcvDescriptors.begin(); iter != _rcvDescriptors.end(); iter++)
+		::close(*iter);
+}
+
+Connection::SendClass::SendClass() :
+	queue(SEND_BLOCK),
+	headSent(0),
+	quantum(0),
+	deficit(0)
+{}
+
+Connection::Stats::Stats() :
+	bytesIn(0), framesIn(0), readBatches(0),
+	bytesOut(0), framesOut(0),
+	messagesAllocated(0)
+{}
+
+Connection::Stats& Connection::Stats::operator+=(const Connection::Stats& other)
+{
+	bytesIn += other.bytesIn;
+	framesIn += other.framesIn;
+	readBatches += other.readBatches;
+	bytesOut += other.bytesOut;
+	framesOut += other.framesOut;
+	messagesAllocated += other.messagesAllocated;
+	return *this;
+}
+
+std::ostream& bithorde::operator<<(std::ostream& str, const Connection::Stats& stats)
+{
+	return str << "in: " << stats.framesIn << " frames/" << stats.bytesIn << " bytes in " << stats.readBatches << " reads, "
+		<< "out: " << stats.framesOut << " frames/" << stats.bytesOut << " bytes, "
+		<< stats.messagesAllocated << " message allocations";
 }
 
 Connection::Pointer Connection::create(asio::io_service& ioSvc, const boost::asio::ip::tcp::endpoint& addr)  {
 	Pointer c(new ConnectionImpl<asio::ip::tcp>(ioSvc, addr));
-	c->tryRead();
+	c->processFrames();
 	return c;
 }
 
 Connection::Pointer Connection::create(asio::io_service& ioSvc, boost::shared_ptr<boost::asio::ip::tcp::socket>& socket)
 {
 	Pointer c(new ConnectionImpl<asio::ip::tcp>(ioSvc, socket));
-	c->tryRead();
+	c->processFrames();
 	return c;
 }
 
 Connection::Pointer Connection::create(asio::io_service& ioSvc, const boost::asio::local::stream_protocol::endpoint& addr)  {
-	Pointer c(new ConnectionImpl<asio::local::stream_protocol>(ioSvc, addr));
-	c->tryRead();
+	Pointer c(new SharedMemoryConnection(ioSvc, addr));
+	c->processFrames();
 	return c;
 }
 
 Connection::Pointer Connection::create(asio::io_service& ioSvc, boost::shared_ptr< asio::local::stream_protocol::socket >& socket)
 {
-	Pointer c(new ConnectionImpl<asio::local::stream_protocol>(ioSvc, socket));
-	c->tryRead();
+	Pointer c(new SharedMemoryConnection(ioSvc, socket));
+	c->processFrames();
 	return c;
 }
 
+asio::mutable_buffers_1 Connection::readBuffer()
+{
+	size_t pending = _rcvBuf->size - _rcvParsed;
+	if (!pending && _rcvBuf.unique()) {
+		// Nobody holds slices of the parsed data, just start over.
+		_rcvBuf->size = _rcvParsed = 0;
+	}
+
+	bool fits;
+	if (_rcvFrameSize)
+		fits = (_rcvParsed + _rcvFrameSize) <= _rcvBuf->capacity;
+	else
+		fits = (_rcvBuf->capacity - _rcvBuf->size) >= READ_MIN;
+
+	if (!fits) {
+		// Carry the partial frame over to a fresh slab. The current one is left
+		// untouched, since payload-slices may still refer to it.
+		boost::shared_ptr<Buffer> slab;
+		slab.swap(_rcvSpare);
+		if (!slab)
+			slab = allocateSlab();
+		memcpy(slab->ptr, _rcvBuf->ptr + _rcvParsed, pending);
+		CopyCounter::count(pending);
+		slab->size = pending;
+		if (_rcvBuf.unique()) {
+			_rcvBuf->size = 0;
+			_rcvSpare = _rcvBuf;
+		}
+		_rcvBuf = slab;
+		_rcvParsed = 0;
+	}
+
+	return asio::buffer(_rcvBuf->ptr + _rcvBuf->size, _rcvBuf->capacity - _rcvBuf->size);
+}
+
 void Connection::onRead(const boost::system::error_code& err, size_t count)
 {
+	_reading = false;
 	if (err || (count == 0)) {
 		close();
 		return;
 	} else {
-		_rcvBuf.charge(count);
+		_rcvBuf->charge(count);
+		_stats.bytesIn += count;
+		_stats.readBatches++;
 	}
+	processFrames();
+}
 
-	google::protobuf::io::CodedInputStream stream((::google::protobuf::uint8*)_rcvBuf.ptr, _rcvBuf.size);
-	bool res = true;
-	size_t remains;
-	while (res) {
-		remains = stream.BytesUntilLimit();
-		uint32_t tag = stream.ReadTag();
-		if (tag == 0)
-			break;
-		switch (::google::protobuf::internal::WireFormatLite::GetTagFieldNumber(tag)) {
-		case HandShake:
-			if (_state != Connected) goto proto_error;
-			res = dequeue<bithorde::HandShake>(HandShake, stream); break;
-		case BindRead:
-			if (_state == Authenticated) goto proto_error;
-			res = dequeue<bithorde::BindRead>(BindRead, stream); break;
-		case AssetStatus:
-			if (_state == Authenticated) goto proto_error;
-			res = dequeue<bithorde::AssetStatus>(AssetStatus, stream); break;
-		case ReadRequest:
-			if (_state == Authenticated) goto proto_error;
-			res = dequeue<bithorde::Read::Request>(ReadRequest, stream); break;
-		case ReadResponse:
-			if (_state == Authenticated) goto proto_error;
-			res = dequeue<bithorde::Read::Response>(ReadResponse, stream); break;
-		case BindWrite:
-			if (_state == Authenticated) goto proto_error;
-			res = dequeue<bithorde::BindWrite>(BindWrite, stream); break;
-		case DataSegment:
-			if (_state == Authenticated) goto proto_error;
-			res = dequeue<bithorde::DataSegment>(DataSegment, stream); break;
-		case HandShakeConfirmed:
-			if (_state != AwaitingAuth) goto proto_error;
-			res = dequeue<bithorde::HandShakeConfirmed>(HandShakeConfirmed, stream); break;
-		case Ping:
-			if (_state == Authenticated) goto proto_error;
-			res = dequeue<bithorde::Ping>(Ping, stream); break;
-		default:
-			cerr << "BitHorde protocol warning: unknown message tag" << endl;
-			res = ::google::protobuf::internal::WireFormatLite::SkipMessage(&stream);
-		}
-	}
-
-	_rcvBuf.pop(_rcvBuf.size-remains);
-
-	tryRead();
+void Connection::onDescriptor(int fd)
+{
+	if (_rcvDescriptors.size() < MAX_DESCRIPTORS) {
+		_rcvDescriptors.push_back(fd);
+	} else {
+		cerr << "WARNING: Too many file descriptors passed from peer, dropping" << endl;
+		::close(fd);
+	}
+}
+
+int Connection::takeDescriptor()
+{
+	int res = _descriptor;
+	_descriptor = -1;
+	return res;
+}
+
+void Connection::pauseRead()
+{
+	_readPaused = true;
+}
+
+void Connection::resumeRead()
+{
+	if (_readPaused) {
+		_readPaused = false;
+		// Frames may already be buffered. Deliver them outside of the caller's context.
+		_ioSvc.post(boost::bind(&Connection::processFrames, shared_from_this()));
+	}
+}
+
+/**
+ * Dispatches all complete frames in the receive-buffer, then reads more unless paused.
+ */
+void Connection::processFrames()
+{
+	while (!_readPaused) {
+		const byte* frame = _rcvBuf->ptr + _rcvParsed;
+		size_t available = _rcvBuf->size - _rcvParsed;
+		if (!_rcvFrameSize) {
+			::google::protobuf::io::CodedInputStream header(frame, available);
+			uint32_t tag, length;
+			if (!(header.ReadVarint32(&tag) && header.ReadVarint32(&length))) {
+				if (available < MAX_FRAME_HEADER)
+					break; // Wait for the rest of the header
+				goto proto_error;
+			}
+			if ((length > MAX_MSG) ||
+			    (::google::protobuf::internal::WireFormatLite::GetTagWireType(tag) != ::google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED))
+				goto proto_error;
+			_rcvFrameSize = header.CurrentPosition() + length;
+		}
+		if (available < _rcvFrameSize)
+			break; // Wait for the rest of the frame
+		if (!dispatch(frame, _rcvFrameSize))
+			goto proto_error;
+		_stats.framesIn++;
+		_rcvParsed += _rcvFrameSize;
+		_rcvFrameSize = 0;
+	}
+
+	if (!(_readPaused || _reading)) {
+		_reading = true;
+		tryRead();
+	}
 	return;
 proto_error:
 	cerr << "ERROR: BitHorde Protocol Error, Disconnecting" << endl;
@@ -163,61 +795,334 @@ proto_error:
 	return;
 }
 
+bool Connection::dispatch(const byte* frame, size_t size)
+{
+	::google::protobuf::io::CodedInputStream header(frame, size);
+	uint32_t tag, length;
+	header.ReadVarint32(&tag);
+	header.ReadVarint32(&length);
+	const byte* msg = frame + header.CurrentPosition();
+
+	switch (::google::protobuf::internal::WireFormatLite::GetTagFieldNumber(tag)) {
+	case HandShake:
+		if (_state != Connected) return false;
+		return dequeue<bithorde::HandShake>(HandShake, msg, length);
+	case BindRead:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::BindRead>(BindRead, msg, length);
+	case AssetStatus:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::AssetStatus>(AssetStatus, msg, length);
+	case ReadRequest:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::Read::Request>(ReadRequest, msg, length);
+	case ReadResponse:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::Read::Response>(ReadResponse, msg, length, bithorde::Read::Response::kContentFieldNumber);
+	case BindWrite:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::BindWrite>(BindWrite, msg, length);
+	case DataSegment:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::DataSegment>(DataSegment, msg, length, bithorde::DataSegment::kContentFieldNumber);
+	case HandShakeConfirmed:
+		if (_state != AwaitingAuth) return false;
+		return dequeue<bithorde::HandShakeConfirmed>(HandShakeConfirmed, msg, length);
+	case Ping:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::Ping>(Ping, msg, length);
+	case LocalFile:
+		if (_state == Authenticated) return false;
+		return dequeueAttached<bithorde::LocalFile>(LocalFile, msg, length);
+	case SharedMemory: {
+		if (_state == Authenticated) return false;
+		bithorde::SharedMemory& shm = decodeTarget<bithorde::SharedMemory>(SharedMemory);
+		return shm.ParseFromArray(msg, length) && onSharedMemory(shm);
+	}
+	case ReadV:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::ReadV>(ReadV, msg, length);
+	case ReadStream:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::ReadStream>(ReadStream, msg, length);
+	case ReadCancel:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::Read::Cancel>(ReadCancel, msg, length);
+	case BindBatch:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::BindBatch>(BindBatch, msg, length);
+	case AssetStatusBatch:
+		if (_state == Authenticated) return false;
+		return dequeue<bithorde::AssetStatusBatch>(AssetStatusBatch, msg, length);
+	default:
+		cerr << "BitHorde protocol warning: unknown message tag" << endl;
+		return true;
+	}
+}
+
 template <class T>
-bool Connection::dequeue(MessageType type, ::google::protobuf::io::CodedInputStream &stream) {
-	bool res;
-	T msg;
+T& Connection::decodeTarget(MessageType type) {
+	if (_decodeCache.size() <= (size_t)type)
+		_decodeCache.resize(type+1);
+	auto& slot = _decodeCache[type];
+	if (!slot) {
+		slot.reset(new T());
+		_stats.messagesAllocated++;
+	}
+	T& res = static_cast<T&>(*slot);
+	res.Clear();
+	return res;
+}
 
-	uint32_t length;
-	if (!stream.ReadVarint32(&length)) return false;
+template <class T>
+bool Connection::dequeue(MessageType type, const byte* data, size_t size) {
+	T& msg = decodeTarget<T>(type);
+	if (!msg.ParsePartialFromArray(data, size))
+		return false;
+	message(type, msg, ByteSlice());
+	return true;
+}
 
-	uint32_t bytesLeft = stream.BytesUntilLimit();
-	if (length > bytesLeft) return false;
+/**
+ * Parses everything except the bytes-field /payloadField/, which is instead passed along
+ * as a slice of the receive-buffer.
+ */
+template <class T>
+bool Connection::dequeue(MessageType type, const byte* data, size_t size, uint32_t payloadField) {
+	using ::google::protobuf::internal::WireFormatLite;
+	::google::protobuf::io::CodedInputStream stream(data, size);
+	int fieldStart = 0, fieldEnd = 0, payloadStart = 0;
+	uint32_t payloadSize = 0;
+	while (true) {
+		int pos = stream.CurrentPosition();
+		uint32_t tag = stream.ReadTag();
+		if (tag == 0)
+			break;
+		if (tag == WireFormatLite::MakeTag(payloadField, WireFormatLite::WIRETYPE_LENGTH_DELIMITED)) {
+			if (!stream.ReadVarint32(&payloadSize))
+				return false;
+			fieldStart = pos;
+			payloadStart = stream.CurrentPosition();
+			if (!stream.Skip(payloadSize))
+				return false;
+			fieldEnd = stream.CurrentPosition();
+		} else if (!WireFormatLite::SkipField(&stream, tag)) {
+			return false;
+		}
+	}
+	if (!stream.ConsumedEntireMessage())
+		return false;
 
-	::google::protobuf::io::CodedInputStream::Limit limit = stream.PushLimit(length);
-	if ((res = msg.MergePartialFromCodedStream(&stream))) {
-		message(type, msg);
+	T& msg = decodeTarget<T>(type);
+	if (fieldEnd) {
+		::google::protobuf::io::CodedInputStream head(data, fieldStart);
+		::google::protobuf::io::CodedInputStream tail(data+fieldEnd, size-fieldEnd);
+		if (!(msg.MergePartialFromCodedStream(&head) && msg.MergePartialFromCodedStream(&tail)))
+			return false;
+		message(type, msg, ByteSlice(_rcvBuf, (data - _rcvBuf->ptr) + payloadStart, payloadSize));
+	} else {
+		if (!msg.ParsePartialFromArray(data, size))
+			return false;
+		message(type, msg, ByteSlice());
 	}
-	stream.PopLimit(limit);
+	return true;
+}
 
+/**
+ * Like dequeue(), with the next received file descriptor attached, if any. The peer sends
+ * descriptors together with the first byte of their message, so they always arrive first.
+ */
+template <class T>
+bool Connection::dequeueAttached(MessageType type, const byte* data, size_t size) {
+	if (_rcvDescriptors.empty())
+		pollDescriptors();
+	if (!_rcvDescriptors.empty()) {
+		_descriptor = _rcvDescriptors.front();
+		_rcvDescriptors.pop_front();
+	}
+	bool res = dequeue<T>(type, data, size);
+	if (_descriptor >= 0)
+		::close(_descriptor);
+	_descriptor = -1;
 	return res;
 }
 
-bool Connection::encode(Connection::MessageType type, const google::protobuf::Message &msg) {
-	byte* buf = _sendBuf.allocate(MAX_MSG);
-	::google::protobuf::io::ArrayOutputStream of(buf, MAX_MSG);
-	::google::protobuf::io::CodedOutputStream stream(&of);
-	stream.WriteTag(::google::protobuf::internal::WireFormatLite::MakeTag(type, ::google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
-	stream.WriteVarint32(msg.ByteSize());
-	bool res = msg.SerializeToCodedStream(&stream);
-	if (res)
-		_sendBuf.charge(stream.ByteCount());
-	return res;
+/**
+ * The bytes-field of /type/ which may be sent as a separate payload, or 0 if none.
+ */
+static uint32_t payloadField(Connection::MessageType type) {
+	switch (type) {
+	case Connection::ReadResponse:
+		return bithorde::Read::Response::kContentFieldNumber;
+	case Connection::DataSegment:
+		return bithorde::DataSegment::kContentFieldNumber;
+	default:
+		return 0;
+	}
 }
 
-bool Connection::sendMessage(Connection::MessageType type, const::google::protobuf::Message &msg, bool prioritized)
+Connection::Priority Connection::defaultPriority(Connection::MessageType type) {
+	switch (type) {
+	case Connection::ReadResponse:
+		return Connection::Interactive;
+	case Connection::DataSegment:
+		return Connection::Bulk;
+	default:
+		return Connection::Control;
+	}
+}
+
+/**
+ * Encodes /msg/ into the queue of /cls/. If /payloadSize/ is set, the frame is extended
+ * with the header of the payload-field, and the payload itself must be appended right after.
+ * If /attached/ is set, it goes out along with the frame.
+ */
+bool Connection::encode(Connection::MessageType type, const google::protobuf::Message &msg, size_t payloadSize, SendClass& cls, const Descriptor* attached) {
+	using ::google::protobuf::internal::WireFormatLite;
+	using ::google::protobuf::io::CodedOutputStream;
+	uint32_t tag = WireFormatLite::MakeTag(type, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+	uint32_t msgSize = msg.ByteSize();
+
+	// The payload is appended as a trailing field, after the serialized message.
+	uint32_t payloadTag = 0;
+	size_t payloadHeaderSize = 0;
+	if (payloadSize) {
+		uint32_t field = payloadField(type);
+		if (!field) {
+			cerr << "Failed to serialize Message, type " << type << " carries no payload." << endl;
+			return false;
+		}
+		payloadTag = WireFormatLite::MakeTag(field, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+		payloadHeaderSize = CodedOutputStream::VarintSize32(payloadTag) + CodedOutputStream::VarintSize32(payloadSize);
+	}
+	uint32_t bodySize = msgSize + payloadHeaderSize + payloadSize;
+	size_t headerSize = CodedOutputStream::VarintSize32(tag) + CodedOutputStream::VarintSize32(bodySize);
+	if (headerSize + bodySize > MAX_MSG) {
+		cerr << "Failed to serialize Message, too large." << endl;
+		return false;
+	}
+
+	size_t encodedSize = headerSize + msgSize + payloadHeaderSize;
+	if (attached)
+		cls.queue.attach(*attached);
+	byte* buf = cls.queue.allocate(encodedSize);
+	byte* pos = CodedOutputStream::WriteVarint32ToArray(tag, buf);
+	pos = CodedOutputStream::WriteVarint32ToArray(bodySize, pos);
+	pos = msg.SerializeWithCachedSizesToArray(pos);
+	if (payloadTag) {
+		pos = CodedOutputStream::WriteVarint32ToArray(payloadTag, pos);
+		pos = CodedOutputStream::WriteVarint32ToArray(payloadSize, pos);
+	}
+	BOOST_ASSERT((size_t)(pos - buf) == encodedSize);
+	cls.queue.charge(encodedSize);
+	cls.frames.push_back(headerSize + bodySize);
+	_stats.framesOut++;
+	return true;
+}
+
+template <class Payload>
+bool Connection::queueMessage(MessageType type, const ::google::protobuf::Message & msg, const Payload& payload, size_t payloadSize, Priority priority, const Descriptor* attached)
 {
-	size_t bufLimit = prioritized ? SEND_BUF_EMERGENCY : SEND_BUF;
-	if (_sendBuf.size > bufLimit)
+	if (priority == Auto)
+		priority = defaultPriority(type);
+	if (!sendCredit(type, priority))
 		return false;
-	bool prevQueued = _sendBuf.size;
+	SendClass& cls = _sendClasses[priority];
 
-	bool queued = encode(type, msg);
-	if (queued) {
-		if (!prevQueued)
-			trySend();
-		return true;
-	} else {
-		cerr << "Failed to serialize Message." << endl;
+	bool prevQueued = queued() > 0;
+	if (!encode(type, msg, payloadSize, cls, attached))
+		return false;
+	if (payloadSize)
+		cls.queue.append(payload);
+	if (!prevQueued)
+		trySend();
+	return true;
+}
+
+bool Connection::sendMessage(Connection::MessageType type, const::google::protobuf::Message &msg, Priority priority)
+{
+	return queueMessage(type, msg, ByteSlice(), 0, priority);
+}
+
+bool Connection::sendMessage(Connection::MessageType type, const::google::protobuf::Message &msg, const ByteSlice& payload, Priority priority)
+{
+	return queueMessage(type, msg, payload, payload.size(), priority);
+}
+
+bool Connection::sendMessage(Connection::MessageType type, const::google::protobuf::Message &msg, const FileSlice& payload, Priority priority)
+{
+	return queueMessage(type, msg, payload, payload.size, priority);
+}
+
+bool Connection::sendMessage(Connection::MessageType type, const::google::protobuf::Message &msg, const Descriptor& fd, Priority priority)
+{
+	if (!passesDescriptors())
 		return false;
+	return queueMessage(type, msg, ByteSlice(), 0, priority, &fd);
+}
+
+size_t Connection::sendCredit(MessageType type, Priority priority) const
+{
+	if (_sendHeld)
+		return 0;
+	if (priority == Auto)
+		priority = defaultPriority(type);
+	size_t bufLimit = (priority == Control) ? SEND_BUF_EMERGENCY : SEND_BUF;
+	size_t size = _sendClasses[priority].queue.size();
+	return (size < bufLimit) ? (bufLimit - size) : 0;
+}
+
+size_t Connection::queued() const
+{
+	size_t res = 0;
+	for (size_t i = 0; i < Auto; i++)
+		res += _sendClasses[i].queue.size();
+	return res;
+}
+
+SendQueue* Connection::nextSendQueue(size_t& limit)
+{
+	// Never switch class in the middle of a frame, but finish it with a write of its own
+	// so other classes get their turn.
+	if (_sending && _sending->headSent) {
+		limit = _sending->frames.front() - _sending->headSent;
+		return &_sending->queue;
 	}
+
+	limit = SIZE_MAX;
+	_sending = NULL;
+	if (!_sendClasses[Control].queue.empty()) {
+		_sending = &_sendClasses[Control];
+	} else if (!(_sendClasses[Interactive].queue.empty() && _sendClasses[Bulk].queue.empty())) {
+		// Deficit round-robin between the weighted classes
+		while (true) {
+			SendClass& cls = _sendClasses[_roundRobin];
+			if (cls.queue.empty()) {
+				cls.deficit = 0;
+			} else if (cls.deficit > 0) {
+				_sending = &cls;
+				break;
+			}
+			_roundRobin = (_roundRobin == Interactive) ? Bulk : Interactive;
+			_sendClasses[_roundRobin].deficit += _sendClasses[_roundRobin].quantum;
+		}
+	}
+	return _sending ? &_sending->queue : NULL;
 }
 
 void Connection::onWritten(const boost::system::error_code& err, size_t written) {
 	if ((!err) && (written > 0)) {
-		_sendBuf.pop(written);
+		SendClass& cls = *_sending;
+		cls.queue.pop(written);
+		cls.deficit -= written;
+		cls.headSent += written;
+		while (!cls.frames.empty() && (cls.headSent >= cls.frames.front())) {
+			cls.headSent -= cls.frames.front();
+			cls.frames.pop_front();
+		}
+		_stats.bytesOut += written;
 		trySend();
-		if (_sendBuf.size < SEND_BUF_LOW_WATER_MARK)
+		if (queued() < SEND_BUF_LOW_WATER_MARK)
 			writable();
 	} else {
 		cerr << "Failed to write. Disconnecting..." << endl;
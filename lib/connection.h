@@ -1,6 +1,9 @@
 #ifndef BITHORDE_CONNECTION_H
 #define BITHORDE_CONNECTION_H
 
+#include <deque>
+#include <memory>
+#include <ostream>
 #include <queue>
 
 #include <boost/asio/io_service.hpp>
@@ -10,6 +13,8 @@
 #include <boost/smart_ptr/enable_shared_from_this.hpp>
 
 #include "bithorde.pb.h"
+#include "callback.h"
+#include "sendqueue.h"
 #include "types.h"
 
 namespace bithorde {
@@ -30,6 +35,40 @@ public:
 		DataSegment = 8,
 		HandShakeConfirmed = 9,
 		Ping = 10,
+		LocalFile = 11,
+		SharedMemory = 12,
+		ReadV = 13,
+		ReadStream = 14,
+		ReadCancel = 15,
+		BindBatch = 16,
+		AssetStatusBatch = 17,
+	};
+	/**
+	 * Largest content of a single message. Peers agree on a chunk-size up to this in their
+	 * HandShakes, assuming DEFAULT_CHUNK for peers not announcing one.
+	 */
+	const static size_t MAX_CHUNK = 256*1024;
+	const static size_t DEFAULT_CHUNK = 64*1024;
+
+	/**
+	 * Most ranges in a single ReadV-request
+	 */
+	const static size_t MAX_RANGES = 32;
+
+	/**
+	 * Most binds in a single BindBatch, and statuses in a single AssetStatusBatch
+	 */
+	const static size_t MAX_BINDS = 256;
+
+	/**
+	 * Outgoing traffic classes, each queued separately. Control-messages are sent before
+	 * anything else, while Interactive and Bulk share the link by weight.
+	 */
+	enum Priority {
+		Control,
+		Interactive,
+		Bulk,
+		Auto, // Derived from the MessageType
 	};
 	enum State {
 		Connecting,
@@ -38,44 +77,185 @@ public:
 		Authenticated,
 	};
 
+	/**
+	 * Traffic counters for a connection
+	 */
+	struct Stats {
+		uint64_t bytesIn, framesIn, readBatches;
+		uint64_t bytesOut, framesOut;
+		uint64_t messagesAllocated; // Message-objects allocated for decoding
+
+		Stats();
+		Stats& operator+=(const Stats& other);
+	};
+
 	static Pointer create(boost::asio::io_service& ioSvc, const boost::asio::ip::tcp::endpoint& addr);
 	static Pointer create(boost::asio::io_service& ioSvc, boost::shared_ptr< boost::asio::ip::tcp::socket >& socket);
 	static Pointer create(boost::asio::io_service& ioSvc, const boost::asio::local::stream_protocol::endpoint& addr);
 	static Pointer create(boost::asio::io_service& ioSvc, boost::shared_ptr< boost::asio::local::stream_protocol::socket >& socket);
+	virtual ~Connection();
 
 	typedef boost::signals2::signal<void ()> VoidSignal;
-	typedef boost::signals2::signal<void (MessageType, ::google::protobuf::Message&)> MessageSignal;
+	typedef Callback<void (MessageType, ::google::protobuf::Message&, const ByteSlice& payload)> MessageCallback;
 	VoidSignal disconnected;
-	MessageSignal message;
+	MessageCallback message; // Fired for every message, so taking a single handler
 	VoidSignal writable;
 
-	bool sendMessage(MessageType type, const ::google::protobuf::Message & msg, bool prioritized=false);
+	bool sendMessage(MessageType type, const ::google::protobuf::Message & msg, Priority priority=Auto);
+
+	/**
+	 * Sends /msg/ with /payload/ as its content-field. The payload is queued by reference
+	 * and written straight from its buffer, so /msg/ must not have the content-field set.
+	 */
+	bool sendMessage(MessageType type, const ::google::protobuf::Message & msg, const ByteSlice& payload, Priority priority=Auto);
+
+	/**
+	 * Like above, but the payload is sent directly from a file, using sendfile().
+	 */
+	bool sendMessage(MessageType type, const ::google::protobuf::Message & msg, const FileSlice& payload, Priority priority=Auto);
+
+	/**
+	 * Sends /msg/ with /fd/ attached, for the peer to pick up through takeDescriptor().
+	 * Fails unless passesDescriptors().
+	 */
+	bool sendMessage(MessageType type, const ::google::protobuf::Message & msg, const Descriptor& fd, Priority priority=Auto);
+
+	/**
+	 * Whether file descriptors can be passed over this connection, i.e. it's a unix-socket
+	 */
+	virtual bool passesDescriptors() const = 0;
+
+	/**
+	 * While a message is delivered, takes ownership of the file descriptor the peer
+	 * attached to it, if any. Descriptors not taken are closed after delivery.
+	 *
+	 * @return the descriptor, or -1 if none
+	 */
+	int takeDescriptor();
+
+	/**
+	 * Whether the conversation may move into shared memory, i.e. it's a unix-socket
+	 */
+	virtual bool supportsSharedMemory() const { return false; }
+
+	/**
+	 * Offer the peer to continue the conversation in rings of /capacity/ bytes, see
+	 * SharedMemory in bithorde.proto. Sending is held back, with sendCredit() at 0,
+	 * until the queues have drained onto the socket.
+	 *
+	 * @return false if shared memory is not available
+	 */
+	virtual bool offerSharedMemory(size_t capacity) { return false; }
+
+	/**
+	 * Whether messages are sent through shared memory
+	 */
+	virtual bool usesSharedMemory() const { return false; }
+
+	/**
+	 * The traffic class /type/ is sent in, unless told otherwise
+	 */
+	static Priority defaultPriority(MessageType type);
+
+	/**
+	 * The number of bytes which may still be queued for /type/, before sendMessage()
+	 * starts refusing. Callers should defer sending until /writable/ when it reaches 0.
+	 */
+	size_t sendCredit(MessageType type, Priority priority=Auto) const;
+
+	/**
+	 * Stop delivering incoming messages, and reading from the socket. The peer is then
+	 * held back by the transport's own flow-control.
+	 */
+	void pauseRead();
+	void resumeRead();
 
 	virtual void close() = 0;
 
+	const Stats& stats() const { return _stats; }
+
 protected:
 	Connection(boost::asio::io_service& ioSvc);
 
 	virtual void trySend() = 0;
 	virtual void tryRead() = 0;
 	
+	boost::asio::mutable_buffers_1 readBuffer();
 	void onRead(const boost::system::error_code& err, size_t count);
+	void onDescriptor(int fd);
+
+	/**
+	 * Called when descriptors are needed, but none are received yet. Transports not
+	 * receiving them along with the messages must pick them up here.
+	 */
+	virtual void pollDescriptors() {}
+
+	/**
+	 * Called for SharedMemory-messages. Transports not supporting it refuse, by returning false.
+	 */
+	virtual bool onSharedMemory(const bithorde::SharedMemory& msg) { return false; }
+
+	void processFrames();
 	void onWritten(const boost::system::error_code& err, size_t count);
 
-	bool encode(Connection::MessageType type, const::google::protobuf::Message &msg);
+	/**
+	 * Picks the queue to write from next, or NULL if nothing is queued. At most /limit/
+	 * bytes should be written, and the write must be reported to onWritten() before
+	 * asking again.
+	 */
+	SendQueue* nextSendQueue(size_t& limit);
+
+	size_t queued() const;
 
 protected:
 	State _state;
 
 	boost::asio::io_service& _ioSvc;
 
-	Buffer _rcvBuf;
-	Buffer _sendBuf;
+	boost::shared_ptr<Buffer> _rcvBuf;
+	boost::shared_ptr<Buffer> _rcvSpare;
+	size_t _rcvParsed;
+	size_t _rcvFrameSize;
+	bool _reading; // A read is outstanding on the socket
+	bool _readPaused;
+	std::deque<int> _rcvDescriptors; // Received ahead of the message they are attached to
+	int _descriptor; // Attached to the message being delivered
+
+	struct SendClass {
+		SendQueue queue;
+		std::deque<size_t> frames; // Sizes of the queued frames
+		size_t headSent; // Part of the first frame already written
+		size_t quantum;
+		int64_t deficit;
+
+		SendClass();
+	};
+	SendClass _sendClasses[Auto];
+	SendClass* _sending;
+	Priority _roundRobin;
+	bool _sendHeld; // While switching transport, no more messages are accepted
+
+	Stats _stats;
+
+	bool encode(Connection::MessageType type, const::google::protobuf::Message &msg, size_t payloadSize, SendClass& cls, const Descriptor* attached);
 
 private:
-	template <class T> bool dequeue(MessageType type, ::google::protobuf::io::CodedInputStream &stream);
+	template <class Payload>
+	bool queueMessage(MessageType type, const ::google::protobuf::Message & msg, const Payload& payload, size_t payloadSize, Priority priority, const Descriptor* attached=NULL);
+
+	// One re-used instance per message-type. Clear() keeps sub-objects allocated, so
+	// decoding a steady stream of messages requires no allocation after warm-up.
+	std::vector< std::unique_ptr< ::google::protobuf::Message > > _decodeCache;
+	template <class T> T& decodeTarget(MessageType type);
+
+	bool dispatch(const byte* frame, size_t size);
+	template <class T> bool dequeue(MessageType type, const byte* data, size_t size);
+	template <class T> bool dequeue(MessageType type, const byte* data, size_t size, uint32_t payloadField);
+	template <class T> bool dequeueAttached(MessageType type, const byte* data, size_t size);
 };
 
+std::ostream& operator<<(std::ostream& str, const Connection::Stats& stats);
+
 }
 
 #endif // BITHORDE_CONNECTION_H
@@ -0,0 +1,27 @@
+#include "roundtrip.h"
+
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+const long RoundTripFilter::WINDOW;
+
+RoundTripFilter::RoundTripFilter() :
+	_shortest(pt::not_a_date_time)
+{}
+
+void RoundTripFilter::sample(const pt::time_duration& roundTrip, const pt::ptime& now)
+{
+	if (roundTrip.is_negative())
+		return; // The clock was set back
+	if (!measured() || (roundTrip < _shortest) || (now - _at > pt::seconds(WINDOW))) {
+		_shortest = roundTrip;
+		_at = now;
+	}
+}
+
+void RoundTripFilter::reset()
+{
+	_shortest = pt::not_a_date_time;
+	_at = pt::not_a_date_time;
+}
@@ -0,0 +1,44 @@
+#ifndef BITHORDE_ROUNDTRIP_H
+#define BITHORDE_ROUNDTRIP_H
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace bithorde {
+
+/**
+ * The shortest round-trip of a link lately, as its latency without queueing. Longer
+ * round-trips are taken as the peer or link being busy, unless the shortest is older
+ * than WINDOW.
+ */
+class RoundTripFilter
+{
+public:
+	const static long WINDOW = 10; // Seconds the shortest round-trip is kept
+
+	RoundTripFilter();
+
+	/**
+	 * A round-trip of /roundTrip/ ending at /now/
+	 */
+	void sample(const boost::posix_time::time_duration& roundTrip, const boost::posix_time::ptime& now);
+
+	/**
+	 * Forget all round-trips, such as when the link is lost
+	 */
+	void reset();
+
+	bool measured() const { return !_at.is_not_a_date_time(); }
+
+	/**
+	 * Shortest round-trip lately, or not_a_date_time until measured
+	 */
+	boost::posix_time::time_duration shortest() const { return _shortest; }
+
+private:
+	boost::posix_time::time_duration _shortest;
+	boost::posix_time::ptime _at;
+};
+
+}
+
+#endif // BITHORDE_ROUNDTRIP_H
@@ -0,0 +1,150 @@
+#include "sendqueue.h"
+
+#include <boost/assert.hpp>
+
+const size_t MAX_SPARE_BLOCKS = 2;
+
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+SendQueue::SendQueue(size_t blockSize) :
+	_blockSize(blockSize),
+	_size(0)
+{
+}
+
+boost::shared_ptr<Buffer> SendQueue::newBlock(size_t minSize)
+{
+	boost::shared_ptr<Buffer> res;
+	if (minSize <= _blockSize && !_spare.empty()) {
+		res = _spare.back();
+		_spare.pop_back();
+	} else {
+		res.reset(new Buffer());
+		res->grow((minSize > _blockSize) ? minSize : _blockSize);
+	}
+	return res;
+}
+
+void SendQueue::releaseSegment(Segment& segment)
+{
+	if (!segment.owned || (segment.owner == _tail) || !segment.owner.unique())
+		return;
+	// Recycle blocks no longer referred to by any segment.
+	auto block = boost::static_pointer_cast<Buffer>(segment.owner);
+	if ((block->capacity == _blockSize) && (_spare.size() < MAX_SPARE_BLOCKS)) {
+		block->size = 0;
+		_spare.push_back(block);
+	}
+}
+
+byte* SendQueue::allocate(size_t amount)
+{
+	if (!_tail || (_tail->capacity - _tail->size) < amount)
+		_tail = newBlock(amount);
+	return _tail->ptr + _tail->size;
+}
+
+void SendQueue::charge(size_t amount)
+{
+	BOOST_ASSERT(_tail);
+	BOOST_ASSERT(_tail->size + amount <= _tail->capacity);
+	const byte* data = _tail->ptr + _tail->size;
+	if (!_segments.empty() && (_segments.back().owner == _tail) && (_segments.back().data + _segments.back().size == data)) {
+		_segments.back().size += amount;
+	} else {
+		Segment segment = { _tail, data, amount, true, -1, 0, -1 };
+		_segments.push_back(segment);
+	}
+	_tail->size += amount;
+	_size += amount;
+}
+
+void SendQueue::append(const ByteSlice& slice)
+{
+	if (slice.size() < MIN_EXTERNAL_SLICE) {
+		byte* buf = allocate(slice.size());
+		memcpy(buf, slice.data(), slice.size());
+		CopyCounter::count(slice.size());
+		charge(slice.size());
+	} else {
+		Segment segment = { slice.buffer(), slice.data(), slice.size(), false, -1, 0, -1 };
+		_segments.push_back(segment);
+		_size += slice.size();
+	}
+}
+
+void SendQueue::append(const FileSlice& slice)
+{
+	Segment segment = { slice.owner, NULL, slice.size, false, slice.fd, slice.offset, -1 };
+	_segments.push_back(segment);
+	_size += slice.size;
+}
+
+void SendQueue::attach(const Descriptor& fd)
+{
+	// An empty segment, popped along with the first byte after it
+	Segment segment = { fd.owner, NULL, 0, false, -1, 0, fd.fd };
+	_segments.push_back(segment);
+}
+
+void SendQueue::pop(size_t amount)
+{
+	BOOST_ASSERT(amount <= _size);
+	_size -= amount;
+	while (amount) {
+		Segment& head = _segments.front();
+		if (amount < head.size) {
+			if (head.fd >= 0)
+				head.fileOffset += amount;
+			else
+				head.data += amount;
+			head.size -= amount;
+			return;
+		}
+		amount -= head.size;
+		Segment segment = head;
+		_segments.pop_front();
+		releaseSegment(segment);
+	}
+	if (_segments.empty() && _tail) {
+		// Keep the tail block, it is likely to be appended to again.
+		_tail->size = 0;
+	}
+}
+
+SendQueue::Buffers SendQueue::buffers(size_t limit) const
+{
+	Buffers res;
+	auto iter = _segments.begin();
+	if ((iter != _segments.end()) && (iter->attached >= 0))
+		iter++; // Goes out with this write
+	for (; (iter != _segments.end()) && (iter->fd < 0) && (iter->attached < 0) && (res.count < MAX_BUFFERS) && limit; iter++) {
+		size_t size = (iter->size < limit) ? iter->size : limit;
+		res.items[res.count++] = asio::const_buffer(iter->data, size);
+		limit -= size;
+		if (size < iter->size) {
+			res.more = true;
+			return res;
+		}
+	}
+	res.more = (iter != _segments.end());
+	return res;
+}
+
+bool SendQueue::fileHead(int& fd, uint64_t& offset, size_t& size) const
+{
+	if (_segments.empty() || (_segments.front().fd < 0))
+		return false;
+	const Segment& head = _segments.front();
+	fd = head.fd;
+	offset = head.fileOffset;
+	size = head.size;
+	return true;
+}
+
+int SendQueue::attachedHead() const
+{
+	return _segments.empty() ? -1 : _segments.front().attached;
+}
@@ -0,0 +1,133 @@
+#ifndef BITHORDE_SENDQUEUE_H
+#define BITHORDE_SENDQUEUE_H
+
+#include <deque>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "types.h"
+
+namespace bithorde {
+
+/**
+ * Outgoing byte-queue built as a chain of segments. Data is appended at the tail and
+ * consumed from the head without ever being moved, so partial writes are cheap no
+ * matter how much is queued behind them.
+ *
+ * Segments are either copied into blocks owned by the queue, or refer to external
+ * ByteSlices which are sent straight from where they already are. A segment may also
+ * be a FileSlice, which the owner of the queue must send from the file descriptor.
+ *
+ * Descriptors to pass to the peer may be attached in between, and must be sent together
+ * with the first byte following them.
+ */
+class SendQueue : boost::noncopyable {
+public:
+	/**
+	 * The maximum number of buffers handed to a single scatter-gather write.
+	 */
+	const static size_t MAX_BUFFERS = 16;
+
+	/**
+	 * Slices smaller than this are cheaper to copy than to track as a separate segment.
+	 */
+	const static size_t MIN_EXTERNAL_SLICE = 1024;
+
+	/**
+	 * Fixed-capacity ConstBufferSequence, cheap to copy into asynchronous operations.
+	 */
+	struct Buffers {
+		typedef boost::asio::const_buffer value_type;
+		typedef const boost::asio::const_buffer* const_iterator;
+
+		boost::asio::const_buffer items[MAX_BUFFERS];
+		size_t count;
+		bool more; // More data is queued after these buffers
+
+		Buffers() : count(0), more(false) {}
+		const_iterator begin() const { return items; }
+		const_iterator end() const { return items+count; }
+	};
+
+	explicit SendQueue(size_t blockSize);
+
+	/**
+	 * The number of bytes queued
+	 */
+	size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+
+	/**
+	 * Reserve /amount/ contiguous bytes at the end of the queue. The returned memory
+	 * is not part of the queue until charge() is called.
+	 */
+	byte* allocate(size_t amount);
+
+	/**
+	 * Notify /amount/ bytes at the end of the queue has been filled.
+	 */
+	void charge(size_t amount);
+
+	/**
+	 * Append the bytes viewed by /slice/, keeping a reference instead of copying.
+	 */
+	void append(const ByteSlice& slice);
+
+	/**
+	 * Append a range of a file, to be sent directly from the file descriptor.
+	 */
+	void append(const FileSlice& slice);
+
+	/**
+	 * Attach /fd/ to the next byte appended.
+	 */
+	void attach(const Descriptor& fd);
+
+	/**
+	 * Consume /amount/ bytes at the beginning of the queue
+	 */
+	void pop(size_t amount);
+
+	/**
+	 * Buffers covering the head of the queue, suitable for a gathered write. Stops at
+	 * the first file-segment or attached descriptor not at the head, or after /limit/ bytes.
+	 */
+	Buffers buffers(size_t limit=SIZE_MAX) const;
+
+	/**
+	 * If the head of the queue is a file-segment, describe the remaining range of it.
+	 */
+	bool fileHead(int& fd, uint64_t& offset, size_t& size) const;
+
+	/**
+	 * The descriptor attached to the head of the queue, or -1 if none.
+	 */
+	int attachedHead() const;
+
+private:
+	struct Segment {
+		boost::shared_ptr<void> owner;
+		const byte* data;
+		size_t size;
+		bool owned; // /owner/ is one of our blocks, not an external buffer
+		int fd; // For file-segments, -1 otherwise
+		uint64_t fileOffset;
+		int attached; // Descriptor for the byte after this empty segment, -1 otherwise
+	};
+
+	boost::shared_ptr<Buffer> newBlock(size_t minSize);
+	void releaseSegment(Segment& segment);
+
+	std::deque<Segment> _segments;
+	boost::shared_ptr<Buffer> _tail;
+	std::vector< boost::shared_ptr<Buffer> > _spare;
+	size_t _blockSize;
+	size_t _size;
+};
+
+}
+
+#endif // BITHORDE_SENDQUEUE_H
@@ -0,0 +1,219 @@
+#include "sequentialreader.h"
+
+#include <algorithm>
+
+#include "client.h"
+
+using namespace std;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+const static size_t READ_BATCH = 5; // Chunks sent together in one ReadV
+
+const size_t SequentialReader::MAX_AUTO_WINDOW;
+const int SequentialReader::DEFAULT_RETRIES;
+
+SequentialReader::SequentialReader(ReadAsset& asset, uint64_t offset, uint64_t size) :
+	_asset(asset),
+	_offset(offset),
+	_end(offset + size),
+	_chunkSize(0),
+	_chunks(0),
+	_delivered(0),
+	_requested(0),
+	_window(0),
+	_maxWindow(MAX_AUTO_WINDOW),
+	_retries(DEFAULT_RETRIES),
+	_running(false)
+{
+	_asset.dataArrived.connect<SequentialReader, &SequentialReader::onData>(this);
+}
+
+SequentialReader::~SequentialReader()
+{
+	_asset.dataArrived.disconnect();
+	if (_running)
+		cancelPending();
+}
+
+bool SequentialReader::start()
+{
+	if (!_asset.isBound() || (_end <= _offset))
+		return false;
+	_chunkSize = _asset.client()->chunkSize();
+	_chunks = (_end - _offset + _chunkSize - 1) / _chunkSize;
+	_delivered = _requested = 0;
+	if (_maxWindow) {
+		_tuner.reset(new WindowTuner(_chunkSize, 2 * _chunkSize, _maxWindow));
+		_window = _tuner->window();
+	}
+	_running = true;
+	if (!fill()) {
+		_running = false;
+		return false;
+	}
+	return true;
+}
+
+void SequentialReader::setWindow(size_t bytes)
+{
+	_window = bytes;
+	_maxWindow = 0;
+	_tuner.reset();
+}
+
+void SequentialReader::setAutoWindow(size_t maxWindow)
+{
+	_maxWindow = maxWindow;
+	if (_running) {
+		_tuner.reset(new WindowTuner(_chunkSize, 2 * _chunkSize, _maxWindow));
+		_window = _tuner->window();
+	}
+}
+
+uint64_t SequentialReader::position() const
+{
+	return min(_offset + _delivered * _chunkSize, _end);
+}
+
+uint64_t SequentialReader::inFlight() const
+{
+	return min(_offset + _requested * _chunkSize, _end) - position();
+}
+
+ReadAsset::Range SequentialReader::range(uint64_t chunk) const
+{
+	uint64_t offset = _offset + chunk * _chunkSize;
+	return ReadAsset::Range(offset, min<uint64_t>(_chunkSize, _end - offset));
+}
+
+void SequentialReader::reserve(size_t chunks)
+{
+	if (chunks <= _ring.size())
+		return;
+	vector<Slot> ring(max(chunks, _ring.size() * 2));
+	for (uint64_t chunk = _delivered; chunk < _requested; chunk++)
+		ring[chunk % ring.size()] = slot(chunk);
+	_ring.swap(ring);
+}
+
+bool SequentialReader::fill()
+{
+	size_t window = max<size_t>(_window / _chunkSize, 1);
+	size_t pending = _requested - _delivered;
+	uint64_t left = _chunks - _requested;
+	if ((pending >= window) || !left)
+		return true;
+	size_t room = min<uint64_t>(window - pending, left);
+
+	// Peers serving ReadV get the window refilled a batch at a time
+	bool vectored = _asset.client()->peerServesVectoredReads();
+	if (vectored && (room < min(READ_BATCH, window)) && (room < left))
+		return true;
+
+	reserve(pending + room);
+	vector<ReadAsset::Range> ranges;
+	for (; room; room--, _requested++) {
+		Slot& s = slot(_requested);
+		s.data = ByteSlice();
+		s.tag = -1;
+		s.tries = 0;
+		s.arrived = false;
+		ranges.push_back(range(_requested));
+	}
+	return request(ranges, vectored);
+}
+
+bool SequentialReader::request(const vector<ReadAsset::Range>& ranges, bool vectored)
+{
+	pt::ptime now = pt::microsec_clock::universal_time();
+	for (size_t first = 0; first < ranges.size(); first += Connection::MAX_RANGES) {
+		size_t count = min(ranges.size() - first, Connection::MAX_RANGES);
+		int tag = -1;
+		if (vectored && (count > 1)) {
+			vector<ReadAsset::Range> batch(ranges.begin() + first, ranges.begin() + first + count);
+			tag = _asset.aSyncReadV(batch);
+		}
+		for (size_t i = first; i < first + count; i++) {
+			Slot& s = slot((ranges[i].first - _offset) / _chunkSize);
+			s.tag = (tag >= 0) ? tag : _asset.aSyncRead(ranges[i].first, ranges[i].second);
+			s.sent = now;
+			if (s.tag < 0)
+				return false;
+		}
+	}
+	return true;
+}
+
+void SequentialReader::onData(uint64_t offset, const ByteSlice& data, int tag, bithorde::Status status)
+{
+	if (!_running || (offset < _offset) || (offset >= _end))
+		return;
+	uint64_t chunk = (offset - _offset) / _chunkSize;
+	if ((chunk < _delivered) || (chunk >= _requested))
+		return;
+	Slot& s = slot(chunk);
+	if (s.arrived || (s.tag != tag))
+		return; // From a try given up on
+
+	ReadAsset::Range expected = range(chunk);
+	if ((status == bithorde::SUCCESS) && (offset == expected.first) && (data.size() == expected.second)) {
+		s.data = data;
+		s.arrived = true;
+		if (_tuner) {
+			pt::ptime now = pt::microsec_clock::universal_time();
+			if (!s.tries) // Which try a retried chunk is from is unknown
+				_tuner->onRoundTrip(now - s.sent, now);
+			_tuner->onDelivered(data.size(), now);
+			_window = _tuner->window();
+		}
+	} else if (s.tries < _retries) {
+		if (_tuner && (status == bithorde::TIMEOUT)) {
+			_tuner->onTimeout();
+			_window = _tuner->window();
+		}
+		// Short reads are retried too, since the rest would not fit the ring
+		s.tries++;
+		s.tag = _asset.aSyncRead(expected.first, expected.second);
+		if (s.tag < 0)
+			finish(bithorde::ERROR);
+		return;
+	} else {
+		finish((status == bithorde::SUCCESS) ? bithorde::ERROR : status);
+		return;
+	}
+
+	while ((_delivered < _requested) && slot(_delivered).arrived) {
+		Slot& head = slot(_delivered);
+		ByteSlice ready(head.data);
+		head.data = ByteSlice(); // Release the buffer as soon as it is delivered
+		head.arrived = false;
+		uint64_t at = range(_delivered).first;
+		_delivered++;
+		dataArrived(at, ready);
+	}
+
+	if (_delivered == _chunks)
+		finish(bithorde::SUCCESS);
+	else if (!fill())
+		finish(bithorde::ERROR);
+}
+
+void SequentialReader::cancelPending()
+{
+	int cancelled = -1;
+	for (uint64_t chunk = _delivered; chunk < _requested; chunk++) {
+		Slot& s = slot(chunk);
+		if (!s.arrived && (s.tag >= 0) && (s.tag != cancelled)) // Chunks of a ReadV share its tag
+			_asset.cancel(cancelled = s.tag);
+		s.data = ByteSlice();
+	}
+}
+
+void SequentialReader::finish(bithorde::Status status)
+{
+	_running = false;
+	cancelPending();
+	finished(status); // May destroy this reader
+}
@@ -0,0 +1,120 @@
+#ifndef BITHORDE_SEQUENTIALREADER_H
+#define BITHORDE_SEQUENTIALREADER_H
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/signals2.hpp>
+
+#include "asset.h"
+#include "callback.h"
+#include "types.h"
+#include "windowtuner.h"
+
+namespace bithorde {
+
+/**
+ * Reads a range of a bound ReadAsset from start to end, keeping a window of chunk-sized
+ * reads in flight, batched into ReadV:s where the peer serves them. Chunks coming back out
+ * of order are held in a ring until the ones before them are in, so the data is delivered
+ * strictly in order. Failed chunks are read again, on top of the RetryPolicy of the asset.
+ * The window is tuned to the link by a WindowTuner, unless set.
+ *
+ * The reader takes over dataArrived of the asset while it exists.
+ */
+class SequentialReader : boost::noncopyable
+{
+public:
+	static const size_t MAX_AUTO_WINDOW = 64*1024*1024;
+	static const int DEFAULT_RETRIES = 2; // Tries of each chunk after the first
+
+	/**
+	 * Reads /size/ bytes from /offset/ of /asset/, which must outlive the reader
+	 */
+	SequentialReader(ReadAsset& asset, uint64_t offset, uint64_t size);
+	~SequentialReader(); // Cancels the reads in flight
+
+	/**
+	 * Starts reading, in chunks of the chunkSize() of the client
+	 *
+	 * @return false if the asset is not bound, the range is empty, or on failure
+	 */
+	bool start();
+
+	/**
+	 * Bytes to keep in flight, at least a chunk, instead of tuning the window. Takes effect
+	 * as chunks come in.
+	 */
+	void setWindow(size_t bytes);
+
+	/**
+	 * Tunes the window to the bandwidth-delay product of the link, as measured by the
+	 * round-trips and delivery rate of the chunks, up to /maxWindow/ bytes. The default.
+	 */
+	void setAutoWindow(size_t maxWindow=MAX_AUTO_WINDOW);
+
+	/**
+	 * Bytes kept in flight, once started
+	 */
+	size_t window() const { return _window; }
+	const WindowTuner* tuner() const { return _tuner.get(); }
+
+	void setRetries(int retries) { _retries = retries; }
+
+	/**
+	 * The offset up to which data has been delivered
+	 */
+	uint64_t position() const;
+
+	/**
+	 * Bytes requested, but not yet delivered
+	 */
+	uint64_t inFlight() const;
+
+	// Every chunk, in order. The handler must not destroy the reader.
+	typedef Callback<void (uint64_t offset, const ByteSlice& data)> DataCallback;
+	DataCallback dataArrived;
+
+	// SUCCESS once all is delivered, or the status the last try of a chunk failed with.
+	// Nothing more is read after.
+	typedef boost::signals2::signal<void (bithorde::Status)> FinishedSignal;
+	FinishedSignal finished;
+
+private:
+	struct Slot {
+		ByteSlice data;
+		int tag;
+		int tries;
+		bool arrived;
+		boost::posix_time::ptime sent; // Of the first try
+	};
+
+	Slot& slot(uint64_t chunk) { return _ring[chunk % _ring.size()]; }
+	ReadAsset::Range range(uint64_t chunk) const;
+	void reserve(size_t chunks);
+	bool fill();
+	bool request(const std::vector<ReadAsset::Range>& ranges, bool vectored);
+	void cancelPending();
+	void onData(uint64_t offset, const ByteSlice& data, int tag, bithorde::Status status);
+	void finish(bithorde::Status status);
+
+	ReadAsset& _asset;
+	uint64_t _offset, _end;
+	size_t _chunkSize;
+	uint64_t _chunks;
+	uint64_t _delivered; // Chunks delivered, and the first one in the ring
+	uint64_t _requested; // Chunks requested
+	std::vector<Slot> _ring;
+	size_t _window;
+	size_t _maxWindow; // Of the tuner, or 0 for a set window
+	std::unique_ptr<WindowTuner> _tuner;
+	int _retries;
+	bool _running;
+};
+
+}
+
+#endif // BITHORDE_SEQUENTIALREADER_H
@@ -0,0 +1,181 @@
+#include "shmring.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+using namespace bithorde;
+
+// Each side writes its own cache-line only
+struct ShmRing::Header {
+	std::atomic<uint64_t> head; // Written by the consumer
+	char _pad1[64 - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint64_t> tail; // Written by the producer
+	char _pad2[64 - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint32_t> consumerSleeps;
+	std::atomic<uint32_t> producerSleeps;
+	char _pad3[64 - 2*sizeof(std::atomic<uint32_t>)];
+};
+
+size_t ShmRing::footprint(size_t capacity)
+{
+	return sizeof(Header) + capacity;
+}
+
+ShmRing::ShmRing() :
+	_header(NULL),
+	_data(NULL),
+	_capacity(0),
+	_pos(0)
+{
+}
+
+void ShmRing::attach(void* mem, size_t capacity)
+{
+	// Fresh memory is all zeroes, which is an empty ring
+	_header = (Header*)mem;
+	_data = (byte*)mem + sizeof(Header);
+	_capacity = capacity;
+	_pos = 0;
+}
+
+size_t ShmRing::regions(uint64_t pos, size_t size, struct iovec iov[2])
+{
+	size_t offset = pos & (_capacity - 1);
+	size_t first = min(size, _capacity - offset);
+	iov[0].iov_base = _data + offset;
+	iov[0].iov_len = first;
+	iov[1].iov_base = _data;
+	iov[1].iov_len = size - first;
+	return size;
+}
+
+ssize_t ShmRing::reserve(struct iovec iov[2])
+{
+	uint64_t used = _pos - _header->head.load(std::memory_order_acquire);
+	if (used > _capacity)
+		return -1;
+	return regions(_pos, _capacity - used, iov);
+}
+
+bool ShmRing::commit(size_t amount)
+{
+	_pos += amount;
+	_header->tail.store(_pos, std::memory_order_release);
+	// Pairs with the fence in consumerSleep(), so either it sees the data, or we see it sleeping
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return _header->consumerSleeps.load(std::memory_order_relaxed) && _header->consumerSleeps.exchange(0);
+}
+
+ssize_t ShmRing::peek(struct iovec iov[2])
+{
+	uint64_t available = _header->tail.load(std::memory_order_acquire) - _pos;
+	if (available > _capacity)
+		return -1;
+	return regions(_pos, available, iov);
+}
+
+bool ShmRing::consume(size_t amount)
+{
+	_pos += amount;
+	_header->head.store(_pos, std::memory_order_release);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return _header->producerSleeps.load(std::memory_order_relaxed) && _header->producerSleeps.exchange(0);
+}
+
+bool ShmRing::producerSleep()
+{
+	_header->producerSleeps.store(1);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if ((_pos - _header->head.load(std::memory_order_acquire)) < _capacity) {
+		_header->producerSleeps.store(0);
+		return false;
+	}
+	return true;
+}
+
+bool ShmRing::consumerSleep()
+{
+	_header->consumerSleeps.store(1);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (_header->tail.load(std::memory_order_acquire) != _pos) {
+		_header->consumerSleeps.store(0);
+		return false;
+	}
+	return true;
+}
+
+ShmRings::ShmRings(int fd, size_t capacity, bool creator) :
+	_fd(fd),
+	_capacity(capacity),
+	_creator(creator),
+	_mem(NULL),
+	_size(2 * ShmRing::footprint(capacity))
+{
+}
+
+ShmRings::~ShmRings()
+{
+	if (_mem)
+		munmap(_mem, _size);
+	close(_fd);
+}
+
+bool ShmRings::validCapacity(size_t capacity)
+{
+	return (capacity >= MIN_CAPACITY) && (capacity <= MAX_CAPACITY) && !(capacity & (capacity - 1));
+}
+
+ShmRings::Pointer ShmRings::create(size_t capacity)
+{
+	if (!validCapacity(capacity))
+		return Pointer(); // The peer would refuse them
+#ifdef MFD_ALLOW_SEALING
+	int fd = memfd_create("bithorde", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return Pointer();
+	Pointer res(new ShmRings(fd, capacity, true));
+	// Sealed, so the peer can trust the size never changes under it
+	if ((ftruncate(fd, res->_size) < 0) ||
+	    (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) ||
+	    !res->init())
+		return Pointer();
+	return res;
+#else
+	return Pointer();
+#endif
+}
+
+ShmRings::Pointer ShmRings::map(int fd, size_t capacity)
+{
+	Pointer res(new ShmRings(fd, capacity, false));
+	if (!validCapacity(capacity))
+		return Pointer();
+#ifdef F_GET_SEALS
+	// An unsealed file could be truncated while mapped, crashing us with SIGBUS
+	int seals = fcntl(fd, F_GET_SEALS);
+	struct stat s;
+	if ((seals < 0) || !(seals & F_SEAL_SHRINK) ||
+	    (fstat(fd, &s) < 0) || ((size_t)s.st_size < res->_size) ||
+	    !res->init())
+		return Pointer();
+	return res;
+#else
+	return Pointer();
+#endif
+}
+
+bool ShmRings::init()
+{
+	void* mem = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (mem == MAP_FAILED)
+		return false;
+	_mem = mem;
+	_rings[0].attach(_mem, _capacity);
+	_rings[1].attach((byte*)_mem + ShmRing::footprint(_capacity), _capacity);
+	return true;
+}
@@ -0,0 +1,141 @@
+#ifndef BITHORDE_SHMRING_H
+#define BITHORDE_SHMRING_H
+
+#include <atomic>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "types.h"
+
+namespace bithorde {
+
+/**
+ * Byte-ring with a single producer and a single consumer, living in memory shared with
+ * another process. Each side keeps its own position, and checks the position published by
+ * the other before trusting it.
+ *
+ * A side with nothing to do may sleep, after announcing it through producerSleep() or
+ * consumerSleep(). The other side is then told to wake it, by commit() or consume().
+ */
+class ShmRing {
+public:
+	/**
+	 * Bytes of shared memory needed for a ring of /capacity/
+	 */
+	static size_t footprint(size_t capacity);
+
+	ShmRing();
+
+	/**
+	 * Use the ring laid out at /mem/. /capacity/ must be a power of two.
+	 */
+	void attach(void* mem, size_t capacity);
+
+	/**
+	 * Producer: the free space, as up to two regions in /iov/
+	 *
+	 * @return the free space, or -1 if the consumer corrupted the ring
+	 */
+	ssize_t reserve(struct iovec iov[2]);
+
+	/**
+	 * Producer: publish /amount/ bytes written to the reserved space
+	 *
+	 * @return true if the consumer sleeps, and must be woken
+	 */
+	bool commit(size_t amount);
+
+	/**
+	 * Consumer: the data available, as up to two regions in /iov/
+	 *
+	 * @return the amount available, or -1 if the producer corrupted the ring
+	 */
+	ssize_t peek(struct iovec iov[2]);
+
+	/**
+	 * Consumer: release /amount/ bytes of the available data
+	 *
+	 * @return true if the producer sleeps, and must be woken
+	 */
+	bool consume(size_t amount);
+
+	/**
+	 * Announce that the producer is about to sleep, waiting for space.
+	 *
+	 * @return false if there is space already, and the producer should carry on
+	 */
+	bool producerSleep();
+
+	/**
+	 * Announce that the consumer is about to sleep, waiting for data.
+	 *
+	 * @return false if there is data already, and the consumer should carry on
+	 */
+	bool consumerSleep();
+
+private:
+	struct Header;
+	size_t regions(uint64_t pos, size_t size, struct iovec iov[2]);
+
+	Header* _header;
+	byte* _data;
+	size_t _capacity;
+	uint64_t _pos; // Produced or consumed, depending on the side
+};
+
+/**
+ * Two ShmRings in a sealed memfd, one for each direction. The first carries data from the
+ * side creating them, the second data to it.
+ */
+class ShmRings : boost::noncopyable {
+public:
+	typedef boost::shared_ptr<ShmRings> Pointer;
+
+	/**
+	 * Smallest and largest capacity accepted. Capacities must also be powers of two.
+	 */
+	const static size_t MIN_CAPACITY = 64*1024;
+	const static size_t MAX_CAPACITY = 64*1024*1024;
+	static bool validCapacity(size_t capacity);
+
+	/**
+	 * Creates fresh rings of /capacity/ bytes each
+	 *
+	 * @return the rings, or NULL if /capacity/ is not valid, or the platform has no memfd:s
+	 */
+	static Pointer create(size_t capacity);
+
+	/**
+	 * Maps rings created by the peer. /fd/ is taken over, and must be sealed against
+	 * shrinking.
+	 *
+	 * @return the rings, or NULL if /fd/ does not hold rings of /capacity/
+	 */
+	static Pointer map(int fd, size_t capacity);
+
+	~ShmRings();
+
+	int fd() const { return _fd; }
+	size_t capacity() const { return _capacity; }
+
+	ShmRing& outgoing() { return _rings[_creator ? 0 : 1]; }
+	ShmRing& incoming() { return _rings[_creator ? 1 : 0]; }
+
+private:
+	ShmRings(int fd, size_t capacity, bool creator);
+	bool init();
+
+	int _fd;
+	size_t _capacity;
+	bool _creator;
+	void* _mem;
+	size_t _size;
+	ShmRing _rings[2];
+};
+
+}
+
+#endif // BITHORDE_SHMRING_H
@@ -0,0 +1,121 @@
+#ifndef BITHORDE_SLOTMAP_H
+#define BITHORDE_SLOTMAP_H
+
+#include <deque>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+/**
+ * Dense map for the small integer ids handed out to peers, such as asset-handles and
+ * request-ids. A key is the index of its slot, tagged in the upper GENERATION_BITS with
+ * the generation of the slot, which is bumped every time the slot is freed. A key kept
+ * after being freed will then not find whatever took its slot next.
+ *
+ * Freed slots are reused last-in-first-out. Their values are kept as they were left, so
+ * a warmed-up map never allocates. Slots live in a deque, so references to values stay
+ * valid as the map grows.
+ */
+template <typename T, int GENERATION_BITS>
+class SlotMap : boost::noncopyable {
+	struct Slot {
+		T value;
+		uint32_t generation;
+		int64_t nextFree; // Or -1 at the end of the free-list
+		bool used;
+	};
+	std::deque<Slot> _slots;
+	size_t _first;
+	int64_t _free;
+	size_t _size;
+public:
+	typedef int Key;
+
+	const static int INDEX_BITS = 31 - GENERATION_BITS;
+	const static uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+	const static uint32_t GENERATION_MASK = (1u << GENERATION_BITS) - 1;
+
+	/**
+	 * Keys start from /first/, so that the keys below are never handed out
+	 */
+	explicit SlotMap(size_t first=1) :
+		_slots(first),
+		_first(first),
+		_free(-1),
+		_size(0)
+	{}
+
+	/**
+	 * Takes a free slot, growing the map if none is left. Its value is that left by the
+	 * last user of the slot, or default-constructed.
+	 *
+	 * @return the key of the slot, or -1 if the map is full
+	 */
+	Key allocate() {
+		size_t index;
+		if (_free >= 0) {
+			index = _free;
+			_free = _slots[index].nextFree;
+		} else if (_slots.size() <= INDEX_MASK) {
+			index = _slots.size();
+			_slots.resize(index+1);
+		} else {
+			return -1;
+		}
+		Slot& slot = _slots[index];
+		slot.used = true;
+		_size++;
+		return ((slot.generation & GENERATION_MASK) << INDEX_BITS) | index;
+	}
+
+	/**
+	 * The value of /key/, or NULL if it is not in use, or a stale key to its slot
+	 */
+	T* find(Key key) {
+		uint32_t index = (uint32_t)key & INDEX_MASK;
+		if ((key < 0) || (index < _first) || (index >= _slots.size()))
+			return NULL;
+		Slot& slot = _slots[index];
+		if (!slot.used || ((slot.generation & GENERATION_MASK) != ((uint32_t)key >> INDEX_BITS)))
+			return NULL;
+		return &slot.value;
+	}
+
+	/**
+	 * Frees the slot of /key/ for reuse, leaving its value as is
+	 *
+	 * @return false if /key/ was not in use
+	 */
+	bool free(Key key) {
+		if (!find(key))
+			return false;
+		size_t index = (uint32_t)key & INDEX_MASK;
+		Slot& slot = _slots[index];
+		slot.used = false;
+		slot.generation++;
+		slot.nextFree = _free;
+		_free = index;
+		_size--;
+		return true;
+	}
+
+	/**
+	 * The keys in use, in the order of their slots
+	 */
+	std::vector<Key> keys() const {
+		std::vector<Key> res;
+		res.reserve(_size);
+		for (size_t index=_first; index < _slots.size(); index++) {
+			const Slot& slot = _slots[index];
+			if (slot.used)
+				res.push_back(((slot.generation & GENERATION_MASK) << INDEX_BITS) | index);
+		}
+		return res;
+	}
+
+	size_t size() const { return _size; }
+	bool empty() const { return !_size; }
+};
+
+#endif // BITHORDE_SLOTMAP_H
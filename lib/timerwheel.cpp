@@ -0,0 +1,183 @@
+#include "timerwheel.h"
+
+#include <boost/asio/placeholders.hpp>
+#include <boost/assert.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <time.h>
+
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+const static uint64_t MAX_TICKS = (1ull << (TimerWheel::SLOT_BITS * TimerWheel::LEVELS)) - 1;
+
+boost::asio::io_service::id TimerWheel::id;
+
+// Cheaper than the calendar-time of posix_time, and not set back
+static int64_t monotonicMicros() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
+
+TimerWheel::Timer::Timer(TimerWheel& wheel, const Handler& handler) :
+	_wheel(wheel),
+	_expires(0),
+	_handler(handler)
+{
+	prev = next = NULL;
+}
+
+TimerWheel::Timer::Timer(asio::io_service& ioSvc, const Handler& handler) :
+	_wheel(asio::use_service<TimerWheel>(ioSvc)),
+	_expires(0),
+	_handler(handler)
+{
+	prev = next = NULL;
+}
+
+TimerWheel::Timer::~Timer()
+{
+	cancel();
+}
+
+void TimerWheel::Timer::arm(const boost::posix_time::time_duration& timeout)
+{
+	BOOST_ASSERT(_handler);
+	cancel();
+	int64_t now = monotonicMicros() - _wheel._epoch;
+	int64_t expires = (now + timeout.total_microseconds() + 999) / 1000; // Never early
+	if (!_wheel._count && (now / 1000 > (int64_t)_wheel._current))
+		_wheel._current = now / 1000; // Idle, so no ticks to catch up on
+	_expires = (expires > (int64_t)_wheel._current) ? expires : _wheel._current + 1;
+	_wheel.add(this);
+	_wheel.schedule(_expires);
+}
+
+void TimerWheel::Timer::arm(const boost::posix_time::time_duration& timeout, const Handler& handler)
+{
+	_handler = handler;
+	arm(timeout);
+}
+
+void TimerWheel::Timer::cancel()
+{
+	if (next)
+		_wheel.remove(this);
+}
+
+TimerWheel::TimerWheel(asio::io_service& ioSvc) :
+	asio::io_service::service(ioSvc),
+	_current(0),
+	_wakeAt(0),
+	_count(0),
+	_epoch(monotonicMicros()),
+	_driver(ioSvc)
+{
+	for (size_t level=0; level < LEVELS; level++) {
+		for (size_t slot=0; slot < SLOTS; slot++)
+			_slots[level][slot].prev = _slots[level][slot].next = &_slots[level][slot];
+	}
+}
+
+void TimerWheel::shutdown_service()
+{
+	// Timers outliving the io_service must not touch the wheel when destroyed
+	for (size_t level=0; level < LEVELS; level++) {
+		for (size_t slot=0; slot < SLOTS; slot++) {
+			Link& head = _slots[level][slot];
+			while (head.next != &head)
+				remove(static_cast<Timer*>(head.next));
+		}
+	}
+	_driver.cancel();
+}
+
+uint64_t TimerWheel::now() const
+{
+	return (monotonicMicros() - _epoch) / 1000;
+}
+
+void TimerWheel::add(Timer* timer)
+{
+	BOOST_ASSERT(timer->_expires >= _current);
+	uint64_t delta = timer->_expires - _current;
+	if (delta > MAX_TICKS) {
+		timer->_expires = _current + MAX_TICKS;
+		delta = MAX_TICKS;
+	}
+	size_t level = 0;
+	while ((level+1 < LEVELS) && (delta >> (SLOT_BITS*(level+1))))
+		level++;
+	Link& head = _slots[level][(timer->_expires >> (SLOT_BITS*level)) & (SLOTS-1)];
+	timer->prev = head.prev;
+	timer->next = &head;
+	head.prev->next = timer;
+	head.prev = timer;
+	_count++;
+}
+
+void TimerWheel::remove(Timer* timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = timer->next = NULL;
+	_count--;
+}
+
+/**
+ * Moves the timers of the slot of /tick/ on /level/ down to the levels below
+ */
+void TimerWheel::cascade(size_t level, uint64_t tick)
+{
+	Link& head = _slots[level][(tick >> (SLOT_BITS*level)) & (SLOTS-1)];
+	while (head.next != &head) {
+		Timer* timer = static_cast<Timer*>(head.next);
+		remove(timer);
+		add(timer);
+	}
+}
+
+void TimerWheel::advance(uint64_t tick)
+{
+	while (_count && (_current < tick)) {
+		uint64_t next = ++_current;
+		for (size_t level=1; (level < LEVELS) && !(next & ((1ull << (SLOT_BITS*level)) - 1)); level++)
+			cascade(level, next);
+		Link& head = _slots[0][next & (SLOTS-1)];
+		while (head.next != &head) {
+			Timer* timer = static_cast<Timer*>(head.next);
+			remove(timer);
+			timer->_handler();
+		}
+	}
+	if (_current < tick)
+		_current = tick; // Nothing left to run
+}
+
+void TimerWheel::schedule(uint64_t tick)
+{
+	if (_wakeAt && (_wakeAt <= tick))
+		return;
+	_wakeAt = tick;
+	_driver.expires_from_now(boost::posix_time::microseconds(tick*1000 - (monotonicMicros() - _epoch)));
+	_driver.async_wait(boost::bind(&TimerWheel::onTick, this, asio::placeholders::error));
+}
+
+void TimerWheel::onTick(const boost::system::error_code& error)
+{
+	if (error)
+		return; // Rescheduled, or shut down
+	_wakeAt = 0;
+	advance(now());
+	if (!_count)
+		return;
+
+	// The next tick with timers due, or else the next move down from the level above
+	uint64_t next = _current + 1;
+	uint64_t boundary = (_current | (SLOTS-1)) + 1;
+	while ((next < boundary) && (_slots[0][next & (SLOTS-1)].next == &_slots[0][next & (SLOTS-1)]))
+		next++;
+	schedule(next);
+}
@@ -0,0 +1,88 @@
+#ifndef BITHORDE_TIMERWHEEL_H
+#define BITHORDE_TIMERWHEEL_H
+
+#include <stdint.h>
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace bithorde {
+
+/**
+ * Hierarchical timer-wheel shared by all timers of an io_service, and driven by a single
+ * deadline_timer on it. Arming and cancelling a timer are O(1) and do not allocate, so
+ * every binding and request can afford one.
+ *
+ * Timers are kept in millisecond ticks on LEVELS wheels of SLOTS slots each, every level
+ * spanning SLOTS times the one below it. Timers on the upper levels move down as their
+ * slot comes up. The driver only wakes for ticks with timers due, or to move timers down.
+ */
+class TimerWheel : public boost::asio::io_service::service {
+	struct Link {
+		Link* prev;
+		Link* next;
+	};
+public:
+	typedef boost::function<void ()> Handler;
+
+	const static int SLOT_BITS = 8;
+	const static size_t SLOTS = 1 << SLOT_BITS;
+	const static size_t LEVELS = 4;
+
+	static boost::asio::io_service::id id;
+
+	/**
+	 * A timer on the wheel of an io_service. Unlike deadline_timer, the handler is not
+	 * called at all once cancelled. It may re-arm the timer, but not destroy it.
+	 */
+	class Timer : Link, boost::noncopyable {
+		friend class TimerWheel;
+		TimerWheel& _wheel;
+		uint64_t _expires; // Tick
+		Handler _handler;
+	public:
+		explicit Timer(TimerWheel& wheel, const Handler& handler=Handler());
+		explicit Timer(boost::asio::io_service& ioSvc, const Handler& handler=Handler());
+		~Timer();
+
+		/**
+		 * Calls the handler once /timeout/ has passed, replacing any earlier arming
+		 */
+		void arm(const boost::posix_time::time_duration& timeout);
+		void arm(const boost::posix_time::time_duration& timeout, const Handler& handler);
+
+		void cancel();
+		bool armed() const { return next; }
+	};
+
+	explicit TimerWheel(boost::asio::io_service& ioSvc);
+
+	/**
+	 * The number of timers armed
+	 */
+	size_t size() const { return _count; }
+
+private:
+	virtual void shutdown_service();
+
+	uint64_t now() const;
+	void add(Timer* timer);
+	void remove(Timer* timer);
+	void cascade(size_t level, uint64_t tick);
+	void advance(uint64_t tick);
+	void schedule(uint64_t tick);
+	void onTick(const boost::system::error_code& error);
+
+	Link _slots[LEVELS][SLOTS];
+	uint64_t _current; // The last tick run
+	uint64_t _wakeAt; // The tick the driver is waiting for, or 0
+	size_t _count;
+	int64_t _epoch; // Of tick 0, in monotonic microseconds
+	boost::asio::deadline_timer _driver;
+};
+
+}
+
+#endif // BITHORDE_TIMERWHEEL_H
@@ -1 +1,57 @@
 #include "types.h"
+
+#include <atomic>
+
+#include <boost/assert.hpp>
+
+static std::atomic<uint64_t> _copies(0);
+static std::atomic<uint64_t> _copiedBytes(0);
+
+void CopyCounter::count(size_t bytes)
+{
+	_copies.fetch_add(1, std::memory_order_relaxed);
+	_copiedBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+uint64_t CopyCounter::copies()
+{
+	return _copies.load(std::memory_order_relaxed);
+}
+
+uint64_t CopyCounter::bytes()
+{
+	return _copiedBytes.load(std::memory_order_relaxed);
+}
+
+void CopyCounter::reset()
+{
+	_copies.store(0, std::memory_order_relaxed);
+	_copiedBytes.store(0, std::memory_order_relaxed);
+}
+
+ByteSlice ByteSlice::slice(size_t offset, size_t size) const
+{
+	BOOST_ASSERT(offset + size <= _size);
+	ByteSlice res(*this);
+	res._data += offset;
+	res._size = size;
+	return res;
+}
+
+ByteSlice ByteSlice::copy() const
+{
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	if (_size) {
+		buf->grow(_size);
+		memcpy(buf->ptr, _data, _size);
+		buf->charge(_size);
+		CopyCounter::count(_size);
+	}
+	return ByteSlice(buf, 0, _size);
+}
+
+std::string ByteSlice::str() const
+{
+	CopyCounter::count(_size);
+	return std::string((const char*)_data, _size);
+}
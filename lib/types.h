@@ -2,10 +2,14 @@
 #define BITHORDE_TYPES_H
 
 #include <stdexcept>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+
 typedef unsigned char byte;
 
 struct Buffer {
@@ -66,4 +70,94 @@ struct Buffer {
 	}
 };
 
-#endif // BITHORDE_TYPES_H
\ No newline at end of file
+/**
+ * Read-only view of a range of bytes in a shared Buffer. The Buffer is kept alive as
+ * long as any slice refers to it, so data can be handed around without copying.
+ *
+ * The viewed range must not be modified, nor the Buffer grown, while slices exist.
+ */
+class ByteSlice {
+	boost::shared_ptr<Buffer> _buf;
+	const byte* _data;
+	size_t _size;
+public:
+	ByteSlice() :
+		_data(0), _size(0)
+	{}
+	ByteSlice(const boost::shared_ptr<Buffer>& buf, size_t offset, size_t size) :
+		_buf(buf), _data(buf->ptr + offset), _size(size)
+	{}
+
+	const byte* data() const { return _data; }
+	size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+
+	/**
+	 * The Buffer kept alive by this slice
+	 */
+	const boost::shared_ptr<Buffer>& buffer() const { return _buf; }
+
+	/**
+	 * The /size/ bytes at /offset/ of this slice, keeping the same Buffer alive
+	 */
+	ByteSlice slice(size_t offset, size_t size) const;
+
+	/**
+	 * The viewed bytes copied into a Buffer of their own, so the Buffer of this slice
+	 * need not be kept alive for them. Counted by CopyCounter.
+	 */
+	ByteSlice copy() const;
+
+	/**
+	 * Copies the viewed bytes into a string, counted by CopyCounter
+	 */
+	std::string str() const;
+};
+
+/**
+ * Process-wide count of payload copied between buffers in user space, where data could
+ * not be passed on as a ByteSlice. Frames copied into and out of shared-memory rings are
+ * counted whole. For tests and benchmarks to check the data path with.
+ */
+struct CopyCounter {
+	static void count(size_t bytes);
+	static uint64_t copies();
+	static uint64_t bytes();
+	static void reset();
+};
+
+/**
+ * A range of an open file, for sending without passing through user space. /owner/
+ * keeps the file descriptor open as long as the range is referenced.
+ */
+struct FileSlice {
+	boost::shared_ptr<void> owner;
+	int fd;
+	uint64_t offset;
+	size_t size;
+
+	FileSlice() :
+		fd(-1), offset(0), size(0)
+	{}
+	FileSlice(const boost::shared_ptr<void>& owner, int fd, uint64_t offset, size_t size) :
+		owner(owner), fd(fd), offset(offset), size(size)
+	{}
+};
+
+/**
+ * An open file descriptor, to be passed on to a peer over a unix-socket. /owner/ keeps
+ * it open until it has been sent.
+ */
+struct Descriptor {
+	boost::shared_ptr<void> owner;
+	int fd;
+
+	Descriptor() :
+		fd(-1)
+	{}
+	Descriptor(const boost::shared_ptr<void>& owner, int fd) :
+		owner(owner), fd(fd)
+	{}
+};
+
+#endif // BITHORDE_TYPES_H
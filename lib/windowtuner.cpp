@@ -0,0 +1,87 @@
+#include "windowtuner.h"
+
+#include <algorithm>
+
+using namespace std;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+const static pt::milliseconds MIN_ROUND(1); // Shorter rounds see too few reads to rate
+const static size_t INITIAL_STEPS = 4;
+
+const size_t WindowTuner::RATE_ROUNDS;
+const int WindowTuner::FULL_ROUNDS;
+
+WindowTuner::WindowTuner(size_t step, size_t minWindow, size_t maxWindow) :
+	_step(step),
+	_minWindow(max(minWindow, step)),
+	_maxWindow(max(maxWindow, _minWindow)),
+	_window(0),
+	_slowStart(true),
+	_flatRounds(0),
+	_fullRate(0),
+	_roundBytes(0),
+	_rounds(0)
+{
+	fill(_rates, _rates + RATE_ROUNDS, 0.0);
+	setWindow(INITIAL_STEPS * step);
+}
+
+void WindowTuner::onRoundTrip(const pt::time_duration& roundTrip, const pt::ptime& now)
+{
+	_roundTrip.sample(roundTrip, now);
+}
+
+void WindowTuner::onDelivered(size_t bytes, const pt::ptime& now)
+{
+	if (_roundStart.is_not_a_date_time()) {
+		_roundStart = now; // Rated from the first delivery on
+		return;
+	}
+	_roundBytes += bytes;
+	if (_roundTrip.measured() && (now - _roundStart >= max(_roundTrip.shortest(), pt::time_duration(MIN_ROUND))))
+		endRound(now);
+}
+
+void WindowTuner::onTimeout()
+{
+	_slowStart = false;
+	setWindow(_window / 2);
+}
+
+double WindowTuner::rate() const
+{
+	return *max_element(_rates, _rates + RATE_ROUNDS);
+}
+
+void WindowTuner::endRound(const pt::ptime& now)
+{
+	double rate = _roundBytes * 1000000.0 / (now - _roundStart).total_microseconds();
+	_rates[_rounds++ % RATE_ROUNDS] = rate;
+	_roundStart = now;
+	_roundBytes = 0;
+
+	if (_slowStart) {
+		if (rate >= _fullRate * 1.25) {
+			_fullRate = rate;
+			_flatRounds = 0;
+			setWindow(_window * 2);
+			return;
+		} else if (++_flatRounds < FULL_ROUNDS) {
+			return;
+		}
+		_slowStart = false; // The link is full
+	}
+
+	uint64_t target = 2 * this->rate() * _roundTrip.shortest().total_microseconds() / 1000000.0;
+	if (_window < target)
+		setWindow(min<uint64_t>(target, _window + _step));
+	else if (_window > target)
+		setWindow(max<uint64_t>(target, _window - _window / 4));
+}
+
+void WindowTuner::setWindow(uint64_t window)
+{
+	_window = min<uint64_t>(max<uint64_t>(window, _minWindow), _maxWindow);
+}
@@ -0,0 +1,77 @@
+#ifndef BITHORDE_WINDOWTUNER_H
+#define BITHORDE_WINDOWTUNER_H
+
+#include <stdint.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "roundtrip.h"
+
+namespace bithorde {
+
+/**
+ * Sizes a read window to the bandwidth-delay product of a link, from the round-trips and
+ * delivery of the reads on it, much like TCP congestion control. The window starts small,
+ * and doubles every round-trip as long as the delivery rate keeps growing with it. After
+ * that, it is steered towards twice the product of the highest delivery rate and the
+ * shortest round-trip lately, growing a step per round and shrinking by a quarter. Reads
+ * timing out halve it.
+ */
+class WindowTuner
+{
+public:
+	const static size_t RATE_ROUNDS = 10; // Rounds the highest delivery rate is kept for
+	const static int FULL_ROUNDS = 3; // Rounds without growth that end the slow start
+
+	/**
+	 * A window of /minWindow/ to /maxWindow/ bytes, grown by /step/ at a time
+	 */
+	WindowTuner(size_t step, size_t minWindow, size_t maxWindow);
+
+	/**
+	 * A read, sent once only, answered after /roundTrip/
+	 */
+	void onRoundTrip(const boost::posix_time::time_duration& roundTrip, const boost::posix_time::ptime& now);
+
+	/**
+	 * /bytes/ read at /now/
+	 */
+	void onDelivered(size_t bytes, const boost::posix_time::ptime& now);
+
+	/**
+	 * A read timed out, taken as the link or peer being overloaded
+	 */
+	void onTimeout();
+
+	size_t window() const { return _window; }
+	bool slowStart() const { return _slowStart; }
+
+	/**
+	 * Highest delivery rate lately, in bytes per second
+	 */
+	double rate() const;
+
+	/**
+	 * Shortest round-trip lately, or not_a_date_time until measured
+	 */
+	boost::posix_time::time_duration roundTrip() const { return _roundTrip.shortest(); }
+
+private:
+	void endRound(const boost::posix_time::ptime& now);
+	void setWindow(uint64_t window);
+
+	size_t _step, _minWindow, _maxWindow;
+	size_t _window;
+	bool _slowStart;
+	int _flatRounds; // Slow-start rounds without the rate growing
+	double _fullRate; // Rate to beat by a quarter to stay in slow start
+	RoundTripFilter _roundTrip;
+	boost::posix_time::ptime _roundStart;
+	uint64_t _roundBytes;
+	double _rates[RATE_ROUNDS]; // Of the last rounds, by round
+	uint64_t _rounds;
+};
+
+}
+
+#endif // BITHORDE_WINDOWTUNER_H
@@ -0,0 +1,557 @@
+#include <unistd.h>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "lib/client.h"
+#include "lib/sequentialreader.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+const uint64_t ASSET_SIZE = 1024*1024;
+const size_t SEGMENT = 64*1024;
+
+// Serves any asset, with every byte set to the low byte of its offset
+class VectorServer : public Client {
+public:
+	vector<int> requests; // Ranges of each ReadV received
+	int reads; // Read.Requests received
+	bool hold; // Keep requests in held, as single-range ReadV:s, until cancelled
+	vector<bithorde::ReadV> held;
+	int cancels;
+	vector<int> bindBatches; // Binds of each BindBatch received
+
+	static boost::shared_ptr<VectorServer> create(asio::io_service& ioSvc) {
+		return boost::shared_ptr<VectorServer>(new VectorServer(ioSvc));
+	}
+
+	// Answers the held requests, last range first
+	void release() {
+		for (auto req = held.rbegin(); req != held.rend(); req++) {
+			for (int i = req->ranges_size()-1; i >= 0; i--)
+				respond(req->reqid(), req->ranges(i).offset(), req->ranges(i).size());
+		}
+		held.clear();
+	}
+
+protected:
+	VectorServer(asio::io_service& ioSvc) : Client(ioSvc, "server"), reads(0), hold(false), cancels(0) {}
+
+	virtual bool servesVectoredReads() const { return true; }
+	virtual bool servesStreams() const { return true; }
+	virtual bool servesBindBatches() const { return true; }
+
+	static void found(bithorde::AssetStatus& resp, const bithorde::BindRead& msg) {
+		resp.set_handle(msg.handle());
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_size(ASSET_SIZE);
+	}
+
+	virtual void onMessage(bithorde::BindRead& msg) {
+		bithorde::AssetStatus resp;
+		found(resp, msg);
+		sendMessage(Connection::AssetStatus, resp);
+	}
+
+	// Answered all at once, last bind first
+	virtual void onMessage(bithorde::BindBatch& msg) {
+		bindBatches.push_back(msg.binds_size());
+		BOOST_REQUIRE( peerTakesStatusBatches() );
+		bithorde::AssetStatusBatch resp;
+		for (int i = msg.binds_size()-1; i >= 0; i--)
+			found(*resp.add_statuses(), msg.binds(i));
+		sendMessage(Connection::AssetStatusBatch, resp);
+	}
+
+	virtual void onMessage(const bithorde::Read::Request& msg) {
+		reads++;
+		bithorde::ReadV req;
+		req.set_reqid(msg.reqid());
+		req.set_handle(msg.handle());
+		req.set_timeout(msg.timeout());
+		auto range = req.add_ranges();
+		range->set_offset(msg.offset());
+		range->set_size(msg.size());
+		if (hold)
+			held.push_back(req);
+		else
+			answer(req);
+	}
+
+	virtual void onMessage(const bithorde::ReadV& msg) {
+		requests.push_back(msg.ranges_size());
+		if (hold)
+			held.push_back(msg);
+		else
+			answer(msg);
+	}
+
+	void answer(const bithorde::ReadV& msg) {
+		for (int i=0; i < msg.ranges_size(); i++)
+			respond(msg.reqid(), msg.ranges(i).offset(), msg.ranges(i).size());
+	}
+
+	// Pushed all at once, last segment first
+	virtual void onMessage(const bithorde::ReadStream& msg) {
+		for (uint64_t offset = msg.offset() + msg.size(); offset > msg.offset(); ) {
+			size_t size = min<uint64_t>(SEGMENT, offset - msg.offset());
+			offset -= size;
+			respond(msg.reqid(), offset, size);
+		}
+		bithorde::Read::Response end;
+		end.set_reqid(msg.reqid());
+		end.set_status(bithorde::NONE);
+		sendMessage(Connection::ReadResponse, end);
+	}
+
+	virtual void onMessage(const bithorde::Read::Cancel& msg) {
+		cancels++;
+		for (auto iter = held.begin(); iter != held.end(); ) {
+			if (iter->reqid() == msg.reqid()) {
+				bithorde::Read::Response resp;
+				resp.set_reqid(msg.reqid());
+				resp.set_status(bithorde::NONE);
+				for (int i=0; i < iter->ranges_size(); i++)
+					sendMessage(Connection::ReadResponse, resp);
+				iter = held.erase(iter);
+			} else {
+				iter++;
+			}
+		}
+	}
+
+	void respond(uint32_t reqId, uint64_t offset, size_t size) {
+		boost::shared_ptr<Buffer> buf(new Buffer());
+		buf->grow(size);
+		for (size_t i=0; i < size; i++)
+			buf->ptr[i] = (byte)(offset + i);
+		buf->charge(size);
+		bithorde::Read::Response resp;
+		resp.set_reqid(reqId);
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_offset(offset);
+		sendMessage(Connection::ReadResponse, resp, ByteSlice(buf, 0, size));
+	}
+};
+
+struct DataReceiver {
+	Status status;
+	vector<uint64_t> offsets;
+	vector<size_t> sizes;
+	vector<int> tags;
+	vector<Status> statuses;
+	bool intact;
+
+	DataReceiver() : status(bithorde::NONE), intact(true) {}
+
+	void onStatus(const bithorde::AssetStatus& msg) {
+		status = msg.status();
+	}
+
+	void onData(uint64_t offset, const ByteSlice& data, int tag, Status status) {
+		offsets.push_back(offset);
+		sizes.push_back(data.size());
+		tags.push_back(tag);
+		statuses.push_back(status);
+		for (size_t i=0; i < data.size(); i++)
+			intact &= (data.data()[i] == (byte)(offset + i));
+	}
+};
+
+struct StatusCounter {
+	size_t found, other;
+
+	StatusCounter() : found(0), other(0) {}
+
+	void onStatus(const bithorde::AssetStatus& msg) {
+		if (msg.status() == bithorde::SUCCESS)
+			found++;
+		else
+			other++;
+	}
+};
+
+struct InOrderReceiver {
+	uint64_t position;
+	bool ordered, intact, finished;
+	Status status;
+
+	InOrderReceiver(uint64_t position) :
+		position(position), ordered(true), intact(true), finished(false), status(bithorde::NONE)
+	{}
+
+	void onData(uint64_t offset, const ByteSlice& data) {
+		ordered &= (offset == position);
+		position = offset + data.size();
+		for (size_t i=0; i < data.size(); i++)
+			intact &= (data.data()[i] == (byte)(offset + i));
+	}
+
+	void onFinished(Status s) {
+		finished = true;
+		status = s;
+	}
+};
+
+// A client bound to an asset of a VectorServer
+struct BoundAsset {
+	asio::io_service ioSvc;
+	boost::shared_ptr<VectorServer> server;
+	Connection::Pointer serverSide;
+	Client::Pointer client;
+	boost::shared_ptr<ReadAsset> asset;
+	DataReceiver receiver;
+
+	BoundAsset() {
+		auto sa = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+		auto sb = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+		asio::local::connect_pair(*sa, *sb);
+		server = VectorServer::create(ioSvc);
+		client = Client::create(ioSvc, "client");
+		serverSide = Connection::create(ioSvc, sa);
+		server->connect(serverSide);
+		client->connect(Connection::create(ioSvc, sb));
+
+		BitHordeIds ids;
+		auto id = ids.Add();
+		id->set_type(bithorde::TREE_TIGER);
+		id->set_id("asset");
+		asset.reset(new ReadAsset(client, ids));
+		asset->statusUpdate.connect(boost::bind(&DataReceiver::onStatus, &receiver, _1));
+		asset->dataArrived.connect<DataReceiver, &DataReceiver::onData>(&receiver);
+		BOOST_REQUIRE( client->bind(*asset) );
+		while ((receiver.status == bithorde::NONE) && ioSvc.run_one());
+		BOOST_REQUIRE_EQUAL( receiver.status, bithorde::SUCCESS );
+	}
+};
+
+BOOST_AUTO_TEST_CASE( client_readv )
+{
+	BoundAsset b;
+	ReadAsset& asset = *b.asset;
+	DataReceiver& receiver = b.receiver;
+	BOOST_REQUIRE( b.client->peerServesVectoredReads() );
+
+	vector<ReadAsset::Range> ranges;
+	ranges.push_back(make_pair(0, 4096));
+	ranges.push_back(make_pair(4096, 4096));
+	ranges.push_back(make_pair(65536, 1000));
+	int tag = asset.aSyncReadV(ranges);
+	BOOST_REQUIRE( tag >= 0 );
+
+	// Every range is delivered on its own, under the tag of the request
+	while ((receiver.offsets.size() < 3) && b.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.offsets.size(), 3 );
+	BOOST_REQUIRE_EQUAL( b.server->requests.size(), 1 );
+	BOOST_CHECK_EQUAL( b.server->requests[0], 3 );
+	for (size_t i=0; i < ranges.size(); i++) {
+		BOOST_CHECK_EQUAL( receiver.offsets[i], ranges[i].first );
+		BOOST_CHECK_EQUAL( receiver.tags[i], tag );
+	}
+	BOOST_CHECK( receiver.intact );
+
+	// The tag is freed only after the last range, and not handed out again as is
+	BOOST_CHECK_EQUAL( b.client->pendingRequests(), 0 );
+	BOOST_CHECK( asset.aSyncRead(0, 10) != tag );
+
+	ranges.resize(Connection::MAX_RANGES+1, make_pair(0, 1));
+	BOOST_CHECK_EQUAL( asset.aSyncReadV(ranges), -1 );
+}
+
+BOOST_AUTO_TEST_CASE( client_sequential )
+{
+	BoundAsset b;
+	b.server->hold = true;
+	InOrderReceiver receiver(1000);
+	SequentialReader reader(*b.asset, 1000, ASSET_SIZE - 1000);
+	reader.setWindow(2 * b.client->chunkSize());
+	reader.dataArrived.connect<InOrderReceiver, &InOrderReceiver::onData>(&receiver);
+	reader.finished.connect(boost::bind(&InOrderReceiver::onFinished, &receiver, _1));
+	BOOST_REQUIRE( reader.start() );
+
+	// The first window fails, and is read again. Every window is answered backwards, but
+	// delivered in order.
+	bool failed = false;
+	while (!receiver.finished && b.ioSvc.run_one()) {
+		BOOST_REQUIRE( reader.inFlight() <= 2 * b.client->chunkSize() );
+		if (!failed && !b.server->held.empty()) {
+			const bithorde::ReadV& req = b.server->held.front();
+			for (int i=0; i < req.ranges_size(); i++) {
+				bithorde::Read::Response resp;
+				resp.set_reqid(req.reqid());
+				resp.set_status(bithorde::ERROR);
+				resp.set_offset(req.ranges(i).offset());
+				b.server->sendMessage(Connection::ReadResponse, resp);
+			}
+			b.server->held.clear();
+			failed = true;
+		}
+		b.server->release();
+	}
+	BOOST_CHECK_EQUAL( receiver.status, bithorde::SUCCESS );
+	BOOST_CHECK( receiver.ordered );
+	BOOST_CHECK( receiver.intact );
+	BOOST_CHECK_EQUAL( receiver.position, ASSET_SIZE );
+	BOOST_CHECK_EQUAL( reader.position(), ASSET_SIZE );
+	BOOST_CHECK( b.server->requests.size() > 1 );
+	BOOST_CHECK_EQUAL( b.server->reads, 2 ); // The retries
+	BOOST_CHECK_EQUAL( b.client->pendingRequests(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( client_stream )
+{
+	BoundAsset b;
+	DataReceiver& receiver = b.receiver;
+	BOOST_REQUIRE( b.client->peerServesStreams() );
+
+	CopyCounter::reset();
+	int tag = b.asset->aSyncStream(1000, 3*SEGMENT);
+	BOOST_REQUIRE( tag >= 0 );
+	while ((receiver.offsets.size() < 4) && b.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.offsets.size(), 4 );
+	uint64_t streamed = 0;
+	for (size_t i=0; i < 3; i++) {
+		BOOST_CHECK_EQUAL( receiver.tags[i], tag );
+		streamed += receiver.sizes[i];
+	}
+	BOOST_CHECK_EQUAL( streamed, 3*SEGMENT );
+	BOOST_CHECK( receiver.intact );
+	BOOST_CHECK_EQUAL( CopyCounter::bytes(), 0 ); // Sent and received in place
+
+	// The end comes last, freeing the tag
+	BOOST_CHECK_EQUAL( receiver.tags[3], tag );
+	BOOST_CHECK_EQUAL( receiver.sizes[3], 0 );
+	BOOST_CHECK_EQUAL( b.client->pendingRequests(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( client_cancel )
+{
+	BoundAsset b;
+	ReadAsset& asset = *b.asset;
+	DataReceiver& receiver = b.receiver;
+
+	b.server->hold = true;
+	vector<ReadAsset::Range> ranges;
+	ranges.push_back(make_pair(0, 4096));
+	ranges.push_back(make_pair(8192, 4096));
+	int tag = asset.aSyncReadV(ranges);
+	BOOST_REQUIRE( tag >= 0 );
+	while (b.server->held.empty() && b.ioSvc.run_one());
+	BOOST_REQUIRE( asset.cancel(tag) );
+	BOOST_CHECK( !asset.cancel(tag) );
+	while (!b.server->cancels && b.ioSvc.run_one());
+	BOOST_CHECK( b.server->held.empty() );
+
+	// Answered after the cancelled ranges, so those are in once it has arrived
+	b.server->hold = false;
+	ranges.resize(1);
+	int next = asset.aSyncReadV(ranges);
+	while (receiver.offsets.empty() && b.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.offsets.size(), 1 );
+	BOOST_CHECK_EQUAL( receiver.tags[0], next );
+
+	// Nothing was delivered for the cancelled request, and its tag is free again
+	BOOST_CHECK_EQUAL( b.client->pendingRequests(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( client_roundtrip )
+{
+	BoundAsset b;
+	DataReceiver& receiver = b.receiver;
+	BOOST_CHECK_EQUAL( b.client->roundTrip().total_microseconds(), 0 );
+
+	b.server->hold = true;
+	vector<ReadAsset::Range> ranges(1, make_pair(0, 4096));
+	b.asset->aSyncReadV(ranges, 1234);
+	while (b.server->held.empty() && b.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( b.server->held.size(), 1 );
+	BOOST_CHECK_EQUAL( b.server->held[0].timeout(), 1234 );
+	usleep(20000);
+	b.server->hold = false;
+	b.server->answer(b.server->held[0]);
+	while (receiver.offsets.empty() && b.ioSvc.run_one());
+	BOOST_CHECK( b.client->roundTrip() >= boost::posix_time::milliseconds(20) );
+
+	// The shortest is kept, as the one least delayed by the peer
+	b.asset->aSyncReadV(ranges);
+	while ((receiver.offsets.size() < 2) && b.ioSvc.run_one());
+	BOOST_CHECK( b.client->roundTrip() < boost::posix_time::milliseconds(20) );
+}
+
+BOOST_AUTO_TEST_CASE( client_retry )
+{
+	BoundAsset b;
+	ReadAsset& asset = *b.asset;
+	DataReceiver& receiver = b.receiver;
+	asset.setRetryPolicy(ReadAsset::RetryPolicy(20, 2, 10, 10));
+
+	// The first try is lost, and cancelled on timeout. The retry is sent under the same tag.
+	b.server->hold = true;
+	int tag = asset.aSyncRead(4096, 1000);
+	BOOST_REQUIRE( tag >= 0 );
+	while (b.server->held.empty() && b.ioSvc.run_one());
+	b.server->hold = false;
+	while (receiver.offsets.empty() && b.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.offsets.size(), 1 );
+	BOOST_CHECK_EQUAL( receiver.tags[0], tag );
+	BOOST_CHECK_EQUAL( receiver.statuses[0], bithorde::SUCCESS );
+	BOOST_CHECK_EQUAL( receiver.sizes[0], 1000 );
+	BOOST_CHECK_EQUAL( b.server->reads, 2 );
+	BOOST_CHECK_EQUAL( b.server->cancels, 1 );
+	BOOST_CHECK( b.server->held.empty() );
+
+	// Every try is lost, so the read times out, once
+	b.server->hold = true;
+	tag = asset.aSyncRead(8192, 1000);
+	BOOST_REQUIRE( tag >= 0 );
+	while ((receiver.offsets.size() < 2) && b.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.offsets.size(), 2 );
+	BOOST_CHECK_EQUAL( receiver.tags[1], tag );
+	BOOST_CHECK_EQUAL( receiver.offsets[1], 8192 );
+	BOOST_CHECK_EQUAL( receiver.statuses[1], bithorde::TIMEOUT );
+	BOOST_CHECK_EQUAL( receiver.sizes[1], 0 );
+	BOOST_CHECK_EQUAL( b.server->reads, 5 );
+	while (!b.server->held.empty() && b.ioSvc.run_one());
+	BOOST_CHECK_EQUAL( b.server->cancels, 4 );
+
+	// Answered after the cancelled last try, which is not delivered
+	b.server->hold = false;
+	vector<ReadAsset::Range> ranges(1, make_pair(0, 10));
+	asset.aSyncReadV(ranges);
+	while ((receiver.offsets.size() < 3) && b.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.offsets.size(), 3 );
+	BOOST_CHECK_EQUAL( receiver.statuses[2], bithorde::SUCCESS );
+	BOOST_CHECK_EQUAL( receiver.offsets[2], 0 );
+}
+
+BOOST_AUTO_TEST_CASE( client_disconnect )
+{
+	BoundAsset b;
+	ReadAsset& asset = *b.asset;
+	DataReceiver& receiver = b.receiver;
+
+	// Reads outstanding when the link is lost are failed, every range on its own
+	b.server->hold = true;
+	int single = asset.aSyncRead(4096, 1000);
+	vector<ReadAsset::Range> ranges;
+	ranges.push_back(make_pair(0, 4096));
+	ranges.push_back(make_pair(8192, 4096));
+	int vectored = asset.aSyncReadV(ranges);
+	BOOST_REQUIRE( (single >= 0) && (vectored >= 0) );
+	while ((b.server->held.size() < 2) && b.ioSvc.run_one());
+	b.serverSide->close();
+	while ((receiver.offsets.size() < 3) && b.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.offsets.size(), 3 );
+	for (size_t i = 0; i < 3; i++) {
+		BOOST_CHECK_EQUAL( receiver.statuses[i], bithorde::DISCONNECTED );
+		BOOST_CHECK_EQUAL( receiver.sizes[i], 0 );
+		if (receiver.tags[i] == single)
+			BOOST_CHECK_EQUAL( receiver.offsets[i], 4096 );
+		else
+			BOOST_CHECK( (receiver.offsets[i] == 0) || (receiver.offsets[i] == 8192) );
+	}
+	BOOST_CHECK_EQUAL( receiver.status, bithorde::DISCONNECTED );
+	BOOST_CHECK_EQUAL( b.client->pendingRequests(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( client_bind_batch )
+{
+	BoundAsset b;
+	BOOST_REQUIRE( b.client->peerServesBindBatches() );
+
+	const size_t COUNT = Connection::MAX_BINDS + 10;
+	StatusCounter counter;
+	vector< boost::shared_ptr<ReadAsset> > assets;
+	vector<ReadAsset*> toBind;
+	for (size_t i = 0; i < COUNT; i++) {
+		BitHordeIds ids;
+		auto id = ids.Add();
+		id->set_type(bithorde::TREE_TIGER);
+		id->set_id("asset" + boost::lexical_cast<string>(i));
+		assets.push_back(boost::make_shared<ReadAsset>(b.client, ids));
+		assets.back()->statusUpdate.connect(boost::bind(&StatusCounter::onStatus, &counter, _1));
+		toBind.push_back(assets.back().get());
+	}
+
+	// Sent in two batches, each answered by a single batch of statuses
+	BOOST_CHECK_EQUAL( b.client->bind(toBind), COUNT );
+	while ((counter.found + counter.other < COUNT) && b.ioSvc.run_one());
+	BOOST_CHECK_EQUAL( counter.found, COUNT );
+	BOOST_CHECK_EQUAL( counter.other, 0 );
+	BOOST_REQUIRE( b.server->bindBatches.size() >= 2 );
+	BOOST_CHECK_EQUAL( b.server->bindBatches[b.server->bindBatches.size()-2], Connection::MAX_BINDS );
+	BOOST_CHECK_EQUAL( b.server->bindBatches.back(), 10 );
+	for (size_t i = 0; i < COUNT; i++)
+		BOOST_CHECK( assets[i]->isBound() );
+}
+
+BOOST_AUTO_TEST_CASE( client_old_handshake )
+{
+	asio::io_service ioSvc;
+	auto sa = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+	auto sb = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+	asio::local::connect_pair(*sa, *sb);
+	Connection::Pointer peer = Connection::create(ioSvc, sa);
+	Client::Pointer client = Client::create(ioSvc, "client");
+	client->connect(Connection::create(ioSvc, sb));
+
+	// Peers of older protocol-versions are hung up on
+	bithorde::HandShake hello;
+	hello.set_name("old");
+	hello.set_protoversion(1);
+	BOOST_REQUIRE( peer->sendMessage(Connection::HandShake, hello) );
+	while (client->isConnected() && ioSvc.run_one());
+	BOOST_CHECK( !client->isConnected() );
+}
+
+BOOST_AUTO_TEST_CASE( client_deferred_classes )
+{
+	asio::io_service ioSvc;
+	auto sa = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+	auto sb = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+	asio::local::connect_pair(*sa, *sb);
+	Client::Pointer client = Client::create(ioSvc, "client");
+	client->connect(Connection::create(ioSvc, sb));
+
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	buf->grow(SEGMENT);
+	buf->charge(SEGMENT);
+	bithorde::DataSegment segment;
+	segment.set_handle(1);
+	segment.set_offset(0);
+
+	// Fill the socket and the Bulk-queue, with the peer not reading
+	for (int i = 0; client->sendCredit(Connection::DataSegment) && (i < 1000); i++) {
+		BOOST_REQUIRE( client->sendMessage(Connection::DataSegment, segment, ByteSlice(buf, 0, SEGMENT)) );
+		ioSvc.poll();
+		ioSvc.reset();
+	}
+	BOOST_REQUIRE( client->sendMessage(Connection::DataSegment, segment, ByteSlice(buf, 0, SEGMENT)) );
+	BOOST_CHECK_EQUAL( client->sendCredit(Connection::DataSegment), 0 );
+
+	// Deferred bulk data holds up neither Control nor Interactive messages
+	BOOST_CHECK( client->sendCredit(Connection::Ping) > 0 );
+	BOOST_CHECK( client->sendCredit(Connection::ReadResponse) > 0 );
+	uint64_t framesOut = client->stats().framesOut;
+	BOOST_REQUIRE( client->sendMessage(Connection::Ping, bithorde::Ping()) );
+	BOOST_CHECK_EQUAL( client->stats().framesOut, framesOut + 1 );
+
+	// The deferred segment goes out once the peer reads
+	vector<char> sink(1024*1024);
+	for (int i = 0; (client->stats().framesOut < framesOut + 2) && (i < 1000); i++) {
+		size_t available = sa->available();
+		if (available)
+			sa->read_some(asio::buffer(&sink[0], min(available, sink.size())));
+		ioSvc.poll();
+		ioSvc.reset();
+	}
+	BOOST_CHECK_EQUAL( client->stats().framesOut, framesOut + 2 );
+	BOOST_CHECK( client->sendCredit(Connection::DataSegment) > 0 );
+}
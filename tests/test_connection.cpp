@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "lib/connection.h"
+#include "lib/shmring.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+const size_t CHUNK = 64*1024;
+
+struct ConnectionPair {
+	asio::io_service ioSvc;
+	Connection::Pointer a, b;
+	vector<uint32_t> received;
+
+	ConnectionPair() {
+		auto sa = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+		auto sb = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+		asio::local::connect_pair(*sa, *sb);
+		a = Connection::create(ioSvc, sa);
+		b = Connection::create(ioSvc, sb);
+		b->message.connect(boost::bind(&ConnectionPair::onMessage, this, _1, _2, _3));
+	}
+
+	void onMessage(Connection::MessageType type, ::google::protobuf::Message& msg, const ByteSlice& payload) {
+		BOOST_CHECK_EQUAL( type, Connection::ReadResponse );
+		BOOST_CHECK_EQUAL( payload.size(), CHUNK );
+		received.push_back(static_cast<bithorde::Read::Response&>(msg).reqid());
+	}
+
+	bool send(uint32_t reqId) {
+		boost::shared_ptr<Buffer> buf(new Buffer());
+		buf->grow(CHUNK);
+		buf->charge(CHUNK);
+		bithorde::Read::Response resp;
+		resp.set_reqid(reqId);
+		resp.set_status(bithorde::SUCCESS);
+		return a->sendMessage(Connection::ReadResponse, resp, ByteSlice(buf, 0, CHUNK));
+	}
+};
+
+BOOST_AUTO_TEST_CASE( connection_flowcontrol )
+{
+	ConnectionPair c;
+	c.b->pauseRead();
+
+	// Fill the send-side until credit runs out
+	uint32_t sent = 0;
+	while (c.a->sendCredit(Connection::ReadResponse))
+		BOOST_REQUIRE( c.send(sent++) );
+	BOOST_CHECK( !c.send(sent) );
+	BOOST_CHECK( c.a->sendCredit(Connection::Ping) > 0 ); // Control-traffic has its own queue
+
+	// Nothing is delivered while paused
+	while (c.ioSvc.poll());
+	BOOST_CHECK( c.received.empty() );
+
+	// Everything is delivered in order after resuming
+	c.b->resumeRead();
+	while (c.received.size() < sent && c.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( c.received.size(), sent );
+	for (uint32_t i = 0; i < sent; i++)
+		BOOST_CHECK_EQUAL( c.received[i], i );
+	BOOST_CHECK( c.a->sendCredit(Connection::ReadResponse) > 0 );
+}
+
+struct PayloadReceiver {
+	vector<size_t> sizes;
+
+	void onMessage(Connection::MessageType type, ::google::protobuf::Message& msg, const ByteSlice& payload) {
+		sizes.push_back(payload.size());
+	}
+};
+
+BOOST_AUTO_TEST_CASE( connection_maxchunk )
+{
+	ConnectionPair c;
+	PayloadReceiver receiver;
+	c.b->message.connect(boost::bind(&PayloadReceiver::onMessage, &receiver, _1, _2, _3));
+
+	boost::shared_ptr<Buffer> buf(new Buffer());
+	buf->grow(2*Connection::MAX_CHUNK);
+	buf->charge(2*Connection::MAX_CHUNK);
+	bithorde::Read::Response resp;
+	resp.set_reqid(1);
+	resp.set_status(bithorde::SUCCESS);
+	resp.set_offset(0xFFFFFFFFFFFFull);
+	BOOST_REQUIRE( c.a->sendMessage(Connection::ReadResponse, resp, ByteSlice(buf, 0, Connection::MAX_CHUNK)) );
+	BOOST_CHECK( !c.a->sendMessage(Connection::ReadResponse, resp, ByteSlice(buf, 0, 2*Connection::MAX_CHUNK)) );
+
+	while (receiver.sizes.empty() && c.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.sizes.size(), 1 );
+	BOOST_CHECK_EQUAL( receiver.sizes[0], Connection::MAX_CHUNK );
+}
+
+struct DescriptorReceiver {
+	Connection::Pointer conn;
+	vector<uint32_t> handles;
+	vector<int> fds;
+
+	void onMessage(Connection::MessageType type, ::google::protobuf::Message& msg, const ByteSlice& payload) {
+		if (type != Connection::LocalFile)
+			return;
+		handles.push_back(static_cast<bithorde::LocalFile&>(msg).handle());
+		fds.push_back(conn->takeDescriptor());
+	}
+};
+
+BOOST_AUTO_TEST_CASE( connection_descriptors )
+{
+	ConnectionPair c;
+	BOOST_REQUIRE( c.a->passesDescriptors() );
+	DescriptorReceiver receiver;
+	receiver.conn = c.b;
+	c.b->message.connect(boost::bind(&DescriptorReceiver::onMessage, &receiver, _1, _2, _3));
+
+	FILE* file = tmpfile();
+	BOOST_REQUIRE( file );
+	fputs("content", file);
+	fflush(file);
+	boost::shared_ptr<FILE> owner(file, fclose);
+
+	// Descriptors are matched to their messages, in between other traffic
+	for (uint32_t handle = 1; handle <= 3; handle++) {
+		c.send(handle);
+		bithorde::LocalFile msg;
+		msg.set_handle(handle);
+		BOOST_REQUIRE( c.a->sendMessage(Connection::LocalFile, msg, Descriptor(owner, fileno(file))) );
+	}
+	bithorde::LocalFile bare;
+	bare.set_handle(4);
+	BOOST_REQUIRE( c.a->sendMessage(Connection::LocalFile, bare) );
+
+	while (receiver.handles.size() < 4 && c.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.handles.size(), 4 );
+	for (size_t i = 0; i < 3; i++) {
+		BOOST_CHECK_EQUAL( receiver.handles[i], i+1 );
+		BOOST_REQUIRE( receiver.fds[i] >= 0 );
+		char buf[7];
+		BOOST_CHECK_EQUAL( pread(receiver.fds[i], buf, sizeof(buf), 0), sizeof(buf) );
+		BOOST_CHECK_EQUAL( string(buf, sizeof(buf)), "content" );
+		close(receiver.fds[i]);
+	}
+	BOOST_CHECK_EQUAL( receiver.fds[3], -1 );
+}
+
+struct Flag {
+	bool value;
+	Flag() : value(false) {}
+	void set() { value = true; }
+};
+
+BOOST_AUTO_TEST_CASE( connection_sharedmemory )
+{
+	ConnectionPair c;
+	BOOST_REQUIRE( c.a->supportsSharedMemory() );
+	c.send(0);
+	// Capacities the peer would refuse are never offered
+	BOOST_CHECK( !c.a->offerSharedMemory(ShmRings::MIN_CAPACITY + 4096) );
+	BOOST_CHECK( !c.a->offerSharedMemory(ShmRings::MIN_CAPACITY / 2) );
+	BOOST_REQUIRE( c.a->offerSharedMemory(ShmRings::MIN_CAPACITY) );
+	BOOST_CHECK_EQUAL( c.a->sendCredit(Connection::ReadResponse), 0 ); // Held until switched
+
+	while (!(c.a->usesSharedMemory() && c.b->usesSharedMemory()) && c.ioSvc.run_one());
+	BOOST_REQUIRE( c.a->usesSharedMemory() && c.b->usesSharedMemory() );
+	BOOST_REQUIRE_EQUAL( c.received.size(), 1 );
+
+	// Many times the capacity, so each side has to sleep and be woken by the other
+	const uint32_t total = 256;
+	uint32_t sent = 1;
+	CopyCounter::reset();
+	while (c.received.size() < total) {
+		while ((sent < total) && c.a->sendCredit(Connection::ReadResponse))
+			BOOST_REQUIRE( c.send(sent++) );
+		if (!c.ioSvc.run_one())
+			break;
+	}
+	BOOST_REQUIRE_EQUAL( c.received.size(), total );
+	for (uint32_t i = 0; i < total; i++)
+		BOOST_CHECK_EQUAL( c.received[i], i );
+	// Copied into the ring, and out of it
+	BOOST_CHECK( CopyCounter::bytes() >= 2 * (total - 1) * CHUNK );
+
+	// Descriptors still go through the socket
+	DescriptorReceiver receiver;
+	receiver.conn = c.b;
+	c.b->message.connect(boost::bind(&DescriptorReceiver::onMessage, &receiver, _1, _2, _3));
+	boost::shared_ptr<FILE> file(tmpfile(), fclose);
+	BOOST_REQUIRE( file );
+	fputs("content", file.get());
+	fflush(file.get());
+	bithorde::LocalFile msg;
+	msg.set_handle(1);
+	BOOST_REQUIRE( c.a->sendMessage(Connection::LocalFile, msg, Descriptor(file, fileno(file.get()))) );
+	while (receiver.handles.empty() && c.ioSvc.run_one());
+	BOOST_REQUIRE_EQUAL( receiver.fds.size(), 1 );
+	BOOST_REQUIRE( receiver.fds[0] >= 0 );
+	char buf[7];
+	BOOST_CHECK_EQUAL( pread(receiver.fds[0], buf, sizeof(buf), 0), sizeof(buf) );
+	close(receiver.fds[0]);
+
+	// Hanging up is noticed through the socket
+	Flag disconnected;
+	c.b->disconnected.connect(boost::bind(&Flag::set, &disconnected));
+	c.a->close();
+	while (!disconnected.value && c.ioSvc.run_one());
+	BOOST_CHECK( disconnected.value );
+}
+
+// A Connection fed raw bytes through the other end of its socket
+struct RawPeer {
+	asio::io_service ioSvc;
+	boost::shared_ptr<asio::local::stream_protocol::socket> raw;
+	Connection::Pointer conn;
+	vector<uint32_t> reqIds;
+	vector<ByteSlice> payloads;
+	Flag disconnected;
+
+	RawPeer() {
+		raw = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+		auto sb = boost::make_shared<asio::local::stream_protocol::socket>(ioSvc);
+		asio::local::connect_pair(*raw, *sb);
+		conn = Connection::create(ioSvc, sb);
+		conn->message.connect(boost::bind(&RawPeer::onMessage, this, _1, _2, _3));
+		conn->disconnected.connect(boost::bind(&Flag::set, &disconnected));
+	}
+
+	void onMessage(Connection::MessageType type, ::google::protobuf::Message& msg, const ByteSlice& payload) {
+		BOOST_REQUIRE_EQUAL( type, Connection::ReadResponse );
+		reqIds.push_back(static_cast<bithorde::Read::Response&>(msg).reqid());
+		payloads.push_back(payload);
+	}
+
+	static void writeAll(const boost::shared_ptr<asio::local::stream_protocol::socket>& socket, const string& data) {
+		asio::write(*socket, asio::buffer(data));
+	}
+
+	void write(const string& data) {
+		asio::write(*raw, asio::buffer(data));
+		while (ioSvc.poll());
+	}
+
+	static void varint(string& out, uint32_t value) {
+		for (; value >= 0x80; value >>= 7)
+			out += (char)(value | 0x80);
+		out += (char)value;
+	}
+
+	static string header(uint32_t type, uint32_t wireType, uint32_t length) {
+		string res;
+		varint(res, (type << 3) | wireType);
+		varint(res, length);
+		return res;
+	}
+
+	// A ReadResponse carrying /size/ bytes, each the low byte of /reqId/ plus its position
+	static string frame(uint32_t reqId, size_t size) {
+		string content(size, 0);
+		for (size_t i = 0; i < size; i++)
+			content[i] = (char)(reqId + i);
+		bithorde::Read::Response resp;
+		resp.set_reqid(reqId);
+		resp.set_status(bithorde::SUCCESS);
+		resp.set_content(content);
+		string body;
+		resp.SerializeToString(&body);
+		return header(Connection::ReadResponse, 2, body.size()) + body;
+	}
+
+	bool intact(size_t i) const {
+		for (size_t j = 0; j < payloads[i].size(); j++) {
+			if (payloads[i].data()[j] != (byte)(reqIds[i] + j))
+				return false;
+		}
+		return true;
+	}
+};
+
+BOOST_AUTO_TEST_CASE( connection_split_header )
+{
+	RawPeer p;
+	string data = RawPeer::frame(1, 1000) + RawPeer::frame(2, 10);
+	BOOST_REQUIRE( (unsigned char)data[1] & 0x80 ); // The length takes two bytes
+
+	// Cut within the length of the first frame, and then within the second frame
+	p.write(data.substr(0, 2));
+	BOOST_CHECK( p.payloads.empty() );
+	p.write(data.substr(2, data.size() - 5));
+	BOOST_REQUIRE_EQUAL( p.payloads.size(), 1 );
+	p.write(data.substr(data.size() - 3));
+	BOOST_REQUIRE_EQUAL( p.payloads.size(), 2 );
+	BOOST_CHECK_EQUAL( p.payloads[0].size(), 1000 );
+	BOOST_CHECK_EQUAL( p.payloads[1].size(), 10 );
+	BOOST_CHECK( p.intact(0) && p.intact(1) );
+	BOOST_CHECK( !p.disconnected.value );
+}
+
+BOOST_AUTO_TEST_CASE( connection_carry_over )
+{
+	// Frames of most of a chunk cannot all fit a slab, so some are carried over to a fresh
+	// one, while the payloads before them still refer to the old
+	RawPeer p;
+	const uint32_t FRAMES = 12;
+	string data;
+	for (uint32_t i = 0; i < FRAMES; i++)
+		data += RawPeer::frame(i, Connection::MAX_CHUNK - 1000*i);
+	CopyCounter::reset();
+	boost::thread writer(boost::bind(&RawPeer::writeAll, p.raw, data));
+	while ((p.payloads.size() < FRAMES) && p.ioSvc.run_one());
+	writer.join();
+
+	BOOST_REQUIRE_EQUAL( p.payloads.size(), FRAMES );
+	BOOST_CHECK( CopyCounter::bytes() > 0 );
+	for (uint32_t i = 0; i < FRAMES; i++) {
+		BOOST_CHECK_EQUAL( p.reqIds[i], i );
+		BOOST_CHECK_EQUAL( p.payloads[i].size(), Connection::MAX_CHUNK - 1000*i );
+		BOOST_CHECK( p.intact(i) );
+	}
+}
+
+BOOST_AUTO_TEST_CASE( connection_oversized_frame )
+{
+	RawPeer p;
+	p.write(RawPeer::header(Connection::ReadResponse, 2, 4*Connection::MAX_CHUNK));
+	BOOST_CHECK( p.disconnected.value );
+	BOOST_CHECK( p.payloads.empty() );
+}
+
+BOOST_AUTO_TEST_CASE( connection_bad_wiretype )
+{
+	RawPeer p;
+	p.write(RawPeer::header(Connection::ReadResponse, 0, 1) + string(16, 'x'));
+	BOOST_CHECK( p.disconnected.value );
+	BOOST_CHECK( p.payloads.empty() );
+}
@@ -0,0 +1,133 @@
+#include <string>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "lib/sendqueue.h"
+
+using namespace std;
+namespace asio = boost::asio;
+
+using namespace bithorde;
+
+const size_t BLOCK_SIZE = 64;
+
+void push(SendQueue& q, const string& data) {
+	byte* buf = q.allocate(data.size());
+	memcpy(buf, data.data(), data.size());
+	q.charge(data.size());
+}
+
+string contents(const SendQueue& q) {
+	string res;
+	auto buffers = q.buffers();
+	for (auto iter = buffers.begin(); iter != buffers.end(); iter++)
+		res.append(asio::buffer_cast<const char*>(*iter), asio::buffer_size(*iter));
+	return res;
+}
+
+BOOST_AUTO_TEST_CASE( sendqueue_fifo )
+{
+	SendQueue q(BLOCK_SIZE);
+	BOOST_CHECK( q.empty() );
+
+	string expected;
+	for (char c = 'a'; c <= 'z'; c++) {
+		string chunk(BLOCK_SIZE/3, c);
+		push(q, chunk);
+		expected += chunk;
+	}
+	BOOST_CHECK_EQUAL( q.size(), expected.size() );
+	BOOST_CHECK_EQUAL( contents(q), expected.substr(0, contents(q).size()) );
+
+	// Consume in odd-sized pieces, verifying the head each time
+	while (!q.empty()) {
+		size_t amount = min(q.size(), BLOCK_SIZE/2+1);
+		q.pop(amount);
+		expected.erase(0, amount);
+		BOOST_CHECK_EQUAL( q.size(), expected.size() );
+		string head = contents(q);
+		BOOST_CHECK_EQUAL( head, expected.substr(0, head.size()) );
+	}
+}
+
+BOOST_AUTO_TEST_CASE( sendqueue_oversized )
+{
+	SendQueue q(BLOCK_SIZE);
+	string big(BLOCK_SIZE*3, 'x');
+	push(q, "head");
+	push(q, big);
+	push(q, "tail");
+	BOOST_CHECK_EQUAL( q.size(), big.size()+8 );
+	BOOST_CHECK_EQUAL( contents(q), "head" + big + "tail" );
+
+	// Limited gathers stop mid-segment
+	auto buffers = q.buffers(10);
+	BOOST_CHECK_EQUAL( buffers.count, 2 );
+	BOOST_CHECK_EQUAL( asio::buffer_size(buffers.items[1]), 6 );
+	BOOST_CHECK( buffers.more );
+
+	q.pop(q.size());
+	BOOST_CHECK( q.empty() );
+	BOOST_CHECK_EQUAL( q.buffers().count, 0 );
+}
+
+BOOST_AUTO_TEST_CASE( sendqueue_slices )
+{
+	boost::shared_ptr<Buffer> external(new Buffer());
+	string content(SendQueue::MIN_EXTERNAL_SLICE*2, 'p');
+	memcpy(external->allocate(content.size()), content.data(), content.size());
+	external->charge(content.size());
+
+	SendQueue q(BLOCK_SIZE);
+	push(q, "head");
+	q.append(ByteSlice(external, 0, content.size()));
+	q.append(ByteSlice(external, 0, 3)); // Small enough to be copied
+	push(q, "tail");
+	BOOST_CHECK_EQUAL( contents(q), "head" + content + "ppptail" );
+	BOOST_CHECK_EQUAL( q.buffers().count, 3 );
+
+	// The large slice is referenced, not copied
+	BOOST_CHECK_EQUAL( asio::buffer_cast<const byte*>(q.buffers().items[1]), external->ptr );
+	BOOST_CHECK_EQUAL( external.use_count(), 2 );
+
+	q.pop(4 + content.size()/2);
+	BOOST_CHECK_EQUAL( contents(q), content.substr(content.size()/2) + "ppptail" );
+	q.pop(content.size()/2);
+	BOOST_CHECK( external.unique() );
+	BOOST_CHECK_EQUAL( contents(q), "ppptail" );
+}
+
+BOOST_AUTO_TEST_CASE( sendqueue_files )
+{
+	SendQueue q(BLOCK_SIZE);
+	push(q, "head");
+	q.append(FileSlice(boost::shared_ptr<void>(), 42, 1000, 500));
+	push(q, "tail");
+	BOOST_CHECK_EQUAL( q.size(), 508 );
+
+	// Gathering stops at the file, which must be sent separately
+	auto buffers = q.buffers();
+	BOOST_CHECK_EQUAL( buffers.count, 1 );
+	BOOST_CHECK( buffers.more );
+	int fd;
+	uint64_t offset;
+	size_t size;
+	BOOST_CHECK( !q.fileHead(fd, offset, size) );
+
+	q.pop(4);
+	BOOST_CHECK( q.fileHead(fd, offset, size) );
+	BOOST_CHECK_EQUAL( fd, 42 );
+	BOOST_CHECK_EQUAL( offset, 1000 );
+	BOOST_CHECK_EQUAL( size, 500 );
+
+	q.pop(200);
+	BOOST_CHECK( q.fileHead(fd, offset, size) );
+	BOOST_CHECK_EQUAL( offset, 1200 );
+	BOOST_CHECK_EQUAL( size, 300 );
+
+	q.pop(300);
+	BOOST_CHECK( !q.fileHead(fd, offset, size) );
+	BOOST_CHECK_EQUAL( contents(q), "tail" );
+	BOOST_CHECK( !q.buffers().more );
+}
@@ -0,0 +1,54 @@
+#include <memory>
+
+#include <boost/test/unit_test.hpp>
+
+#include "lib/slotmap.h"
+
+using namespace std;
+
+typedef SlotMap<int, 8> TaggedMap;
+
+BOOST_AUTO_TEST_CASE( slotmap_generations )
+{
+	TaggedMap map;
+	BOOST_CHECK( map.empty() );
+	int a = map.allocate();
+	int b = map.allocate();
+	BOOST_CHECK( a > 0 );
+	BOOST_CHECK( a != b );
+	*map.find(a) = 1;
+	*map.find(b) = 2;
+	BOOST_CHECK_EQUAL( map.size(), 2 );
+	BOOST_CHECK( !map.find(0) );
+	BOOST_CHECK( !map.find(-1) );
+	BOOST_CHECK( !map.find(b+1) );
+
+	// The slot of a is reused under a new key, and the old key finds nothing
+	BOOST_CHECK( map.free(a) );
+	BOOST_CHECK( !map.free(a) );
+	BOOST_CHECK( !map.find(a) );
+	int c = map.allocate();
+	BOOST_CHECK( c != a );
+	BOOST_CHECK_EQUAL( c & TaggedMap::INDEX_MASK, a & TaggedMap::INDEX_MASK );
+	BOOST_CHECK( !map.find(a) );
+	BOOST_REQUIRE( map.find(c) );
+	BOOST_CHECK_EQUAL( *map.find(c), 1 ); // Left by a
+
+	auto keys = map.keys();
+	BOOST_REQUIRE_EQUAL( keys.size(), 2 );
+	BOOST_CHECK_EQUAL( keys[0], c );
+	BOOST_CHECK_EQUAL( keys[1], b );
+}
+
+BOOST_AUTO_TEST_CASE( slotmap_dense )
+{
+	// Without generations, keys are just the slots
+	SlotMap<unique_ptr<int>, 0> map;
+	for (int i=1; i <= 100; i++)
+		BOOST_CHECK_EQUAL( map.allocate(), i );
+	map.free(50);
+	map.free(20);
+	BOOST_CHECK_EQUAL( map.allocate(), 20 );
+	BOOST_CHECK_EQUAL( map.allocate(), 50 );
+	BOOST_CHECK_EQUAL( map.allocate(), 101 );
+}
@@ -0,0 +1,134 @@
+#include <boost/asio/io_service.hpp>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <fstream>
+#include <string.h>
+
+#include "bithorded/source/asset.hpp"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+using namespace bithorded::source;
+
+const size_t FILE_SIZE = 1024*1024;
+
+struct AssetFolder {
+	fs::path path;
+	vector<char> content;
+
+	AssetFolder() :
+		path(fs::temp_directory_path() / fs::unique_path("bithorded-test-%%%%-%%%%")),
+		content(FILE_SIZE)
+	{
+		for (size_t i = 0; i < content.size(); i++)
+			content[i] = (char)(i * 7 + i / 4096);
+		fs::create_directories(path);
+		ofstream data((path/"data").c_str(), ios::binary);
+		data.write(&content[0], content.size());
+	}
+
+	~AssetFolder() {
+		fs::remove_all(path);
+	}
+
+	bool intact(uint64_t offset, const byte* data, size_t size) {
+		return !memcmp(&content[offset], data, size);
+	}
+};
+
+struct ReadResult {
+	boost::mutex mutex;
+	boost::condition_variable done;
+	bool called;
+	int64_t offset;
+	ByteSlice slice;
+	const byte* data;
+	size_t size;
+
+	ReadResult() : called(false), offset(-1), data(NULL), size(0) {}
+
+	void onRead(int64_t offset, const ByteSlice& slice) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		this->offset = offset;
+		this->slice = slice;
+		data = slice.data();
+		size = slice.size();
+		called = true;
+		done.notify_all();
+	}
+
+	void onData(const byte* data, size_t size) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		this->data = data;
+		this->size = size;
+		called = true;
+		done.notify_all();
+	}
+
+	bool wait(boost::asio::io_service& ioSvc) {
+		boost::unique_lock<boost::mutex> lock(mutex);
+		for (int i = 0; !called && (i < 500); i++) {
+			lock.unlock();
+			ioSvc.poll();
+			ioSvc.reset();
+			lock.lock();
+			done.timed_wait(lock, boost::posix_time::milliseconds(10));
+		}
+		return called;
+	}
+};
+
+static void readFrom(bool useRing)
+{
+	AssetFolder folder;
+	boost::asio::io_service ioSvc;
+	ReadEngine readEngine(ioSvc, 1, useRing);
+	auto asset = boost::make_shared<SourceAsset>(boost::ref(readEngine), folder.path);
+
+	ReadResult result;
+	uint64_t offset = 3 * 64 * 1024 + 100;
+	size_t size = 256 * 1024;
+	asset->async_read(offset, size, boost::bind(&ReadResult::onRead, &result, _1, _2), &result, boost::posix_time::pos_infin);
+	BOOST_REQUIRE( result.wait(ioSvc) );
+	BOOST_CHECK_EQUAL( size, 256 * 1024 );
+	BOOST_CHECK_EQUAL( result.offset, offset );
+	BOOST_REQUIRE_EQUAL( result.size, size );
+	BOOST_CHECK( folder.intact(offset, result.data, size) );
+
+	// Larger reads are cut short, not failed
+	ReadResult clamped;
+	size = FILE_SIZE;
+	asset->async_read(0, size, boost::bind(&ReadResult::onRead, &clamped, _1, _2), &clamped, boost::posix_time::pos_infin);
+	BOOST_REQUIRE( clamped.wait(ioSvc) );
+	BOOST_CHECK_EQUAL( size, RandomAccessFile::WINDOW_SIZE );
+	BOOST_REQUIRE_EQUAL( clamped.size, size );
+	BOOST_CHECK( folder.intact(0, clamped.data, size) );
+}
+
+BOOST_AUTO_TEST_CASE( sourceasset_read_chunk )
+{
+	readFrom(false);
+	readFrom(true);
+}
+
+BOOST_AUTO_TEST_CASE( readengine_read_chunk )
+{
+	AssetFolder folder;
+	boost::asio::io_service ioSvc;
+	RandomAccessFile file(folder.path/"data");
+
+	for (int useRing = 0; useRing < 2; useRing++) {
+		ReadEngine readEngine(ioSvc, 1, useRing);
+		vector<byte> buf(256 * 1024);
+		ReadResult result;
+		// Past page-cache or not, the full chunk must come back from the disk-path too
+		readEngine.read(file, 64 * 1024, buf.size(), &buf[0], boost::bind(&ReadResult::onData, &result, _1, _2));
+		BOOST_REQUIRE( result.wait(ioSvc) );
+		BOOST_REQUIRE_EQUAL( result.size, buf.size() );
+		BOOST_CHECK( folder.intact(64 * 1024, result.data, buf.size()) );
+	}
+}
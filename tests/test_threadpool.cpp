@@ -46,3 +46,40 @@ BOOST_AUTO_TEST_CASE( threadpool_test )
 
 	tp.join();
 }
+
+class FlagTask : public Task {
+public:
+	FlagTask() : _done(false) {}
+
+	void operator()() {
+		boost::lock_guard<boost::mutex> lock(_m);
+		_done = true;
+		_cond.notify_all();
+	}
+
+	bool wait() {
+		boost::unique_lock<boost::mutex> lock(_m);
+		auto deadline = boost::get_system_time() + boost::posix_time::seconds(5);
+		while (!_done)
+			if (!_cond.timed_wait(lock, deadline))
+				return false;
+		return true;
+	}
+private:
+	boost::mutex _m;
+	boost::condition_variable _cond;
+	bool _done;
+};
+
+BOOST_AUTO_TEST_CASE( threadpool_idle )
+{
+	// Workers left idle must still pick up tasks posted later
+	ThreadPool tp(1);
+	for (auto i = 0; i < 3; i++) {
+		FlagTask task;
+		tp.post(task);
+		BOOST_CHECK( task.wait() );
+		usleep(10000);
+	}
+	tp.join();
+}
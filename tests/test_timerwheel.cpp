@@ -0,0 +1,79 @@
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "lib/timerwheel.h"
+
+using namespace std;
+namespace asio = boost::asio;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+struct Firing {
+	vector<int> fired;
+	vector<pt::ptime> due;
+	bool early;
+
+	Firing() : early(false) {}
+
+	void onTimer(int i) {
+		fired.push_back(i);
+		early |= (pt::microsec_clock::universal_time() < due[i]);
+	}
+};
+
+BOOST_AUTO_TEST_CASE( timerwheel_order )
+{
+	asio::io_service ioSvc;
+	Firing firing;
+	boost::ptr_vector<TimerWheel::Timer> timers;
+
+	// Spread over the first two levels, armed out of order
+	const int COUNT = 100;
+	for (int i=0; i < COUNT; i++) {
+		int ms = ((i * 37) % COUNT) * 6;
+		firing.due.push_back(pt::microsec_clock::universal_time() + pt::milliseconds(ms));
+		timers.push_back(new TimerWheel::Timer(ioSvc, boost::bind(&Firing::onTimer, &firing, i)));
+		timers.back().arm(pt::milliseconds(ms));
+	}
+	BOOST_CHECK_EQUAL( asio::use_service<TimerWheel>(ioSvc).size(), COUNT );
+	while ((firing.fired.size() < COUNT) && ioSvc.run_one());
+
+	BOOST_REQUIRE_EQUAL( firing.fired.size(), COUNT );
+	BOOST_CHECK( !firing.early );
+	for (size_t i=1; i < firing.fired.size(); i++)
+		BOOST_CHECK( firing.due[firing.fired[i-1]] <= firing.due[firing.fired[i]] );
+	BOOST_CHECK_EQUAL( asio::use_service<TimerWheel>(ioSvc).size(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( timerwheel_cancel )
+{
+	asio::io_service ioSvc;
+	Firing firing;
+	firing.due.resize(3, pt::microsec_clock::universal_time());
+	TimerWheel::Timer a(ioSvc, boost::bind(&Firing::onTimer, &firing, 0));
+	TimerWheel::Timer b(ioSvc, boost::bind(&Firing::onTimer, &firing, 1));
+	{
+		TimerWheel::Timer c(ioSvc, boost::bind(&Firing::onTimer, &firing, 2));
+		c.arm(pt::milliseconds(5));
+	} // Cancelled by going away
+
+	a.arm(pt::milliseconds(5));
+	b.arm(pt::milliseconds(10));
+	a.cancel();
+	BOOST_CHECK( !a.armed() );
+	BOOST_CHECK( b.armed() );
+
+	// Re-arming replaces the earlier deadline
+	a.arm(pt::milliseconds(20));
+	a.arm(pt::milliseconds(15));
+	ioSvc.run();
+	BOOST_REQUIRE_EQUAL( firing.fired.size(), 2 );
+	BOOST_CHECK_EQUAL( firing.fired[0], 1 );
+	BOOST_CHECK_EQUAL( firing.fired[1], 0 );
+}
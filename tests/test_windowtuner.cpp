@@ -0,0 +1,55 @@
+#include <algorithm>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "lib/windowtuner.h"
+
+using namespace std;
+namespace pt = boost::posix_time;
+
+using namespace bithorde;
+
+const size_t CHUNK = 256*1024;
+
+// A link of /rate/ bytes per second and a round-trip of /roundTrip/, delivering what the
+// window lets through, spread over each round-trip
+static void simulate(WindowTuner& tuner, double rate, const pt::time_duration& roundTrip, int rounds) {
+	pt::ptime now(boost::gregorian::date(2026, 1, 1));
+	double roundSecs = roundTrip.total_microseconds() / 1000000.0;
+	for (int round = 0; round < rounds; round++) {
+		uint64_t bytes = min<uint64_t>(tuner.window(), rate * roundSecs);
+		size_t chunks = max<size_t>(bytes / CHUNK, 1);
+		for (size_t i = 0; i < chunks; i++) {
+			now += pt::microseconds(roundTrip.total_microseconds() / chunks);
+			tuner.onRoundTrip(roundTrip, now);
+			tuner.onDelivered(CHUNK, now);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE( windowtuner_longhaul )
+{
+	// 100 MB/s over 50 ms, so 5 MB in flight fills the link
+	WindowTuner tuner(CHUNK, 2*CHUNK, 64*1024*1024);
+	BOOST_CHECK( tuner.slowStart() );
+	simulate(tuner, 100e6, pt::milliseconds(50), 40);
+	BOOST_CHECK( !tuner.slowStart() );
+	BOOST_CHECK( tuner.window() >= 5e6 );
+	BOOST_CHECK( tuner.window() <= 2.5 * 5e6 );
+	BOOST_CHECK( tuner.rate() >= 90e6 );
+
+	// Timing out halves it
+	size_t before = tuner.window();
+	tuner.onTimeout();
+	BOOST_CHECK_EQUAL( tuner.window(), before / 2 );
+}
+
+BOOST_AUTO_TEST_CASE( windowtuner_local )
+{
+	// 1 GB/s over 100 us, 100 KB in flight fills the link, so the window shrinks to the least
+	WindowTuner tuner(CHUNK, 2*CHUNK, 64*1024*1024);
+	simulate(tuner, 1e9, pt::microseconds(100), 400);
+	BOOST_CHECK( !tuner.slowStart() );
+	BOOST_CHECK_EQUAL( tuner.window(), 2*CHUNK );
+}